@@ -0,0 +1,808 @@
+/*
+ * Glacsweb at.c
+ * AT command engine
+ */
+
+/** \file
+ * Queue of AT commands for a modem, and the parser which sorts the lines
+ * received into command echoes, information responses, final result
+ * codes and unsolicited result codes. Each command is matched to its
+ * response by the state of the exchange rather than by expecting a
+ * fixed number of lines, so a stray line does not throw the following
+ * commands out of step.
+ *
+ * Copyright (C) 2004 Alistair Riddoch, The University of Southampton
+ */
+
+#include "at.h"
+#include "log.h"
+
+#define AT_CODES_TABLE
+#include "atcodes.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <assert.h>
+
+#define debug(prg) { if (debug_flag) { prg } }
+
+static const int debug_flag = 0;
+
+/** Time allowed for the modem to respond to a cancelled data entry, in
+ *  microseconds */
+static const long AT_CANCEL_TIMEOUT = 1000000;
+
+/** Kinds of line received from the modem */
+enum at_line {
+    /** No complete line arrived before the deadline */
+    AT_LINE_NONE = 0,
+    /** A complete line is in ae_line */
+    AT_LINE_TEXT,
+    /** The "> " prompt for the data of a command */
+    AT_LINE_PROMPT
+};
+
+static int has_prefix(const char * line, const char * prefix)
+{
+    return strncmp(line, prefix, strlen(prefix)) == 0;
+}
+
+/** Check whether a classified line starts with a prefix. Known prefixes
+ *  are matched by code, and only others need comparing as strings.
+ */
+static int matches(const char * line, const ATParsed * parsed,
+                   const char * prefix, ATCode code)
+{
+    if (code != AT_CODE_NONE) {
+        return parsed->ap_code == code;
+    }
+    return has_prefix(line, prefix);
+}
+
+/** Split the fields of a response, which follow the prefix and are
+ *  separated by commas. Quoted strings and bracketed lists are each
+ *  taken as one field.
+ */
+static void split_fields(const char * p, ATParsed * parsed)
+{
+    while (*p == ' ') {
+        ++p;
+    }
+    while ((*p != 0) && (parsed->ap_nfields < AT_MAX_FIELDS)) {
+        int n = parsed->ap_nfields++;
+        int depth = 0;
+
+        if (*p == '"') {
+            parsed->ap_field[n] = ++p;
+            parsed->ap_value[n] = 0;
+            while ((*p != 0) && (*p != '"')) {
+                ++p;
+            }
+            // Step over the closing quote, so it is not taken as the
+            // start of another string
+            if (*p == '"') {
+                ++p;
+            }
+        } else {
+            char * end;
+
+            parsed->ap_field[n] = p;
+            parsed->ap_value[n] = strtol(p, &end, 10);
+            if (*p == '(') {
+                parsed->ap_value[n] = 0;
+            }
+        }
+        // Move on to the comma which ends the field
+        for (; *p != 0; ++p) {
+            if (*p == '(') {
+                ++depth;
+            } else if (*p == ')') {
+                --depth;
+            } else if (*p == '"') {
+                for (++p; (*p != 0) && (*p != '"'); ++p) {
+                }
+                if (*p == 0) {
+                    break;
+                }
+            } else if ((*p == ',') && (depth <= 0)) {
+                break;
+            }
+        }
+        if (*p == ',') {
+            ++p;
+        }
+    }
+}
+
+/** Classify a line from the modem, and split it into fields, in one
+ *  pass. The key, which is the whole line for basic result codes or the
+ *  text up to the colon for other responses, is looked up in the perfect
+ *  hash table generated from atcodes.def, so the cost does not depend on
+ *  how many codes are known.
+ *  @param line line to classify, without the CR LF.
+ *  @param parsed pointer used to return the code and fields. The fields
+ *  point into line, which must stay unchanged while they are used.
+ *  @return the code of the line, or AT_CODE_NONE if it is not known.
+ */
+ATCode ATClassify(const char * line, ATParsed * parsed)
+{
+    const ATCodeEntry * entry;
+    unsigned long h = AT_HASH_SEED;
+    size_t len;
+    int colon = 0;
+
+    assert(line != NULL);
+    assert(parsed != NULL);
+
+    parsed->ap_code = AT_CODE_NONE;
+    parsed->ap_kind = 0;
+    parsed->ap_nfields = 0;
+
+    for (len = 0; line[len] != 0; ++len) {
+        h = (h * 33 + (unsigned char)line[len]) % AT_HASH_MOD;
+        if (line[len] == ':') {
+            colon = 1;
+            ++len;
+            break;
+        }
+        if (len >= AT_KEY_MAX) {
+            // Too long to be a known key, but the fields may still be
+            // wanted if there is a prefix
+            const char * sptr = strchr(line + len, ':');
+
+            if (sptr != NULL) {
+                split_fields(sptr + 1, parsed);
+            }
+            return AT_CODE_NONE;
+        }
+    }
+
+    entry = &at_code_table[h % AT_HASH_SIZE];
+    if ((entry->ce_len == len) && (memcmp(entry->ce_key, line, len) == 0)) {
+        parsed->ap_code = entry->ce_code;
+        parsed->ap_kind = entry->ce_kind;
+    }
+    if (colon) {
+        split_fields(line + len, parsed);
+    }
+    return parsed->ap_code;
+}
+
+/** Read the next line from the modem.
+ *  The CR LF characters are stripped, and the line is left NULL
+ *  terminated in ae_line. Characters which arrive before the deadline
+ *  but do not make up a whole line are kept for the next call.
+ *  @param ae engine to read for.
+ *  @param prompt non-zero if the "> " prompt may arrive.
+ *  @param deadline time by which the line must have been read.
+ */
+static enum at_line read_line(ATEngine * ae, int prompt,
+                              const struct timespec * deadline)
+{
+    int c;
+
+    for (;;) {
+        if ((c = SERGetByteDeadline(ae->ae_sp, deadline)) == -1) {
+            return AT_LINE_NONE;
+        }
+        if (c == '\n') {
+            // A truncated line is marked by a length past the buffer
+            if (ae->ae_linelen >= AT_LINE_LEN) {
+                ae->ae_linelen = AT_LINE_LEN - 1;
+            }
+            while ((ae->ae_linelen > 0) &&
+                   (ae->ae_line[ae->ae_linelen - 1] == '\r')) {
+                --ae->ae_linelen;
+            }
+            ae->ae_line[ae->ae_linelen] = 0;
+            ae->ae_linelen = 0;
+            return AT_LINE_TEXT;
+        }
+        if (ae->ae_linelen >= AT_LINE_LEN - 1) {
+            if (ae->ae_linelen == AT_LINE_LEN - 1) {
+                LOGWrite(GWL_DEBUG, "Overlong line from modem truncated.");
+                ae->ae_linelen = AT_LINE_LEN;
+            }
+            continue;
+        }
+        ae->ae_line[ae->ae_linelen++] = c;
+        if (prompt && (ae->ae_linelen == 2) &&
+            (ae->ae_line[0] == '>') && (ae->ae_line[1] == ' ')) {
+            ae->ae_line[0] = 0;
+            ae->ae_linelen = 0;
+            return AT_LINE_PROMPT;
+        }
+    }
+}
+
+/** Pass a line to the unsolicited result code handler which takes it.
+ *  @return non-zero if a handler took the line.
+ */
+static int dispatch_urc(ATEngine * ae, const char * line,
+                        const ATParsed * parsed)
+{
+    int i;
+
+    for (i = 0; i < ae->ae_nurcs; ++i) {
+        ATURC * urc = &ae->ae_urcs[i];
+
+        if (matches(line, parsed, urc->au_prefix, urc->au_code)) {
+            urc->au_handler(line, parsed, urc->au_arg);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/** Pass a line to the handler waiting for the line after an unsolicited
+ *  result code, if there is one. A line with a known result code or
+ *  prefix is not taken, as it means the expected line never came.
+ *  @return non-zero if the handler took the line.
+ */
+static int follow_line(ATEngine * ae, const char * line,
+                       const ATParsed * parsed)
+{
+    ATURCHandler handler = ae->ae_follow;
+
+    if (handler == NULL) {
+        return 0;
+    }
+    ae->ae_follow = NULL;
+    if (parsed->ap_code != AT_CODE_NONE) {
+        return 0;
+    }
+    handler(line, parsed, ae->ae_follow_arg);
+    return 1;
+}
+
+/** Check whether a line is a final result code, and record it in the
+ *  command if it is.
+ *  @return non-zero if the line ends the command.
+ */
+static int parse_final(ATCommand * cmd, const ATParsed * parsed)
+{
+    if (!(parsed->ap_kind & AT_KIND_FINAL)) {
+        return 0;
+    }
+    switch (parsed->ap_code) {
+        case AT_CODE_OK:
+            cmd->ac_result = AT_OK;
+            break;
+        case AT_CODE_CME_ERROR:
+            cmd->ac_result = AT_CME_ERROR;
+            cmd->ac_error = parsed->ap_value[0];
+            break;
+        case AT_CODE_CMS_ERROR:
+            cmd->ac_result = AT_CMS_ERROR;
+            cmd->ac_error = parsed->ap_value[0];
+            break;
+        default:
+            cmd->ac_result = AT_ERROR;
+            break;
+    }
+    return 1;
+}
+
+/** Check whether a line is the echo of part of the data sent after the
+ *  prompt, and step over that part if it is. Data lines such as "OK"
+ *  would otherwise be taken for the final result.
+ *  @return non-zero if the line is echoed data.
+ */
+static int match_data_echo(ATCommand * cmd, const char * line)
+{
+    const char * data = cmd->ac_data_echo;
+    size_t len;
+
+    if (data == NULL) {
+        return 0;
+    }
+    // Some modems prompt again at the start of each line of the data
+    while ((line[0] == '>') && (line[1] == ' ')) {
+        line += 2;
+    }
+    len = strcspn(line, "\x1a");
+    if ((strncmp(line, data, len) != 0) ||
+        ((data[len] != 0) && (data[len] != '\r') && (data[len] != '\n'))) {
+        return 0;
+    }
+    data += len;
+    if (*data == '\r') {
+        ++data;
+    }
+    if (*data == '\n') {
+        ++data;
+    }
+    cmd->ac_data_echo = ((line[len] == 0x1a) || (*data == 0)) ? NULL : data;
+    return 1;
+}
+
+/** Find the command an information response belongs to, by its prefix.
+ *  While a batch is running the line may belong to any of the commands
+ *  in it.
+ *  @return the command, or NULL if the line has no expected prefix.
+ */
+static ATCommand * line_owner(ATEngine * ae, ATCommand * cmd,
+                              const char * line, const ATParsed * parsed)
+{
+    int i;
+
+    for (i = 0; i < ae->ae_nbatch; ++i) {
+        ATCommand * part = ae->ae_batch[i];
+
+        if ((part->ac_prefix != NULL) &&
+            matches(line, parsed, part->ac_prefix, part->ac_code)) {
+            return part;
+        }
+    }
+    if ((cmd->ac_prefix != NULL) &&
+        matches(line, parsed, cmd->ac_prefix, cmd->ac_code)) {
+        return cmd;
+    }
+    return NULL;
+}
+
+/** Sort a line received while a command is in progress.
+ *  @return non-zero if the line ends the command.
+ */
+static int handle_line(ATEngine * ae, ATCommand * cmd, const char * line)
+{
+    ATParsed parsed;
+    ATCommand * owner;
+
+    if (line[0] == 0) {
+        return 0;
+    }
+    if (match_data_echo(cmd, line)) {
+        return 0;
+    }
+    if (!cmd->ac_echoed && (cmd->ac_nlines == 0) &&
+        (strcmp(line, cmd->ac_cmd) == 0)) {
+        cmd->ac_echoed = 1;
+        return 0;
+    }
+    ATClassify(line, &parsed);
+    if (follow_line(ae, line, &parsed)) {
+        return 0;
+    }
+    if (parse_final(cmd, &parsed)) {
+        return 1;
+    }
+    // Lines with the prefix a command expects belong to that command
+    // even if a handler for the same unsolicited result exists, as
+    // the query and unsolicited forms of +CREG do.
+    owner = line_owner(ae, cmd, line, &parsed);
+    if (owner == NULL) {
+        if (dispatch_urc(ae, line, &parsed)) {
+            return 0;
+        }
+        if ((cmd->ac_prefix != NULL) || (ae->ae_nbatch > 0)) {
+            debug( printf("Ignoring line \"%s\"\n", line); );
+            return 0;
+        }
+        owner = cmd;
+    }
+    if (owner->ac_nlines < AT_MAX_LINES) {
+        strcpy(owner->ac_lines[owner->ac_nlines++], line);
+    } else {
+        LOGWrite(GWL_DEBUG, "Too many response lines, dropping one.");
+    }
+    return 0;
+}
+
+/** Give up on a command whose prompt did not arrive. ESC is sent to
+ *  cancel the data entry in case the prompt was lost rather than never
+ *  sent, and any result that produces is read so it cannot be taken for
+ *  the result of the next command.
+ */
+static void cancel_prompt(ATEngine * ae, ATCommand * cmd,
+                          const struct timespec * deadline)
+{
+    ATCommand cancel;
+
+    LOGWrite(GWL_ERROR, "Prompt did not arrive, cancelling.");
+    SERQueueByte(ae->ae_sp, 0x1b);
+    SERFlushOutput(ae->ae_sp, deadline, 0);
+    memset(&cancel, 0, sizeof(ATCommand));
+    while ((read_line(ae, 0, deadline) == AT_LINE_TEXT) &&
+           !handle_line(ae, &cancel, ae->ae_line)) {
+    }
+    cmd->ac_result = AT_TIMEOUT;
+}
+
+/** Send a command, and read the response until a final result code
+ *  arrives or the command times out.
+ */
+static void run_command(ATEngine * ae, ATCommand * cmd)
+{
+    struct timespec deadline, prompt;
+    enum at_line kind;
+    int waiting;
+
+    SERDeadline(&deadline, cmd->ac_timeout);
+    if ((cmd->ac_prompt_timeout > 0) &&
+        (cmd->ac_prompt_timeout < cmd->ac_timeout)) {
+        SERDeadline(&prompt, cmd->ac_prompt_timeout);
+    } else {
+        prompt = deadline;
+    }
+    waiting = (cmd->ac_payload != NULL);
+
+    debug( printf("Sending \"%s\"\n", cmd->ac_cmd); );
+    SERQueueString(ae->ae_sp, cmd->ac_cmd);
+    SERQueueByte(ae->ae_sp, '\r');
+    if (SERFlushOutput(ae->ae_sp, &deadline, 0) != 0) {
+        LOGWrite(GWL_ERROR, "Error writing command.");
+        cmd->ac_result = AT_IO_ERROR;
+        return;
+    }
+
+    for (;;) {
+        kind = read_line(ae, waiting, waiting ? &prompt : &deadline);
+        if (kind == AT_LINE_NONE) {
+            if (waiting) {
+                SERDeadline(&prompt, AT_CANCEL_TIMEOUT);
+                cancel_prompt(ae, cmd, &prompt);
+                return;
+            }
+            cmd->ac_result = AT_TIMEOUT;
+            return;
+        }
+        if (kind == AT_LINE_PROMPT) {
+            SERQueueString(ae->ae_sp, cmd->ac_payload);
+            SERQueueByte(ae->ae_sp, 0x1a);
+            if (SERFlushOutput(ae->ae_sp, &deadline, 0) != 0) {
+                LOGWrite(GWL_ERROR, "Error writing command data.");
+                cmd->ac_result = AT_IO_ERROR;
+                return;
+            }
+            waiting = 0;
+            cmd->ac_echoed = 1;
+            cmd->ac_data_echo = cmd->ac_payload;
+            continue;
+        }
+        debug( printf("Line \"%s\"\n", ae->ae_line); );
+        if (handle_line(ae, cmd, ae->ae_line)) {
+            return;
+        }
+    }
+}
+
+/** Create the command engine for a modem.
+ *  @param sp serial port the modem is attached to.
+ *  @return a pointer to the new engine, or NULL if out of memory.
+ */
+ATEngine * ATCreate(SerialPort * sp)
+{
+    ATEngine * ae;
+
+    assert(sp != NULL);
+
+    ae = calloc(1, sizeof(ATEngine));
+    if (ae == NULL) {
+        LOGWrite(GWL_FATAL, "Out of memory.");
+        return NULL;
+    }
+    ae->ae_sp = sp;
+    return ae;
+}
+
+/** Free a command engine. Commands still queued are not completed. */
+void ATDestroy(ATEngine * ae)
+{
+    free(ae);
+}
+
+/** Get the code of a response prefix, so lines can be matched to it by
+ *  code. Only a prefix which is a whole key, such as "+CREG: ", has one.
+ */
+static ATCode prefix_code(const char * prefix)
+{
+    ATParsed parsed;
+    size_t len = strlen(prefix);
+
+    while ((len > 0) && (prefix[len - 1] == ' ')) {
+        --len;
+    }
+    if ((len == 0) || (prefix[len - 1] != ':')) {
+        return AT_CODE_NONE;
+    }
+    return ATClassify(prefix, &parsed);
+}
+
+/** Prepare a command for submission.
+ *  @param cmd command to prepare.
+ *  @param line command line to be sent, without the terminating CR.
+ *  @param prefix prefix of the information responses to the command, or
+ *  NULL if they have no common prefix.
+ *  @param timeout microseconds allowed for the command to complete.
+ */
+void ATInitCommand(ATCommand * cmd, const char * line, const char * prefix,
+                   long timeout)
+{
+    assert(cmd != NULL);
+    assert(line != NULL);
+    assert(strlen(line) < AT_LINE_LEN);
+
+    memset(cmd, 0, sizeof(ATCommand));
+    strcpy(cmd->ac_cmd, line);
+    cmd->ac_prefix = prefix;
+    cmd->ac_code = (prefix != NULL) ? prefix_code(prefix) : AT_CODE_NONE;
+    cmd->ac_timeout = timeout;
+}
+
+/** Register a handler for an unsolicited result code.
+ *  @param prefix prefix of the lines the handler takes.
+ *  @return zero on success, or non-zero if there are too many handlers.
+ */
+int ATRegisterURC(ATEngine * ae, const char * prefix, ATURCHandler handler,
+                  void * arg)
+{
+    assert(ae != NULL);
+    assert(prefix != NULL);
+    assert(handler != NULL);
+
+    if (ae->ae_nurcs >= AT_MAX_URCS) {
+        LOGWrite(GWL_ERROR, "Too many unsolicited result handlers.");
+        return 1;
+    }
+    ae->ae_urcs[ae->ae_nurcs].au_prefix = prefix;
+    ae->ae_urcs[ae->ae_nurcs].au_code = prefix_code(prefix);
+    ae->ae_urcs[ae->ae_nurcs].au_handler = handler;
+    ae->ae_urcs[ae->ae_nurcs].au_arg = arg;
+    ++ae->ae_nurcs;
+    return 0;
+}
+
+/** Pass the next line from the modem to a handler, rather than treating
+ *  it as a response. An unsolicited result handler calls this for
+ *  results which carry a second line of data, such as +CDS in PDU mode.
+ */
+void ATTakeNextLine(ATEngine * ae, ATURCHandler handler, void * arg)
+{
+    assert(ae != NULL);
+    assert(handler != NULL);
+
+    ae->ae_follow = handler;
+    ae->ae_follow_arg = arg;
+}
+
+/** Clear the result of a command before it is run. */
+static void reset_command(ATCommand * cmd)
+{
+    cmd->ac_result = AT_PENDING;
+    cmd->ac_nlines = 0;
+    cmd->ac_error = 0;
+    cmd->ac_echoed = 0;
+    cmd->ac_data_echo = NULL;
+    cmd->ac_next = NULL;
+}
+
+/** Add a command to the end of the queue. The command must stay valid
+ *  until it has completed.
+ */
+void ATSubmit(ATEngine * ae, ATCommand * cmd)
+{
+    assert(ae != NULL);
+    assert(cmd != NULL);
+
+    reset_command(cmd);
+    if (ae->ae_tail == NULL) {
+        ae->ae_head = cmd;
+    } else {
+        ae->ae_tail->ac_next = cmd;
+    }
+    ae->ae_tail = cmd;
+}
+
+/** Run the queued commands in order, calling the completion function of
+ *  each as it finishes.
+ *  @return the number of commands which did not complete with OK.
+ */
+int ATRun(ATEngine * ae)
+{
+    ATCommand * cmd;
+    int failed = 0;
+
+    assert(ae != NULL);
+
+    while ((cmd = ae->ae_head) != NULL) {
+        ae->ae_head = cmd->ac_next;
+        if (ae->ae_head == NULL) {
+            ae->ae_tail = NULL;
+        }
+        cmd->ac_next = NULL;
+
+        run_command(ae, cmd);
+        if (cmd->ac_result != AT_OK) {
+            ++failed;
+            debug( printf("\"%s\" failed: %s\n", cmd->ac_cmd,
+                          ATResultName(cmd->ac_result)); );
+        }
+        if (cmd->ac_done != NULL) {
+            cmd->ac_done(cmd, cmd->ac_arg);
+        }
+    }
+    return failed;
+}
+
+/** Run a single command, along with any others already queued before it.
+ *  @return the outcome of the command.
+ */
+ATResult ATExec(ATEngine * ae, ATCommand * cmd)
+{
+    ATSubmit(ae, cmd);
+    ATRun(ae);
+    return cmd->ac_result;
+}
+
+/** Check whether a command is an extended command, which must be
+ *  followed by ';' when another command comes after it on the same line.
+ */
+static int is_extended(const ATCommand * cmd)
+{
+    char c = cmd->ac_cmd[2];
+
+    return (c != '&') && !((c >= 'A') && (c <= 'Z')) &&
+           !((c >= 'a') && (c <= 'z'));
+}
+
+/** Join a number of commands into one compound command line.
+ *  @return zero on success, or non-zero if the commands can not be
+ *  joined.
+ */
+static int join_commands(ATCommand * batch, ATCommand ** cmds, int count)
+{
+    size_t len = 2;
+    int i;
+
+    strcpy(batch->ac_cmd, "AT");
+    for (i = 0; i < count; ++i) {
+        const char * body = cmds[i]->ac_cmd + 2;
+
+        if ((strncasecmp(cmds[i]->ac_cmd, "AT", 2) != 0) ||
+            (cmds[i]->ac_payload != NULL) ||
+            (len + strlen(body) + 1 >= AT_LINE_LEN)) {
+            return 1;
+        }
+        if ((i > 0) && is_extended(cmds[i - 1])) {
+            batch->ac_cmd[len++] = ';';
+        }
+        strcpy(batch->ac_cmd + len, body);
+        len += strlen(body);
+        batch->ac_timeout += cmds[i]->ac_timeout;
+    }
+    return 0;
+}
+
+/** Run a number of commands as a single compound command line, such as
+ *  "ATE1+CMGF=1" or "AT+CREG?;+CSQ", and pass the information responses
+ *  back to the command each belongs to. This saves a round trip to the
+ *  modem for each command after the first.
+ *  If the compound line fails, the modem does not say which command
+ *  failed, but it runs the commands in order and stops at the first
+ *  error. Every command up to the last one which got an information
+ *  response has therefore succeeded, and the rest are run again one at
+ *  a time to get their results. Those run again after succeeding can
+ *  only be commands with no information response, such as ATE0 or
+ *  AT+CMGF=1, which set modem state and can be repeated safely. If that
+ *  shows the modem just does not accept compound lines, they are not
+ *  tried again.
+ *  @param cmds commands to run, which must not prompt for data.
+ *  @param count number of commands.
+ *  @return AT_OK if all the commands succeeded, or the result of the
+ *  first which did not.
+ */
+ATResult ATExecBatch(ATEngine * ae, ATCommand ** cmds, int count)
+{
+    ATCommand batch;
+    ATResult res = AT_OK;
+    int done = 0;
+    int i;
+
+    assert(ae != NULL);
+    assert(cmds != NULL);
+
+    ATRun(ae);
+
+    memset(&batch, 0, sizeof(ATCommand));
+    if ((count > 1) && !ae->ae_no_batch &&
+        (join_commands(&batch, cmds, count) == 0)) {
+        for (i = 0; i < count; ++i) {
+            reset_command(cmds[i]);
+        }
+        ae->ae_batch = cmds;
+        ae->ae_nbatch = count;
+        run_command(ae, &batch);
+        ae->ae_batch = NULL;
+        ae->ae_nbatch = 0;
+
+        if ((batch.ac_result == AT_TIMEOUT) ||
+            (batch.ac_result == AT_IO_ERROR) || (batch.ac_result == AT_OK)) {
+            for (i = 0; i < count; ++i) {
+                cmds[i]->ac_result = batch.ac_result;
+                if (cmds[i]->ac_done != NULL) {
+                    cmds[i]->ac_done(cmds[i], cmds[i]->ac_arg);
+                }
+            }
+            return batch.ac_result;
+        }
+        // Commands before one which answered were run before the error
+        for (i = 0; i < count; ++i) {
+            if (cmds[i]->ac_nlines > 0) {
+                done = i + 1;
+            }
+        }
+        for (i = 0; i < done; ++i) {
+            cmds[i]->ac_result = AT_OK;
+            if (cmds[i]->ac_done != NULL) {
+                cmds[i]->ac_done(cmds[i], cmds[i]->ac_arg);
+            }
+        }
+        debug( printf("\"%s\" failed, running commands from %d separately\n",
+                      batch.ac_cmd, done); );
+    }
+
+    for (i = done; i < count; ++i) {
+        ATSubmit(ae, cmds[i]);
+    }
+    ATRun(ae);
+    for (i = 0; i < count; ++i) {
+        if ((cmds[i]->ac_result != AT_OK) && (res == AT_OK)) {
+            res = cmds[i]->ac_result;
+        }
+    }
+    if ((batch.ac_result != AT_PENDING) && (done == 0) && (res == AT_OK)) {
+        LOGWrite(GWL_DEBUG, "Modem does not accept compound commands.");
+        ae->ae_no_batch = 1;
+    }
+    return res;
+}
+
+/** Read from the modem while no command is in progress, passing any
+ *  unsolicited result codes to their handlers. Returns as soon as one
+ *  has been handled, so the caller can act on it straight away.
+ *  @param deadline time until which to wait, or NULL to take only what
+ *  has already arrived.
+ *  @return one if an unsolicited result code was handled, or zero if
+ *  none arrived before the deadline.
+ */
+int ATPoll(ATEngine * ae, const struct timespec * deadline)
+{
+    struct timespec now;
+    ATParsed parsed;
+
+    assert(ae != NULL);
+
+    if (deadline == NULL) {
+        SERDeadline(&now, 0);
+        deadline = &now;
+    }
+    while (read_line(ae, 0, deadline) == AT_LINE_TEXT) {
+        if (ae->ae_line[0] == 0) {
+            continue;
+        }
+        ATClassify(ae->ae_line, &parsed);
+        if (follow_line(ae, ae->ae_line, &parsed) ||
+            dispatch_urc(ae, ae->ae_line, &parsed)) {
+            return 1;
+        }
+        debug( printf("Ignoring line \"%s\"\n", ae->ae_line); );
+    }
+    return 0;
+}
+
+/** Name of a command outcome, for use in log messages. */
+const char * ATResultName(ATResult result)
+{
+    switch (result) {
+        case AT_PENDING:   return "pending";
+        case AT_OK:        return "OK";
+        case AT_ERROR:     return "ERROR";
+        case AT_CME_ERROR: return "+CME ERROR";
+        case AT_CMS_ERROR: return "+CMS ERROR";
+        case AT_TIMEOUT:   return "timeout";
+        case AT_IO_ERROR:  return "I/O error";
+    }
+    return "unknown";
+}
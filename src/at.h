@@ -0,0 +1,182 @@
+/*
+ * Glacsweb at.h
+ * Copyright (C) 2004 Alistair Riddoch, The University of Southampton
+ */
+
+#ifndef GLACSWEB_AT_H
+#define GLACSWEB_AT_H
+
+#include "serial.h"
+#include "atcodes.h"
+
+/** Maximum number of information response lines kept for a command */
+#define AT_MAX_LINES    8
+
+/** Maximum length of a line sent to or received from the modem, which
+ *  must hold the echo of a whole SMS PDU */
+#define AT_LINE_LEN     512
+
+/** Maximum number of unsolicited result code handlers on an engine */
+#define AT_MAX_URCS     16
+
+/** Maximum number of fields parsed from a response line */
+#define AT_MAX_FIELDS   12
+
+/** Kinds of line a result code or response prefix starts */
+#define AT_KIND_FINAL   0x01
+#define AT_KIND_INFO    0x02
+#define AT_KIND_URC     0x04
+
+/** An entry in the generated table of known result codes and response
+ *  prefixes. */
+typedef struct at_code_entry {
+    /** Whole result code, or response prefix including the colon */
+    const char * ce_key;
+    /** Length of ce_key */
+    unsigned char ce_len;
+    /** Code the key maps to */
+    unsigned char ce_code;
+    /** Kinds of line the key starts, as AT_KIND_ flags */
+    unsigned char ce_kind;
+} ATCodeEntry;
+
+/** A line from the modem, classified and split into fields. */
+typedef struct at_parsed {
+    /** Result code or response the line starts with, or AT_CODE_NONE */
+    ATCode      ap_code;
+    /** Kinds of line it may be, as AT_KIND_ flags, or zero if unknown */
+    int         ap_kind;
+    /** Number of fields after the prefix */
+    int         ap_nfields;
+    /** Start of each field in the line, after any opening quote */
+    const char * ap_field[AT_MAX_FIELDS];
+    /** Decimal value of each field, or zero for quoted and list fields */
+    long        ap_value[AT_MAX_FIELDS];
+} ATParsed;
+
+/** Outcome of an AT command */
+typedef enum at_result {
+    /** The command has not completed yet */
+    AT_PENDING = 0,
+    /** The modem replied OK */
+    AT_OK,
+    /** The modem replied ERROR, or another failure result code */
+    AT_ERROR,
+    /** The modem replied +CME ERROR, with the code in ac_error */
+    AT_CME_ERROR,
+    /** The modem replied +CMS ERROR, with the code in ac_error */
+    AT_CMS_ERROR,
+    /** No final result arrived before the command timed out */
+    AT_TIMEOUT,
+    /** The command could not be written to the serial port */
+    AT_IO_ERROR
+} ATResult;
+
+struct at_command;
+
+/** Function called when a command completes */
+typedef void (*ATCallback)(struct at_command * cmd, void * arg);
+
+/** Function called when an unsolicited result code arrives */
+typedef void (*ATURCHandler)(const char * line, const ATParsed * parsed,
+                             void * arg);
+
+/** Structure to hold one AT command, and its response once complete. */
+typedef struct at_command {
+    /** Command line to send, without the terminating CR */
+    char        ac_cmd[AT_LINE_LEN];
+    /** Prefix of the information responses which belong to this command,
+     *  or NULL to take any line which is not an unsolicited result */
+    const char * ac_prefix;
+    /** Code of ac_prefix, or AT_CODE_NONE if it is not a known prefix */
+    ATCode      ac_code;
+    /** Data to send once the modem prompts for it, or NULL if the command
+     *  does not prompt. The engine terminates it with Ctrl-Z. */
+    const char * ac_payload;
+    /** Time allowed for the command to complete, in microseconds */
+    long        ac_timeout;
+    /** Time allowed for the prompt to arrive, in microseconds, or zero
+     *  if only ac_timeout applies */
+    long        ac_prompt_timeout;
+    /** Information response lines received */
+    char        ac_lines[AT_MAX_LINES][AT_LINE_LEN];
+    /** Number of lines in ac_lines */
+    int         ac_nlines;
+    /** Outcome of the command */
+    ATResult    ac_result;
+    /** Error code given with +CME ERROR or +CMS ERROR */
+    int         ac_error;
+    /** Function called when the command completes, or NULL */
+    ATCallback  ac_done;
+    /** Argument passed to ac_done */
+    void *      ac_arg;
+    /** Set once the echo of the command has been seen */
+    int         ac_echoed;
+    /** Part of ac_payload whose echo may still arrive, or NULL */
+    const char * ac_data_echo;
+    /** Next command in the queue */
+    struct at_command * ac_next;
+} ATCommand;
+
+/** An unsolicited result code handler. */
+typedef struct at_urc {
+    /** Prefix of the lines this handler takes */
+    const char * au_prefix;
+    /** Code of au_prefix, or AT_CODE_NONE if it is not a known prefix */
+    ATCode      au_code;
+    /** Function called with each matching line */
+    ATURCHandler au_handler;
+    /** Argument passed to au_handler */
+    void *      au_arg;
+} ATURC;
+
+/** Structure to hold the state of the AT command engine for one modem.
+ *  Commands are queued, sent one at a time, and each line received is
+ *  classified as the echo of the command, an information response, a
+ *  final result code or an unsolicited result code.
+ */
+typedef struct at_engine {
+    /** Serial port the modem is attached to */
+    SerialPort * ae_sp;
+    /** First command in the queue */
+    ATCommand * ae_head;
+    /** Last command in the queue */
+    ATCommand * ae_tail;
+    /** Unsolicited result code handlers */
+    ATURC       ae_urcs[AT_MAX_URCS];
+    /** Number of handlers in ae_urcs */
+    int         ae_nurcs;
+    /** Line being assembled from the modem */
+    char        ae_line[AT_LINE_LEN];
+    /** Number of characters in ae_line */
+    int         ae_linelen;
+    /** Commands combined into the line being run, if it is a batch */
+    ATCommand ** ae_batch;
+    /** Number of commands in ae_batch */
+    int         ae_nbatch;
+    /** Set once the modem has been found not to accept compound lines */
+    int         ae_no_batch;
+    /** Handler which takes the next line, or NULL */
+    ATURCHandler ae_follow;
+    /** Argument passed to ae_follow */
+    void *      ae_follow_arg;
+} ATEngine;
+
+ATEngine * ATCreate(SerialPort * sp);
+void ATDestroy(ATEngine * ae);
+
+void ATInitCommand(ATCommand * cmd, const char * line, const char * prefix,
+                   long timeout);
+int  ATRegisterURC(ATEngine * ae, const char * prefix, ATURCHandler handler,
+                   void * arg);
+void ATTakeNextLine(ATEngine * ae, ATURCHandler handler, void * arg);
+void ATSubmit(ATEngine * ae, ATCommand * cmd);
+int  ATRun(ATEngine * ae);
+ATResult ATExec(ATEngine * ae, ATCommand * cmd);
+ATResult ATExecBatch(ATEngine * ae, ATCommand ** cmds, int count);
+int  ATPoll(ATEngine * ae, const struct timespec * deadline);
+
+ATCode ATClassify(const char * line, ATParsed * parsed);
+const char * ATResultName(ATResult result);
+
+#endif // GLACSWEB_AT_H
@@ -0,0 +1,326 @@
+/*
+ * Glacsweb dlr.c
+ * Tracking of delivery reports for the blocks of files sent
+ */
+
+/** \file
+ * A table of the messages sent with status reports requested, indexed
+ * by the message reference the network gave each one, so the +CDS
+ * report for a reference can be matched to the block of the file it
+ * carried. Blocks which were never reported delivered can then be
+ * listed, and sent again rather than the whole file.
+ *
+ * References are only 8 bits, so a slot is reused once 256 more
+ * messages have been sent, and the report for the message which used it
+ * before is lost if it has not arrived by then.
+ *
+ * The table is kept on the card as a record of lines, one for each
+ * message submitted and one for each report, appended with a single
+ * write. The record is not flushed with fsync(), as losing the last few
+ * lines in a crash only leaves blocks looking undelivered. It is
+ * rewritten from the table each time it is opened, and whenever it
+ * grows long, which also drops any line cut short by a crash.
+ *
+ * Copyright (C) 2004 Alistair Riddoch, The University of Southampton
+ */
+
+#include "dlr.h"
+#include "log.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+
+#define debug(prg) { if (debug_flag) { prg } }
+
+static const int debug_flag = 0;
+
+/** Number of lines the record may hold before it is rewritten */
+#define DLR_MAX_RECORDS         (4 * DLR_SLOTS)
+/** Longest line in the record */
+#define DLR_LINE_MAX            256
+
+/** Line recording a message submitted, giving the reference, the time,
+ *  the block, the parity index, the number and the name */
+static const char * const DLR_SUBMIT_RECORD = "s %x %lx %x %d %s %s\n";
+/** Line recording a report, giving the reference and the status */
+static const char * const DLR_REPORT_RECORD = "r %x %x\n";
+
+/** Get the state a message is in after a report with a status.
+ *  Statuses below 0x20 mean the message was delivered, and those from
+ *  0x20 to 0x3f that the service centre is still trying. The rest mean
+ *  it has given up.
+ */
+static DeliveryState report_state(int status)
+{
+    if (status < 0x20) {
+        return DLR_DELIVERED;
+    }
+    if (status < 0x40) {
+        return DLR_PENDING;
+    }
+    return DLR_FAILED;
+}
+
+/** Fill in the entry for a message submitted. */
+static void set_entry(DeliveryEntry * de, time_t sent, const char * number,
+                      const char * name, int block, int parity)
+{
+    de->de_state = DLR_PENDING;
+    de->de_status = -1;
+    de->de_block = block;
+    de->de_parity = parity;
+    de->de_sent = sent;
+    snprintf(de->de_number, sizeof(de->de_number), "%s", number);
+    snprintf(de->de_name, sizeof(de->de_name), "%s", name);
+}
+
+/** Apply one line of the record to the table. Lines which can not be
+ *  read are skipped. */
+static void read_record(DeliveryTable * dt, char * line)
+{
+    unsigned int mr, block, status;
+    unsigned long sent;
+    char number[PDU_MAX_DIGITS + 2];
+    int parity, name;
+
+    if ((sscanf(line, "s %x %lx %x %d %21s %n", &mr, &sent, &block, &parity,
+                number, &name) == 5) && (mr < DLR_SLOTS) &&
+        (strlen(line + name) <= DLR_NAME_MAX)) {
+        set_entry(&dt->dt_entries[mr], sent, number, line + name, block,
+                  parity);
+    } else if ((sscanf(line, "r %x %x", &mr, &status) == 2) &&
+               (mr < DLR_SLOTS) &&
+               (dt->dt_entries[mr].de_state != DLR_FREE)) {
+        dt->dt_entries[mr].de_status = status;
+        dt->dt_entries[mr].de_state = report_state(status);
+    }
+}
+
+/** Read the record of a table, if there is one. */
+static void load_table(DeliveryTable * dt)
+{
+    char line[DLR_LINE_MAX];
+    FILE * fp;
+
+    if ((fp = fopen(dt->dt_path, "r")) == NULL) {
+        return;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        size_t len = strlen(line);
+
+        // Lines cut short, by a crash or by their length, are skipped
+        if ((len == 0) || (line[len - 1] != '\n')) {
+            while ((len == sizeof(line) - 1) &&
+                   (fgets(line, sizeof(line), fp) != NULL) &&
+                   (line[strlen(line) - 1] != '\n')) {
+            }
+            continue;
+        }
+        line[len - 1] = 0;
+        read_record(dt, line);
+    }
+    fclose(fp);
+}
+
+/** Write the record of the table afresh, holding only the entries in
+ *  use, and open it for appending.
+ *  @return zero if the record was written, non-zero otherwise.
+ */
+static int rewrite_table(DeliveryTable * dt)
+{
+    char mesg[1024]; // For logfile
+    char * tmp = malloc(strlen(dt->dt_path) + 5);
+    FILE * fp;
+    int mr;
+
+    if (tmp == NULL) {
+        LOGWrite(GWL_FATAL, "Out of memory.");
+        return 1;
+    }
+    sprintf(tmp, "%s.new", dt->dt_path);
+    if ((fp = fopen(tmp, "w")) == NULL) {
+        snprintf(mesg, sizeof(mesg), "Could not write %s.", tmp);
+        LOGWrite(GWL_WARNING, mesg);
+        free(tmp);
+        return 1;
+    }
+    dt->dt_records = 0;
+    for (mr = 0; mr < DLR_SLOTS; ++mr) {
+        const DeliveryEntry * de = &dt->dt_entries[mr];
+
+        if (de->de_state == DLR_FREE) {
+            continue;
+        }
+        fprintf(fp, DLR_SUBMIT_RECORD, mr, (unsigned long)de->de_sent,
+                de->de_block, de->de_parity, de->de_number, de->de_name);
+        ++dt->dt_records;
+        if (de->de_status >= 0) {
+            fprintf(fp, DLR_REPORT_RECORD, mr, de->de_status);
+            ++dt->dt_records;
+        }
+    }
+    if ((fflush(fp) != 0) || (fsync(fileno(fp)) != 0) || (fclose(fp) != 0) ||
+        (rename(tmp, dt->dt_path) != 0)) {
+        snprintf(mesg, sizeof(mesg), "Could not replace %s.", dt->dt_path);
+        LOGWrite(GWL_WARNING, mesg);
+        unlink(tmp);
+        free(tmp);
+        return 1;
+    }
+    free(tmp);
+
+    if (dt->dt_fd != -1) {
+        close(dt->dt_fd);
+    }
+    dt->dt_fd = open(dt->dt_path, O_WRONLY | O_APPEND);
+    return (dt->dt_fd == -1) ? 1 : 0;
+}
+
+/** Add a line to the record, rewriting it first if it has grown long. */
+static void append_record(DeliveryTable * dt, const char * line)
+{
+    ssize_t len = strlen(line);
+
+    if ((dt->dt_records >= DLR_MAX_RECORDS) || (dt->dt_fd == -1)) {
+        rewrite_table(dt);
+        // The table already holds the change, so the rewrite has it
+        return;
+    }
+    if (write(dt->dt_fd, line, len) != len) {
+        LOGWrite(GWL_WARNING, "Error writing delivery record.");
+        return;
+    }
+    ++dt->dt_records;
+}
+
+/** Open the table of messages sent, reading the record of it if there
+ *  is one.
+ *  @param path file which holds the record.
+ *  @return the table, or NULL if the record could not be written.
+ */
+DeliveryTable * DLROpen(const char * path)
+{
+    DeliveryTable * dt;
+
+    assert(path != NULL);
+
+    dt = calloc(1, sizeof(DeliveryTable));
+    if ((dt == NULL) || ((dt->dt_path = strdup(path)) == NULL)) {
+        LOGWrite(GWL_FATAL, "Out of memory.");
+        free(dt);
+        return NULL;
+    }
+    dt->dt_fd = -1;
+    load_table(dt);
+    if (rewrite_table(dt) != 0) {
+        DLRClose(dt);
+        return NULL;
+    }
+    // The record is rewritten by name, which must not depend on the
+    // current directory
+    if ((path = realpath(dt->dt_path, NULL)) != NULL) {
+        free(dt->dt_path);
+        dt->dt_path = (char *)path;
+    }
+    debug( fprintf(stderr, "Delivery table %s has %d records\n", path,
+                   dt->dt_records); );
+    return dt;
+}
+
+/** Record a block which has been submitted.
+ *  @param mr message reference the network gave it.
+ *  @param number the block was sent to.
+ *  @param name of the file, as given in the block header. Only the last
+ *  DLR_NAME_MAX characters of a longer name are kept, which hold the
+ *  base name of a path.
+ *  @param block number of the block, or of the first block of the group
+ *  for a parity block.
+ *  @param parity index of the parity block in its group, or -1 for a
+ *  data block.
+ *  @return zero if the block was recorded, non-zero if it can not be.
+ */
+int DLRSubmitted(DeliveryTable * dt, int mr, const char * number,
+                 const char * name, int block, int parity)
+{
+    char line[DLR_LINE_MAX];
+    DeliveryEntry * de;
+
+    assert(dt != NULL);
+    assert(number != NULL);
+    assert(name != NULL);
+
+    if ((mr < 0) || (mr >= DLR_SLOTS) ||
+        (strlen(number) > PDU_MAX_DIGITS + 1) ||
+        (strchr(number, ' ') != NULL) || (strchr(name, '\n') != NULL)) {
+        return 1;
+    }
+    if (strlen(name) > DLR_NAME_MAX) {
+        name += strlen(name) - DLR_NAME_MAX;
+    }
+    de = &dt->dt_entries[mr];
+    if (de->de_state == DLR_PENDING) {
+        debug( fprintf(stderr, "Reference %d reused before report for %s "
+                       "block %d\n", mr, de->de_name, de->de_block); );
+    }
+    set_entry(de, time(NULL), number, name, block, parity);
+    sprintf(line, DLR_SUBMIT_RECORD, mr, (unsigned long)de->de_sent,
+            de->de_block, de->de_parity, de->de_number, de->de_name);
+    append_record(dt, line);
+    return 0;
+}
+
+/** Record a status report for a message.
+ *  @param mr message reference the report is for.
+ *  @param status of the message, TP-ST.
+ *  @return the state of the message after the report, or -1 if no
+ *  message is known with the reference.
+ */
+int DLRReport(DeliveryTable * dt, int mr, int status)
+{
+    char line[32];
+    DeliveryEntry * de;
+
+    assert(dt != NULL);
+
+    if ((mr < 0) || (mr >= DLR_SLOTS) ||
+        (dt->dt_entries[mr].de_state == DLR_FREE)) {
+        return -1;
+    }
+    de = &dt->dt_entries[mr];
+    de->de_status = status & 0xff;
+    de->de_state = report_state(de->de_status);
+    sprintf(line, DLR_REPORT_RECORD, mr, de->de_status);
+    append_record(dt, line);
+    return de->de_state;
+}
+
+/** Name of a delivery state, for listings and log messages. */
+const char * DLRStateName(DeliveryState state)
+{
+    switch (state) {
+        case DLR_FREE:      return "free";
+        case DLR_PENDING:   return "pending";
+        case DLR_DELIVERED: return "delivered";
+        case DLR_FAILED:    return "failed";
+    }
+    return "unknown";
+}
+
+/** Close a table. The record is left for the next session. */
+void DLRClose(DeliveryTable * dt)
+{
+    assert(dt != NULL);
+
+    if (dt->dt_fd != -1) {
+        close(dt->dt_fd);
+    }
+    free(dt->dt_path);
+    free(dt);
+}
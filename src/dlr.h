@@ -0,0 +1,67 @@
+/*
+ * Glacsweb dlr.h
+ * Copyright (C) 2004 Alistair Riddoch, The University of Southampton
+ */
+
+#ifndef GLACSWEB_DLR_H
+#define GLACSWEB_DLR_H
+
+#include "pdu.h"
+
+#include <time.h>
+
+/** Number of message references, which index the table */
+#define DLR_SLOTS               256
+/** Longest file name kept for a block, as the end of longer names */
+#define DLR_NAME_MAX            64
+
+/** What is known of the delivery of a message */
+typedef enum delivery_state {
+    /** No message has been sent with this reference */
+    DLR_FREE = 0,
+    /** Sent, with no final report yet */
+    DLR_PENDING,
+    /** Reported delivered */
+    DLR_DELIVERED,
+    /** Reported as not delivered, with the service centre given up */
+    DLR_FAILED
+} DeliveryState;
+
+/** The block of a file sent in one message, and its delivery */
+typedef struct delivery_entry {
+    /** Delivery of the message */
+    DeliveryState de_state;
+    /** Status from the last report, TP-ST, or -1 if none has arrived */
+    int         de_status;
+    /** Block number, or the first block of the group for parity */
+    int         de_block;
+    /** Index of the parity block in its group, or -1 for data */
+    int         de_parity;
+    /** Time the message was submitted */
+    time_t      de_sent;
+    /** Number the message was sent to */
+    char        de_number[PDU_MAX_DIGITS + 2];
+    /** Name of the file, as given in the block header */
+    char        de_name[DLR_NAME_MAX + 1];
+} DeliveryEntry;
+
+/** Messages sent, indexed by the reference the network gave them */
+typedef struct delivery_table {
+    /** File descriptor of the record of the table, open for appending */
+    int         dt_fd;
+    /** Path of the record */
+    char *      dt_path;
+    /** Number of lines in the record */
+    int         dt_records;
+    /** Message sent with each reference */
+    DeliveryEntry dt_entries[DLR_SLOTS];
+} DeliveryTable;
+
+DeliveryTable * DLROpen(const char * path);
+int DLRSubmitted(DeliveryTable *, int mr, const char * number,
+                 const char * name, int block, int parity);
+int DLRReport(DeliveryTable *, int mr, int status);
+const char * DLRStateName(DeliveryState state);
+void DLRClose(DeliveryTable *);
+
+#endif // GLACSWEB_DLR_H
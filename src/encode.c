@@ -0,0 +1,321 @@
+/*
+ * Glacsweb encode.c
+ * Binary to text encodings
+ */
+
+/** \file
+ * Encodings of binary data as text, for sending files as text mode SMS
+ * messages. Hex is what was always sent, and carries 4 bits in each
+ * character. Base64 carries 6 bits, and base84 carries 19 bits in each
+ * 3 characters, using the letters, digits and the punctuation which the
+ * GSM default alphabet has without an escape. All of them are table
+ * driven in both directions.
+ *
+ * Copyright (C) 2004 Alistair Riddoch, The University of Southampton
+ */
+
+#include "encode.h"
+
+#include <string.h>
+#include <assert.h>
+
+static const char hex_alphabet[] = "0123456789abcdef";
+
+static const char base64_alphabet[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static const char base84_alphabet[] =
+    "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz"
+    "!\"#$%&'()*+,-./:;<=>?_";
+
+/** Names and header letters of the encodings */
+static const struct enc_name {
+    const char *        en_name;
+    char                en_letter;
+} enc_names[ENC_COUNT] = {
+    { "hex", 'h' },
+    { "base64", 'b' },
+    { "base84", 'z' }
+};
+
+/** Values of the characters in each alphabet, or -1 for characters which
+ *  are not in it */
+static signed char hex_values[256];
+static signed char base64_values[256];
+static signed char base84_values[256];
+/** Non-zero once the decoding tables are built */
+static int enc_ready = 0;
+
+/** Fill a decoding table from an alphabet. */
+static void build_table(signed char * values, const char * alphabet)
+{
+    int i;
+
+    memset(values, -1, 256);
+    for (i = 0; alphabet[i] != 0; ++i) {
+        values[(unsigned char)alphabet[i]] = i;
+    }
+}
+
+/** Build the decoding tables. */
+static void build_tables()
+{
+    int i;
+
+    build_table(hex_values, hex_alphabet);
+    build_table(base64_values, base64_alphabet);
+    build_table(base84_values, base84_alphabet);
+    // Upper case hex is decoded too
+    for (i = 10; i < 16; ++i) {
+        hex_values['A' + i - 10] = i;
+    }
+    enc_ready = 1;
+}
+
+/** Get an encoding from its name.
+ *  @return zero if the name is known, non-zero otherwise.
+ */
+int ENCGetEncoding(const char * name, Encoding * enc)
+{
+    int i;
+
+    assert(name != NULL);
+    assert(enc != NULL);
+
+    for (i = 0; i < ENC_COUNT; ++i) {
+        if (strcmp(name, enc_names[i].en_name) == 0) {
+            *enc = i;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/** Get an encoding from the letter which names it in a message header.
+ *  @return zero if the letter is known, non-zero otherwise.
+ */
+int ENCGetLetter(char letter, Encoding * enc)
+{
+    int i;
+
+    assert(enc != NULL);
+
+    for (i = 0; i < ENC_COUNT; ++i) {
+        if (letter == enc_names[i].en_letter) {
+            *enc = i;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/** Get the letter which names an encoding in a message header. */
+char ENCLetter(Encoding enc)
+{
+    assert(enc < ENC_COUNT);
+
+    return enc_names[enc].en_letter;
+}
+
+/** Get the number of characters an encoding uses for some bytes, not
+ *  counting the NULL terminator. */
+size_t ENCEncodedLength(Encoding enc, size_t len)
+{
+    size_t bits = len * 8;
+
+    switch (enc) {
+    case ENC_HEX:
+        return len * 2;
+    case ENC_BASE64:
+        return (bits + 5) / 6;
+    case ENC_BASE84:
+        // Left over bits take one character up to 6, two up to 12
+        return (bits / 19) * 3 + ((bits % 19 == 0) ? 0 :
+                                  (bits % 19 <= 6) ? 1 :
+                                  (bits % 19 <= 12) ? 2 : 3);
+    default:
+        assert(0);
+    }
+    return 0;
+}
+
+/** Get the number of bytes an encoding can carry in some characters. */
+size_t ENCCapacity(Encoding enc, size_t chars)
+{
+    size_t len;
+
+    switch (enc) {
+    case ENC_HEX:
+        return chars / 2;
+    case ENC_BASE64:
+        return chars * 6 / 8;
+    case ENC_BASE84:
+        len = ((chars / 3) * 19 + ((chars % 3) * 6)) / 8;
+        while ((len > 0) && (ENCEncodedLength(enc, len) > chars)) {
+            --len;
+        }
+        return len;
+    default:
+        assert(0);
+    }
+    return 0;
+}
+
+/** Encode bytes as text.
+ *  @param enc encoding to use.
+ *  @param data bytes to encode.
+ *  @param len number of bytes.
+ *  @param text buffer for the text, which must hold
+ *  ENCEncodedLength(enc, len) + 1 characters.
+ *  @return the number of characters, not counting the NULL terminator.
+ */
+size_t ENCEncode(Encoding enc, const BYTE * data, size_t len, char * text)
+{
+    unsigned long acc = 0;
+    int bits = 0;
+    char * p = text;
+    size_t i;
+
+    assert(data != NULL || len == 0);
+    assert(text != NULL);
+
+    switch (enc) {
+    case ENC_HEX:
+        for (i = 0; i < len; ++i) {
+            *p++ = hex_alphabet[data[i] >> 4];
+            *p++ = hex_alphabet[data[i] & 0x0f];
+        }
+        break;
+    case ENC_BASE64:
+        for (i = 0; i < len; ++i) {
+            acc = (acc << 8) | data[i];
+            bits += 8;
+            while (bits >= 6) {
+                bits -= 6;
+                *p++ = base64_alphabet[(acc >> bits) & 0x3f];
+            }
+        }
+        if (bits > 0) {
+            *p++ = base64_alphabet[(acc << (6 - bits)) & 0x3f];
+        }
+        break;
+    case ENC_BASE84:
+        for (i = 0; i < len; ++i) {
+            acc = (acc << 8) | data[i];
+            bits += 8;
+            if (bits >= 19) {
+                unsigned long v;
+
+                bits -= 19;
+                v = (acc >> bits) & 0x7ffff;
+                *p++ = base84_alphabet[v / (84 * 84)];
+                *p++ = base84_alphabet[(v / 84) % 84];
+                *p++ = base84_alphabet[v % 84];
+            }
+        }
+        if (bits > 12) {
+            unsigned long v = (acc << (19 - bits)) & 0x7ffff;
+
+            *p++ = base84_alphabet[v / (84 * 84)];
+            *p++ = base84_alphabet[(v / 84) % 84];
+            *p++ = base84_alphabet[v % 84];
+        } else if (bits > 6) {
+            unsigned long v = (acc << (12 - bits)) & 0xfff;
+
+            *p++ = base84_alphabet[v / 84];
+            *p++ = base84_alphabet[v % 84];
+        } else if (bits > 0) {
+            *p++ = base84_alphabet[(acc << (6 - bits)) & 0x3f];
+        }
+        break;
+    default:
+        assert(0);
+    }
+    *p = 0;
+    return p - text;
+}
+
+/** Decode text made by ENCEncode.
+ *  @param enc encoding which was used.
+ *  @param text the encoded text, which need not be NULL terminated.
+ *  @param chars number of characters of text.
+ *  @param data buffer for the bytes, which must hold
+ *  ENCCapacity(enc, chars) bytes.
+ *  @return the number of bytes, or -1 if the text is not valid.
+ */
+int ENCDecode(Encoding enc, const char * text, size_t chars, BYTE * data)
+{
+    const unsigned char * t = (const unsigned char *)text;
+    unsigned long acc = 0;
+    int bits = 0;
+    BYTE * p = data;
+    size_t i;
+
+    assert(text != NULL || chars == 0);
+    assert(data != NULL);
+
+    if (!enc_ready) {
+        build_tables();
+    }
+
+    switch (enc) {
+    case ENC_HEX:
+        if ((chars % 2) != 0) {
+            return -1;
+        }
+        for (i = 0; i < chars; i += 2) {
+            int high = hex_values[t[i]];
+            int low = hex_values[t[i + 1]];
+
+            if ((high < 0) || (low < 0)) {
+                return -1;
+            }
+            *p++ = (high << 4) | low;
+        }
+        break;
+    case ENC_BASE64:
+        for (i = 0; i < chars; ++i) {
+            int v = base64_values[t[i]];
+
+            if (v < 0) {
+                return -1;
+            }
+            acc = (acc << 6) | v;
+            bits += 6;
+            if (bits >= 8) {
+                bits -= 8;
+                *p++ = (acc >> bits) & 0xff;
+            }
+        }
+        break;
+    case ENC_BASE84:
+        for (i = 0; i < chars; i += 3) {
+            size_t n = (chars - i < 3) ? chars - i : 3;
+            unsigned long v = 0;
+            size_t j;
+
+            for (j = 0; j < n; ++j) {
+                int c = base84_values[t[i + j]];
+
+                if (c < 0) {
+                    return -1;
+                }
+                v = v * 84 + c;
+            }
+            // Three characters carry 19 bits, two carry 12, one carries 6
+            if (v >= (1UL << ((n == 3) ? 19 : n * 6))) {
+                return -1;
+            }
+            acc = (acc << ((n == 3) ? 19 : n * 6)) | v;
+            bits += (n == 3) ? 19 : n * 6;
+            while (bits >= 8) {
+                bits -= 8;
+                *p++ = (acc >> bits) & 0xff;
+            }
+        }
+        break;
+    default:
+        assert(0);
+    }
+    return p - data;
+}
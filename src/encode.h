@@ -0,0 +1,33 @@
+/*
+ * Glacsweb encode.h
+ * Copyright (C) 2004 Alistair Riddoch, The University of Southampton
+ */
+
+#ifndef GLACSWEB_ENCODE_H
+#define GLACSWEB_ENCODE_H
+
+#include "types.h"
+
+#include <stddef.h>
+
+/** Encodings of binary data as text which passes through text mode SMS */
+typedef enum encoding {
+    /** Lower case hex, two characters for each byte */
+    ENC_HEX = 0,
+    /** Base64 without padding, four characters for three bytes */
+    ENC_BASE64,
+    /** Base84, three characters for 19 bits, using only characters which
+     *  are in the GSM default alphabet without an escape */
+    ENC_BASE84,
+    ENC_COUNT
+} Encoding;
+
+int ENCGetEncoding(const char * name, Encoding * enc);
+int ENCGetLetter(char letter, Encoding * enc);
+char ENCLetter(Encoding enc);
+size_t ENCEncodedLength(Encoding enc, size_t len);
+size_t ENCCapacity(Encoding enc, size_t chars);
+size_t ENCEncode(Encoding enc, const BYTE * data, size_t len, char * text);
+int ENCDecode(Encoding enc, const char * text, size_t chars, BYTE * data);
+
+#endif // GLACSWEB_ENCODE_H
@@ -0,0 +1,288 @@
+/*
+ * Glacsweb fec.c
+ * Erasure coding of groups of blocks
+ */
+
+/** \file
+ * Forward error correction for files sent as many messages, so lost
+ * messages can be rebuilt by the receiver. The blocks of a file are sent
+ * in groups of k, each followed by m parity blocks, and any k of the
+ * k + m blocks of a group are enough to rebuild the rest.
+ *
+ * Parity is computed with a Cauchy matrix over GF(256): parity block j is
+ * the sum over data blocks i of C[j][i] * row i, where C[j][i] is the
+ * inverse of x_j + y_i, with x_j = j and y_i = m + i. Every square
+ * submatrix of a Cauchy matrix can be inverted, which is what makes any
+ * k blocks enough. Multiplication is done a row at a time, through a
+ * table of the products of one coefficient with every byte.
+ *
+ * Copyright (C) 2004 Alistair Riddoch, The University of Southampton
+ */
+
+#include "fec.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+/** Polynomial which defines the field, x^8 + x^4 + x^3 + x^2 + 1 */
+#define FEC_POLY        0x11d
+
+/** Powers of the generator 2, twice over so sums of logs need no
+ *  reduction */
+static BYTE fec_exp[510];
+/** Logarithms to base 2, with the log of zero unused */
+static int fec_log[256];
+/** Non-zero once the tables are built */
+static int fec_ready = 0;
+
+/** Build the tables of powers and logarithms. */
+static void build_tables()
+{
+    int x = 1;
+    int i;
+
+    for (i = 0; i < 255; ++i) {
+        fec_exp[i] = fec_exp[i + 255] = x;
+        fec_log[x] = i;
+        x <<= 1;
+        if (x & 0x100) {
+            x ^= FEC_POLY;
+        }
+    }
+    fec_log[0] = 0;
+    fec_ready = 1;
+}
+
+/** Multiply two elements of the field. */
+static BYTE gf_mul(BYTE a, BYTE b)
+{
+    if ((a == 0) || (b == 0)) {
+        return 0;
+    }
+    return fec_exp[fec_log[a] + fec_log[b]];
+}
+
+/** Get the inverse of a non-zero element of the field. */
+static BYTE gf_inv(BYTE a)
+{
+    assert(a != 0);
+
+    return fec_exp[255 - fec_log[a]];
+}
+
+/** Get the coefficient of data block i in parity block j. */
+static BYTE coefficient(int m, int j, int i)
+{
+    return gf_inv(j ^ (m + i));
+}
+
+/** Add a multiple of one row of bytes to another.
+ *  @param dst row to add to.
+ *  @param src row to add.
+ *  @param coef element of the field to multiply src by.
+ *  @param len length of the rows.
+ */
+void FECMulAdd(BYTE * dst, const BYTE * src, BYTE coef, size_t len)
+{
+    BYTE product[256];
+    size_t i;
+    int x;
+
+    assert(dst != NULL);
+    assert(src != NULL);
+
+    if (!fec_ready) {
+        build_tables();
+    }
+
+    if (coef == 0) {
+        return;
+    }
+    if (coef == 1) {
+        for (i = 0; i < len; ++i) {
+            dst[i] ^= src[i];
+        }
+        return;
+    }
+    product[0] = 0;
+    for (x = 1; x < 256; ++x) {
+        product[x] = fec_exp[fec_log[x] + fec_log[coef]];
+    }
+    for (i = 0; i < len; ++i) {
+        dst[i] ^= product[src[i]];
+    }
+}
+
+/** Add one data block of a group to its parity blocks, so parity can be
+ *  computed as the blocks are sent, without holding the group.
+ *  @param m number of parity blocks.
+ *  @param i index of the data block in its group.
+ *  @param row the data block.
+ *  @param len length of the data block, which must be no longer than
+ *  the parity blocks.
+ *  @param parity the m parity blocks, which must be zero before the
+ *  first data block of the group is added.
+ */
+void FECAddBlock(int m, int i, const BYTE * row, size_t len,
+                 BYTE * const * parity)
+{
+    int j;
+
+    assert(m > 0);
+    assert((i >= 0) && (m + i < FEC_MAX_BLOCKS));
+    assert(row != NULL);
+    assert(parity != NULL);
+
+    if (!fec_ready) {
+        build_tables();
+    }
+
+    for (j = 0; j < m; ++j) {
+        FECMulAdd(parity[j], row, coefficient(m, j, i), len);
+    }
+}
+
+/** Invert a square matrix over the field, by Gauss-Jordan elimination.
+ *  @param a matrix of n by n elements, which is destroyed.
+ *  @param inv used to return the inverse.
+ *  @return zero if the matrix was inverted, non-zero if it is singular.
+ */
+static int invert(BYTE * a, BYTE * inv, int n)
+{
+    int row, col, r;
+
+    memset(inv, 0, n * n);
+    for (r = 0; r < n; ++r) {
+        inv[r * n + r] = 1;
+    }
+    for (col = 0; col < n; ++col) {
+        BYTE scale;
+
+        for (row = col; (row < n) && (a[row * n + col] == 0); ++row) {
+        }
+        if (row == n) {
+            return 1;
+        }
+        if (row != col) {
+            for (r = 0; r < n; ++r) {
+                BYTE t = a[row * n + r];
+
+                a[row * n + r] = a[col * n + r];
+                a[col * n + r] = t;
+                t = inv[row * n + r];
+                inv[row * n + r] = inv[col * n + r];
+                inv[col * n + r] = t;
+            }
+        }
+        scale = gf_inv(a[col * n + col]);
+        for (r = 0; r < n; ++r) {
+            a[col * n + r] = gf_mul(a[col * n + r], scale);
+            inv[col * n + r] = gf_mul(inv[col * n + r], scale);
+        }
+        for (row = 0; row < n; ++row) {
+            BYTE factor = a[row * n + col];
+
+            if ((row == col) || (factor == 0)) {
+                continue;
+            }
+            FECMulAdd(a + row * n, a + col * n, factor, n);
+            FECMulAdd(inv + row * n, inv + col * n, factor, n);
+        }
+    }
+    return 0;
+}
+
+/** Rebuild the missing data blocks of a group from its parity blocks.
+ *  @param k number of data blocks in the group.
+ *  @param m number of parity blocks in the group.
+ *  @param rows the k data blocks, each len bytes, padded with zeros.
+ *  Those which are missing are overwritten with the rebuilt data.
+ *  @param present flags for each data block, non-zero if it arrived.
+ *  @param parity the m parity blocks, each len bytes, or NULL for those
+ *  which are missing.
+ *  @param len length of every block.
+ *  @return zero if all the data blocks are present or were rebuilt, or
+ *  -1 if too few blocks arrived.
+ */
+int FECRecover(int k, int m, BYTE * const * rows, const int * present,
+               const BYTE * const * parity, size_t len)
+{
+    int missing[FEC_MAX_BLOCKS];
+    int used[FEC_MAX_BLOCKS];
+    BYTE * matrix;
+    BYTE * inv;
+    BYTE * sums;
+    int e = 0;
+    int found = 0;
+    int i, j, r;
+
+    assert((k > 0) && (m > 0) && (k + m <= FEC_MAX_BLOCKS));
+    assert(rows != NULL);
+    assert(present != NULL);
+    assert(parity != NULL);
+
+    if (!fec_ready) {
+        build_tables();
+    }
+
+    for (i = 0; i < k; ++i) {
+        if (!present[i]) {
+            missing[e++] = i;
+        }
+    }
+    if (e == 0) {
+        return 0;
+    }
+    for (j = 0; (j < m) && (found < e); ++j) {
+        if (parity[j] != NULL) {
+            used[found++] = j;
+        }
+    }
+    if (found < e) {
+        return -1;
+    }
+
+    matrix = malloc(e * e);
+    inv = malloc(e * e);
+    sums = malloc(e * len);
+    if ((matrix == NULL) || (inv == NULL) || (sums == NULL)) {
+        free(matrix);
+        free(inv);
+        free(sums);
+        return -1;
+    }
+
+    // Take the blocks which arrived out of each parity block used, leaving
+    // the sum of the missing blocks times their coefficients
+    for (r = 0; r < e; ++r) {
+        BYTE * sum = sums + r * len;
+
+        memcpy(sum, parity[used[r]], len);
+        for (i = 0; i < k; ++i) {
+            if (present[i]) {
+                FECMulAdd(sum, rows[i], coefficient(m, used[r], i), len);
+            }
+        }
+        for (i = 0; i < e; ++i) {
+            matrix[r * e + i] = coefficient(m, used[r], missing[i]);
+        }
+    }
+
+    if (invert(matrix, inv, e) != 0) {
+        e = -1;
+    }
+    for (i = 0; i < e; ++i) {
+        BYTE * row = rows[missing[i]];
+
+        memset(row, 0, len);
+        for (r = 0; r < e; ++r) {
+            FECMulAdd(row, sums + r * len, inv[i * e + r], len);
+        }
+    }
+
+    free(matrix);
+    free(inv);
+    free(sums);
+    return (e < 0) ? -1 : 0;
+}
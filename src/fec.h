@@ -0,0 +1,22 @@
+/*
+ * Glacsweb fec.h
+ * Copyright (C) 2004 Alistair Riddoch, The University of Southampton
+ */
+
+#ifndef GLACSWEB_FEC_H
+#define GLACSWEB_FEC_H
+
+#include "types.h"
+
+#include <stddef.h>
+
+/** Most blocks, data and parity together, in one group */
+#define FEC_MAX_BLOCKS          256
+
+void FECMulAdd(BYTE * dst, const BYTE * src, BYTE coef, size_t len);
+void FECAddBlock(int m, int i, const BYTE * row, size_t len,
+                 BYTE * const * parity);
+int FECRecover(int k, int m, BYTE * const * rows, const int * present,
+               const BYTE * const * parity, size_t len);
+
+#endif // GLACSWEB_FEC_H
@@ -6,67 +6,234 @@
  */
 
 #include "gsm.h"
+#include "at.h"
+#include "pdu.h"
+#include "gsm7.h"
+#include "lzss.h"
+#include "journal.h"
+#include "fec.h"
+#include "dlr.h"
 #include "log.h"
 
+#include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include <assert.h>
 
 #define debug(prg) { if (debug_flag) { prg } }
 
 static const int debug_flag = 0;
 
-/** Read a CR LF terminated line from the serial port.
- *  The CR LF characters are stripped, and the buffer is NULL terminated
- *  so the result can be used as a string.
- *
- *  @param sp serial port to read from
- *  @param buffer buffer to store the line in
- *  @param buflen size of buffer to read data into
- *  @return the number of bytes read, or minus one if an error or timeout
- *  occured.
+/** Time allowed for an ordinary command to complete, in microseconds */
+static const long GSM_COMMAND_TIMEOUT = 3000000;
+/** Default time allowed for an SMS message to be submitted, in
+ *  microseconds */
+static const long GSM_SEND_TIMEOUT = 20000000;
+/** Time allowed for the SMS message prompt to arrive, in microseconds */
+static const long GSM_PROMPT_TIMEOUT = 1000000;
+/** Time allowed for the modem to attach to GPRS, in microseconds */
+static const long GSM_ATTACH_TIMEOUT = 20000000;
+/** Time for which a signal strength reading is used, in microseconds */
+static const long GSM_SIGNAL_MAX_AGE = 60000000;
+/** Time between signal strength readings while waiting for the signal
+ *  to improve, in microseconds */
+static const long GSM_SIGNAL_RETRY_INTERVAL = 5000000;
+
+/** Set a deadline a number of microseconds from now, but no later than
+ *  an overall limit.
+ *  @param deadline pointer used to return the deadline.
+ *  @param usec number of microseconds from now.
+ *  @param limit overall deadline which must not be exceeded.
  */
-static int get_line(SerialPort * sp, char * const buffer, int buflen)
+static void deadline_within(struct timespec * deadline, long usec,
+                            const struct timespec * limit)
 {
-    int state = 0;
-    int count = 0;
+    SERDeadline(deadline, usec);
+    if (SERRemaining(limit) < usec) {
+        *deadline = *limit;
+    }
+}
 
-    assert(sp != NULL);
-    assert(buffer != NULL);
+/** Command engine for the modem, created when first needed */
+static ATEngine * gsm_engine = NULL;
 
-    for (;;) {
-        int c = SERGetByteTimeout(sp, 900000);
-        debug( printf("0x%x,'%c'\n", c, c); );
-        if (c == -1) {
-            LOGWrite(GWL_DEBUG, "Timout\n");
-            return -1;
-        } else if (c == '\r') {
-            if (state != 0) {
-                LOGWrite(GWL_DEBUG, "Unexpected <CR>");
-                return -1;
-            }
-            buffer[count] = 0;
-            state = 1;
-        } else if (c == '\n') {
-            if (state != 1) {
-                LOGWrite(GWL_DEBUG, "Unexpected <LF>");
-                return -1;
-            }
-            debug( printf("EOL\n"); );
-            return count;
-        } else {
-            if (state != 0) {
-                LOGWrite(GWL_DEBUG, "Normal character after <CR>");
-                return -1;
-            }
-            buffer[count++] = c;
-            assert(count <= buflen);
-            if (count == buflen) {
-                LOGWrite(GWL_DEBUG, "Overflow.");
-                return -1;
-            }
+/** Network state of the modem, as last read or reported */
+static GSMNetState gsm_net = { -1, -1, -1, -1, 99, { 0, 0 }, 0, 0 };
+
+/** Take the registration status and cell location from a classified
+ *  +CREG or +CGREG line. The query response starts with the report mode,
+ *  which the unsolicited form leaves out.
+ *  @param parsed classified line received from the modem.
+ *  @param query non-zero if the line is the response to a query.
+ *  @param stat pointer used to return the registration status.
+ *  @return zero on success, or -1 if the line has no status.
+ */
+static int parse_registration(const ATParsed * parsed, int query, int * stat)
+{
+    int first = query ? 1 : 0;
+
+    if ((parsed->ap_code != AT_CODE_CREG) &&
+        (parsed->ap_code != AT_CODE_CGREG)) {
+        return -1;
+    }
+    if ((parsed->ap_nfields <= first) ||
+        (parsed->ap_field[first][0] < '0') ||
+        (parsed->ap_field[first][0] > '9')) {
+        return -1;
+    }
+    *stat = parsed->ap_value[first];
+
+    // The cell location follows as two quoted hex strings, if reported
+    if ((parsed->ap_code == AT_CODE_CREG) &&
+        (parsed->ap_nfields >= first + 3)) {
+        gsm_net.ns_lac = strtol(parsed->ap_field[first + 1], NULL, 16);
+        gsm_net.ns_ci = strtol(parsed->ap_field[first + 2], NULL, 16);
+    }
+    return 0;
+}
+
+/** Handle an unsolicited network registration report. */
+static void creg_report(const char * line, const ATParsed * parsed,
+                        void * arg)
+{
+    int stat;
+
+    if (parse_registration(parsed, 0, &stat) == 0) {
+        debug( printf("Network registration now %d\n", stat); );
+        gsm_net.ns_creg = stat;
+    }
+}
+
+/** Handle an unsolicited GPRS registration report. */
+static void cgreg_report(const char * line, const ATParsed * parsed,
+                         void * arg)
+{
+    int stat;
+
+    if (parse_registration(parsed, 0, &stat) == 0) {
+        debug( printf("GPRS registration now %d\n", stat); );
+        gsm_net.ns_cgreg = stat;
+    }
+}
+
+/** Handle an indicator event. A change in the signal indicator only
+ *  gives a coarse level, so it marks the stored signal strength as out
+ *  of date rather than replacing it.
+ */
+static void ciev_report(const char * line, const ATParsed * parsed,
+                        void * arg)
+{
+    if ((parsed->ap_nfields >= 2) && (gsm_net.ns_signal_ind != 0) &&
+        (parsed->ap_value[0] == gsm_net.ns_signal_ind)) {
+        debug( printf("Signal level changed\n"); );
+        SERDeadline(&gsm_net.ns_csq_expiry, 0);
+    }
+}
+
+/** Handle a vendor signal strength report, given in +CSQ units. */
+static void rssi_report(const char * line, const ATParsed * parsed,
+                        void * arg)
+{
+    if (parsed->ap_nfields >= 1) {
+        gsm_net.ns_csq = parsed->ap_value[0];
+        SERDeadline(&gsm_net.ns_csq_expiry, GSM_SIGNAL_MAX_AGE);
+    }
+}
+
+/** Table of messages sent, which delivery reports are matched against,
+ *  or NULL if delivery is not being tracked */
+static DeliveryTable * gsm_dlr = NULL;
+
+/** Record a status report for a message in the table of messages sent. */
+static void delivery_report(int mr, int status)
+{
+    char mesg[64]; // For logfile
+    int state;
+
+    if (gsm_dlr == NULL) {
+        return;
+    }
+    state = DLRReport(gsm_dlr, mr, status);
+    if (state == DLR_FAILED) {
+        const DeliveryEntry * de = &gsm_dlr->dt_entries[mr];
+
+        snprintf(mesg, sizeof(mesg), "Message %d to %.20s not delivered, "
+                 "status %d.", mr, de->de_number, status);
+        LOGWrite(GWL_VERBOSE, mesg);
+    }
+    debug( printf("Report for message %d status %d is %s\n", mr, status,
+                  (state < 0) ? "unknown" : DLRStateName(state)); );
+}
+
+/** Handle the PDU of a status report, which follows +CDS in PDU mode. */
+static void cds_pdu(const char * line, const ATParsed * parsed, void * arg)
+{
+    int mr, status;
+
+    if (PDUDecodeStatusReport(line, &mr, NULL, &status) == 0) {
+        delivery_report(mr, status);
+    }
+}
+
+/** Handle a status report. In text mode the report is given in full, as
+ *  the first octet, the reference, the recipient and its type, two times
+ *  and the status. In PDU mode only the length is given, and the PDU
+ *  follows on the next line.
+ */
+static void cds_report(const char * line, const ATParsed * parsed,
+                       void * arg)
+{
+    if (parsed->ap_nfields == 1) {
+        ATTakeNextLine(gsm_engine, cds_pdu, NULL);
+    } else if (parsed->ap_nfields >= 7) {
+        delivery_report(parsed->ap_value[1], parsed->ap_value[6]);
+    }
+}
+
+/** Get the command engine for the modem on a serial port, creating it
+ *  if needed.
+ *  @return the engine, or NULL if it could not be created.
+ */
+static ATEngine * get_engine(SerialPort * sp)
+{
+    if ((gsm_engine != NULL) && (gsm_engine->ae_sp != sp)) {
+        ATDestroy(gsm_engine);
+        gsm_engine = NULL;
+    }
+    if (gsm_engine == NULL) {
+        gsm_engine = ATCreate(sp);
+        if (gsm_engine == NULL) {
+            return NULL;
         }
+        gsm_net.ns_creg = -1;
+        gsm_net.ns_cgreg = -1;
+        gsm_net.ns_csq = 99;
+        gsm_net.ns_reports = 0;
+        gsm_net.ns_signal_ind = 0;
+        ATRegisterURC(gsm_engine, "+CREG:", creg_report, NULL);
+        ATRegisterURC(gsm_engine, "+CGREG:", cgreg_report, NULL);
+        ATRegisterURC(gsm_engine, "+CIEV:", ciev_report, NULL);
+        ATRegisterURC(gsm_engine, "^RSSI:", rssi_report, NULL);
+        ATRegisterURC(gsm_engine, "+CDS:", cds_report, NULL);
+    }
+    return gsm_engine;
+}
+
+/** Run a command through the engine for the modem on a serial port.
+ *  @param sp serial port used to communicate with the modem.
+ *  @param cmd command to run.
+ *  @return the outcome of the command.
+ */
+static ATResult gsm_exec(SerialPort * sp, ATCommand * cmd)
+{
+    ATEngine * ae = get_engine(sp);
+
+    if (ae == NULL) {
+        return AT_IO_ERROR;
     }
+    return ATExec(ae, cmd);
 }
 
 static int debug_mode = 0;
@@ -77,29 +244,24 @@ int GSMDebugMode()
     return 0;
 }
 
-/** Message to turn on echoing of commands */
-static const char * const	E1_MESSAGE		= "ATE1\r\n";
+/** Command to turn on echoing of commands */
+static const char * const	E1_MESSAGE		= "ATE1";
+/** Command to turn off echoing of commands */
+static const char * const	E0_MESSAGE		= "ATE0";
 
 /** Send the AT command which enables echo on the GSM modem. This ensures
  *  that all future commands are echoed as expected.
  */
 int GSMEchoOn(SerialPort * sp)
 {
-    char linebuf[256];
-    int count;
+    ATCommand cmd;
 
     if (debug_mode) {
         return 0;
     }
 
-    SERPutString(sp, E1_MESSAGE);
-    get_line(sp, linebuf, 256); // Either blank, or echoed command
-    get_line(sp, linebuf, 256); // Blank
-    count = get_line(sp, linebuf, 256); // OK Response
-
-    SERFlushChannel(sp, 100000);
-
-    if (strncmp(linebuf, "OK", 2) != 0) {
+    ATInitCommand(&cmd, E1_MESSAGE, NULL, GSM_COMMAND_TIMEOUT);
+    if (gsm_exec(sp, &cmd) != AT_OK) {
         LOGWrite(GWL_ERROR, "Failed to enable ECHO mode.");
         return 1;
     }
@@ -107,67 +269,145 @@ int GSMEchoOn(SerialPort * sp)
     return 0;
 }
 
-/** Send a command to the GSM modem, and listen for the echoed response.
- *  @return zero if the message was echoed back correctly, and one otherwise.
+/** Send the AT command which disables echo on the GSM modem. Responses
+ *  are matched to commands without the echo, so this halves the traffic
+ *  from the modem for short commands, and saves the echo of the whole
+ *  text of each SMS message.
  */
-int GSMSendCommand(SerialPort * sp, const char * const msg)
+int GSMEchoOff(SerialPort * sp)
 {
-    char linebuf[256];
-    int count;
+    ATCommand cmd;
 
-    SERPutString(sp, msg);
-
-    count = get_line(sp, linebuf, 256);
-
-    if (count <= 0) {
-        return 1;
+    if (debug_mode) {
+        return 0;
     }
 
-    if (strncmp(linebuf, msg, strlen(linebuf)) != 0) {
-        LOGWrite(GWL_ERROR, "Message was not echoed correctly.");
+    ATInitCommand(&cmd, E0_MESSAGE, NULL, GSM_COMMAND_TIMEOUT);
+    if (gsm_exec(sp, &cmd) != AT_OK) {
+        LOGWrite(GWL_ERROR, "Failed to disable ECHO mode.");
         return 1;
     }
+
     return 0;
 }
 
-/** Message to read network registration status */
-static const char * const	CREG_MESSAGE		= "AT+CREG?\r\n";
+/** Command to read network registration status */
+static const char * const	CREG_MESSAGE		= "AT+CREG?";
 /** Prefix of reported network registration status message */
 static const char * const	CREG_MESSAGE_RES	= "+CREG: ";
-/** Minimum length of reported network registration status message */
-static const int		CREG_MESSAGE_RES_LEN	= 10;
 
-/** Message to read signal strength */
-static const char * const	CSQ_MESSAGE		= "AT+CSQ\r\n";
+/** Command to read signal strength */
+static const char * const	CSQ_MESSAGE		= "AT+CSQ";
 /** Prefix of reported signal strength message */
 static const char * const	CSQ_MESSAGE_RES		= "+CSQ: ";
-/** Minimum length of reported signal strength message */
-static const int		CSQ_MESSAGE_RES_LEN	= 9;
 
-/** Message to put modem into SMS mode */
-static const char * const	CMGF_MESSAGE		= "AT+CMGF=1\r\n";
+/** Command to put modem into SMS mode */
+static const char * const	CMGF_MESSAGE		= "AT+CMGF=1";
+/** Command to put modem into SMS PDU mode */
+static const char * const	CMGF_PDU_MESSAGE	= "AT+CMGF=0";
+
+/** Command format to send SMS message */
+static const char * const	CMGS_MESSAGE		= "AT+CMGS=%s";
+/** Command format to send SMS message in PDU mode */
+static const char * const	CMGS_PDU_MESSAGE	= "AT+CMGS=%d";
+/** Prefix of the message reference returned when a message is sent */
+static const char * const	CMGS_MESSAGE_RES	= "+CMGS:";
+
+/** Message format the modem was last put into, 1 for text, 0 for PDU, or
+ *  -1 if not known */
+static int gsm_cmgf = -1;
+
+/** Put the modem into text or PDU message format, unless it is known to
+ *  be in that format already.
+ *  @param format 1 for text mode, or 0 for PDU mode.
+ *  @return zero if the modem is in the format, non-zero otherwise.
+ */
+static int set_message_format(SerialPort * sp, int format)
+{
+    ATCommand cmd;
+
+    if (gsm_cmgf == format) {
+        return 0;
+    }
+    ATInitCommand(&cmd, format ? CMGF_MESSAGE : CMGF_PDU_MESSAGE, NULL,
+                  GSM_COMMAND_TIMEOUT);
+    if (gsm_exec(sp, &cmd) != AT_OK) {
+        gsm_cmgf = -1;
+        LOGWrite(GWL_ERROR, "Error from GSM modem setting message format.");
+        return 1;
+    }
+    gsm_cmgf = format;
+    return 0;
+}
+
+/** Time allowed for an SMS message to be submitted, in microseconds, or
+ *  zero for GSM_SEND_TIMEOUT */
+static long gsm_send_timeout = 0;
 
-/** Message format to send SMS message */
-static const char * const	CMGS_MESSAGE		= "AT+CMGS=%s\r\n";
+/** Set the time allowed for each SMS message to be submitted. This
+ *  covers the whole exchange with the modem, from sending the command to
+ *  the final result.
+ *  @param usec time allowed in microseconds, or zero for the default.
+ */
+void GSMSetSendTimeout(long usec)
+{
+    gsm_send_timeout = (usec > 0) ? usec : 0;
+}
 
-/** Send an SMS message using the GSM modem.
- *  The message to be sent shall be less than 171 bytes long.
+/** Check the result of submitting an SMS message, and get the message
+ *  reference the network gave it.
+ *  @param mr pointer used to return the message reference, or NULL.
+ *  @return zero if the message was sent, non-zero otherwise.
+ */
+static int submit_result(const ATCommand * cmd, ATResult res, int * mr)
+{
+    char line[64];
+
+    if (res == AT_CMS_ERROR) {
+        sprintf(line, "Message rejected with +CMS ERROR: %d.", cmd->ac_error);
+        LOGWrite(GWL_ERROR, line);
+        return 1;
+    }
+    if (res != AT_OK) {
+        sprintf(line, "Error sending message: %s.", ATResultName(res));
+        LOGWrite(GWL_ERROR, line);
+        return 1;
+    }
+    if (cmd->ac_nlines < 1) {
+        LOGWrite(GWL_ERROR, "No message reference for sent message.");
+        return 1;
+    }
+    if (mr != NULL) {
+        ATParsed parsed;
+
+        ATClassify(cmd->ac_lines[0], &parsed);
+        *mr = (parsed.ap_nfields > 0) ? parsed.ap_value[0] : 0;
+    }
+
+    return 0;
+}
+
+/** Send an SMS message using the GSM modem, and get the message
+ *  reference the network gave it.
+ *  Messages more than 170 bytes long are sent with
+ *  GSMSubmitLongMessage. The call
+ *  returns as soon as the modem gives its final result, and the whole
+ *  exchange is bounded by the time set with GSMSetSendTimeout.
+ *  @param mr pointer used to return the message reference, or NULL.
  *  @return zero if the message is sent successfully, non-zero otherwise.
  */
-int GSMSendMessage(SerialPort * sp, const char * const number,
-                   const char * const msg)
+int GSMSubmitMessage(SerialPort * sp, const char * const number,
+                     const char * const msg, int * mr)
 {
-    char cmd[256];
-    char buf[256];
-    int count;
+    ATCommand cmd;
+    char line[AT_LINE_LEN];
 
     assert(sp != NULL);
     assert(number != NULL);
     assert(msg != NULL);
 
     if (strlen(msg) > 170) {
-        LOGWrite(GWL_ERROR, "Message is too long.");
-        return 1;
+        return GSMSubmitLongMessage(sp, number, msg, mr);
     }
 
     if (strlen(number) > 80) {
@@ -180,80 +420,447 @@ int GSMSendMessage(SerialPort * sp, const char * const number,
 
     // ?? Not sure why this is here pjb08r 02/13
     if (debug_mode) {
+        if (mr != NULL) {
+            *mr = 0;
+        }
         return 0;
     }
 
-    sprintf(cmd, CMGS_MESSAGE, number);
-    GSMSendCommand(sp, cmd);
+    if ((gsm_cmgf == 0) && (set_message_format(sp, 1) != 0)) {
+        return 1;
+    }
+
+    sprintf(line, CMGS_MESSAGE, number);
+    ATInitCommand(&cmd, line, CMGS_MESSAGE_RES,
+                  (gsm_send_timeout > 0) ? gsm_send_timeout : GSM_SEND_TIMEOUT);
+    cmd.ac_prompt_timeout = GSM_PROMPT_TIMEOUT;
+    cmd.ac_payload = msg;
 
-    // blank line?
-    get_line(sp, buf, 256);
+    return submit_result(&cmd, gsm_exec(sp, &cmd), mr);
+}
 
-    count = SERGetBytesTimeout(sp, buf, 2, 50000);
-    if (count != 2) {
-        LOGWrite(GWL_ERROR, "Error waiting for message prompt.");
-        return 1;
+/** Send an SMS message of binary data using the GSM modem in PDU mode,
+ *  and get the message reference the network gave it. The modem is left
+ *  in PDU mode, and GSMSubmitMessage puts it back into text mode.
+ *  @param number destination, of digits with an optional leading +.
+ *  @param flags PDU_FLAG_ bits to set in the first octet of the PDU.
+ *  @param dcs data coding scheme of the data, eg PDU_DCS_8BIT.
+ *  @param data user data, including any user data header, with 7-bit
+ *  text already packed.
+ *  @param len length of the data, in septets for 7-bit text, or in bytes
+ *  otherwise. Must fit in one message.
+ *  @param mr pointer used to return the message reference, or NULL.
+ *  @return zero if the message is sent successfully, non-zero otherwise.
+ */
+int GSMSubmitPDU(SerialPort * sp, const char * const number, int flags,
+                 BYTE dcs, const BYTE * data, size_t len, int * mr)
+{
+    ATCommand cmd;
+    char line[32];
+    char hex[PDU_MAX_HEX];
+    int tpdu_len;
+
+    assert(sp != NULL);
+    assert(number != NULL);
+    assert(data != NULL);
+
+    if (gsm_dlr != NULL) {
+        flags |= PDU_FLAG_SRR;
     }
-    debug( fprintf(stderr, "0x%x, 0x%x\n", buf[0], buf[1]); );
-    if ((buf[0] != '>') || (buf[1] != ' ')) {
-        LOGWrite(GWL_ERROR, "Did not get message prompt.");
+    if (PDUEncodeSubmit(number, flags, dcs, data, len, hex, &tpdu_len) != 0) {
         return 1;
     }
 
-    SERPutString(sp, msg);
-    SERPutByte(sp, 0x1a);
+    if (debug_mode) {
+        printf("%s\n", hex);
+        if (mr != NULL) {
+            *mr = 0;
+        }
+        return 0;
+    }
 
-    // Read the messsage back, including any prompts.
-    SERGetBytesTimeout(sp, buf, 256, 500000);
+    if (set_message_format(sp, 0) != 0) {
+        return 1;
+    }
+
+    sprintf(line, CMGS_PDU_MESSAGE, tpdu_len);
+    ATInitCommand(&cmd, line, CMGS_MESSAGE_RES,
+                  (gsm_send_timeout > 0) ? gsm_send_timeout : GSM_SEND_TIMEOUT);
+    cmd.ac_prompt_timeout = GSM_PROMPT_TIMEOUT;
+    cmd.ac_payload = hex;
 
-    sleep(1);
+    return submit_result(&cmd, gsm_exec(sp, &cmd), mr);
+}
 
-    get_line(sp, buf, 256);
+/** Command format to set whether the modem keeps the link to the network
+ *  open between messages */
+static const char * const	CMMS_MESSAGE		= "AT+CMMS=%d";
+/** Command to read whether the modem keeps the link open */
+static const char * const	CMMS_QUERY_MESSAGE	= "AT+CMMS?";
+/** Prefix of the response giving whether the link is kept open */
+static const char * const	CMMS_MESSAGE_RES	= "+CMMS:";
+
+/** Set whether the modem keeps the link to the network open after a
+ *  message is sent, so that more messages follow without the delay of
+ *  setting it up again. Modems which do not support AT+CMMS are left to
+ *  close the link, which only makes sending slower.
+ *  @param mode 2 to keep the link open until told otherwise, 1 to keep it
+ *  open until the next message or a timeout, or 0 to close it after each
+ *  message.
+ *  @return zero if the mode was set, non-zero otherwise.
+ */
+static int set_more_messages(SerialPort * sp, int mode)
+{
+    ATCommand cmd;
+    char line[16];
 
+    if (debug_mode) {
+        return 0;
+    }
+    sprintf(line, CMMS_MESSAGE, mode);
+    ATInitCommand(&cmd, line, NULL, GSM_COMMAND_TIMEOUT);
+    if (gsm_exec(sp, &cmd) != AT_OK) {
+        LOGWrite(GWL_DEBUG, "Modem does not keep the link open.");
+        return 1;
+    }
     return 0;
 }
 
+/** Start sending a batch of messages back to back, with the link to the
+ *  network kept open from one to the next. The mode the modem was in is
+ *  read first, so end_batch can put it back.
+ *  @return the mode to give to end_batch, or -1 if the modem can not keep
+ *  the link open.
+ */
+static int begin_batch(SerialPort * sp)
+{
+    ATCommand cmd;
+    ATParsed parsed;
+    int mode;
+
+    if (debug_mode) {
+        return -1;
+    }
+    ATInitCommand(&cmd, CMMS_QUERY_MESSAGE, CMMS_MESSAGE_RES,
+                  GSM_COMMAND_TIMEOUT);
+    if ((gsm_exec(sp, &cmd) != AT_OK) || (cmd.ac_nlines < 1)) {
+        LOGWrite(GWL_DEBUG, "Modem does not keep the link open.");
+        return -1;
+    }
+    ATClassify(cmd.ac_lines[0], &parsed);
+    mode = (parsed.ap_nfields > 0) ? parsed.ap_value[0] : 0;
+    if ((mode != 2) && (set_more_messages(sp, 2) != 0)) {
+        return -1;
+    }
+    return mode;
+}
+
+/** End a batch of messages started with begin_batch, putting back the
+ *  mode the modem was in, which closes the link unless it was kept open
+ *  before.
+ *  @param mode value returned by begin_batch.
+ */
+static void end_batch(SerialPort * sp, int mode)
+{
+    if ((mode >= 0) && (mode != 2)) {
+        set_more_messages(sp, mode);
+    }
+}
+
+/** Reference number of the last concatenated message, or -1 if none has
+ *  been sent */
+static int gsm_concat_ref = -1;
+
+/** Septets of 7-bit text carried in each part of a concatenated message,
+ *  after the header and one fill bit */
+static const size_t GSM_CONCAT_SEPTETS =
+    PDU_MAX_SEPTETS - (PDU_CONCAT_HEADER * 8 + 6) / 7;
+
+/** Get the number of septets of 7-bit text to put in the next part of a
+ *  concatenated message, keeping an escape with the character after it.
+ *  @param septets the whole text.
+ *  @param offset septet at which the part starts.
+ *  @param count number of septets in the whole text.
+ */
+static size_t septet_part(const BYTE * septets, size_t offset, size_t count)
+{
+    size_t n = count - offset;
+
+    if (n > GSM_CONCAT_SEPTETS) {
+        n = GSM_CONCAT_SEPTETS;
+        if (septets[offset + n - 1] == GSM7_ESCAPE) {
+            --n;
+        }
+    }
+    return n;
+}
+
+/** Bytes of UCS2 text or 8-bit data carried in each part of a
+ *  concatenated message, after the header */
+#define GSM_CONCAT_DATA         (PDU_MAX_DATA - PDU_CONCAT_HEADER)
+
+/** Get the number of bytes of UCS2 text or 8-bit data to put in the next
+ *  part of a message, keeping the two halves of a UTF-16 surrogate pair
+ *  together.
+ *  @param data the whole message.
+ *  @param offset byte at which the part starts.
+ *  @param size number of bytes in the whole message.
+ *  @param ucs2 non-zero if the data is UCS2 text.
+ */
+static size_t data_part(const BYTE * data, size_t offset, size_t size,
+                        int ucs2)
+{
+    size_t n = size - offset;
+
+    if (n > GSM_CONCAT_DATA) {
+        n = GSM_CONCAT_DATA;
+        if (ucs2 && ((data[offset + n - 2] & 0xfc) == 0xd8)) {
+            n -= 2;
+        }
+    }
+    return n;
+}
+
+/** Send a message too long for one SMS as a concatenated message, in
+ *  parts which each carry a user data header giving the reference number
+ *  of the message, the number of parts, and the place of the part. The
+ *  receiver joins the parts back into one message. Text in the GSM 7-bit
+ *  alphabet is sent packed, 153 characters to a part. Other text is sent
+ *  as UCS2, 67 characters to a part, and a message which is not valid
+ *  UTF-8 is sent as 8-bit data, 134 bytes to a part. A message which
+ *  fits in one SMS is sent without the header. The parts are sent back to
+ *  back with the modem asked to keep the link to the network open, and
+ *  the modem is left in text mode afterwards.
+ *  @param number destination, of digits with an optional leading +.
+ *  @param msg the message, as UTF-8 text.
+ *  @param mr pointer used to return the message reference of the last
+ *  part, or NULL.
+ *  @return zero if every part is sent successfully, non-zero otherwise.
+ */
+int GSMSubmitLongMessage(SerialPort * sp, const char * const number,
+                         const char * const msg, int * mr)
+{
+    BYTE part[PDU_MAX_DATA];
+    // Septets of 7-bit text, or else UCS2 text
+    BYTE * septets;
+    const BYTE * data;
+    size_t len, size, offset;
+    int count, total, seq;
+    int ucs2 = -1;
+    int batch = -1;
+    int ret = 0;
+
+    assert(sp != NULL);
+    assert(number != NULL);
+    assert(msg != NULL);
+
+    len = strlen(msg);
+    septets = malloc(2 * len + 1);
+    if (septets == NULL) {
+        LOGWrite(GWL_FATAL, "Out of memory.");
+        return 1;
+    }
+    count = GSM7Encode(msg, septets, 2 * len + 1);
+    if (count < 0) {
+        ucs2 = GSM7EncodeUCS2(msg, septets, 2 * len + 1);
+    }
+    data = (ucs2 >= 0) ? septets : (const BYTE *)msg;
+    size = (ucs2 >= 0) ? (size_t)ucs2 : len;
+
+    if (count < 0) {
+        if (size <= PDU_MAX_DATA) {
+            total = 1;
+        } else {
+            for (total = 0, offset = 0; offset < size; ++total) {
+                offset += data_part(data, offset, size, ucs2 >= 0);
+            }
+        }
+    } else if (count <= PDU_MAX_SEPTETS) {
+        total = 1;
+    } else {
+        for (total = 0, offset = 0; offset < (size_t)count; ++total) {
+            offset += septet_part(septets, offset, count);
+        }
+    }
+    if ((total < 1) || (total > 255)) {
+        LOGWrite(GWL_ERROR, "Message is too long.");
+        free(septets);
+        return 1;
+    }
+
+    // Start from a different reference in each run, so parts of
+    // messages sent by separate runs are not joined by the receiver
+    if (gsm_concat_ref < 0) {
+        gsm_concat_ref = time(NULL);
+    }
+    gsm_concat_ref = (gsm_concat_ref + 1) & 0xff;
+
+    debug(fprintf(stderr, "Sending message to number %s in %d %s parts "
+                          "with reference %d\n", number, total,
+                          (count >= 0) ? "7-bit" : (ucs2 >= 0) ? "UCS2" :
+                          "8-bit", gsm_concat_ref););
+
+    if (total > 1) {
+        batch = begin_batch(sp);
+    }
+    if ((count >= 0) && (total == 1)) {
+        GSM7Pack(septets, count, 0, part);
+        ret = GSMSubmitPDU(sp, number, 0, PDU_DCS_7BIT, part, count, mr);
+    } else if (count >= 0) {
+        for (seq = 1, offset = 0; (seq <= total) && (ret == 0); ++seq) {
+            size_t n = septet_part(septets, offset, count);
+            size_t udh = PDUConcatHeader(part, gsm_concat_ref, total, seq);
+            // Fill bits put the text on a septet boundary after the header
+            int fill = (7 - (udh * 8) % 7) % 7;
+
+            GSM7Pack(septets + offset, n, fill, part + udh);
+            ret = GSMSubmitPDU(sp, number, PDU_FLAG_UDHI, PDU_DCS_7BIT, part,
+                               (udh * 8 + fill) / 7 + n, mr);
+            offset += n;
+        }
+    } else if (total == 1) {
+        memcpy(part, data, size);
+        ret = GSMSubmitPDU(sp, number, 0,
+                           (ucs2 >= 0) ? PDU_DCS_UCS2 : PDU_DCS_8BIT, part,
+                           size, mr);
+    } else {
+        for (seq = 1, offset = 0; (seq <= total) && (ret == 0); ++seq) {
+            size_t n = data_part(data, offset, size, ucs2 >= 0);
+            size_t udh = PDUConcatHeader(part, gsm_concat_ref, total, seq);
+
+            memcpy(part + udh, data + offset, n);
+            ret = GSMSubmitPDU(sp, number, PDU_FLAG_UDHI,
+                               (ucs2 >= 0) ? PDU_DCS_UCS2 : PDU_DCS_8BIT,
+                               part, udh + n, mr);
+            offset += n;
+        }
+    }
+    if (total > 1) {
+        end_batch(sp, batch);
+    }
+    free(septets);
+
+    if (!debug_mode && (set_message_format(sp, 1) != 0)) {
+        ret = 1;
+    }
+    return ret;
+}
+
+/** Send an SMS message using the GSM modem.
+ *  Messages more than 170 bytes long are sent as concatenated messages.
+ *  @return zero if the message is sent successfully, non-zero otherwise.
+ */
+int GSMSendMessage(SerialPort * sp, const char * const number,
+                   const char * const msg)
+{
+    return GSMSubmitMessage(sp, number, msg, NULL);
+}
+
 char * GSMEncodeBytes(const BYTE * const data, size_t len)
 {
     char * text;
-    char * cptr;
-    int i;
 
-    text = calloc(len * 2 + 1, sizeof(char));
+    text = malloc(ENCEncodedLength(ENC_HEX, len) + 1);
 
     if (text == NULL) {
         return NULL;
     }
 
-    for (cptr = text, i = 0; i < len; ++i, cptr += 2) {
-        snprintf(cptr, 3, "%2.2x", data[i]);
-    }
+    ENCEncode(ENC_HEX, data, len, text);
 
     return text;
 }
 
+/** Decode hex text made by GSMEncodeBytes, in upper or lower case.
+ *  @param text NULL terminated hex text.
+ *  @return the bytes, of half the length of the text, which the caller
+ *  must free, or NULL if the text is not valid hex or memory runs out.
+ */
 BYTE * GSMDecodeBytes(const char * const text)
 {
-// Don't need this functionaloty in Norway, so I'll postpone.
-#if 0
     BYTE * data;
     size_t len;
 
-    len = strlen(text)
+    assert(text != NULL);
+
+    len = strlen(text);
 
     if ((len % 2) != 0) {
         LOGWrite(GWL_ERROR, "Text should be multiple of 2 long.");
         return NULL;
     }
 
-    data = calloc(len / 2, sizeof(BYTE));
+    // One byte more, so empty text gives a buffer rather than NULL
+    data = malloc(len / 2 + 1);
+    if (data == NULL) {
+        LOGWrite(GWL_FATAL, "Out of memory.");
+        return NULL;
+    }
+
+    if (ENCDecode(ENC_HEX, text, len, data) < 0) {
+        LOGWrite(GWL_ERROR, "Text is not valid hex.");
+        free(data);
+        return NULL;
+    }
+    return data;
+}
 
-    for
-#endif
-    return NULL;
+/** Store the network registration status read by an AT+CREG? command.
+ *  @return zero on success, or -1 if the command failed.
+ */
+static int registration_result(const ATCommand * cmd)
+{
+    ATParsed parsed;
+    int status;
+
+    if (cmd->ac_result != AT_OK) {
+        LOGWrite(GWL_ERROR, (cmd->ac_result == AT_TIMEOUT) ?
+                 "No network registration response." :
+                 "Error reading network registration.");
+        return -1;
+    }
+    if (cmd->ac_nlines < 1) {
+        LOGWrite(GWL_ERROR, "Network registration response short\n");
+        return -1;
+    }
+    ATClassify(cmd->ac_lines[0], &parsed);
+    if (parse_registration(&parsed, 1, &status) != 0) {
+        LOGWrite(GWL_ERROR, "Network registration response short\n");
+        return -1;
+    }
+    gsm_net.ns_creg = status;
+    return 0;
+}
+
+/** Store the signal strength read by an AT+CSQ command.
+ *  @return zero on success, or -1 if the command failed.
+ */
+static int signal_result(const ATCommand * cmd)
+{
+    ATParsed parsed;
+
+    if (cmd->ac_result != AT_OK) {
+        LOGWrite(GWL_ERROR, (cmd->ac_result == AT_TIMEOUT) ?
+                 "No network signal response." :
+                 "Error reading network signal.");
+        return -1;
+    }
+    if ((cmd->ac_nlines < 1) ||
+        (ATClassify(cmd->ac_lines[0], &parsed) != AT_CODE_CSQ) ||
+        (parsed.ap_nfields < 1)) {
+        LOGWrite(GWL_ERROR, "Network signal response short.");
+        return -1;
+    }
+    gsm_net.ns_csq = parsed.ap_value[0];
+    SERDeadline(&gsm_net.ns_csq_expiry, GSM_SIGNAL_MAX_AGE);
+    return 0;
 }
 
 /** Check the network association and signal strength of the GSM modem.
+ *  Once unsolicited reports are enabled the registration status is
+ *  taken from the latest report, and the signal strength is only read
+ *  again when it is out of date, so a check usually needs no commands.
+ *  Otherwise both are read with one compound command.
  *
  * @param sp pointer to serial port to be used to talk to the modem.
  * @return zero if the modem is associated with a GSM network, and has
@@ -263,10 +870,10 @@ BYTE * GSMDecodeBytes(const char * const text)
  */
 int GSMCheckSignal(SerialPort * sp)
 {
-    char linebuf[256];
-    char * sptr = NULL;
-    int count;
-    int status, signal;
+    ATCommand creg, csq;
+    ATCommand * batch[2];
+    ATEngine * ae;
+    int need_creg, need_csq, count = 0;
 
     assert(sp != NULL);
 
@@ -274,94 +881,262 @@ int GSMCheckSignal(SerialPort * sp)
         return 0;
     }
 
-    GSMSendCommand(sp, CREG_MESSAGE);
-
-    get_line(sp, linebuf, 256);
-    count = get_line(sp, linebuf, 256);
-
-    if (count < CREG_MESSAGE_RES_LEN) {
-        LOGWrite(GWL_ERROR, "Network registration response short\n");
-        SERFlushChannel(sp, 50000);
+    if ((ae = get_engine(sp)) == NULL) {
         return -1;
     }
-    assert(strlen(linebuf) < 256);
-    if (strncmp(linebuf, CREG_MESSAGE_RES, strlen(CREG_MESSAGE_RES)) != 0) {
-        LOGWrite(GWL_ERROR, "Network registration response does not match expected.");
-        SERFlushChannel(sp, 50000);
-        return -1;
+    if (gsm_net.ns_reports) {
+        // Take in any reports which arrived since the last command
+        while (ATPoll(ae, NULL) > 0) { }
     }
-    sptr = strchr(linebuf, ',');
-    if (sptr == NULL) {
-        LOGWrite(GWL_ERROR, "',' not found in CREG message response.");
-        SERFlushChannel(sp, 50000);
+
+    need_creg = !gsm_net.ns_reports || (gsm_net.ns_creg < 0);
+    need_csq = !gsm_net.ns_reports || (gsm_net.ns_csq == 99) ||
+               (SERRemaining(&gsm_net.ns_csq_expiry) == 0);
+    if (need_creg) {
+        ATInitCommand(&creg, CREG_MESSAGE, CREG_MESSAGE_RES,
+                      GSM_COMMAND_TIMEOUT);
+        batch[count++] = &creg;
+    }
+    if (need_csq) {
+        ATInitCommand(&csq, CSQ_MESSAGE, CSQ_MESSAGE_RES, GSM_COMMAND_TIMEOUT);
+        batch[count++] = &csq;
+    }
+    if (count > 0) {
+        ATExecBatch(ae, batch, count);
+    }
+
+    if (need_creg && (registration_result(&creg) != 0)) {
         return -1;
     }
-    ++sptr;
-    status = strtol(sptr, NULL, 10);
-    debug( printf("Network status %d\n", status); );
-    SERFlushChannel(sp, 50000);
-    if ((status != 1) && (status != 5)) {
+    debug( printf("Network status %d\n", gsm_net.ns_creg); );
+    if ((gsm_net.ns_creg != 1) && (gsm_net.ns_creg != 5)) {
         LOGWrite(GWL_ERROR, "ERROR: Not registed with network.");
         return 1;
     }
 
-    GSMSendCommand(sp, CSQ_MESSAGE);
+    if (need_csq && (signal_result(&csq) != 0)) {
+        return -1;
+    }
+    debug( printf("Signal strength %d\n", gsm_net.ns_csq); );
+    if ((gsm_net.ns_csq < 5) || (gsm_net.ns_csq == 99)) {
+        LOGWrite(GWL_ERROR, "ERROR: Signal strength too weak.");
+        return 2;
+    }
 
-    // Get blank line
-    get_line(sp, linebuf, 256);
-    count = get_line(sp, linebuf, 256);
+    return 0;
+}
 
-    if (count < CSQ_MESSAGE_RES_LEN) {
-        LOGWrite(GWL_ERROR, "Network signal response short.");
-        SERFlushChannel(sp, 50000);
-        return -1;
+/** Wait for the GSM modem to be associated with a network, with good
+ *  enough signal strength to send messages. Unsolicited reports are
+ *  enabled if they are not already, so the wait ends as soon as the
+ *  registration changes rather than at the next poll.
+ *
+ * @param sp pointer to serial port to be used to talk to the modem.
+ * @param retries number of signal strength readings to make before
+ * giving up. Readings are GSM_SIGNAL_RETRY_INTERVAL apart.
+ * @return zero if the modem is associated with a GSM network, and has
+ * good enough signal strength to send messages, or 1 if GSM network
+ * is not available, 2 if GSM signal strength is too weak, or -1 if
+ * an error occured talking to the modem.
+ */
+int GSMWaitSignal(SerialPort * sp, int retries)
+{
+    struct timespec limit, step;
+    ATEngine * ae;
+    int res;
+
+    if (debug_mode) {
+        return 0;
+    }
+
+    res = GSMCheckSignal(sp);
+    if ((res < 1) || (retries <= 1)) {
+        // Success or outright failure
+        return res;
     }
-    assert(strlen(linebuf) < 256);
-    if (strncmp(linebuf, CSQ_MESSAGE_RES, strlen(CSQ_MESSAGE_RES)) != 0) {
-        LOGWrite(GWL_ERROR, "Network signal response does not match expected.");
-        SERFlushChannel(sp, 50000);
+    if (!gsm_net.ns_reports) {
+        GSMEnableReports(sp);
+    }
+    if ((ae = get_engine(sp)) == NULL) {
         return -1;
     }
-    sptr = &linebuf[6];
-    signal = strtol(sptr, NULL, 10);
-    debug( printf("Signal strength %d\n", signal); );
-    SERFlushChannel(sp, 50000);
-    if (signal < 5) {
-        LOGWrite(GWL_ERROR, "ERROR: Signal strength too weak.");
-        return 2;
+
+    SERDeadline(&limit, (retries - 1) * GSM_SIGNAL_RETRY_INTERVAL);
+    deadline_within(&step, GSM_SIGNAL_RETRY_INTERVAL, &limit);
+    while (SERRemaining(&limit) > 0) {
+        if (ATPoll(ae, &step) == 0) {
+            // Nothing reported in time, so read the signal strength again
+            // unless its changes are reported.
+            if (gsm_net.ns_signal_ind == 0) {
+                SERDeadline(&gsm_net.ns_csq_expiry, 0);
+            }
+            deadline_within(&step, GSM_SIGNAL_RETRY_INTERVAL, &limit);
+        }
+        // Not associated with network, or low signal - try again
+        res = GSMCheckSignal(sp);
+        if (res < 1) {
+            return res;
+        }
+    }
+    return res;
+}
+
+/** Command to report network registration changes, with cell location */
+static const char * const	CREG_REPORT_MESSAGE	= "AT+CREG=2";
+/** Command to report GPRS registration changes */
+static const char * const	CGREG_REPORT_MESSAGE	= "AT+CGREG=2";
+/** Command to list the indicators reported by +CIEV */
+static const char * const	CIND_LIST_MESSAGE	= "AT+CIND=?";
+/** Prefix of the indicator list */
+static const char * const	CIND_LIST_RES		= "+CIND:";
+/** Command to report indicator changes with +CIEV */
+static const char * const	CMER_MESSAGE		= "AT+CMER=3,0,0,1";
+
+/** Enable unsolicited reports of network registration, GPRS registration
+ *  and, where the modem supports it, signal strength. The stored network
+ *  state is then kept up to date by the reports, so GSMCheckSignal can
+ *  answer without asking the modem.
+ *  @return zero if registration changes will be reported, non-zero
+ *  otherwise.
+ */
+int GSMEnableReports(SerialPort * sp)
+{
+    ATCommand cmd;
+    ATParsed parsed;
+    int ind;
+
+    assert(sp != NULL);
+
+    if (debug_mode) {
+        return 0;
+    }
+
+    ATInitCommand(&cmd, CREG_REPORT_MESSAGE, NULL, GSM_COMMAND_TIMEOUT);
+    if (gsm_exec(sp, &cmd) != AT_OK) {
+        LOGWrite(GWL_ERROR, "Failed to enable network registration reports.");
+        return 1;
+    }
+    gsm_net.ns_reports = 1;
+    // Read the status once, as reports only give changes from now on
+    gsm_net.ns_creg = -1;
+
+    ATInitCommand(&cmd, CGREG_REPORT_MESSAGE, NULL, GSM_COMMAND_TIMEOUT);
+    if (gsm_exec(sp, &cmd) != AT_OK) {
+        LOGWrite(GWL_DEBUG, "GPRS registration reports not available.");
     }
+    gsm_net.ns_cgreg = -1;
 
+    // Find which indicator is the signal level, if there is one
+    ATInitCommand(&cmd, CIND_LIST_MESSAGE, CIND_LIST_RES, GSM_COMMAND_TIMEOUT);
+    if ((gsm_exec(sp, &cmd) != AT_OK) || (cmd.ac_nlines < 1)) {
+        LOGWrite(GWL_DEBUG, "Modem indicators not available.");
+        return 0;
+    }
+    ATClassify(cmd.ac_lines[0], &parsed);
+    for (ind = 0; ind < parsed.ap_nfields; ++ind) {
+        if (strncmp(parsed.ap_field[ind], "(\"signal\"", 9) == 0) {
+            break;
+        }
+    }
+    if (ind == parsed.ap_nfields) {
+        LOGWrite(GWL_DEBUG, "Modem has no signal indicator.");
+        return 0;
+    }
+    ATInitCommand(&cmd, CMER_MESSAGE, NULL, GSM_COMMAND_TIMEOUT);
+    if (gsm_exec(sp, &cmd) != AT_OK) {
+        LOGWrite(GWL_DEBUG, "Indicator reports not available.");
+        return 0;
+    }
+    // Indicators are numbered from one
+    gsm_net.ns_signal_ind = ind + 1;
     return 0;
 }
 
-/** Check the network association and signal strength of the GSM modem.
- *
- * @param sp pointer to serial port to be used to talk to the modem.
- * @return zero if the modem is associated with a GSM network, and has
- * good enough signal strength to send messages, or 1 if GSM network
- * is not available, 2 if GSM signal strength is too weak, or -1 if
- * an error occured talking to the modem.
+/** Wait while there is nothing to send, passing any unsolicited reports
+ *  from the modem to their handlers, so the network state is kept up to
+ *  date between messages.
+ *  @param usec longest time to wait.
+ *  @return one if a report arrived, which ends the wait early, zero if
+ *  none did, or -1 if the modem can not be read.
+ */
+int GSMIdle(SerialPort * sp, long usec)
+{
+    struct timespec deadline;
+    ATEngine * ae;
+
+    assert(sp != NULL);
+
+    if (debug_mode) {
+        usleep(usec);
+        return 0;
+    }
+
+    if ((ae = get_engine(sp)) == NULL) {
+        return -1;
+    }
+    SERDeadline(&deadline, usec);
+    return ATPoll(ae, &deadline);
+}
+
+/** Command to request status reports for messages sent in text mode,
+ *  with the default validity period and data coding */
+static const char * const	CSMP_REPORT_MESSAGE	= "AT+CSMP=49,167,0,0";
+/** Command to send messages in text mode without status reports */
+static const char * const	CSMP_MESSAGE		= "AT+CSMP=17,167,0,0";
+/** Command to pass status reports straight to us as +CDS */
+static const char * const	CNMI_REPORT_MESSAGE	= "AT+CNMI=2,0,0,1,0";
+
+/** Request status reports for the messages sent from now on, and match
+ *  the reports which arrive with +CDS to the blocks of files in a table
+ *  of messages sent. Reports are handled whenever the modem is read, so
+ *  GSMIdle should be called between messages to catch them.
+ *  @param dt table of messages sent, or NULL to stop requesting reports.
+ *  @return zero if reports were requested, or stopped, non-zero
+ *  otherwise.
  */
-int GSMWaitSignal(SerialPort * sp, int retries)
+int GSMTrackDelivery(SerialPort * sp, DeliveryTable * dt)
 {
-    int i, res = 1;
+    ATCommand cmd;
+
+    assert(sp != NULL);
 
+    gsm_dlr = NULL;
     if (debug_mode) {
         return 0;
     }
+    ATInitCommand(&cmd, (dt != NULL) ? CSMP_REPORT_MESSAGE : CSMP_MESSAGE,
+                  NULL, GSM_COMMAND_TIMEOUT);
+    if (gsm_exec(sp, &cmd) != AT_OK) {
+        LOGWrite(GWL_ERROR, "Failed to set status report request.");
+        return 1;
+    }
+    if (dt == NULL) {
+        return 0;
+    }
+    ATInitCommand(&cmd, CNMI_REPORT_MESSAGE, NULL, GSM_COMMAND_TIMEOUT);
+    if (gsm_exec(sp, &cmd) != AT_OK) {
+        LOGWrite(GWL_ERROR, "Failed to enable status reports.");
+        return 1;
+    }
+    gsm_dlr = dt;
+    return 0;
+}
 
-    for (i = 0; i < retries; ++i) {
-        res = GSMCheckSignal(sp);
-
-        if (res < 1) {
-            // Success or outright failure
-            return res;
-        }
-        // Not associated with network, or low signal - try again
-
-        sleep(5);
+/** Record the message reference of a block of a file just submitted, if
+ *  delivery is being tracked. */
+static void track_block(const char * const number, const char * const name,
+                        int block_number, int parity, int mr)
+{
+    if ((gsm_dlr != NULL) &&
+        (DLRSubmitted(gsm_dlr, mr, number, name, block_number, parity) != 0)) {
+        LOGWrite(GWL_DEBUG, "Block can not be tracked.");
     }
-    return res;
+}
+
+/** Get the network state of the modem, as last read or reported. */
+const GSMNetState * GSMGetNetState(void)
+{
+    return &gsm_net;
 }
 
 /** Put the GSM modem into a mode where it can send SMS messages.
@@ -370,8 +1145,8 @@ int GSMWaitSignal(SerialPort * sp, int retries)
  */
 int GSMSetSMSMode(SerialPort * sp)
 {
-    char linebuf[256];
-    int count;
+    ATCommand cmd;
+    ATResult res;
 
     if (debug_mode) {
         return 0;
@@ -379,24 +1154,83 @@ int GSMSetSMSMode(SerialPort * sp)
 
     assert(sp != NULL);
 
-    GSMSendCommand(sp, CMGF_MESSAGE);
+    ATInitCommand(&cmd, CMGF_MESSAGE, NULL, GSM_COMMAND_TIMEOUT);
+    res = gsm_exec(sp, &cmd);
+    if (res == AT_OK) {
+        LOGWrite(GWL_DEBUG, "OK from GSM modem setting SMS mode.");
+        gsm_cmgf = 1;
+        return 0;
+    }
+    if (res == AT_TIMEOUT) {
+        LOGWrite(GWL_ERROR, "No response from GSM modem setting SMS mode.");
+        return 1;
+    }
+    LOGWrite(GWL_ERROR, "Error from GSM modem setting SMS mode.");
+    return 1;
+}
+
+/** Prepare the GSM modem for a session, with one compound command.
+ *  This sets the echo mode and, if messages are to be sent, puts the
+ *  modem into the mode where it can send SMS messages.
+ *  @param echo non-zero to turn echo on, or zero to turn it off.
+ *  @param sms non-zero to set the SMS message mode.
+ *  @return zero if the modem was prepared, or non-zero if the SMS
+ *  message mode could not be set. Failure to set the echo mode is only
+ *  logged, as commands are matched to responses either way.
+ */
+int GSMSetup(SerialPort * sp, int echo, int sms)
+{
+    ATCommand echo_cmd, sms_cmd;
+    ATCommand * batch[2] = { &echo_cmd, &sms_cmd };
+    ATEngine * ae;
+
+    assert(sp != NULL);
 
-    get_line(sp, linebuf, 256);
+    if (debug_mode) {
+        return 0;
+    }
 
-    count = get_line(sp, linebuf, 256);
-    if (count <= 0) {
+    if ((ae = get_engine(sp)) == NULL) {
         return 1;
     }
-    if (strcmp(linebuf, "ERROR") == 0) {
+    ATInitCommand(&echo_cmd, echo ? E1_MESSAGE : E0_MESSAGE, NULL,
+                  GSM_COMMAND_TIMEOUT);
+    ATInitCommand(&sms_cmd, CMGF_MESSAGE, NULL, GSM_COMMAND_TIMEOUT);
+    ATExecBatch(ae, batch, sms ? 2 : 1);
+
+    if (echo_cmd.ac_result != AT_OK) {
+        LOGWrite(GWL_ERROR, echo ? "Failed to enable ECHO mode." :
+                                   "Failed to disable ECHO mode.");
+    }
+    if (sms && (sms_cmd.ac_result != AT_OK)) {
         LOGWrite(GWL_ERROR, "Error from GSM modem setting SMS mode.");
         return 1;
     }
-    if (strcmp(linebuf, "OK") == 0) {
-        LOGWrite(GWL_DEBUG, "OK from GSM modem setting SMS mode.");
-        return 0;
+    if (sms) {
+        gsm_cmgf = 1;
     }
-    LOGWrite(GWL_ERROR, "Unknown response from GSM modem setting SMS mode.");
-    return 1;
+    return 0;
+}
+
+/** Submit a text message carrying a block of a file, and record its
+ *  message reference if delivery is being tracked.
+ *  @param name of the file, as given in the block header.
+ *  @param block_number of the block, or of the first block of the group
+ *  for a parity block.
+ *  @param parity index of the parity block in its group, or -1 for a data
+ *  block.
+ */
+static int submit_block(SerialPort * sp, const char * const number,
+                        const char * const msg, const char * const name,
+                        int block_number, int parity)
+{
+    int mr;
+
+    if (GSMSubmitMessage(sp, number, msg, &mr) != 0) {
+        return 1;
+    }
+    track_block(number, name, block_number, parity, mr);
+    return 0;
 }
 
 /** Message format for building an SMS message. Message contains a header
@@ -465,7 +1299,275 @@ int GSMSendBlock(SerialPort * sp, const char * const number,
         printf("%s", msg);
     }
 
-    return GSMSendMessage(sp, number, msg);
+    return submit_block(sp, number, msg, name, block_number, -1);
+}
+
+/** Number of characters in one text mode SMS message */
+#define GSM_TEXT_MAX            160
+
+/** Header of an SMS message carrying a block of binary data in an
+ *  encoding other than hex. The header line gives the filename, the block
+ *  number, and the letter of the encoding, and is followed by one line of
+ *  encoded data.
+ */
+static const char * const ENCODED_MESSAGE_HEADER = "%s %x %c\n";
+
+/** Get the number of data bytes carried by a text message with a given
+ *  header in an encoding, or zero if the header leaves no room. */
+static size_t encoded_block_size(const char * const name, int block_number,
+                                 Encoding enc)
+{
+    size_t header = strlen(name) + 5;
+
+    while ((block_number >>= 4) != 0) {
+        ++header;
+    }
+    // One more character for the newline after the data
+    if (header + 1 >= GSM_TEXT_MAX) {
+        return 0;
+    }
+    return ENCCapacity(enc, GSM_TEXT_MAX - header - 1);
+}
+
+/** Send a block of binary data as a text mode SMS message in the given
+ *  encoding. Hex blocks with no flags are sent as GSMSendBlock sends
+ *  them, so receivers which know nothing of the other encodings can still
+ *  read them. The letter of the encoding is given in upper case if the
+ *  block is part of a compressed stream.
+ *  @param sp serial port used to communicate with the modem.
+ *  @param number string giving the telephone number to be dialied.
+ *  Must contain numerics and + (for international dialing) only.
+ *  @param name to be used in the header.
+ *  @param block_number to be used in the header.
+ *  @param enc encoding of the data.
+ *  @param flags GSM_BLOCK_ flags describing the data.
+ *  @param block pointer to binary data to be sent.
+ *  @param len length of block to send. Must fit in one message with the
+ *  header.
+ */
+int GSMSendEncodedBlock(SerialPort * sp, const char * const number,
+                        const char * const name, int block_number,
+                        Encoding enc, int flags, const BYTE * block,
+                        const size_t len)
+{
+    char msg[GSM_TEXT_MAX + 1];
+    size_t msg_len;
+    char letter;
+
+    assert(sp != NULL);
+    assert(number != NULL);
+    assert(name != NULL);
+    assert(block_number > 0);
+    assert(block != NULL);
+    assert(len > 0);
+
+    if ((enc == ENC_HEX) && (flags == 0)) {
+        return GSMSendBlock(sp, number, name, block_number, block, len);
+    }
+
+    if (len > encoded_block_size(name, block_number, enc)) {
+        LOGWrite(GWL_ERROR, "Header too long writing binary block");
+        return 1;
+    }
+
+    letter = ENCLetter(enc);
+    if (flags & GSM_BLOCK_COMPRESSED) {
+        letter = toupper(letter);
+    }
+    msg_len = sprintf(msg, ENCODED_MESSAGE_HEADER, name, block_number,
+                      letter);
+    msg_len += ENCEncode(enc, block, len, msg + msg_len);
+    msg[msg_len++] = '\n';
+    msg[msg_len] = 0;
+
+    if (debug_mode) {
+        printf("%s", msg);
+    }
+
+    return submit_block(sp, number, msg, name, block_number, -1);
+}
+
+/** Longest name which can be given in the header of a binary block */
+#define GSM_BLOCK_NAME_MAX      64
+
+/** Number of bytes in the header of a binary block, besides the name */
+static const size_t GSM_BLOCK_HEADER = 4;
+
+/** Get the number of data bytes carried by each binary block message
+ *  for a given name, or zero if the name is too long. */
+static size_t binary_block_size(const char * const name)
+{
+    size_t namelen = strlen(name);
+
+    if (namelen > GSM_BLOCK_NAME_MAX) {
+        return 0;
+    }
+    return PDU_MAX_DATA - GSM_BLOCK_HEADER - namelen;
+}
+
+/** Send a block of binary data as an 8-bit PDU mode SMS message.
+ *  The message starts with a compact binary header: a byte of GSM_BLOCK_
+ *  flags, the length of the name, the name itself, and the block number
+ *  as two bytes, most significant first. The rest of the message carries
+ *  the data unencoded.
+ *  @param sp serial port used to communicate with the modem.
+ *  @param number string giving the telephone number to be dialied.
+ *  Must contain numerics and + (for international dialing) only.
+ *  @param name to be used in the header.
+ *  @param block_number to be used in the header.
+ *  @param flags GSM_BLOCK_ flags describing the data.
+ *  @param block pointer to binary data to be sent.
+ *  @param len length of block to send. Must not exceed the size that
+ *  leaves room for the header in one message.
+ */
+int GSMSendBinaryBlock(SerialPort * sp, const char * const number,
+                       const char * const name, int block_number, int flags,
+                       const BYTE * block, const size_t len)
+{
+    BYTE msg[PDU_MAX_DATA];
+    size_t namelen;
+    BYTE * p = msg;
+    int mr;
+
+    assert(sp != NULL);
+    assert(number != NULL);
+    assert(name != NULL);
+    assert(block_number > 0);
+    assert(block != NULL);
+    assert(len > 0);
+
+    if ((len > binary_block_size(name)) || (block_number > 0xffff)) {
+        LOGWrite(GWL_ERROR, "Header too long writing binary block");
+        return 1;
+    }
+
+    namelen = strlen(name);
+    *p++ = flags;
+    *p++ = namelen;
+    memcpy(p, name, namelen);
+    p += namelen;
+    *p++ = block_number >> 8;
+    *p++ = block_number & 0xff;
+    memcpy(p, block, len);
+    p += len;
+
+    if (GSMSubmitPDU(sp, number, 0, PDU_DCS_8BIT, msg, p - msg, &mr) != 0) {
+        return 1;
+    }
+    track_block(number, name, block_number, -1, mr);
+    return 0;
+}
+
+/** Number of bytes in the header of a binary parity block, besides the
+ *  name */
+static const size_t GSM_PARITY_HEADER = 7;
+
+/** Header line of a parity block sent as text, giving the name, the first
+ *  block of the group and the number of blocks in it, the index of the
+ *  parity block and the number of parity blocks, and the encoding */
+static const char * const PARITY_MESSAGE_HEADER = "%s %x/%x %x/%x %c\n";
+
+/** Count the hex digits needed to write a number. */
+static size_t hex_digits(unsigned int n)
+{
+    size_t digits = 1;
+
+    while ((n >>= 4) != 0) {
+        ++digits;
+    }
+    return digits;
+}
+
+/** Get the number of bytes carried by each parity block of a group.
+ *  @return the number of bytes, or zero if the file name leaves no room.
+ */
+static size_t parity_block_size(const char * const name, int first, int k,
+                                int m, const GSMFileOptions * options)
+{
+    size_t header;
+
+    if (options->fo_pdu) {
+        if (strlen(name) > GSM_BLOCK_NAME_MAX) {
+            return 0;
+        }
+        return PDU_MAX_DATA - GSM_PARITY_HEADER - strlen(name);
+    }
+    // Three spaces, two slashes, the letter and the newline
+    header = strlen(name) + hex_digits(first) + hex_digits(k) +
+             hex_digits(m - 1) + hex_digits(m) + 7;
+    // One more character for the newline after the data
+    if (header + 1 >= GSM_TEXT_MAX) {
+        return 0;
+    }
+    return ENCCapacity(options->fo_encoding, GSM_TEXT_MAX - header - 1);
+}
+
+/** Send one parity block of a group, in the same form as the data blocks
+ *  of the file.
+ *  @param first block number of the first block in the group.
+ *  @param k number of data blocks in the group.
+ *  @param j index of this parity block.
+ *  @param m number of parity blocks for the group.
+ */
+static int send_parity_block(SerialPort * sp, const char * const number,
+                             const char * const name,
+                             const GSMFileOptions * options, int flags,
+                             int first, int k, int j, int m,
+                             const BYTE * block, size_t len)
+{
+    char msg[GSM_TEXT_MAX + 1];
+    size_t msg_len;
+    char letter;
+
+    if (len > parity_block_size(name, first, k, m, options)) {
+        LOGWrite(GWL_ERROR, "Header too long writing parity block");
+        return 1;
+    }
+
+    if (options->fo_pdu) {
+        BYTE data[PDU_MAX_DATA];
+        size_t namelen = strlen(name);
+        BYTE * p = data;
+        int mr;
+
+        if (first > 0xffff) {
+            LOGWrite(GWL_ERROR, "Header too long writing parity block");
+            return 1;
+        }
+        *p++ = flags | GSM_BLOCK_PARITY;
+        *p++ = namelen;
+        memcpy(p, name, namelen);
+        p += namelen;
+        *p++ = first >> 8;
+        *p++ = first & 0xff;
+        *p++ = k;
+        *p++ = j;
+        *p++ = m;
+        memcpy(p, block, len);
+        p += len;
+        if (GSMSubmitPDU(sp, number, 0, PDU_DCS_8BIT, data, p - data,
+                         &mr) != 0) {
+            return 1;
+        }
+        track_block(number, name, first, j, mr);
+        return 0;
+    }
+
+    letter = ENCLetter(options->fo_encoding);
+    if (flags & GSM_BLOCK_COMPRESSED) {
+        letter = toupper(letter);
+    }
+    msg_len = sprintf(msg, PARITY_MESSAGE_HEADER, name, first, k, j, m,
+                      letter);
+    msg_len += ENCEncode(options->fo_encoding, block, len, msg + msg_len);
+    msg[msg_len++] = '\n';
+    msg[msg_len] = 0;
+
+    if (debug_mode) {
+        printf("%s", msg);
+    }
+
+    return submit_block(sp, number, msg, name, first, j);
 }
 
 /** Send the contents of a file as a sequence of SMS messages.
@@ -476,51 +1578,305 @@ int GSMSendBlock(SerialPort * sp, const char * const number,
  */
 int GSMSendFile(SerialPort * sp, const char * const number,
                 const char * const filename)
+{
+    return GSMSendFileOptions(sp, number, filename, NULL);
+}
+
+/** Number of bytes of a file read at a time for compression */
+#define GSM_COMPRESS_CHUNK      256
+
+/** Default options for sending a file, as hex text */
+static const GSMFileOptions gsm_file_defaults = { 0, ENC_HEX, 0, NULL, 0, 0,
+                                                  1 };
+
+/** Get the number of bytes of a file to send in a block.
+ *  @return the number of bytes, or zero if the file name leaves no room.
+ */
+static size_t file_block_size(const char * const filename, int block_number,
+                              const GSMFileOptions * options)
+{
+    if (options->fo_pdu) {
+        return binary_block_size(filename);
+    }
+    if ((options->fo_encoding == ENC_HEX) && !options->fo_compress) {
+        return 64;
+    }
+    return encoded_block_size(filename, block_number, options->fo_encoding);
+}
+
+/** Open the journal for sending a file, and report where the transfer
+ *  resumes if blocks have already been sent.
+ *  @return the journal, or NULL if it could not be opened.
+ */
+static Journal * open_journal(const char * const number,
+                              const char * const filename,
+                              const GSMFileOptions * options)
+{
+    char mesg[1024]; // For logfile
+    char mode[48];
+    size_t len;
+    Journal * jn;
+
+    // Anything which changes how the file is split into blocks
+    if (options->fo_pdu) {
+        len = sprintf(mode, "pdu%s", options->fo_compress ? "-z" : "");
+    } else {
+        len = sprintf(mode, "text-%c%s", ENCLetter(options->fo_encoding),
+                      options->fo_compress ? "-z" : "");
+    }
+    if (options->fo_parity > 0) {
+        sprintf(mode + len, "-f%d.%d", options->fo_group, options->fo_parity);
+    }
+    jn = JNLOpen(options->fo_journal, number, filename, mode);
+    if ((jn != NULL) && (jn->jn_count > 0)) {
+        snprintf(mesg, sizeof(mesg), "Resuming %s from block %d, %d blocks "
+                 "already sent.", filename, JNLFirstUnsent(jn), jn->jn_count);
+        LOGWrite(GWL_INFO, mesg);
+    }
+    return jn;
+}
+
+/** Send the parity blocks for a group of blocks.
+ *  @param parity the parity blocks, each PDU_MAX_DATA bytes apart.
+ *  @param len length of each parity block.
+ */
+static int send_group_parity(SerialPort * sp, const char * const number,
+                             const char * const filename,
+                             const GSMFileOptions * options, int flags,
+                             int first, int k, const BYTE * parity,
+                             size_t len)
+{
+    int j;
+
+    for (j = 0; j < options->fo_parity; ++j) {
+        LOGWrite(GWL_DEBUG, "Sending a parity block");
+        if (send_parity_block(sp, number, filename, options, flags, first, k,
+                              j, options->fo_parity,
+                              parity + j * PDU_MAX_DATA, len) != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/** Send the contents of a file as a sequence of SMS messages, choosing
+ *  how the blocks are sent. With compression the file is passed through
+ *  an LZSS compressor as it is read, and the blocks carry pieces of the
+ *  compressed stream, marked as such in their headers. With a journal,
+ *  each block is recorded once it has been submitted, and blocks
+ *  recorded by an earlier attempt to send the same file are skipped.
+ *  With parity, each group of blocks is followed by parity blocks from
+ *  which the receiver can rebuild any blocks of the group which are
+ *  lost, up to the number of parity blocks. Parity is computed over each
+ *  block with its length in front, so blocks of any length are rebuilt
+ *  exactly. The last block of a group is only journaled once the parity
+ *  for the group has been sent. Unless told otherwise, the modem keeps
+ *  the link to the network open from one block to the next, and is put
+ *  back as it was once the file is sent.
+ *  @param sp serial port used to communicate with the modem.
+ *  @param number string giving the telephone number to be dialied.
+ *  Must contain numerics and + (for international dialing) only.
+ *  @param filename name of the file containing the data to be sent.
+ *  @param options how to send the file, or NULL to send hex text
+ *  messages.
+ */
+int GSMSendFileOptions(SerialPort * sp, const char * const number,
+                       const char * const filename,
+                       const GSMFileOptions * options)
 {
     FILE * fp;
-    BYTE buffer[64];
-    int done = 0;
+    BYTE chunk[GSM_COMPRESS_CHUNK];
+    // Data read or compressed, waiting to be sent
+    BYTE pending[PDU_MAX_DATA + LZSS_BOUND(GSM_COMPRESS_CHUNK)];
+    size_t npending = 0;
+    LZSSEncoder * lz = NULL;
+    Journal * jn = NULL;
+    // Parity blocks of the group being sent, and their length so far
+    BYTE * parity = NULL;
+    BYTE * parity_rows[FEC_MAX_BLOCKS];
+    size_t parity_len = 0;
+    int k, m;
+    // Mode to restore once the batch of blocks is sent, if one started
+    int batch = -1;
+    int batching = 0;
+    int flags = 0;
+    int eof = 0;
     int ret = 0;
     int n = 0;
 
     assert(sp != NULL);
 
+    if (options == NULL) {
+        options = &gsm_file_defaults;
+    }
+    k = options->fo_group;
+    m = options->fo_parity;
+
+    if (file_block_size(filename, 1, options) == 0) {
+        LOGWrite(GWL_ERROR, "File name too long for messages.");
+        return 1;
+    }
+
+    if (m > 0) {
+        int j;
+
+        if ((k < 1) || (k + m > FEC_MAX_BLOCKS)) {
+            LOGWrite(GWL_ERROR, "Bad size of parity groups.");
+            return 1;
+        }
+        if ((parity = calloc(m, PDU_MAX_DATA)) == NULL) {
+            LOGWrite(GWL_FATAL, "Out of memory.");
+            return 1;
+        }
+        for (j = 0; j < m; ++j) {
+            parity_rows[j] = parity + j * PDU_MAX_DATA;
+        }
+    }
+
+    if (options->fo_compress) {
+        if ((lz = malloc(sizeof(LZSSEncoder))) == NULL) {
+            LOGWrite(GWL_FATAL, "Out of memory.");
+            free(parity);
+            return 1;
+        }
+        LZSSInitEncoder(lz);
+        flags |= GSM_BLOCK_COMPRESSED;
+    }
+
     fp = fopen(filename, "r");
 
     if (fp == NULL) {
         LOGWrite(GWL_ERROR, "Could not open file for sending.");
+        free(lz);
+        free(parity);
         return 1;
     }
 
-    while (!done) {
-        size_t len = fread(buffer, 1, 64, fp);
+    // Messages are not sent in debug mode, so must not be journaled
+    if ((options->fo_journal != NULL) && !debug_mode) {
+        jn = open_journal(number, filename, options);
+    }
+
+    for (;;) {
+        size_t block_size = file_block_size(filename, n + 1, options);
+        size_t len;
+        int group_end = 0;
+        int sent;
+        int status;
+
+        // Leave room for the length in front of each block in the parity
+        if (m > 0) {
+            size_t parity_size = parity_block_size(filename, n - n % k + 1,
+                                                   k, m, options);
+
+            block_size = (parity_size > 2) ? parity_size - 2 : 0;
+            if (block_size > file_block_size(filename, n + 1, options)) {
+                block_size = file_block_size(filename, n + 1, options);
+            }
+        }
+        if (block_size == 0) {
+            LOGWrite(GWL_ERROR, "File name too long for messages.");
+            ret = 1;
+            break;
+        }
 
-        if (len == 0) {
-            if (ferror(fp) != 0) {
-                LOGWrite(GWL_ERROR, "Error reading from file.");
-                ret = 1;
+        // Read until there is more than a whole block to send, or the file
+        // ends, so the last block is known to be the last when it is sent
+        while (!eof && (npending <= block_size)) {
+            if (lz == NULL) {
+                len = fread(pending + npending, 1, block_size + 1 - npending,
+                            fp);
+                npending += len;
             } else {
-                ret = 0;
+                len = fread(chunk, 1, sizeof(chunk), fp);
+                npending += LZSSCompress(lz, chunk, len, pending + npending);
+            }
+            if (len == 0) {
+                if (lz != NULL) {
+                    npending += LZSSFinish(lz, pending + npending);
+                }
+                eof = 1;
             }
-            done = 1;
-            
-            continue;
+        }
+        if (ferror(fp) != 0) {
+            LOGWrite(GWL_ERROR, "Error reading from file.");
+            ret = 1;
+            break;
+        }
+        if (npending == 0) {
+            break;
         }
 
+        len = (npending < block_size) ? npending : block_size;
         LOGWrite(GWL_DEBUG, "Sending a block");
         ++n;
         debug( fprintf(stderr, "%dnth block is %d bytes\n", n, len); );
-        if (GSMSendBlock(sp, number, filename, n, buffer, len) != 0) {
+        if (m > 0) {
+            BYTE row[PDU_MAX_DATA];
+
+            row[0] = len >> 8;
+            row[1] = len & 0xff;
+            memcpy(row + 2, pending, len);
+            FECAddBlock(m, (n - 1) % k, row, len + 2, parity_rows);
+            if (len + 2 > parity_len) {
+                parity_len = len + 2;
+            }
+            group_end = ((n % k) == 0) || (eof && (npending == len));
+        }
+        // Blocks sent by an earlier attempt, with the parity of their
+        // group if they end one
+        sent = (jn != NULL) && JNLSent(jn, n);
+        if (!sent && !batching && options->fo_keep_link &&
+            ((m > 0) || !eof || (npending > len))) {
+            // More messages follow, so keep the link open for them
+            batch = begin_batch(sp);
+            batching = 1;
+        }
+        if (sent) {
+            status = 0;
+        } else if (options->fo_pdu) {
+            status = GSMSendBinaryBlock(sp, number, filename, n, flags,
+                                        pending, len);
+        } else {
+            status = GSMSendEncodedBlock(sp, number, filename, n,
+                                         options->fo_encoding, flags,
+                                         pending, len);
+        }
+        if ((status == 0) && group_end && !sent) {
+            status = send_group_parity(sp, number, filename, options, flags,
+                                       n - (n - 1) % k, (n - 1) % k + 1,
+                                       parity, parity_len);
+        }
+        if ((status == 0) && (jn != NULL)) {
+            JNLRecord(jn, n);
+        }
+        if (group_end) {
+            memset(parity, 0, m * PDU_MAX_DATA);
+            parity_len = 0;
+        }
+        if (status != 0) {
             LOGWrite(GWL_ERROR, "GSM error sending file");
-            done = 1;
+            ret = 1;
+            break;
         }
+        npending -= len;
+        memmove(pending, pending + len, npending);
+    }
 
-        if (feof(fp) != 0) {
-            ret = 0;
-            done = 1;
-        }
-        
-    };
+    fclose(fp);
+    free(lz);
+    free(parity);
+    if (jn != NULL) {
+        JNLClose(jn, ret == 0);
+    }
+    if (batching) {
+        end_batch(sp, batch);
+    }
+
+    // Leave the modem in text mode, as other commands expect
+    if (options->fo_pdu && !debug_mode && (set_message_format(sp, 1) != 0)) {
+        ret = 1;
+    }
 
     return ret;
 }
@@ -534,54 +1890,69 @@ int GSMWakeUp(SerialPort * sp)
 	return 0;
 }
 
-static const char * const CGATT_MESSAGE = "AT+CGATT=1\r\n";
+static const char * const CGATT_MESSAGE = "AT+CGATT=1";
 
 int GSMAttachGPRS(SerialPort *sp)
 {
-	char linebuf[256];
-	int count;
-
-	GSMSendCommand(sp, CGATT_MESSAGE);
-	get_line( sp, linebuf, 256 );
-
-	count = get_line( sp, linebuf, 256 );
+	ATCommand cmd;
+	ATResult res;
 
-	if( count <= 0 )
-		return 1;
+	ATInitCommand(&cmd, CGATT_MESSAGE, NULL, GSM_ATTACH_TIMEOUT);
+	res = gsm_exec(sp, &cmd);
 
-	if (strcmp(linebuf, "ERROR") == 0) {
-		LOGWrite(GWL_ERROR, "Error from GSM modem attaching to GPRS.");
-		return 1;
-	}
-	if (strcmp(linebuf, "OK") == 0) {
+	if (res == AT_OK) {
 		LOGWrite(GWL_DEBUG, "OK from GSM modem attaching to GPRS.");
 		return 0;
 	}
-	LOGWrite(GWL_ERROR, "Unknown response from GSM modem attaching to GPRS.");
+	if (res == AT_TIMEOUT) {
+		LOGWrite(GWL_ERROR, "No response from GSM modem attaching to GPRS.");
+		return 1;
+	}
+	LOGWrite(GWL_ERROR, "Error from GSM modem attaching to GPRS.");
 	return 1;
 }
 
-static const char * const CGREG_MESSAGE = "AT+CGREG?\r\n";
+static const char * const CGREG_MESSAGE = "AT+CGREG?";
+static const char * const CGREG_MESSAGE_RES = "+CGREG: ";
 
 int GSMCheckGPRS(SerialPort *sp)
 {
-	char linebuf[256];
-	int count;
-	char *sptr;
+	ATCommand cmd;
+	ATParsed parsed;
+	ATEngine * ae;
+	int status;
+
+	if( (ae = get_engine(sp)) == NULL )
+		return -1;
 
-	GSMSendCommand(sp, CGREG_MESSAGE);
-	get_line( sp, linebuf, 256 );
+	if( gsm_net.ns_reports )
+		while( ATPoll(ae, NULL) > 0 ) { }
 
-	/* Response should be at least this: */
-	count = get_line( sp, linebuf, 256 );
-	if( count < strlen("+CGREG: 0,0") )
+	if( !gsm_net.ns_reports || gsm_net.ns_cgreg < 0 )
 	{
-		LOGWrite(GWL_ERROR, "Response too short for CREG command.");
-		return -1;
+		ATInitCommand(&cmd, CGREG_MESSAGE, CGREG_MESSAGE_RES, GSM_COMMAND_TIMEOUT);
+		if (gsm_exec(sp, &cmd) != AT_OK) {
+			LOGWrite(GWL_ERROR, "Error reading GPRS registration.");
+			return -1;
+		}
+
+		/* Response should hold the mode and status */
+		if( cmd.ac_nlines < 1 )
+		{
+			LOGWrite(GWL_ERROR, "Response too short for CREG command.");
+			return -1;
+		}
+
+		ATClassify(cmd.ac_lines[0], &parsed);
+		if( parse_registration(&parsed, 1, &status) != 0 )
+		{
+			LOGWrite(GWL_ERROR, "Response too short for CREG command.");
+			return -1;
+		}
+		gsm_net.ns_cgreg = status;
 	}
 
-	sptr = strchr(linebuf, ',');
-	if( sptr[1] != '1' && sptr[1] != '5' )
+	if( gsm_net.ns_cgreg != 1 && gsm_net.ns_cgreg != 5 )
 		return 1;
 
 	return 0;	
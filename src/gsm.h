@@ -7,19 +7,92 @@
 #define GLACSWEB_GSM_H
 
 #include "serial.h"
+#include "encode.h"
+#include "dlr.h"
+
+/** Network state of the modem, kept up to date by unsolicited result
+ *  codes once GSMEnableReports has been called.
+ */
+typedef struct gsm_net_state {
+    /** Network registration status from +CREG, or -1 if unknown */
+    int         ns_creg;
+    /** GPRS registration status from +CGREG, or -1 if unknown */
+    int         ns_cgreg;
+    /** Location area code of the serving cell, or -1 if unknown */
+    long        ns_lac;
+    /** Id of the serving cell, or -1 if unknown */
+    long        ns_ci;
+    /** Signal strength in +CSQ units, or 99 if unknown */
+    int         ns_csq;
+    /** Time after which ns_csq must be read again */
+    struct timespec ns_csq_expiry;
+    /** Non-zero once registration changes are reported unsolicited */
+    int         ns_reports;
+    /** Index of the signal indicator in +CIEV reports, or zero if
+     *  signal changes are not reported */
+    int         ns_signal_ind;
+} GSMNetState;
+
+/** Flag in the header of a block which carries part of a compressed
+ *  stream rather than the file itself */
+#define GSM_BLOCK_COMPRESSED    0x01
+/** Flag in the header of a block which carries parity for a group of
+ *  blocks, rather than data */
+#define GSM_BLOCK_PARITY        0x02
+
+/** Choices for how GSMSendFileOptions sends a file */
+typedef struct gsm_file_options {
+    /** Non-zero to send blocks as 8-bit PDU mode messages, rather than
+     *  as hex text */
+    int         fo_pdu;
+    /** Encoding of the blocks sent as text */
+    Encoding    fo_encoding;
+    /** Non-zero to compress the file as it is sent */
+    int         fo_compress;
+    /** Directory of journals of the blocks sent, so a transfer which
+     *  fails can be resumed, or NULL to keep no journal */
+    const char * fo_journal;
+    /** Number of blocks in each group covered by parity */
+    int         fo_group;
+    /** Number of parity blocks sent after each group, or zero to send
+     *  none */
+    int         fo_parity;
+    /** Non-zero to keep the link to the network open between the blocks
+     *  of the file, with AT+CMMS */
+    int         fo_keep_link;
+} GSMFileOptions;
 
 char * GSMEncodeBytes(const BYTE * const data, size_t len);
 BYTE * GSMDecodeBytes(const char * const data);
 
 int GSMDebugMode();
 int GSMEchoOn(SerialPort *);
+int GSMEchoOff(SerialPort *);
 int GSMCheckSignal(SerialPort *);
 int GSMWaitSignal(SerialPort * , int retries);
+int GSMEnableReports(SerialPort *);
+int GSMIdle(SerialPort *, long usec);
+int GSMTrackDelivery(SerialPort *, DeliveryTable *);
+const GSMNetState * GSMGetNetState(void);
 int GSMSetSMSMode(SerialPort *);
+int GSMSetup(SerialPort *, int echo, int sms);
+void GSMSetSendTimeout(long usec);
+int GSMSubmitMessage(SerialPort *, const char * const, const char * const,
+                     int * mr);
+int GSMSubmitLongMessage(SerialPort *, const char * const,
+                         const char * const, int * mr);
+int GSMSubmitPDU(SerialPort *, const char * const, int flags, BYTE dcs,
+                 const BYTE *, size_t, int * mr);
 int GSMSendMessage(SerialPort *, const char * const, const char * const);
 int GSMSendBlock(SerialPort *, const char * const, const char * const,
                  int, const BYTE *, size_t);
+int GSMSendEncodedBlock(SerialPort *, const char * const, const char * const,
+                        int, Encoding, int flags, const BYTE *, size_t);
+int GSMSendBinaryBlock(SerialPort *, const char * const, const char * const,
+                       int, int flags, const BYTE *, size_t);
 int GSMSendFile(SerialPort *, const char * const, const char * const);
+int GSMSendFileOptions(SerialPort *, const char * const, const char * const,
+                       const GSMFileOptions *);
 
 int GSMWakeUp(SerialPort *);
 
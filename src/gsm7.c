@@ -0,0 +1,348 @@
+/*
+ * Glacsweb gsm7.c
+ * GSM 03.38 default alphabet
+ */
+
+/** \file
+ * Conversion between UTF-8 text and the GSM 03.38 default alphabet, and
+ * packing of its 7-bit characters into octets as carried in SMS PDUs.
+ * A message of 160 characters in the alphabet fits in the 140 bytes of
+ * one message. Characters from the extension table, such as '{' and the
+ * euro sign, take two septets: GSM7_ESCAPE followed by their code.
+ * Text with other characters is sent as UCS2 instead, two bytes to a
+ * character, with those outside the basic plane as UTF-16 pairs.
+ *
+ * Copyright (C) 2004 Alistair Riddoch, The University of Southampton
+ */
+
+#include "gsm7.h"
+
+#include <assert.h>
+
+/** Code points of the characters in the default alphabet. The escape at
+ *  0x1b decodes as a space if nothing follows it. */
+static const unsigned short gsm7_basic[128] = {
+    0x0040, 0x00a3, 0x0024, 0x00a5, 0x00e8, 0x00e9, 0x00f9, 0x00ec,
+    0x00f2, 0x00c7, 0x000a, 0x00d8, 0x00f8, 0x000d, 0x00c5, 0x00e5,
+    0x0394, 0x005f, 0x03a6, 0x0393, 0x039b, 0x03a9, 0x03a0, 0x03a8,
+    0x03a3, 0x0398, 0x039e, 0x0020, 0x00c6, 0x00e6, 0x00df, 0x00c9,
+    0x0020, 0x0021, 0x0022, 0x0023, 0x00a4, 0x0025, 0x0026, 0x0027,
+    0x0028, 0x0029, 0x002a, 0x002b, 0x002c, 0x002d, 0x002e, 0x002f,
+    0x0030, 0x0031, 0x0032, 0x0033, 0x0034, 0x0035, 0x0036, 0x0037,
+    0x0038, 0x0039, 0x003a, 0x003b, 0x003c, 0x003d, 0x003e, 0x003f,
+    0x00a1, 0x0041, 0x0042, 0x0043, 0x0044, 0x0045, 0x0046, 0x0047,
+    0x0048, 0x0049, 0x004a, 0x004b, 0x004c, 0x004d, 0x004e, 0x004f,
+    0x0050, 0x0051, 0x0052, 0x0053, 0x0054, 0x0055, 0x0056, 0x0057,
+    0x0058, 0x0059, 0x005a, 0x00c4, 0x00d6, 0x00d1, 0x00dc, 0x00a7,
+    0x00bf, 0x0061, 0x0062, 0x0063, 0x0064, 0x0065, 0x0066, 0x0067,
+    0x0068, 0x0069, 0x006a, 0x006b, 0x006c, 0x006d, 0x006e, 0x006f,
+    0x0070, 0x0071, 0x0072, 0x0073, 0x0074, 0x0075, 0x0076, 0x0077,
+    0x0078, 0x0079, 0x007a, 0x00e4, 0x00f6, 0x00f1, 0x00fc, 0x00e0
+};
+
+/** Characters of the extension table, each with its code after the
+ *  escape. Other codes after an escape decode as the character in the
+ *  default alphabet. */
+static const struct gsm7_ext {
+    BYTE                ge_code;
+    unsigned short      ge_char;
+} gsm7_extension[] = {
+    { 0x0a, 0x000c }, { 0x14, 0x005e }, { 0x28, 0x007b }, { 0x29, 0x007d },
+    { 0x2f, 0x005c }, { 0x3c, 0x005b }, { 0x3d, 0x007e }, { 0x3e, 0x005d },
+    { 0x40, 0x007c }, { 0x65, 0x20ac }
+};
+
+#define GSM7_EXTENSIONS (sizeof(gsm7_extension) / sizeof(gsm7_extension[0]))
+
+/** Marks a code point with no septet in the encoding tables */
+#define GSM7_NONE       0xffff
+/** Flag marking an encoding from the extension table */
+#define GSM7_EXT        0x0100
+
+/** Septets for code points up to 0xff, with GSM7_EXT set for characters
+ *  in the extension table, or GSM7_NONE. */
+static unsigned short gsm7_latin[256];
+/** Septets for code points from 0x0390 to 0x03af, which covers the Greek
+ *  capitals of the default alphabet. */
+static unsigned short gsm7_greek[32];
+/** Code points of the characters which follow an escape */
+static unsigned short gsm7_escaped[128];
+/** Non-zero once the encoding tables are built */
+static int gsm7_ready = 0;
+
+/** Build the encoding tables, and the table for escaped characters,
+ *  from the alphabet and the extension table. */
+static void build_tables()
+{
+    unsigned int i;
+
+    for (i = 0; i < 256; ++i) {
+        gsm7_latin[i] = GSM7_NONE;
+    }
+    for (i = 0; i < 32; ++i) {
+        gsm7_greek[i] = GSM7_NONE;
+    }
+    for (i = 0; i < 128; ++i) {
+        gsm7_escaped[i] = gsm7_basic[i];
+    }
+    for (i = 0; i < GSM7_EXTENSIONS; ++i) {
+        gsm7_escaped[gsm7_extension[i].ge_code] = gsm7_extension[i].ge_char;
+        if (gsm7_extension[i].ge_char < 0x100) {
+            gsm7_latin[gsm7_extension[i].ge_char] =
+                GSM7_EXT | gsm7_extension[i].ge_code;
+        }
+    }
+    for (i = 0; i < 128; ++i) {
+        unsigned short c = gsm7_basic[i];
+
+        if (i == GSM7_ESCAPE) {
+            continue;
+        }
+        if (c < 0x100) {
+            gsm7_latin[c] = i;
+        } else if ((c >= 0x390) && (c < 0x3b0)) {
+            gsm7_greek[c - 0x390] = i;
+        }
+    }
+    gsm7_ready = 1;
+}
+
+/** Read one character from UTF-8 text.
+ *  @param text pointer to the text, which is moved past the character.
+ *  @return the code point, or -1 if the text is not valid UTF-8.
+ */
+static long next_char(const unsigned char ** text)
+{
+    const unsigned char * p = *text;
+    long c = *p++;
+    int more;
+
+    if (c < 0x80) {
+        *text = p;
+        return c;
+    } else if ((c & 0xe0) == 0xc0) {
+        c &= 0x1f;
+        more = 1;
+    } else if ((c & 0xf0) == 0xe0) {
+        c &= 0x0f;
+        more = 2;
+    } else if ((c & 0xf8) == 0xf0) {
+        c &= 0x07;
+        more = 3;
+    } else {
+        return -1;
+    }
+    while (more-- > 0) {
+        if ((*p & 0xc0) != 0x80) {
+            return -1;
+        }
+        c = (c << 6) | (*p++ & 0x3f);
+    }
+    *text = p;
+    return c;
+}
+
+/** Convert UTF-8 text to septets in the GSM default alphabet.
+ *  @param text NULL terminated UTF-8 text.
+ *  @param septets buffer for the septets, one per byte.
+ *  @param max size of the buffer. Twice the length of the text is
+ *  always enough.
+ *  @return the number of septets, or -1 if the text has a character not
+ *  in the alphabet, or does not fit in the buffer.
+ */
+int GSM7Encode(const char * text, BYTE * septets, size_t max)
+{
+    const unsigned char * p = (const unsigned char *)text;
+    size_t n = 0;
+
+    assert(text != NULL);
+    assert(septets != NULL);
+
+    if (!gsm7_ready) {
+        build_tables();
+    }
+
+    while (*p != 0) {
+        long c = next_char(&p);
+        unsigned short s = GSM7_NONE;
+
+        if (c < 0) {
+            return -1;
+        } else if (c < 0x100) {
+            s = gsm7_latin[c];
+        } else if ((c >= 0x390) && (c < 0x3b0)) {
+            s = gsm7_greek[c - 0x390];
+        } else if (c == 0x20ac) {
+            // The euro sign, the only extension outside Latin-1
+            s = GSM7_EXT | 0x65;
+        }
+        if (s == GSM7_NONE) {
+            return -1;
+        }
+        if (s & GSM7_EXT) {
+            if (n + 2 > max) {
+                return -1;
+            }
+            septets[n++] = GSM7_ESCAPE;
+            septets[n++] = s & 0x7f;
+        } else {
+            if (n + 1 > max) {
+                return -1;
+            }
+            septets[n++] = s;
+        }
+    }
+    return n;
+}
+
+/** Convert UTF-8 text to UCS2, big-endian as carried in SMS PDUs.
+ *  Characters outside the basic plane take a UTF-16 surrogate pair.
+ *  @param text NULL terminated UTF-8 text.
+ *  @param data buffer for the UCS2 text.
+ *  @param max size of the buffer. Twice the length of the text is
+ *  always enough.
+ *  @return the number of bytes of UCS2 text, or -1 if the text is not
+ *  valid UTF-8, or does not fit in the buffer.
+ */
+int GSM7EncodeUCS2(const char * text, BYTE * data, size_t max)
+{
+    const unsigned char * p = (const unsigned char *)text;
+    size_t n = 0;
+
+    assert(text != NULL);
+    assert(data != NULL);
+
+    while (*p != 0) {
+        long c = next_char(&p);
+
+        if ((c < 0) || (c > 0x10ffff)) {
+            return -1;
+        }
+        if (c >= 0x10000) {
+            if (n + 4 > max) {
+                return -1;
+            }
+            c -= 0x10000;
+            data[n++] = 0xd8 | (c >> 18);
+            data[n++] = (c >> 10) & 0xff;
+            data[n++] = 0xdc | ((c >> 8) & 0x03);
+            data[n++] = c & 0xff;
+        } else {
+            if (n + 2 > max) {
+                return -1;
+            }
+            data[n++] = c >> 8;
+            data[n++] = c & 0xff;
+        }
+    }
+    return n;
+}
+
+/** Convert septets in the GSM default alphabet to UTF-8 text.
+ *  @param septets the septets, one per byte.
+ *  @param count number of septets.
+ *  @param text buffer for the text, which is NULL terminated.
+ *  @param size size of the buffer. Three bytes per septet, and one more,
+ *  is always enough.
+ *  @return the length of the text, or -1 if it does not fit.
+ */
+int GSM7Decode(const BYTE * septets, size_t count, char * text, size_t size)
+{
+    size_t i, n = 0;
+
+    assert(septets != NULL || count == 0);
+    assert(text != NULL);
+
+    if (!gsm7_ready) {
+        build_tables();
+    }
+
+    for (i = 0; i < count; ++i) {
+        unsigned short c = gsm7_basic[septets[i] & 0x7f];
+
+        if (((septets[i] & 0x7f) == GSM7_ESCAPE) && (i + 1 < count)) {
+            c = gsm7_escaped[septets[++i] & 0x7f];
+        }
+        if (n + 4 > size) {
+            return -1;
+        }
+        if (c < 0x80) {
+            text[n++] = c;
+        } else if (c < 0x800) {
+            text[n++] = 0xc0 | (c >> 6);
+            text[n++] = 0x80 | (c & 0x3f);
+        } else {
+            text[n++] = 0xe0 | (c >> 12);
+            text[n++] = 0x80 | ((c >> 6) & 0x3f);
+            text[n++] = 0x80 | (c & 0x3f);
+        }
+    }
+    if (n + 1 > size) {
+        return -1;
+    }
+    text[n] = 0;
+    return n;
+}
+
+/** Pack septets into octets, least significant bit first, as they are
+ *  carried in the user data of a message.
+ *  @param septets the septets, one per byte.
+ *  @param count number of septets.
+ *  @param fill number of zero bits before the first septet, which puts
+ *  it on a septet boundary after a user data header.
+ *  @param data buffer for the octets, of (fill + 7 * count + 7) / 8 bytes.
+ *  @return the number of octets.
+ */
+size_t GSM7Pack(const BYTE * septets, size_t count, int fill, BYTE * data)
+{
+    unsigned int acc = 0;
+    int bits = fill;
+    BYTE * p = data;
+    size_t i;
+
+    assert((fill >= 0) && (fill < 7));
+
+    for (i = 0; i < count; ++i) {
+        acc |= (septets[i] & 0x7f) << bits;
+        bits += 7;
+        if (bits >= 8) {
+            *p++ = acc & 0xff;
+            acc >>= 8;
+            bits -= 8;
+        }
+    }
+    if (bits > 0) {
+        *p++ = acc & 0xff;
+    }
+    return p - data;
+}
+
+/** Unpack septets from octets packed by GSM7Pack.
+ *  @param data the octets.
+ *  @param count number of septets to unpack.
+ *  @param fill number of bits before the first septet.
+ *  @param septets buffer for the septets, of count bytes.
+ */
+void GSM7Unpack(const BYTE * data, size_t count, int fill, BYTE * septets)
+{
+    unsigned int acc;
+    int bits;
+    size_t i;
+
+    assert((fill >= 0) && (fill < 7));
+
+    if (count == 0) {
+        return;
+    }
+    acc = *data++ >> fill;
+    bits = 8 - fill;
+    for (i = 0; i < count; ++i) {
+        if (bits < 7) {
+            acc |= *data++ << bits;
+            bits += 8;
+        }
+        septets[i] = acc & 0x7f;
+        acc >>= 7;
+        bits -= 7;
+    }
+}
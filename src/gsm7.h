@@ -0,0 +1,25 @@
+/*
+ * Glacsweb gsm7.h
+ * Copyright (C) 2004 Alistair Riddoch, The University of Southampton
+ */
+
+#ifndef GLACSWEB_GSM7_H
+#define GLACSWEB_GSM7_H
+
+#include "types.h"
+
+#include <stddef.h>
+
+/** Septet which introduces a character from the extension table */
+#define GSM7_ESCAPE             0x1b
+
+/** Maximum number of septets in one SMS message */
+#define GSM7_MAX_SEPTETS        160
+
+int GSM7Encode(const char * text, BYTE * septets, size_t max);
+int GSM7EncodeUCS2(const char * text, BYTE * data, size_t max);
+int GSM7Decode(const BYTE * septets, size_t count, char * text, size_t size);
+size_t GSM7Pack(const BYTE * septets, size_t count, int fill, BYTE * data);
+void GSM7Unpack(const BYTE * data, size_t count, int fill, BYTE * septets);
+
+#endif // GLACSWEB_GSM7_H
@@ -28,7 +28,7 @@ static SerialPort * initialise(const char * port, speed_t baud)
     LOGWrite(GWL_DEBUG, "Initialise gwgsm.");
 
     // now the serial port
-    sp = SEROpenPort(port, baud, NULL);
+    sp = SEROpenPort(port, baud, NULL, NULL);
     if (sp == NULL) {
         LOGWrite(GWL_FATAL, "Can not open serial port!");
         return NULL;
@@ -0,0 +1,1183 @@
+/**
+ * Glacsweb gsmbench.c
+ * benchmarks for the serial and GSM code
+ * Copyright (C) 2004 Alistair Riddoch, The University of Southampton
+ */
+
+#include "serial.h"
+#include "at.h"
+#include "gsm7.h"
+#include "encode.h"
+#include "lzss.h"
+#include "fec.h"
+#include "gsm.h"
+#include "log.h"
+
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <math.h>
+#include <pty.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/** Response sent by the fake modem for each round trip */
+static const char * const BENCH_RESPONSE = "\r\n+CSQ: 20,99\r\n\r\nOK\r\n";
+
+/** Get the current time on the monotonic clock in microseconds. */
+static double now_usec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/** Play a modem at the master side of a pty. For each command line
+ *  received, send BENCH_RESPONSE one byte at a time, spaced out as if it
+ *  were arriving at the given baud rate.
+ */
+static void fake_modem(int fd, int baud)
+{
+    useconds_t byte_usec = 10000000 / baud;
+    char buf[256];
+
+    for (;;) {
+        const char * c;
+        ssize_t len = read(fd, buf, sizeof(buf));
+
+        if (len <= 0) {
+            exit(0);
+        }
+        if (memchr(buf, '\r', len) == NULL) {
+            continue;
+        }
+        for (c = BENCH_RESPONSE; *c != 0; ++c) {
+            write(fd, c, 1);
+            usleep(byte_usec);
+        }
+    }
+}
+
+/** Time a number of AT round trips over a pty in one read mode.
+ *  @return zero if the run completed, non-zero otherwise.
+ */
+static int bench_read_mode(const SerialOptions * options, const char * name,
+                           int trips, int baud)
+{
+    struct rusage before, after;
+    SerialPort * sp;
+    char ptyname[64];
+    char line[256];
+    double total = 0, worst = 0;
+    pid_t pid;
+    int master, slave, i;
+
+    if (openpty(&master, &slave, ptyname, NULL, NULL) != 0) {
+        perror("openpty");
+        return 1;
+    }
+
+    pid = fork();
+    if (pid == 0) {
+        close(slave);
+        fake_modem(master, baud);
+    }
+    close(master);
+
+    sp = SEROpenPort(ptyname, B9600, NULL, options);
+    if (sp == NULL) {
+        fprintf(stderr, "Could not open %s\n", ptyname);
+        kill(pid, SIGTERM);
+        return 1;
+    }
+
+    getrusage(RUSAGE_SELF, &before);
+    for (i = 0; i < trips; ++i) {
+        struct timespec deadline;
+        double start = now_usec(), elapsed;
+
+        SERDeadline(&deadline, 5000000);
+        SERPutString(sp, "AT+CSQ\r");
+        do {
+            if (SERGetLineDeadline(sp, line, sizeof(line), &deadline) < 0) {
+                fprintf(stderr, "%s: timeout on round trip %d\n", name, i);
+                break;
+            }
+        } while (strcmp(line, "OK") != 0);
+        elapsed = now_usec() - start;
+        total += elapsed;
+        if (elapsed > worst) {
+            worst = elapsed;
+        }
+    }
+    getrusage(RUSAGE_SELF, &after);
+
+    printf("%-12s %8.2f %8.2f %10.1f %10.1f\n", name,
+           total / trips / 1000, worst / 1000,
+           (double)(after.ru_nvcsw - before.ru_nvcsw) / trips,
+           ((after.ru_utime.tv_sec - before.ru_utime.tv_sec) * 1e6 +
+            (after.ru_utime.tv_usec - before.ru_utime.tv_usec) +
+            (after.ru_stime.tv_sec - before.ru_stime.tv_sec) * 1e6 +
+            (after.ru_stime.tv_usec - before.ru_stime.tv_usec)) / trips);
+
+    SERClosePort(sp);
+    close(slave);
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    return 0;
+}
+
+/** Compare the serial read modes over a pty. */
+static int bench_serial(int argc, char ** argv)
+{
+    SerialOptions options = { SER_READ_DEFAULT, 64, 1, 0 };
+    int trips = 100;
+    int baud = 9600;
+    int ret = 0;
+
+    if (argc > 1) {
+        trips = atoi(argv[1]);
+    }
+    if (argc > 2) {
+        baud = atoi(argv[2]);
+    }
+    if ((trips < 1) || (baud < 1)) {
+        return 1;
+    }
+
+    printf("%d round trips, response paced at %d baud\n", trips, baud);
+    printf("%-12s %8s %8s %10s %10s\n", "mode", "mean ms", "max ms",
+           "wakeups", "cpu us");
+
+    options.so_read_mode = SER_READ_DEFAULT;
+    ret |= bench_read_mode(&options, "default", trips, baud);
+    options.so_read_mode = SER_READ_BATCHED;
+    ret |= bench_read_mode(&options, "batched", trips, baud);
+    options.so_read_mode = SER_READ_LOWLATENCY;
+    ret |= bench_read_mode(&options, "lowlatency", trips, baud);
+
+    return ret;
+}
+
+/** Time commands through the AT engine with the modem echo on or off.
+ *  @return zero if the run completed, non-zero otherwise.
+ */
+static int bench_echo_mode(ATEngine * ae, int echo, int count,
+                           const char * payload)
+{
+    ATCommand cmd;
+    double start, csq_time, cmgs_time;
+    int i;
+
+    ATInitCommand(&cmd, echo ? "ATE1" : "ATE0", NULL, 3000000);
+    if (ATExec(ae, &cmd) != AT_OK) {
+        fprintf(stderr, "Could not set echo mode: %s\n",
+                ATResultName(cmd.ac_result));
+        return 1;
+    }
+
+    start = now_usec();
+    for (i = 0; i < count; ++i) {
+        ATInitCommand(&cmd, "AT+CSQ", "+CSQ:", 3000000);
+        if (ATExec(ae, &cmd) != AT_OK) {
+            fprintf(stderr, "AT+CSQ failed: %s\n",
+                    ATResultName(cmd.ac_result));
+            return 1;
+        }
+    }
+    csq_time = now_usec() - start;
+
+    start = now_usec();
+    for (i = 0; i < count; ++i) {
+        ATInitCommand(&cmd, "AT+CMGS=\"0123\"", "+CMGS:", 20000000);
+        cmd.ac_payload = payload;
+        if (ATExec(ae, &cmd) != AT_OK) {
+            fprintf(stderr, "AT+CMGS failed: %s\n",
+                    ATResultName(cmd.ac_result));
+            return 1;
+        }
+    }
+    cmgs_time = now_usec() - start;
+
+    printf("%-12s %10.2f %10.2f\n", echo ? "echo on" : "echo off",
+           csq_time / count / 1000, cmgs_time / count / 1000);
+    return 0;
+}
+
+/** Compare command latency with the modem echo on and off. This runs
+ *  against a real modem or gsmsim, which should be started with its
+ *  response pacing set to the link speed being modelled, eg
+ *  "gsmsim -l /tmp/gsm -b 9600 -m 0".
+ */
+static int bench_echo(int argc, char ** argv)
+{
+    char payload[161];
+    SerialPort * sp;
+    ATEngine * ae;
+    speed_t baud = B9600;
+    int count = 20;
+    int length = 160;
+    int ret;
+
+    if (argc < 2) {
+        return 1;
+    }
+    if (argc > 2) {
+        count = atoi(argv[2]);
+    }
+    if (argc > 3) {
+        length = atoi(argv[3]);
+    }
+    if ((count < 1) || (length < 1) || (length > 160)) {
+        return 1;
+    }
+    memset(payload, 'x', length);
+    payload[length] = 0;
+
+    sp = SEROpenPort(argv[1], baud, NULL, NULL);
+    if (sp == NULL) {
+        fprintf(stderr, "Could not open %s\n", argv[1]);
+        return 1;
+    }
+    ae = ATCreate(sp);
+    if (ae == NULL) {
+        SERClosePort(sp);
+        return 1;
+    }
+
+    printf("%d commands of each kind, %d character messages\n", count,
+           length);
+    printf("%-12s %10s %10s\n", "mode", "CSQ ms", "CMGS ms");
+    ret = bench_echo_mode(ae, 1, count, payload);
+    if (ret == 0) {
+        ret = bench_echo_mode(ae, 0, count, payload);
+    }
+
+    // Leave the modem echoing, as the other tools expect
+    if (ret == 0) {
+        ATCommand cmd;
+
+        ATInitCommand(&cmd, "ATE1", NULL, 3000000);
+        ATExec(ae, &cmd);
+    }
+
+    ATDestroy(ae);
+    SERClosePort(sp);
+    return ret;
+}
+
+/** Lines used to time line classification, in rough proportion to how
+ *  often they arrive from the modem */
+static const char * const classify_lines[] = {
+    "OK", "OK", "OK", "OK",
+    "ERROR",
+    "+CME ERROR: 10",
+    "+CMS ERROR: 500",
+    "+CREG: 2,1,\"00A1\",\"1B2C\"",
+    "+CREG: 1",
+    "+CGREG: 0,1",
+    "+CSQ: 20,99",
+    "+CMGS: 42",
+    "+CIEV: 2,3",
+    "AT+CSQ",
+    "6162636465666768696a6b6c6d6e6f70",
+    NULL
+};
+
+/** Classify a line with a chain of string comparisons, as the command
+ *  functions used to, for comparison with ATClassify. */
+static int classify_chain(const char * line)
+{
+    static const char * const prefixes[] = {
+        "OK", "ERROR", "NO CARRIER", "NO DIALTONE", "BUSY", "NO ANSWER",
+        "+CME ERROR:", "+CMS ERROR:", "RING", "+CREG:", "+CGREG:", "+CSQ:",
+        "+CMGF:", "+CMGS:", "+CMMS:", "+CNMI:", "+CGATT:", "+CIND:",
+        "+CIEV:", "+CMTI:", "+CDS:", "+CDSI:", "^RSSI:", NULL
+    };
+    int i;
+
+    for (i = 0; prefixes[i] != NULL; ++i) {
+        size_t len = strlen(prefixes[i]);
+
+        if (prefixes[i][len - 1] == ':') {
+            if (strncmp(line, prefixes[i], len) == 0) {
+                return i + 1;
+            }
+        } else if (strcmp(line, prefixes[i]) == 0) {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+/** Time the classification of lines from the modem. */
+static int bench_classify(int argc, char ** argv)
+{
+    ATParsed parsed;
+    double start, table_time, chain_time;
+    long total = 0;
+    int count = 1000000;
+    int nlines, i, j;
+
+    if (argc > 1) {
+        count = atoi(argv[1]);
+    }
+    if (count < 1) {
+        return 1;
+    }
+    for (nlines = 0; classify_lines[nlines] != NULL; ++nlines) {
+    }
+
+    start = now_usec();
+    for (i = 0; i < count; ++i) {
+        for (j = 0; j < nlines; ++j) {
+            total += ATClassify(classify_lines[j], &parsed);
+            total += parsed.ap_nfields;
+        }
+    }
+    table_time = now_usec() - start;
+
+    start = now_usec();
+    for (i = 0; i < count; ++i) {
+        for (j = 0; j < nlines; ++j) {
+            total += classify_chain(classify_lines[j]);
+        }
+    }
+    chain_time = now_usec() - start;
+
+    printf("%d lines classified %d times (checksum %ld)\n", nlines, count,
+           total);
+    printf("%-24s %10s\n", "method", "ns/line");
+    printf("%-24s %10.1f\n", "table and fields",
+           table_time * 1000 / count / nlines);
+    printf("%-24s %10.1f\n", "strcmp chain, no fields",
+           chain_time * 1000 / count / nlines);
+    return 0;
+}
+
+/** Every character of the GSM default alphabet and its extension table,
+ *  as UTF-8 */
+static const char * const gsm7_alphabet =
+    "@\xc2\xa3$\xc2\xa5\xc3\xa8\xc3\xa9\xc3\xb9\xc3\xac\xc3\xb2\xc3\x87\n"
+    "\xc3\x98\xc3\xb8\r\xc3\x85\xc3\xa5\xce\x94_\xce\xa6\xce\x93\xce\x9b"
+    "\xce\xa9\xce\xa0\xce\xa8\xce\xa3\xce\x98\xce\x9e\xc3\x86\xc3\xa6"
+    "\xc3\x9f\xc3\x89 !\"#\xc2\xa4%&'()*+,-./0123456789:;<=>?\xc2\xa1"
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZ\xc3\x84\xc3\x96\xc3\x91\xc3\x9c\xc2\xa7"
+    "\xc2\xbf" "abcdefghijklmnopqrstuvwxyz\xc3\xa4\xc3\xb6\xc3\xb1\xc3\xbc"
+    "\xc3\xa0\x0c^{}\\[~]|\xe2\x82\xac";
+
+/** Check that text survives encoding, packing, unpacking and decoding
+ *  with each number of fill bits.
+ *  @return zero if it does, non-zero otherwise.
+ */
+static int gsm7_round_trip(const char * text)
+{
+    BYTE septets[512], unpacked[512], packed[512];
+    char decoded[1024];
+    int count, fill;
+
+    count = GSM7Encode(text, septets, sizeof(septets));
+    if (count < 0) {
+        return 1;
+    }
+    for (fill = 0; fill < 7; ++fill) {
+        GSM7Pack(septets, count, fill, packed);
+        GSM7Unpack(packed, count, fill, unpacked);
+        if ((memcmp(septets, unpacked, count) != 0) ||
+            (GSM7Decode(unpacked, count, decoded, sizeof(decoded)) < 0) ||
+            (strcmp(decoded, text) != 0)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/** Check the GSM 7-bit alphabet code, and time it. */
+static int bench_gsm7(int argc, char ** argv)
+{
+    static const char * const bad[] = {
+        "caf\xc3\xa7", "\xe2\x80\x9cquoted\xe2\x80\x9d", "\xff", "\xc3", NULL
+    };
+    static const char * const text = "Station 3 battery 12.4V, temp -3.2C, "
+        "probes 1-8 ok {tilt 0.5} 100% \xe2\x82\xac" "5 \xc3\xa9t\xc3\xa9";
+    static const char * const wide = "caf\xc3\xa7\xe6\xbc\xa2\xf0\x9f\x98\x80";
+    static const BYTE wide_ucs2[] = {
+        0x00, 0x63, 0x00, 0x61, 0x00, 0x66, 0x00, 0xe7, 0x6f, 0x22,
+        0xd8, 0x3d, 0xde, 0x00
+    };
+    BYTE septets[512], packed[512], unpacked[512];
+    char decoded[1024];
+    char line[161];
+    double start, encode_time, decode_time;
+    long total = 0;
+    int count = 100000;
+    int failures = 0;
+    int i, j, n;
+
+    if (argc > 1) {
+        count = atoi(argv[1]);
+    }
+    if (count < 1) {
+        return 1;
+    }
+
+    failures += gsm7_round_trip(gsm7_alphabet);
+    failures += gsm7_round_trip(text);
+    failures += gsm7_round_trip("");
+    for (i = 0; bad[i] != NULL; ++i) {
+        if (GSM7Encode(bad[i], septets, sizeof(septets)) >= 0) {
+            ++failures;
+        }
+    }
+    // Text outside the alphabet goes as UCS2, with a surrogate pair for
+    // characters beyond the basic plane
+    n = GSM7EncodeUCS2(wide, septets, sizeof(septets));
+    if ((n != sizeof(wide_ucs2)) || (memcmp(septets, wide_ucs2, n) != 0)) {
+        ++failures;
+    }
+    if (GSM7EncodeUCS2("\xc3", septets, sizeof(septets)) >= 0) {
+        ++failures;
+    }
+    // Random printable ASCII, which is all in the alphabet apart from `
+    srandom(1);
+    for (i = 0; i < 10000; ++i) {
+        n = random() % 160;
+        for (j = 0; j < n; ++j) {
+            line[j] = ' ' + random() % 95;
+            if (line[j] == '`') {
+                line[j] = '\'';
+            }
+        }
+        line[n] = 0;
+        failures += gsm7_round_trip(line);
+    }
+    printf("round trip checks: %d failures\n", failures);
+
+    n = GSM7Encode(text, septets, sizeof(septets));
+    start = now_usec();
+    for (i = 0; i < count; ++i) {
+        n = GSM7Encode(text, septets, sizeof(septets));
+        total += GSM7Pack(septets, n, i % 7, packed);
+    }
+    encode_time = now_usec() - start;
+
+    start = now_usec();
+    for (i = 0; i < count; ++i) {
+        GSM7Unpack(packed, n, (count - 1) % 7, unpacked);
+        total += GSM7Decode(unpacked, n, decoded, sizeof(decoded));
+    }
+    decode_time = now_usec() - start;
+
+    printf("%d septets converted %d times (checksum %ld)\n", n, count,
+           total);
+    printf("%-24s %10s %10s\n", "direction", "ns/septet", "Mseptet/s");
+    printf("%-24s %10.1f %10.1f\n", "encode and pack",
+           encode_time * 1000 / count / n, (double)n * count / encode_time);
+    printf("%-24s %10.1f %10.1f\n", "unpack and decode",
+           decode_time * 1000 / count / n, (double)n * count / decode_time);
+    return (failures == 0) ? 0 : 1;
+}
+
+/** Encode bytes as hex with snprintf, as GSMEncodeBytes used to, for
+ *  comparison with the table driven encoders. */
+static size_t encode_snprintf(const BYTE * data, size_t len, char * text)
+{
+    size_t i;
+
+    for (i = 0; i < len; ++i) {
+        snprintf(text + i * 2, 3, "%2.2x", data[i]);
+    }
+    return len * 2;
+}
+
+/** Check the binary to text encodings, and compare their speed and how
+ *  much each text message carries. */
+static int bench_encode(int argc, char ** argv)
+{
+    static const char * const names[ENC_COUNT] = { "hex", "base64",
+                                                   "base84" };
+    // Room in a message for data after a header such as "f.bin 1 b\n"
+    const size_t room = 160 - 10 - 1;
+    BYTE data[256], decoded[256];
+    char text[1024];
+    double start, elapsed;
+    long total = 0;
+    int count = 100000;
+    int failures = 0;
+    int i, enc, len;
+
+    if (argc > 1) {
+        count = atoi(argv[1]);
+    }
+    if (count < 1) {
+        return 1;
+    }
+
+    srandom(1);
+    for (enc = 0; enc < ENC_COUNT; ++enc) {
+        for (len = 0; len <= 200; ++len) {
+            size_t chars;
+
+            for (i = 0; i < len; ++i) {
+                data[i] = random();
+            }
+            chars = ENCEncode(enc, data, len, text);
+            if ((chars != ENCEncodedLength(enc, len)) ||
+                (strlen(text) != chars) ||
+                (ENCDecode(enc, text, chars, decoded) != len) ||
+                (memcmp(data, decoded, len) != 0) ||
+                (ENCCapacity(enc, chars) < (size_t)len)) {
+                ++failures;
+            }
+        }
+    }
+    if ((ENCDecode(ENC_BASE84, "___", 3, decoded) != -1) ||
+        (ENCDecode(ENC_BASE64, "AB=C", 4, decoded) != -1) ||
+        (ENCDecode(ENC_HEX, "abc", 3, decoded) != -1)) {
+        ++failures;
+    }
+    printf("round trip checks: %d failures\n", failures);
+
+    for (i = 0; i < 64; ++i) {
+        data[i] = random();
+    }
+    printf("%-24s %10s %14s\n", "encoding", "ns/byte", "bytes/message");
+    start = now_usec();
+    for (i = 0; i < count; ++i) {
+        total += encode_snprintf(data, 64, text);
+    }
+    elapsed = now_usec() - start;
+    printf("%-24s %10.1f %14d\n", "hex with snprintf",
+           elapsed * 1000 / count / 64, 64);
+    for (enc = 0; enc < ENC_COUNT; ++enc) {
+        start = now_usec();
+        for (i = 0; i < count; ++i) {
+            total += ENCEncode(enc, data, 64, text);
+        }
+        elapsed = now_usec() - start;
+        printf("%-24s %10.1f %14u\n", names[enc],
+               elapsed * 1000 / count / 64,
+               (enc == ENC_HEX) ? 64 : (unsigned)ENCCapacity(enc, room));
+    }
+    printf("(checksum %ld)\n", total);
+    return (failures == 0) ? 0 : 1;
+}
+
+/** Bytes in each sample generated for the compress benchmark */
+#define SAMPLE_SIZE     16384
+
+/** Fill a buffer with readings such as a probe records, one line of
+ *  comma separated values at a time. */
+static size_t sample_readings(BYTE * data, size_t size)
+{
+    size_t len = 0;
+    int i = 0;
+
+    srandom(2);
+    while (len + 64 < size) {
+        len += sprintf((char *)data + len, "%d,%d,%d.%02d,%d,%d\n",
+                       1100000000 + i * 600, 21 + (i / 144) % 3,
+                       -1 - (int)(random() % 3), (int)(random() % 100),
+                       1000 + (int)(random() % 20), 3600 - i / 50);
+        ++i;
+    }
+    return len;
+}
+
+/** Fill a buffer with lines such as the log of a base station. */
+static size_t sample_log(BYTE * data, size_t size)
+{
+    static const char * const events[] = {
+        "GSM: Signal strength %d", "Probe %d replied to poll",
+        "Probe %d did not reply", "Sending file probe%d.dat",
+        "Battery voltage %d mV"
+    };
+    size_t len = 0;
+    int i = 0;
+
+    srandom(3);
+    while (len + 80 < size) {
+        len += sprintf((char *)data + len, "Jun %2d %02d:%02d:%02d base ",
+                       1 + i / 1440, (i / 60) % 24, i % 60,
+                       (int)(random() % 60));
+        len += sprintf((char *)data + len, events[random() % 5],
+                       (int)(random() % 32));
+        data[len++] = '\n';
+        ++i;
+    }
+    return len;
+}
+
+/** Fill a buffer with random bytes, which do not compress. */
+static size_t sample_random(BYTE * data, size_t size)
+{
+    size_t i;
+
+    srandom(4);
+    for (i = 0; i < size; ++i) {
+        data[i] = random();
+    }
+    return size;
+}
+
+/** Compress data as GSMSendFileOptions does, a piece at a time, and
+ *  check that it decompresses to the original.
+ *  @return the compressed size, or -1 if the data did not survive.
+ */
+static long compress_round_trip(const BYTE * data, size_t len,
+                                double * elapsed)
+{
+    static LZSSEncoder le;
+    static LZSSDecoder ld;
+    BYTE * packed = malloc(LZSS_BOUND(len) + len / 256 * 32);
+    BYTE * unpacked = NULL;
+    size_t plen = 0;
+    size_t off;
+    double start;
+    long ulen = -1;
+
+    if (packed == NULL) {
+        return -1;
+    }
+    start = now_usec();
+    LZSSInitEncoder(&le);
+    for (off = 0; off < len; off += 256) {
+        plen += LZSSCompress(&le, data + off,
+                             (len - off < 256) ? len - off : 256,
+                             packed + plen);
+    }
+    plen += LZSSFinish(&le, packed + plen);
+    *elapsed = now_usec() - start;
+
+    LZSSInitDecoder(&ld);
+    if ((unpacked = malloc(plen * LZSS_MAX_MATCH + 1)) != NULL) {
+        ulen = LZSSDecompress(&ld, packed, plen, unpacked);
+    }
+    if ((ulen != (long)len) || (memcmp(data, unpacked, len) != 0)) {
+        plen = -1;
+    }
+    free(unpacked);
+    free(packed);
+    return plen;
+}
+
+/** Count the messages needed for some bytes at a number per message. */
+static long messages(size_t len, size_t per_message)
+{
+    return (len + per_message - 1) / per_message;
+}
+
+/** Compare the number of messages needed to send files with and without
+ *  compression, for each way of sending blocks. */
+static int bench_compress(int argc, char ** argv)
+{
+    static size_t (* const samples[])(BYTE *, size_t) = {
+        sample_readings, sample_log, sample_random
+    };
+    static const char * const sample_names[] = {
+        "(readings)", "(log)", "(random)"
+    };
+    // Room in a message for data after a header such as "f.bin 1 b\n"
+    const size_t room = 160 - 10 - 1;
+    const size_t hex_lettered = ENCCapacity(ENC_HEX, room);
+    const size_t base84 = ENCCapacity(ENC_BASE84, room);
+    const size_t binary = 140 - 4 - strlen("f.bin");
+    int count = (argc > 1) ? argc - 1 : 3;
+    int failures = 0;
+    int i;
+
+    printf("%-16s %8s %8s %6s %11s %11s %11s %8s\n", "file", "bytes",
+           "packed", "ratio", "hex", "base84", "pdu", "MB/s");
+    for (i = 0; i < count; ++i) {
+        const char * name;
+        BYTE * data;
+        size_t len;
+        long plen;
+        double elapsed;
+
+        if (argc > 1) {
+            FILE * fp;
+            long size;
+
+            name = argv[i + 1];
+            if ((fp = fopen(name, "r")) == NULL) {
+                perror(name);
+                ++failures;
+                continue;
+            }
+            fseek(fp, 0, SEEK_END);
+            size = ftell(fp);
+            rewind(fp);
+            data = malloc(size + 1);
+            len = (data == NULL) ? 0 : fread(data, 1, size, fp);
+            fclose(fp);
+        } else {
+            name = sample_names[i];
+            data = malloc(SAMPLE_SIZE);
+            len = (data == NULL) ? 0 : samples[i](data, SAMPLE_SIZE);
+        }
+        if (data == NULL) {
+            ++failures;
+            continue;
+        }
+
+        plen = compress_round_trip(data, len, &elapsed);
+        if (plen < 0) {
+            printf("%-16s round trip failed\n", name);
+            ++failures;
+        } else {
+            printf("%-16s %8lu %8ld %5.0f%% %5ld>%-5ld %5ld>%-5ld "
+                   "%5ld>%-5ld %8.1f\n", name, (unsigned long)len, plen,
+                   (len > 0) ? plen * 100.0 / len : 0.0,
+                   messages(len, 64), messages(plen, hex_lettered),
+                   messages(len, base84), messages(plen, base84),
+                   messages(len, binary), messages(plen, binary),
+                   (elapsed > 0) ? len / elapsed : 0.0);
+        }
+        free(data);
+    }
+    printf("(messages sent without compression > with compression)\n");
+    return (failures == 0) ? 0 : 1;
+}
+
+/** Length of the blocks used in the fec benchmark, as in a PDU message */
+#define FEC_BENCH_LEN   133
+
+/** Encode a group with random data, lose some of its blocks at random,
+ *  and check that the data blocks are rebuilt.
+ *  @return zero if the group was rebuilt, non-zero otherwise.
+ */
+static int fec_round_trip(int k, int m, int lost)
+{
+    static BYTE data[FEC_MAX_BLOCKS][FEC_BENCH_LEN];
+    static BYTE rows[FEC_MAX_BLOCKS][FEC_BENCH_LEN];
+    static BYTE parity[FEC_MAX_BLOCKS][FEC_BENCH_LEN];
+    BYTE * row_ptrs[FEC_MAX_BLOCKS];
+    BYTE * parity_ptrs[FEC_MAX_BLOCKS];
+    const BYTE * received[FEC_MAX_BLOCKS];
+    int present[FEC_MAX_BLOCKS];
+    int i, j;
+
+    for (j = 0; j < m; ++j) {
+        memset(parity[j], 0, FEC_BENCH_LEN);
+        parity_ptrs[j] = parity[j];
+        received[j] = parity[j];
+    }
+    for (i = 0; i < k; ++i) {
+        for (j = 0; j < FEC_BENCH_LEN; ++j) {
+            data[i][j] = random();
+        }
+        FECAddBlock(m, i, data[i], FEC_BENCH_LEN, parity_ptrs);
+        memcpy(rows[i], data[i], FEC_BENCH_LEN);
+        row_ptrs[i] = rows[i];
+        present[i] = 1;
+    }
+    while (lost > 0) {
+        i = random() % (k + m);
+        if ((i < k) && present[i]) {
+            present[i] = 0;
+            memset(rows[i], 0xaa, FEC_BENCH_LEN);
+            --lost;
+        } else if ((i >= k) && (received[i - k] != NULL)) {
+            received[i - k] = NULL;
+            --lost;
+        }
+    }
+    if (FECRecover(k, m, row_ptrs, present, received, FEC_BENCH_LEN) != 0) {
+        return 1;
+    }
+    for (i = 0; i < k; ++i) {
+        if (memcmp(rows[i], data[i], FEC_BENCH_LEN) != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/** Get the chance that no more than m of n messages are lost, when each
+ *  is lost with probability p. */
+static double group_survives(int n, int m, double p)
+{
+    double total = 0;
+    double choose = 1;
+    int i;
+
+    for (i = 0; i <= m; ++i) {
+        total += choose * pow(p, i) * pow(1 - p, n - i);
+        choose = choose * (n - i) / (i + 1);
+    }
+    return total;
+}
+
+/** Check that groups are rebuilt from any k of their blocks, time the
+ *  parity code, and show how much more often a file arrives whole. */
+static int bench_fec(int argc, char ** argv)
+{
+    static const int shapes[][2] = {
+        { 1, 1 }, { 4, 2 }, { 10, 3 }, { 32, 4 }, { 100, 20 }, { 200, 56 }
+    };
+    static const double losses[] = { 0.01, 0.05, 0.10 };
+    static BYTE data[16][FEC_BENCH_LEN];
+    static BYTE parity[4][FEC_BENCH_LEN];
+    BYTE * parity_ptrs[4];
+    double start, elapsed;
+    int count = 20000;
+    int failures = 0;
+    int i, j, s;
+
+    if (argc > 1) {
+        count = atoi(argv[1]);
+    }
+    if (count < 1) {
+        return 1;
+    }
+
+    srandom(1);
+    for (s = 0; s < sizeof(shapes) / sizeof(shapes[0]); ++s) {
+        int k = shapes[s][0], m = shapes[s][1];
+
+        for (i = 0; i < 20; ++i) {
+            failures += fec_round_trip(k, m, i % (m + 1));
+        }
+        // Losing one more than the parity must be reported, not rebuilt
+        if (fec_round_trip(k, m, m + 1) == 0) {
+            ++failures;
+        }
+    }
+    printf("round trip checks: %d failures\n", failures);
+
+    for (j = 0; j < 4; ++j) {
+        parity_ptrs[j] = parity[j];
+    }
+    for (i = 0; i < 10; ++i) {
+        for (j = 0; j < FEC_BENCH_LEN; ++j) {
+            data[i][j] = random();
+        }
+    }
+    start = now_usec();
+    for (s = 0; s < count; ++s) {
+        for (i = 0; i < 10; ++i) {
+            FECAddBlock(3, i, data[i], FEC_BENCH_LEN, parity_ptrs);
+        }
+    }
+    elapsed = now_usec() - start;
+    printf("encode 10+3 groups of %d byte blocks: %.1f MB/s\n",
+           FEC_BENCH_LEN, count * 10.0 * FEC_BENCH_LEN / elapsed);
+    start = now_usec();
+    for (s = 0; s < count / 10; ++s) {
+        failures += fec_round_trip(10, 3, 3);
+    }
+    elapsed = now_usec() - start;
+    printf("encode and rebuild 3 of 10 blocks: %.1f us per group\n",
+           elapsed / (count / 10));
+
+    printf("\nchance a file of 100 blocks arrives whole\n");
+    printf("%-10s %10s %10s %10s %10s\n", "loss", "no parity", "10+1",
+           "10+2", "10+3");
+    for (i = 0; i < sizeof(losses) / sizeof(losses[0]); ++i) {
+        double p = losses[i];
+
+        printf("%9.0f%% %9.1f%%", p * 100, pow(1 - p, 100) * 100);
+        for (j = 1; j <= 3; ++j) {
+            printf(" %9.1f%%", pow(group_survives(10 + j, j, p), 10) * 100);
+        }
+        printf("\n");
+    }
+    return (failures == 0) ? 0 : 1;
+}
+
+/** Open a modem and set it up to send messages.
+ *  @return the port, or NULL if it could not be set up.
+ */
+static SerialPort * open_modem(const char * port)
+{
+    SerialPort * sp;
+
+    LOGInit(GWT_STDERR, GWL_WARNING, "gsmbench");
+    sp = SEROpenPort(port, B9600, NULL, NULL);
+    if (sp == NULL) {
+        fprintf(stderr, "Could not open %s\n", port);
+        return NULL;
+    }
+    GSMWakeUp(sp);
+    if (GSMSetup(sp, 0, 1) != 0) {
+        fprintf(stderr, "Could not set SMS mode\n");
+        SERClosePort(sp);
+        return NULL;
+    }
+    return sp;
+}
+
+/** Send a file of the given number of blocks, and return the messages
+ *  sent per minute, or a negative number if the file was not sent. */
+static double link_rate(SerialPort * sp, const char * filename, int blocks,
+                        int keep_link)
+{
+    GSMFileOptions options = { 0, ENC_HEX, 0, NULL, 0, 0, 0 };
+    double start, elapsed;
+
+    options.fo_keep_link = keep_link;
+    start = now_usec();
+    if (GSMSendFileOptions(sp, "0123", filename, &options) != 0) {
+        return -1;
+    }
+    elapsed = now_usec() - start;
+    return blocks * 60e6 / elapsed;
+}
+
+/** Compare the rate messages are sent at when the modem closes the link
+ *  to the network after each block of a file with the rate when AT+CMMS
+ *  keeps it open. This runs against a real modem or gsmsim, which should
+ *  be started with the time it takes to set up the link, eg
+ *  "gsmsim -l /tmp/gsm -m 200 -L 2000".
+ */
+static int bench_link(int argc, char ** argv)
+{
+    char filename[] = "/tmp/gsmbenchXXXXXX";
+    BYTE data[64];
+    SerialPort * sp;
+    double closed, kept = -1;
+    int blocks = 10;
+    int fd, i;
+
+    if (argc < 2) {
+        return 1;
+    }
+    if (argc > 2) {
+        blocks = atoi(argv[2]);
+    }
+    if (blocks < 2) {
+        return 1;
+    }
+
+    // Hex blocks carry 64 bytes each, so the file is exactly that many
+    if ((fd = mkstemp(filename)) == -1) {
+        perror("mkstemp");
+        return 1;
+    }
+    for (i = 0; i < blocks; ++i) {
+        memset(data, i, sizeof(data));
+        if (write(fd, data, sizeof(data)) != sizeof(data)) {
+            perror("write");
+            close(fd);
+            unlink(filename);
+            return 1;
+        }
+    }
+    close(fd);
+
+    if ((sp = open_modem(argv[1])) == NULL) {
+        unlink(filename);
+        return 1;
+    }
+
+    printf("%d blocks of a file\n", blocks);
+    printf("%-12s %10s\n", "link", "msgs/min");
+    closed = link_rate(sp, filename, blocks, 0);
+    if (closed >= 0) {
+        printf("%-12s %10.1f\n", "closed", closed);
+        kept = link_rate(sp, filename, blocks, 1);
+        if (kept >= 0) {
+            printf("%-12s %10.1f\n", "kept open", kept);
+        }
+    }
+
+    SERClosePort(sp);
+    unlink(filename);
+    return ((closed >= 0) && (kept >= 0)) ? 0 : 1;
+}
+
+/** Count the data and parity blocks recorded in a gsmsim outbox after
+ *  the given offset. Hex text never holds a tab, so each line with one
+ *  starts a message, and the first line of a parity block names its group
+ *  as "<first>/<k> <j>/<m>".
+ *  @return zero on success, non-zero if the outbox could not be read.
+ */
+static int count_blocks(const char * outbox, long offset, int * data,
+                        int * parity)
+{
+    char line[512];
+    FILE * fp;
+
+    *data = *parity = 0;
+    if ((fp = fopen(outbox, "r")) == NULL) {
+        perror(outbox);
+        return 1;
+    }
+    fseek(fp, offset, SEEK_SET);
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        char * text = strrchr(line, '\t');
+        unsigned int first, k, j, m;
+
+        if (text == NULL) {
+            continue;
+        }
+        if (sscanf(text + 1, "%*s %x/%x %x/%x", &first, &k, &j, &m) == 4) {
+            ++*parity;
+        } else {
+            ++*data;
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+/** Find the length of the gsmsim outbox, which does not exist until the
+ *  first message is sent. */
+static long outbox_size(const char * outbox)
+{
+    FILE * fp = fopen(outbox, "r");
+    long size;
+
+    if (fp == NULL) {
+        return 0;
+    }
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    fclose(fp);
+    return size;
+}
+
+/** Send a file with parity, and check from the gsmsim outbox that every
+ *  group, including a last one left short, is followed by its parity
+ *  blocks.
+ *  @return zero if the parity was all sent, non-zero otherwise.
+ */
+static int parity_check(SerialPort * sp, const char * filename,
+                        const char * outbox, int compress)
+{
+    GSMFileOptions options = { 0, ENC_HEX, 0, NULL, 3, 1, 1 };
+    long offset = outbox_size(outbox);
+    int data, parity;
+
+    options.fo_compress = compress;
+    if ((GSMSendFileOptions(sp, "0123", filename, &options) != 0) ||
+        (count_blocks(outbox, offset, &data, &parity) != 0)) {
+        return 1;
+    }
+    if (parity != (data + options.fo_group - 1) / options.fo_group *
+                  options.fo_parity) {
+        fprintf(stderr, "%d blocks sent with %d parity blocks\n", data,
+                parity);
+        return 1;
+    }
+    return 0;
+}
+
+/** Check that files of every length up to a limit are sent with all
+ *  their parity, plain and compressed. The lengths include exact
+ *  multiples of the block size, where the end of the file is only found
+ *  after the last block is read. This runs against gsmsim recording the
+ *  messages it is sent, eg "gsmsim -l /tmp/gsm -d 0 -m 0 -o /tmp/outbox".
+ */
+static int bench_parity(int argc, char ** argv)
+{
+    static BYTE data[SAMPLE_SIZE];
+    char filename[] = "/tmp/gsmbenchXXXXXX";
+    SerialPort * sp;
+    int max = 300;
+    int failures = 0;
+    int fd, len;
+
+    if (argc < 3) {
+        return 1;
+    }
+    if (argc > 3) {
+        max = atoi(argv[3]);
+    }
+    if ((max < 1) || (max > SAMPLE_SIZE)) {
+        return 1;
+    }
+    sample_log(data, sizeof(data));
+
+    if ((fd = mkstemp(filename)) == -1) {
+        perror("mkstemp");
+        return 1;
+    }
+    close(fd);
+    if ((sp = open_modem(argv[1])) == NULL) {
+        unlink(filename);
+        return 1;
+    }
+
+    for (len = 1; len <= max; ++len) {
+        FILE * fp = fopen(filename, "w");
+
+        if ((fp == NULL) || (fwrite(data, 1, len, fp) != (size_t)len) ||
+            (fclose(fp) != 0)) {
+            perror(filename);
+            ++failures;
+            break;
+        }
+        if (parity_check(sp, filename, argv[2], 0) != 0) {
+            fprintf(stderr, "Parity missing from %d byte file\n", len);
+            ++failures;
+        }
+        if (parity_check(sp, filename, argv[2], 1) != 0) {
+            fprintf(stderr, "Parity missing from %d byte compressed file\n",
+                    len);
+            ++failures;
+        }
+    }
+    printf("Files of 1 to %d bytes with parity: %d failures\n", max,
+           failures);
+
+    SERClosePort(sp);
+    unlink(filename);
+    return (failures == 0) ? 0 : 1;
+}
+
+static void usage(const char * prgname)
+{
+    fprintf(stderr, "Usage: %s <benchmark> ...\n\n", prgname);
+    fprintf(stderr, "     serial [trips [baud]]  compare serial read modes on a pty\n");
+    fprintf(stderr, "     echo <port> [count [length]]\n"
+                    "                            compare command latency with echo\n"
+                    "                            on and off, eg against gsmsim\n");
+    fprintf(stderr, "     classify [count]       time classification of modem lines\n");
+    fprintf(stderr, "     gsm7 [count]           check and time the GSM 7-bit alphabet\n");
+    fprintf(stderr, "     encode [count]         check and compare binary to text encodings\n");
+    fprintf(stderr, "     compress [file ...]    compare messages sent with and without\n"
+                    "                            compression, for files or samples\n");
+    fprintf(stderr, "     fec [count]            check and time parity blocks\n");
+    fprintf(stderr, "     parity <port> <outbox> [max]\n"
+                    "                            check parity is sent for files of every\n"
+                    "                            length up to max bytes, against gsmsim\n");
+    fprintf(stderr, "     link <port> [blocks]   compare messages sent with the link to\n"
+                    "                            the network closed and kept open\n\n");
+}
+
+int main(int argc, char ** argv)
+{
+    if (argc < 2) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (strcmp(argv[1], "serial") == 0) {
+        return bench_serial(argc - 1, argv + 1);
+    } else if (strcmp(argv[1], "echo") == 0) {
+        return bench_echo(argc - 1, argv + 1);
+    } else if (strcmp(argv[1], "classify") == 0) {
+        return bench_classify(argc - 1, argv + 1);
+    } else if (strcmp(argv[1], "gsm7") == 0) {
+        return bench_gsm7(argc - 1, argv + 1);
+    } else if (strcmp(argv[1], "encode") == 0) {
+        return bench_encode(argc - 1, argv + 1);
+    } else if (strcmp(argv[1], "compress") == 0) {
+        return bench_compress(argc - 1, argv + 1);
+    } else if (strcmp(argv[1], "fec") == 0) {
+        return bench_fec(argc - 1, argv + 1);
+    } else if (strcmp(argv[1], "link") == 0) {
+        return bench_link(argc - 1, argv + 1);
+    } else if (strcmp(argv[1], "parity") == 0) {
+        return bench_parity(argc - 1, argv + 1);
+    }
+
+    usage(argv[0]);
+    return 1;
+}
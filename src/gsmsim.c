@@ -0,0 +1,1173 @@
+/**
+ * Glacsweb gsmsim.c
+ * GSM modem simulator on a pseudo terminal
+ * Copyright (C) 2004 Alistair Riddoch, The University of Southampton
+ */
+
+/** \file
+ * A scriptable stand in for the GSM modem, so the code in gsm.c can be
+ * exercised and timed without a live SIM. It opens a pty, prints the
+ * name of the slave side, and answers the AT commands used by gsm.c
+ * on the master side. Response delays, jitter and faults can be
+ * configured so that error handling and timing can be tested, and
+ * changes in network state can be scheduled so that unsolicited
+ * result codes are sent.
+ */
+
+#include <sys/select.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <pty.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <termios.h>
+#include <unistd.h>
+
+#define debug(prg) { if (debug_flag) { prg } }
+
+static const int debug_flag = 0;
+
+/** Maximum number of scripted responses */
+#define MAX_SCRIPT 64
+
+/** Maximum length of a command line */
+#define MAX_CMDLINE 1024
+
+/** Maximum length of a message being entered after the prompt */
+#define MAX_MESSAGE 2048
+
+/** Maximum number of scheduled network state changes */
+#define MAX_EVENTS 32
+
+/** Maximum number of status reports waiting to be sent */
+#define MAX_REPORTS 256
+
+/** Outcomes of running a command */
+enum command_result {
+    /** The command failed, and ERROR should be sent */
+    CMD_ERROR = -1,
+    /** The command succeeded, and OK should be sent */
+    CMD_OK = 0,
+    /** Message entry has started, and the prompt should be sent */
+    CMD_PROMPT = 1,
+    /** The command failed, and the response holds its own final result */
+    CMD_FAILED = 2
+};
+
+/** A scripted response, which overrides the built in one. */
+typedef struct script_entry {
+    /** Command, without the AT prefix, which this entry answers */
+    char *      se_cmd;
+    /** Lines of the response, separated by '|' */
+    char *      se_response;
+} ScriptEntry;
+
+/** Network state values which can be changed by a scheduled event */
+enum event_field {
+    EV_CREG,
+    EV_CGREG,
+    EV_CSQ
+};
+
+/** A scheduled change in network state. */
+typedef struct event {
+    /** Milliseconds after the first command that the change happens */
+    long        ev_time;
+    /** Which value changes */
+    int         ev_field;
+    /** New value */
+    int         ev_value;
+} Event;
+
+/** A status report waiting to be sent. */
+typedef struct report {
+    /** Milliseconds after the first command that the report is sent */
+    long        r_time;
+    /** Reference of the message the report is for */
+    int         r_mr;
+    /** Status of the message, TP-ST */
+    int         r_status;
+    /** Recipient of the message, digits with an optional leading + */
+    char        r_dest[32];
+} Report;
+
+/** Percentage chances of the faults the simulator can inject. */
+typedef struct faults {
+    /** Chance of answering ERROR instead of the normal response */
+    int         f_error;
+    /** Chance of not answering at all */
+    int         f_drop;
+    /** Chance of corrupting one character of the response */
+    int         f_garble;
+    /** Chance of not sending the message prompt */
+    int         f_noprompt;
+    /** Chance of a message submission failing with +CMS ERROR */
+    int         f_cms;
+    /** Chance of a message being reported as not delivered */
+    int         f_undelivered;
+} Faults;
+
+/** State of the simulated modem. */
+typedef struct modem {
+    /** File descriptor of the master side of the pty */
+    int         m_fd;
+    /** Non-zero if commands are echoed */
+    int         m_echo;
+    /** SMS message format, 0 for PDU and 1 for text */
+    int         m_cmgf;
+    /** Unsolicited result mode for network registration */
+    int         m_creg_n;
+    /** Unsolicited result mode for GPRS registration */
+    int         m_cgreg_n;
+    /** Network registration status reported */
+    int         m_creg_stat;
+    /** GPRS registration status reported */
+    int         m_cgreg_stat;
+    /** Signal strength reported */
+    int         m_csq;
+    /** Non-zero if indicator events are reported with +CIEV */
+    int         m_cmer;
+    /** Non-zero if attached to GPRS */
+    int         m_cgatt;
+    /** Mode set with AT+CMMS for keeping the link open between messages */
+    int         m_cmms;
+    /** Time the link to the network closes, from event_clock(), or zero
+     *  if it is closed */
+    long        m_link_until;
+    /** First octet of messages submitted in text mode, set by AT+CSMP */
+    int         m_csmp_fo;
+    /** Routing of status reports set by AT+CNMI, 1 to send them as +CDS */
+    int         m_cnmi_ds;
+    /** Reference number of the next message submitted */
+    int         m_mr;
+    /** Non-zero while a message is being entered after the prompt */
+    int         m_entering;
+    /** Destination, or PDU length, of the message being entered */
+    char        m_dest[128];
+    /** Text of the message being entered */
+    char        m_message[MAX_MESSAGE];
+    int         m_msglen;
+    /** Command line being received */
+    char        m_cmdline[MAX_CMDLINE];
+    int         m_cmdlen;
+} Modem;
+
+static ScriptEntry script[MAX_SCRIPT];
+static int script_count = 0;
+static Event events[MAX_EVENTS];
+static int event_count = 0;
+/** Index of the next event to happen */
+static int event_next = 0;
+/** Time of the first command, from which events are scheduled */
+static struct timeval event_start;
+/** Non-zero once the first command has arrived */
+static int event_started = 0;
+/** Status reports waiting to be sent, in time order */
+static Report reports[MAX_REPORTS];
+static int report_count = 0;
+static Faults faults = { 0, 0, 0, 0, 0, 0 };
+
+/** Delay before each response, in milliseconds */
+static int option_delay = 20;
+/** Maximum random extra delay before each response, in milliseconds */
+static int option_jitter = 0;
+/** Time taken to submit a message to the network, in milliseconds */
+static int option_send_delay = 500;
+/** Time taken to set up the link to the network before a message can be
+ *  submitted, in milliseconds, unless AT+CMMS kept it open */
+static int option_link_delay = 0;
+/** Time the link is kept open after a message with AT+CMMS, in
+ *  milliseconds */
+#define LINK_TIMEOUT    5000
+/** Time from submitting a message to its status report, in
+ *  milliseconds */
+static int option_report_delay = 2000;
+/** Baud rate at which responses are paced, or zero for no pacing */
+static int option_baud = 0;
+/** File which submitted messages are appended to, if any */
+static const char * option_outbox = NULL;
+/** Non-zero to log commands and responses to stderr */
+static int option_verbose = 0;
+/** Non-zero to reject lines holding more than one command */
+static int option_single = 0;
+
+/** Return non-zero with the given percentage chance. */
+static int chance(int percent)
+{
+    return (percent > 0) && ((rand() % 100) < percent);
+}
+
+/** Sleep for the configured response delay plus jitter. */
+static void response_delay(int base)
+{
+    int ms = base;
+
+    if (option_jitter > 0) {
+        ms += rand() % (option_jitter + 1);
+    }
+    if (ms > 0) {
+        usleep(ms * 1000);
+    }
+}
+
+/** Write bytes to the modem side of the pty, paced to the baud rate. */
+static void put_bytes(Modem * m, const char * data, size_t len)
+{
+    if (option_baud > 0) {
+        useconds_t byte_usec = 10000000 / option_baud;
+        size_t i;
+
+        for (i = 0; i < len; ++i) {
+            write(m->m_fd, &data[i], 1);
+            usleep(byte_usec);
+        }
+    } else {
+        while (len > 0) {
+            ssize_t done = write(m->m_fd, data, len);
+
+            if (done <= 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return;
+            }
+            data += done;
+            len -= done;
+        }
+    }
+}
+
+/** Send a complete response, applying any garbling fault. */
+static void put_response(Modem * m, char * response)
+{
+    size_t len = strlen(response);
+
+    if ((len > 0) && chance(faults.f_garble)) {
+        size_t i = rand() % len;
+
+        response[i] = (response[i] == 'X') ? 'Y' : 'X';
+    }
+    if (option_verbose) {
+        fprintf(stderr, "gsmsim: <- %zu bytes\n", len);
+    }
+    put_bytes(m, response, len);
+}
+
+/** Append a line of information response to a response buffer. */
+static void add_line(char * response, size_t size, const char * line)
+{
+    size_t len = strlen(response);
+
+    snprintf(response + len, size - len, "\r\n%s\r\n", line);
+}
+
+/** Signal level reported by +CIND and +CIEV for a +CSQ value. */
+static int signal_level(int csq)
+{
+    if (csq == 99) {
+        return 0;
+    }
+    return (csq / 6 > 5) ? 5 : csq / 6;
+}
+
+/** Send an unsolicited result code. */
+static void put_urc(Modem * m, const char * line)
+{
+    char response[256];
+
+    response[0] = 0;
+    add_line(response, sizeof(response), line);
+    if (option_verbose) {
+        fprintf(stderr, "gsmsim: <- %s\n", line);
+    }
+    put_bytes(m, response, strlen(response));
+}
+
+/** Send a registration status report, if enabled, in the form given by
+ *  the unsolicited result mode.
+ */
+static void put_registration(Modem * m, const char * name, int mode, int stat)
+{
+    char line[64];
+
+    if (mode == 1) {
+        snprintf(line, sizeof(line), "+%s: %d", name, stat);
+    } else if (mode == 2) {
+        snprintf(line, sizeof(line), "+%s: %d,\"00A1\",\"1B2C\"", name, stat);
+    } else {
+        return;
+    }
+    put_urc(m, line);
+}
+
+/** Make a scheduled change in network state, and report it. */
+static void apply_event(Modem * m, const Event * ev)
+{
+    char line[64];
+    int level;
+
+    switch (ev->ev_field) {
+        case EV_CREG:
+            if (m->m_creg_stat != ev->ev_value) {
+                m->m_creg_stat = ev->ev_value;
+                put_registration(m, "CREG", m->m_creg_n, m->m_creg_stat);
+            }
+            break;
+        case EV_CGREG:
+            if (m->m_cgreg_stat != ev->ev_value) {
+                m->m_cgreg_stat = ev->ev_value;
+                put_registration(m, "CGREG", m->m_cgreg_n, m->m_cgreg_stat);
+            }
+            break;
+        case EV_CSQ:
+            level = signal_level(m->m_csq);
+            m->m_csq = ev->ev_value;
+            if (m->m_cmer && (signal_level(m->m_csq) != level)) {
+                snprintf(line, sizeof(line), "+CIEV: 2,%d",
+                         signal_level(m->m_csq));
+                put_urc(m, line);
+            }
+            break;
+    }
+}
+
+/** Milliseconds since the first command. */
+static long event_clock(void)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - event_start.tv_sec) * 1000 +
+           (now.tv_usec - event_start.tv_usec) / 1000;
+}
+
+/** Make any scheduled changes which are due.
+ *  @return milliseconds until the next change, or -1 if none are left.
+ */
+static long run_events(Modem * m)
+{
+    long now;
+
+    if (!event_started || (event_next >= event_count)) {
+        return -1;
+    }
+    now = event_clock();
+    // Reports are held back while a message is being entered
+    while (!m->m_entering && (event_next < event_count) &&
+           (events[event_next].ev_time <= now)) {
+        apply_event(m, &events[event_next++]);
+    }
+    if (event_next >= event_count) {
+        return -1;
+    }
+    if (m->m_entering) {
+        return 100;
+    }
+    return events[event_next].ev_time - now;
+}
+
+/** Send a status report as +CDS, in the form for the message format.
+ *  In text mode the report is given in full on one line, and in PDU mode
+ *  the line gives the length of the PDU, which follows on the next.
+ */
+static void put_report(Modem * m, const Report * r)
+{
+    const char * dest = r->r_dest;
+    char line[256];
+    int toa = 129;
+    int len;
+
+    if (*dest == '+') {
+        ++dest;
+        toa = 145;
+    }
+    if (m->m_cmgf) {
+        snprintf(line, sizeof(line), "\r\n+CDS: 6,%d,\"%s\",%d,"
+                 "\"04/10/16,12:00:00+00\",\"04/10/16,12:00:02+00\",%d\r\n",
+                 r->r_mr, r->r_dest, toa, r->r_status);
+    } else {
+        char pdu[128];
+        size_t digits = strlen(dest);
+        size_t i;
+
+        // Address and the two times, which are 7 octets each
+        len = snprintf(pdu, sizeof(pdu), "0006%02X%02X%02X", r->r_mr,
+                       (int)digits, toa);
+        for (i = 0; i < digits; i += 2) {
+            len += snprintf(pdu + len, sizeof(pdu) - len, "%c%c",
+                            (i + 1 < digits) ? dest[i + 1] : 'F', dest[i]);
+        }
+        len += snprintf(pdu + len, sizeof(pdu) - len, "40016121000000"
+                        "40016121002000%02X", r->r_status);
+        snprintf(line, sizeof(line), "\r\n+CDS: %d\r\n%s\r\n",
+                 len / 2 - 1, pdu);
+    }
+    if (option_verbose) {
+        fprintf(stderr, "gsmsim: <- report for %d\n", r->r_mr);
+    }
+    put_bytes(m, line, strlen(line));
+}
+
+/** Get the recipient of a message entered in PDU mode, from the
+ *  destination address of the SMS-SUBMIT.
+ *  @param dest buffer for the digits, with a leading + if international.
+ */
+static void pdu_dest(const Modem * m, char * dest, size_t size)
+{
+    unsigned int sca, digits, toa;
+    const char * p;
+    size_t len = 0;
+    size_t i;
+
+    dest[0] = 0;
+    if ((sscanf(m->m_message, "%2x", &sca) != 1) ||
+        (m->m_msglen < (int)(2 * sca + 10))) {
+        return;
+    }
+    // Skip the service centre, the first octet and the reference
+    p = m->m_message + 2 + 2 * sca + 4;
+    if ((sscanf(p, "%2x%2x", &digits, &toa) != 2) ||
+        (digits + 2 > size) ||
+        (p + 4 + ((digits + 1) & ~1u) > m->m_message + m->m_msglen)) {
+        return;
+    }
+    p += 4;
+    if (toa == 0x91) {
+        dest[len++] = '+';
+    }
+    for (i = 0; i < digits; ++i) {
+        dest[len++] = p[i ^ 1];
+    }
+    dest[len] = 0;
+}
+
+/** Queue a status report for a message just submitted, if one was
+ *  requested and status reports are passed on with +CDS. */
+static void queue_report(Modem * m)
+{
+    Report * r;
+    int fo = m->m_csmp_fo;
+
+    if (m->m_cmgf == 0) {
+        unsigned int sca, octet;
+
+        if ((sscanf(m->m_message, "%2x", &sca) != 1) ||
+            (sscanf(m->m_message + 2 + 2 * sca, "%2x", &octet) != 1)) {
+            return;
+        }
+        fo = octet;
+    }
+    if (((fo & 0x20) == 0) || (m->m_cnmi_ds != 1) ||
+        (report_count == MAX_REPORTS)) {
+        return;
+    }
+    r = &reports[report_count++];
+    r->r_time = event_clock() + option_report_delay;
+    r->r_mr = m->m_mr;
+    // 0x00 is delivered, and 0x41 is incompatible destination
+    r->r_status = chance(faults.f_undelivered) ? 0x41 : 0x00;
+    if (m->m_cmgf) {
+        snprintf(r->r_dest, sizeof(r->r_dest), "%.*s",
+                 (int)strcspn(m->m_dest + (m->m_dest[0] == '"'), "\","),
+                 m->m_dest + (m->m_dest[0] == '"'));
+    } else {
+        pdu_dest(m, r->r_dest, sizeof(r->r_dest));
+    }
+}
+
+/** Send any status reports which are due.
+ *  @return milliseconds until the next report, or -1 if none are left.
+ */
+static long run_reports(Modem * m)
+{
+    long now;
+    int sent = 0;
+
+    if (report_count == 0) {
+        return -1;
+    }
+    // Reports are held back while a message is being entered
+    if (m->m_entering) {
+        return 100;
+    }
+    now = event_clock();
+    while ((sent < report_count) && (reports[sent].r_time <= now)) {
+        put_report(m, &reports[sent++]);
+    }
+    report_count -= sent;
+    memmove(reports, reports + sent, report_count * sizeof(Report));
+    if (report_count == 0) {
+        return -1;
+    }
+    return reports[0].r_time - now;
+}
+
+/** Record a submitted message in the outbox file. */
+static void record_message(Modem * m)
+{
+    FILE * fp;
+
+    if (option_outbox == NULL) {
+        return;
+    }
+    fp = fopen(option_outbox, "a");
+    if (fp == NULL) {
+        perror(option_outbox);
+        return;
+    }
+    fprintf(fp, "%d\t%s\t%s\t", m->m_mr, m->m_cmgf ? "text" : "pdu",
+            m->m_dest);
+    fwrite(m->m_message, 1, m->m_msglen, fp);
+    fputc('\n', fp);
+    fclose(fp);
+}
+
+/** Look for a scripted response to a command. */
+static ScriptEntry * find_script(const char * cmd)
+{
+    int i;
+
+    for (i = 0; i < script_count; ++i) {
+        if (strcasecmp(script[i].se_cmd, cmd) == 0) {
+            return &script[i];
+        }
+    }
+    return NULL;
+}
+
+/** Work out the response to one command.
+ *  @param m modem state.
+ *  @param cmd command, without the AT prefix.
+ *  @param response buffer to which the information response is added.
+ *  @param size size of the response buffer.
+ *  @return one of the command_result values.
+ */
+static int run_command(Modem * m, const char * cmd, char * response,
+                       size_t size)
+{
+    ScriptEntry * se = find_script(cmd);
+    char line[256];
+    int value;
+
+    if (se != NULL) {
+        const char * start = se->se_response;
+
+        // The last part of the script is the final result
+        for (;;) {
+            const char * bar = strchr(start, '|');
+
+            if (bar == NULL) {
+                return (strcmp(start, "OK") == 0) ? CMD_OK : CMD_ERROR;
+            }
+            snprintf(line, sizeof(line), "%.*s", (int)(bar - start), start);
+            add_line(response, size, line);
+            start = bar + 1;
+        }
+    }
+
+    if (*cmd == 0) {
+        return CMD_OK;
+    } else if ((strcasecmp(cmd, "E0") == 0) || (strcasecmp(cmd, "E1") == 0)) {
+        m->m_echo = cmd[1] - '0';
+        return CMD_OK;
+    } else if ((strcasecmp(cmd, "Z") == 0) || (strcasecmp(cmd, "&F") == 0)) {
+        m->m_echo = 1;
+        return CMD_OK;
+    } else if (strcasecmp(cmd, "+CREG?") == 0) {
+        if (m->m_creg_n == 2) {
+            snprintf(line, sizeof(line), "+CREG: %d,%d,\"00A1\",\"1B2C\"",
+                     m->m_creg_n, m->m_creg_stat);
+        } else {
+            snprintf(line, sizeof(line), "+CREG: %d,%d", m->m_creg_n,
+                     m->m_creg_stat);
+        }
+        add_line(response, size, line);
+        return CMD_OK;
+    } else if (sscanf(cmd, "+CREG=%d", &value) == 1) {
+        if ((value < 0) || (value > 2)) {
+            return CMD_ERROR;
+        }
+        m->m_creg_n = value;
+        return CMD_OK;
+    } else if (strcasecmp(cmd, "+CGREG?") == 0) {
+        snprintf(line, sizeof(line), "+CGREG: %d,%d", m->m_cgreg_n,
+                 m->m_cgreg_stat);
+        add_line(response, size, line);
+        return CMD_OK;
+    } else if (sscanf(cmd, "+CGREG=%d", &value) == 1) {
+        if ((value < 0) || (value > 2)) {
+            return CMD_ERROR;
+        }
+        m->m_cgreg_n = value;
+        return CMD_OK;
+    } else if (strcasecmp(cmd, "+CSQ") == 0) {
+        snprintf(line, sizeof(line), "+CSQ: %d,99", m->m_csq);
+        add_line(response, size, line);
+        return CMD_OK;
+    } else if (strcasecmp(cmd, "+CIND=?") == 0) {
+        add_line(response, size, "+CIND: (\"battchg\",(0-5)),"
+                 "(\"signal\",(0-5)),(\"service\",(0-1))");
+        return CMD_OK;
+    } else if (strcasecmp(cmd, "+CIND?") == 0) {
+        snprintf(line, sizeof(line), "+CIND: 5,%d,%d", signal_level(m->m_csq),
+                 (m->m_creg_stat == 1) || (m->m_creg_stat == 5));
+        add_line(response, size, line);
+        return CMD_OK;
+    } else if (strncasecmp(cmd, "+CMER=", 6) == 0) {
+        int mode, keyp, disp, ind;
+
+        if (sscanf(cmd + 6, "%d,%d,%d,%d", &mode, &keyp, &disp, &ind) != 4) {
+            return CMD_ERROR;
+        }
+        m->m_cmer = (mode == 3) && (ind == 1);
+        return CMD_OK;
+    } else if (strcasecmp(cmd, "+CMGF?") == 0) {
+        snprintf(line, sizeof(line), "+CMGF: %d", m->m_cmgf);
+        add_line(response, size, line);
+        return CMD_OK;
+    } else if (sscanf(cmd, "+CMGF=%d", &value) == 1) {
+        if ((value < 0) || (value > 1)) {
+            return CMD_ERROR;
+        }
+        m->m_cmgf = value;
+        return CMD_OK;
+    } else if (strncasecmp(cmd, "+CSMP=", 6) == 0) {
+        if ((sscanf(cmd + 6, "%d", &value) != 1) || (value < 0) ||
+            (value > 255)) {
+            return CMD_ERROR;
+        }
+        m->m_csmp_fo = value;
+        return CMD_OK;
+    } else if (strncasecmp(cmd, "+CNMI=", 6) == 0) {
+        int mode, mt, bm, ds;
+
+        if ((sscanf(cmd + 6, "%d,%d,%d,%d", &mode, &mt, &bm, &ds) != 4) ||
+            (ds < 0) || (ds > 2)) {
+            return CMD_ERROR;
+        }
+        m->m_cnmi_ds = ds;
+        return CMD_OK;
+    } else if (strcasecmp(cmd, "+CMMS?") == 0) {
+        snprintf(line, sizeof(line), "+CMMS: %d", m->m_cmms);
+        add_line(response, size, line);
+        return CMD_OK;
+    } else if (sscanf(cmd, "+CMMS=%d", &value) == 1) {
+        if ((value < 0) || (value > 2)) {
+            return CMD_ERROR;
+        }
+        m->m_cmms = value;
+        if (value == 0) {
+            m->m_link_until = 0;
+        }
+        return CMD_OK;
+    } else if (strncasecmp(cmd, "+CMGS=", 6) == 0) {
+        if ((m->m_creg_stat != 1) && (m->m_creg_stat != 5)) {
+            add_line(response, size, "+CMS ERROR: 331");
+            return CMD_FAILED;
+        }
+        snprintf(m->m_dest, sizeof(m->m_dest), "%s", cmd + 6);
+        m->m_entering = 1;
+        m->m_msglen = 0;
+        return CMD_PROMPT;
+    } else if (strcasecmp(cmd, "+CGATT?") == 0) {
+        snprintf(line, sizeof(line), "+CGATT: %d", m->m_cgatt);
+        add_line(response, size, line);
+        return CMD_OK;
+    } else if (sscanf(cmd, "+CGATT=%d", &value) == 1) {
+        if ((value < 0) || (value > 1)) {
+            return CMD_ERROR;
+        }
+        m->m_cgatt = value;
+        if (value && (m->m_cgreg_stat == 0)) {
+            m->m_cgreg_stat = 1;
+        }
+        return CMD_OK;
+    }
+    return CMD_ERROR;
+}
+
+/** Run the commands on a command line, which may hold several, such as
+ *  "E1+CMGF=1" or "+CREG?;+CSQ". Basic commands are a letter, or '&' and
+ *  a letter, followed by digits. Extended commands run to the next ';'.
+ *  Running stops at the first command which does not succeed.
+ *  @param m modem state.
+ *  @param line command line, without the AT prefix.
+ *  @param response buffer to which the information responses are added.
+ *  @param size size of the response buffer.
+ *  @return one of the command_result values.
+ */
+static int run_line(Modem * m, const char * line, char * response,
+                    size_t size)
+{
+    char cmd[MAX_CMDLINE];
+    int ret = CMD_OK;
+
+    if ((*line == 0) || (find_script(line) != NULL)) {
+        return run_command(m, line, response, size);
+    }
+    while ((*line != 0) && (ret == CMD_OK)) {
+        size_t len;
+
+        if (*line == ';') {
+            ++line;
+            continue;
+        }
+        if (isalpha((unsigned char)*line) || (*line == '&')) {
+            len = (*line == '&') ? 2 : 1;
+            while (isdigit((unsigned char)line[len])) {
+                ++len;
+            }
+        } else {
+            len = strcspn(line, ";");
+        }
+        snprintf(cmd, sizeof(cmd), "%.*s", (int)len, line);
+        line += strlen(cmd);
+        if (option_single && (*line != 0)) {
+            return CMD_ERROR;
+        }
+        ret = run_command(m, cmd, response, size);
+        if ((ret == CMD_PROMPT) && (*line != 0)) {
+            // Message entry must end the line
+            m->m_entering = 0;
+            ret = CMD_ERROR;
+        }
+    }
+    return ret;
+}
+
+/** Handle a complete command line received from the client. */
+static void handle_line(Modem * m, char * cmdline)
+{
+    char response[2048];
+    int ret;
+
+    // Strip any leading noise, such as stray line feeds
+    while ((*cmdline != 0) && isspace((unsigned char)*cmdline)) {
+        ++cmdline;
+    }
+    if (*cmdline == 0) {
+        return;
+    }
+    if (option_verbose) {
+        fprintf(stderr, "gsmsim: -> %s\n", cmdline);
+    }
+    if (strncasecmp(cmdline, "AT", 2) != 0) {
+        return;
+    }
+    if (!event_started) {
+        gettimeofday(&event_start, NULL);
+        event_started = 1;
+    }
+
+    response[0] = 0;
+    ret = run_line(m, cmdline + 2, response, sizeof(response));
+
+    response_delay(option_delay);
+
+    if (chance(faults.f_drop)) {
+        debug( fprintf(stderr, "Dropping response\n"); );
+        m->m_entering = 0;
+        return;
+    }
+    if (ret == CMD_PROMPT) {
+        if (!chance(faults.f_noprompt)) {
+            put_bytes(m, "\r\n> ", 4);
+        }
+        return;
+    }
+    if (ret == CMD_FAILED) {
+        // A failure with its own final result already in the response
+        put_response(m, response);
+        return;
+    }
+    if (ret != CMD_OK) {
+        // The commands before the one which failed have already answered
+        add_line(response, sizeof(response), "ERROR");
+    } else if (chance(faults.f_error)) {
+        response[0] = 0;
+        add_line(response, sizeof(response), "ERROR");
+    } else {
+        add_line(response, sizeof(response), "OK");
+    }
+    put_response(m, response);
+}
+
+/** Check that a message entered in PDU mode is hex text, with the
+ *  length given to AT+CMGS, which does not count the service centre
+ *  address.
+ *  @return non-zero if the PDU is acceptable.
+ */
+static int check_pdu(const Modem * m)
+{
+    int i, sca;
+
+    if ((m->m_msglen < 2) || ((m->m_msglen % 2) != 0)) {
+        return 0;
+    }
+    for (i = 0; i < m->m_msglen; ++i) {
+        if (!isxdigit((unsigned char)m->m_message[i])) {
+            return 0;
+        }
+    }
+    if (sscanf(m->m_message, "%2x", &sca) != 1) {
+        return 0;
+    }
+    return (m->m_msglen / 2 - 1 - sca) == atoi(m->m_dest);
+}
+
+/** Handle the end of message entry. */
+static void handle_message(Modem * m, int submit)
+{
+    char response[256];
+    char line[64];
+
+    m->m_entering = 0;
+    response[0] = 0;
+
+    if (!submit) {
+        // Message cancelled with ESC
+        add_line(response, sizeof(response), "OK");
+        put_response(m, response);
+        return;
+    }
+
+    // Mode 1 lapses once the link has timed out, while 2 only lets it close
+    if ((m->m_link_until != 0) && (event_clock() >= m->m_link_until)) {
+        m->m_link_until = 0;
+        if (m->m_cmms == 1) {
+            m->m_cmms = 0;
+        }
+    }
+    if (m->m_link_until == 0) {
+        response_delay(option_send_delay + option_link_delay);
+    } else {
+        response_delay(option_send_delay);
+    }
+    m->m_link_until = (m->m_cmms != 0) ? event_clock() + LINK_TIMEOUT : 0;
+
+    if (chance(faults.f_cms)) {
+        add_line(response, sizeof(response), "+CMS ERROR: 500");
+    } else if ((m->m_cmgf == 0) && !check_pdu(m)) {
+        // Invalid PDU mode parameter
+        add_line(response, sizeof(response), "+CMS ERROR: 304");
+    } else {
+        record_message(m);
+        queue_report(m);
+        snprintf(line, sizeof(line), "+CMGS: %d", m->m_mr);
+        m->m_mr = (m->m_mr + 1) % 256;
+        add_line(response, sizeof(response), line);
+        add_line(response, sizeof(response), "OK");
+    }
+    put_response(m, response);
+}
+
+/** Handle a chunk of bytes received from the client. */
+static void handle_input(Modem * m, const char * data, size_t len)
+{
+    size_t i;
+
+    if (m->m_echo) {
+        put_bytes(m, data, len);
+    }
+
+    for (i = 0; i < len; ++i) {
+        char c = data[i];
+
+        if (m->m_entering) {
+            if (c == 0x1a) {
+                handle_message(m, 1);
+            } else if (c == 0x1b) {
+                handle_message(m, 0);
+            } else if (m->m_msglen < MAX_MESSAGE - 1) {
+                m->m_message[m->m_msglen++] = c;
+            }
+        } else if (c == '\r') {
+            m->m_cmdline[m->m_cmdlen] = 0;
+            m->m_cmdlen = 0;
+            handle_line(m, m->m_cmdline);
+        } else if (c == '\n') {
+            continue;
+        } else if (m->m_cmdlen < MAX_CMDLINE - 1) {
+            m->m_cmdline[m->m_cmdlen++] = c;
+        }
+    }
+}
+
+/** Unescape \r, \n and \\ in a scripted response, in place. */
+static void unescape(char * s)
+{
+    char * out = s;
+
+    while (*s != 0) {
+        if ((s[0] == '\\') && (s[1] != 0)) {
+            ++s;
+            *out++ = (*s == 'r') ? '\r' : (*s == 'n') ? '\n' : *s;
+            ++s;
+        } else {
+            *out++ = *s++;
+        }
+    }
+    *out = 0;
+}
+
+/** Load scripted responses from a file. Each line holds a command,
+ *  without the AT prefix, a tab, and the response lines separated by
+ *  '|'. The last part of the response is the final result.
+ */
+static int load_script(const char * filename)
+{
+    char buf[1024];
+    FILE * fp = fopen(filename, "r");
+
+    if (fp == NULL) {
+        perror(filename);
+        return 1;
+    }
+    while (fgets(buf, sizeof(buf), fp) != NULL) {
+        char * tab;
+
+        buf[strcspn(buf, "\r\n")] = 0;
+        if ((buf[0] == '#') || (buf[0] == 0)) {
+            continue;
+        }
+        tab = strchr(buf, '\t');
+        if ((tab == NULL) || (script_count == MAX_SCRIPT)) {
+            fprintf(stderr, "Bad script line: %s\n", buf);
+            continue;
+        }
+        *tab = 0;
+        unescape(tab + 1);
+        script[script_count].se_cmd = strdup(buf);
+        script[script_count].se_response = strdup(tab + 1);
+        ++script_count;
+    }
+    fclose(fp);
+    return 0;
+}
+
+/** Parse a fault specification such as "error=5,drop=1". */
+static int parse_faults(char * spec)
+{
+    char * item;
+
+    for (item = strtok(spec, ","); item != NULL; item = strtok(NULL, ",")) {
+        char name[32];
+        int percent;
+
+        if (sscanf(item, "%31[a-z]=%d", name, &percent) != 2) {
+            return 1;
+        }
+        if (strcmp(name, "error") == 0) {
+            faults.f_error = percent;
+        } else if (strcmp(name, "drop") == 0) {
+            faults.f_drop = percent;
+        } else if (strcmp(name, "garble") == 0) {
+            faults.f_garble = percent;
+        } else if (strcmp(name, "noprompt") == 0) {
+            faults.f_noprompt = percent;
+        } else if (strcmp(name, "cms") == 0) {
+            faults.f_cms = percent;
+        } else if (strcmp(name, "undelivered") == 0) {
+            faults.f_undelivered = percent;
+        } else {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/** Parse an event schedule such as "3000:creg=1,5000:csq=4". */
+static int parse_events(char * spec)
+{
+    char * item;
+
+    for (item = strtok(spec, ","); item != NULL; item = strtok(NULL, ",")) {
+        char name[32];
+        long time;
+        int value;
+        Event * ev;
+
+        if ((sscanf(item, "%ld:%31[a-z]=%d", &time, name, &value) != 3) ||
+            (event_count == MAX_EVENTS)) {
+            return 1;
+        }
+        ev = &events[event_count];
+        if (strcmp(name, "creg") == 0) {
+            ev->ev_field = EV_CREG;
+        } else if (strcmp(name, "cgreg") == 0) {
+            ev->ev_field = EV_CGREG;
+        } else if (strcmp(name, "csq") == 0) {
+            ev->ev_field = EV_CSQ;
+        } else {
+            return 1;
+        }
+        ev->ev_time = time;
+        ev->ev_value = value;
+        // Keep the schedule in time order
+        while ((ev > events) && (ev[-1].ev_time > ev->ev_time)) {
+            Event tmp = ev[-1];
+
+            ev[-1] = *ev;
+            *ev = tmp;
+            --ev;
+        }
+        ++event_count;
+    }
+    return 0;
+}
+
+static void usage(const char * prgname)
+{
+    fprintf(stderr, "Usage: %s [options]\n\n", prgname);
+    fprintf(stderr, "  -l <link>         make a symlink to the pty slave\n");
+    fprintf(stderr, "  -d <ms>           delay before each response [20]\n");
+    fprintf(stderr, "  -j <ms>           maximum random extra delay [0]\n");
+    fprintf(stderr, "  -m <ms>           time taken to submit a message [500]\n");
+    fprintf(stderr, "  -L <ms>           time taken to set up the link to the network\n"
+                    "                    for a message, unless AT+CMMS kept it open [0]\n");
+    fprintf(stderr, "  -R <ms>           time until the status report of a message\n"
+                    "                    which asked for one [2000]\n");
+    fprintf(stderr, "  -b <baud>         pace responses at this baud rate\n");
+    fprintf(stderr, "  -r <stat>         network registration status [1]\n");
+    fprintf(stderr, "  -g <stat>         GPRS registration status [0]\n");
+    fprintf(stderr, "  -q <csq>          signal strength [20]\n");
+    fprintf(stderr, "  -f <faults>       percentage chance of faults, eg\n"
+                    "                    error=5,drop=1,garble=1,noprompt=2,cms=5,\n"
+                    "                    undelivered=5\n");
+    fprintf(stderr, "  -e <events>       changes in network state, in ms after the\n"
+                    "                    first command, eg 3000:creg=1,5000:csq=4\n");
+    fprintf(stderr, "  -s <script>       file of scripted responses\n");
+    fprintf(stderr, "  -o <outbox>       append submitted messages to a file\n");
+    fprintf(stderr, "  -S <seed>         random seed, for repeatable runs\n");
+    fprintf(stderr, "  -1                accept only one command per line\n");
+    fprintf(stderr, "  -v                log commands to stderr\n\n");
+}
+
+int main(int argc, char ** argv)
+{
+    const char * option_link = NULL;
+    struct termios term;
+    char ptyname[64];
+    Modem m;
+    int slave;
+
+    memset(&m, 0, sizeof(m));
+    m.m_echo = 1;
+    m.m_creg_stat = 1;
+    m.m_csq = 20;
+    m.m_csmp_fo = 17;
+    srand(getpid());
+
+    while (1) {
+        int c = getopt(argc, argv, "l:d:j:m:L:R:b:r:g:q:f:e:s:o:S:1v");
+        if (c == -1) {
+            break;
+        } else if (c == 'l') {
+            option_link = optarg;
+        } else if (c == 'd') {
+            option_delay = atoi(optarg);
+        } else if (c == 'j') {
+            option_jitter = atoi(optarg);
+        } else if (c == 'm') {
+            option_send_delay = atoi(optarg);
+        } else if (c == 'L') {
+            option_link_delay = atoi(optarg);
+        } else if (c == 'R') {
+            option_report_delay = atoi(optarg);
+        } else if (c == 'b') {
+            option_baud = atoi(optarg);
+        } else if (c == 'r') {
+            m.m_creg_stat = atoi(optarg);
+        } else if (c == 'g') {
+            m.m_cgreg_stat = atoi(optarg);
+        } else if (c == 'q') {
+            m.m_csq = atoi(optarg);
+        } else if (c == 'f') {
+            if (parse_faults(optarg) != 0) {
+                fprintf(stderr, "Bad fault specification\n");
+                return 1;
+            }
+        } else if (c == 'e') {
+            if (parse_events(optarg) != 0) {
+                fprintf(stderr, "Bad event specification\n");
+                return 1;
+            }
+        } else if (c == 's') {
+            if (load_script(optarg) != 0) {
+                return 1;
+            }
+        } else if (c == 'o') {
+            option_outbox = optarg;
+        } else if (c == 'S') {
+            srand(atoi(optarg));
+        } else if (c == '1') {
+            option_single = 1;
+        } else if (c == 'v') {
+            option_verbose = 1;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    // The slave starts raw, so nothing is echoed by the line discipline
+    // before a client has set it up.
+    memset(&term, 0, sizeof(term));
+    cfmakeraw(&term);
+    if (openpty(&m.m_fd, &slave, ptyname, &term, NULL) != 0) {
+        perror("openpty");
+        return 1;
+    }
+    // slave is kept open, so the master does not see a hangup each time
+    // a client closes the port.
+
+    if (option_link != NULL) {
+        unlink(option_link);
+        if (symlink(ptyname, option_link) != 0) {
+            perror(option_link);
+            return 1;
+        }
+    }
+
+    printf("%s\n", ptyname);
+    fflush(stdout);
+
+    for (;;) {
+        char buf[512];
+        struct timeval tv;
+        fd_set fds;
+        long wait = run_events(&m);
+        long report_wait = run_reports(&m);
+        ssize_t len;
+
+        if ((wait < 0) || ((report_wait >= 0) && (report_wait < wait))) {
+            wait = report_wait;
+        }
+
+        FD_ZERO(&fds);
+        FD_SET(m.m_fd, &fds);
+        tv.tv_sec = wait / 1000;
+        tv.tv_usec = (wait % 1000) * 1000;
+        if (select(m.m_fd + 1, &fds, NULL, NULL,
+                   (wait < 0) ? NULL : &tv) < 1) {
+            continue;
+        }
+        len = read(m.m_fd, buf, sizeof(buf));
+
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("read");
+            return 1;
+        }
+        handle_input(&m, buf, len);
+    }
+    return 0;
+}
@@ -0,0 +1,275 @@
+/**
+ * Glacsweb gwcapdump.c
+ * convert a serial port capture into a readable transcript
+ * Copyright (C) 2003, 2004 Kirk Martinez, Alistair Riddoch,
+ *                          The University of Southampton
+ */
+
+#include "sercap.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/** Maximum number of distinct commands kept in the latency summary */
+#define MAX_COMMANDS 64
+
+/** Latency statistics for one command */
+typedef struct command_stats {
+    char        cs_name[32];
+    int         cs_count;
+    double      cs_total;
+    double      cs_max;
+} CommandStats;
+
+static CommandStats stats[MAX_COMMANDS];
+static int stats_count = 0;
+
+/** Set to non-zero to print only the latency summary */
+static int option_quiet = 0;
+
+/** Command waiting for its final result, if any */
+static char pending_cmd[128];
+/** Time at which the pending command was sent */
+static double pending_time = -1;
+/** Partial line received from the modem */
+static char rx_line[512];
+static int rx_len = 0;
+
+/** Lines which end a command */
+static const char * const final_results[] = {
+    "OK", "ERROR", "+CME ERROR", "+CMS ERROR", "NO CARRIER", "BUSY",
+    "NO ANSWER", "NO DIALTONE", "CONNECT", NULL
+};
+
+static double record_time(const SerCapRecord * rec)
+{
+    return rec->cr_sec + rec->cr_nsec / 1e9;
+}
+
+/** Print bytes, escaping anything which is not printable. */
+static void print_escaped(const BYTE * data, size_t len)
+{
+    size_t i;
+
+    putchar('"');
+    for (i = 0; i < len; ++i) {
+        BYTE c = data[i];
+
+        if (c == '\r') {
+            fputs("\\r", stdout);
+        } else if (c == '\n') {
+            fputs("\\n", stdout);
+        } else if ((c == '"') || (c == '\\')) {
+            printf("\\%c", c);
+        } else if (isprint(c)) {
+            putchar(c);
+        } else {
+            printf("\\x%02x", c);
+        }
+    }
+    putchar('"');
+}
+
+/** Add a latency measurement to the summary. */
+static void add_stat(const char * cmd, double latency)
+{
+    char name[32];
+    size_t len = strcspn(cmd, "=?");
+    int i;
+
+    if (len >= sizeof(name)) {
+        len = sizeof(name) - 1;
+    }
+    memcpy(name, cmd, len);
+    name[len] = 0;
+
+    for (i = 0; i < stats_count; ++i) {
+        if (strcmp(stats[i].cs_name, name) == 0) {
+            break;
+        }
+    }
+    if (i == stats_count) {
+        if (stats_count == MAX_COMMANDS) {
+            return;
+        }
+        strcpy(stats[i].cs_name, name);
+        ++stats_count;
+    }
+    ++stats[i].cs_count;
+    stats[i].cs_total += latency;
+    if (latency > stats[i].cs_max) {
+        stats[i].cs_max = latency;
+    }
+}
+
+/** Note that a command has been sent, to time its response. */
+static void track_tx(const BYTE * data, size_t len, double t)
+{
+    size_t cmdlen;
+
+    if ((len >= 2) && (toupper(data[0]) == 'A') && (toupper(data[1]) == 'T')) {
+        cmdlen = 0;
+        while ((cmdlen < len) && (data[cmdlen] != '\r') &&
+               (data[cmdlen] != '\n')) {
+            ++cmdlen;
+        }
+        if (cmdlen >= sizeof(pending_cmd)) {
+            cmdlen = sizeof(pending_cmd) - 1;
+        }
+        memcpy(pending_cmd, data, cmdlen);
+        pending_cmd[cmdlen] = 0;
+        pending_time = t;
+    } else if (memchr(data, 0x1a, len) != NULL) {
+        strcpy(pending_cmd, "<message body>");
+        pending_time = t;
+    }
+}
+
+/** Look for final results in received data, to time the command. */
+static void track_rx(const BYTE * data, size_t len, double t)
+{
+    size_t i;
+
+    for (i = 0; i < len; ++i) {
+        if (data[i] == '\n') {
+            int j;
+
+            while ((rx_len > 0) && (rx_line[rx_len - 1] == '\r')) {
+                --rx_len;
+            }
+            rx_line[rx_len] = 0;
+            rx_len = 0;
+            if (pending_time < 0) {
+                continue;
+            }
+            for (j = 0; final_results[j] != NULL; ++j) {
+                if (strncmp(rx_line, final_results[j],
+                            strlen(final_results[j])) == 0) {
+                    break;
+                }
+            }
+            if (final_results[j] == NULL) {
+                continue;
+            }
+            if (!option_quiet) {
+                printf("             %s -> %s in %.1f ms\n", pending_cmd,
+                       rx_line, (t - pending_time) * 1000);
+            }
+            add_stat(pending_cmd, (t - pending_time) * 1000);
+            pending_time = -1;
+        } else if (rx_len < (int)sizeof(rx_line) - 1) {
+            rx_line[rx_len++] = data[i];
+            if ((rx_len == 2) && (strncmp(rx_line, "> ", 2) == 0) &&
+                (pending_time >= 0)) {
+                if (!option_quiet) {
+                    printf("             %s -> prompt in %.1f ms\n",
+                           pending_cmd, (t - pending_time) * 1000);
+                }
+                add_stat(pending_cmd, (t - pending_time) * 1000);
+                pending_time = -1;
+                rx_len = 0;
+            }
+        }
+    }
+}
+
+/** Print the transcript of one capture file. */
+static int dump_file(const char * filename)
+{
+    static BYTE data[SERCAP_MAX_DATA];
+    SerCapRecord rec;
+    double start = 0;
+    FILE * fp;
+    int ret;
+
+    fp = fopen(filename, "rb");
+    if (fp == NULL) {
+        perror(filename);
+        return 1;
+    }
+
+    while ((ret = SERCapRead(fp, &rec, data)) == 1) {
+        double t = record_time(&rec);
+
+        if ((rec.cr_type == SERCAP_NOTE) &&
+            (rec.cr_len >= strlen(SERCAP_MAGIC)) &&
+            (memcmp(data, SERCAP_MAGIC, strlen(SERCAP_MAGIC)) == 0)) {
+            start = t;
+            pending_time = -1;
+            rx_len = 0;
+        }
+
+        if (!option_quiet) {
+            printf("%11.6f %s ", t - start,
+                   (rec.cr_type == SERCAP_RX) ? "RX" :
+                   (rec.cr_type == SERCAP_TX) ? "TX" : "--");
+            if (rec.cr_type == SERCAP_NOTE) {
+                printf("%.*s", rec.cr_len, (char *)data);
+            } else {
+                print_escaped(data, rec.cr_len);
+            }
+            if (rec.cr_flags & SERCAP_DISCARDED) {
+                printf(" (discarded)");
+            }
+            putchar('\n');
+        }
+
+        if (rec.cr_type == SERCAP_TX) {
+            track_tx(data, rec.cr_len, t);
+        } else if (rec.cr_type == SERCAP_RX) {
+            track_rx(data, rec.cr_len, t);
+        }
+    }
+
+    fclose(fp);
+    if (ret < 0) {
+        fprintf(stderr, "%s: truncated capture\n", filename);
+    }
+    return 0;
+}
+
+static void usage(const char * prgname)
+{
+    fprintf(stderr, "Usage: %s [-q] <capture file> ...\n\n", prgname);
+    fprintf(stderr, "  -q                only print the latency summary\n");
+}
+
+int main(int argc, char ** argv)
+{
+    int ret = 0;
+    int i;
+
+    while (1) {
+        int c = getopt(argc, argv, "q");
+        if (c == -1) {
+            break;
+        } else if (c == 'q') {
+            option_quiet = 1;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    for (i = optind; i < argc; ++i) {
+        ret |= dump_file(argv[i]);
+    }
+
+    if (stats_count > 0) {
+        printf("\n%-20s %6s %10s %10s\n", "command", "count", "mean ms",
+               "max ms");
+        for (i = 0; i < stats_count; ++i) {
+            printf("%-20s %6d %10.1f %10.1f\n", stats[i].cs_name,
+                   stats[i].cs_count, stats[i].cs_total / stats[i].cs_count,
+                   stats[i].cs_max);
+        }
+    }
+    return ret;
+}
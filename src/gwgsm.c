@@ -8,10 +8,13 @@
 
 #include "gsm.h"
 #include "log.h"
+#include "log_files.h"
+#include "fec.h"
 
 #include <sys/types.h>
 #include <sys/stat.h>
 
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -20,13 +23,15 @@
 static const int debug_flag = 0;
 
 //-------------------- INITIALISE ------------------
-static SerialPort * initialise(const char * port, speed_t baud)
+static SerialPort * initialise(const char * port, speed_t baud,
+                               const SerialOptions * options,
+                               char * capture, int echo, int sms)
 {
     SerialPort * sp;
     LOGWrite(GWL_DEBUG, "Initialise gwgsm.");
 
     // now the serial port
-    sp = SEROpenPort(port, baud, NULL);
+    sp = SEROpenPort(port, baud, capture, options);
     if (sp == NULL) {
         LOGWrite(GWL_FATAL, "Can not open serial port!");
         return NULL;
@@ -37,7 +42,11 @@ static SerialPort * initialise(const char * port, speed_t baud)
     /* Send a couple of newlines to wake up the translators and/or modem! */
     GSMWakeUp(sp);
 
-    GSMEchoOn(sp);
+    if (GSMSetup(sp, echo, sms) != 0) {
+        LOGWrite(GWL_ERROR, "Unable to set SMS mode");
+        SERClosePort(sp);
+        return NULL;
+    }
 
     LOGWrite(GWL_DEBUG, "Initialise gwgsm complete.");
 
@@ -48,9 +57,28 @@ static SerialPort * initialise(const char * port, speed_t baud)
 //-------------------- USAGE ------------------------
 static void usage(const char * prgname)
 {
-    fprintf(stderr, "Usage: %s  [-b <baud_rate>] [-p <serialport>] {check|message|send} ... \n\n", prgname);
+    fprintf(stderr, "Usage: %s  [-b <baud_rate>] [-m <read_mode>] [-p <serialport>] {check|message|send} ... \n\n", prgname);
     fprintf(stderr, "  -d                debug, write messages to files\n");
-    fprintf(stderr, "  -b <baud_rate>    set the serial baud rate\n");
+    fprintf(stderr, "  -c <capturefile>  capture all serial traffic to a file\n");
+    fprintf(stderr, "  -b <baud_rate>    set the serial baud rate, which may be any\n"
+                    "                    rate the port supports, eg 921600\n");
+    fprintf(stderr, "  -m <read_mode>    default, batched or lowlatency\n");
+    fprintf(stderr, "  -t                read the serial port in a separate thread\n");
+    fprintf(stderr, "  -e                turn off command echo on the modem\n");
+    fprintf(stderr, "  -T <seconds>      time allowed to send each message [20]\n");
+    fprintf(stderr, "  -P                send file blocks as binary PDU messages\n");
+    fprintf(stderr, "  -E <encoding>     hex, base64 or base84 for file blocks sent\n"
+                    "                    as text [hex]\n");
+    fprintf(stderr, "  -z                compress files as they are sent\n");
+    fprintf(stderr, "  -j <directory>    keep journals of files sent, to resume\n"
+                    "                    failed sends, eg " JOURNAL_DIR "\n");
+    fprintf(stderr, "  -F <k>,<m>        send m parity blocks after each k blocks\n"
+                    "                    of a file, so any k of them rebuild it\n");
+    fprintf(stderr, "  -L                let the modem close the link to the network\n"
+                    "                    after each block of a file\n");
+    fprintf(stderr, "  -D <file>         request delivery reports for the blocks of\n"
+                    "                    files, tracked in a file, eg\n"
+                    "                    " DELIVERY_FILE "\n");
     fprintf(stderr, "  -p <serialport>   set the serial port device\n\n");
     fprintf(stderr, "     check          check that the modem is associated\n");
     fprintf(stderr, "                    with a network, and has enough\n");
@@ -58,7 +86,9 @@ static void usage(const char * prgname)
 	            "     check-gprs     check that the modem is associated\n"
 	            "                    with a GPRS network, and force attachment.\n");
     fprintf(stderr, "     message        send a command line message\n");
-    fprintf(stderr, "     send           send a file as a sequence of  messages\n\n");
+    fprintf(stderr, "     send           send a file as a sequence of  messages\n");
+    fprintf(stderr, "     reports        wait for delivery reports, and list the\n"
+                    "                    blocks not yet delivered\n\n");
 
 }
 
@@ -77,66 +107,46 @@ static void usage_send(const char * prgname)
     fprintf(stderr, "Usage: %s  [-b <baud_rate>] [-p <serialport>] send <number> <file> \n", prgname);
 }
 
+static void usage_reports(const char * prgname)
+{
+    fprintf(stderr, "Usage: %s  [-b <baud_rate>] [-p <serialport>] [-D <file>] reports [<seconds>]\n", prgname);
+}
 
-//-------------------- MAIN ------------------------
-int main (int argc, char **argv) 
+/** List the blocks in a table of messages sent which have not been
+ *  reported delivered. */
+static void list_undelivered(const DeliveryTable * dt)
 {
-    const char * option_serialport = "/dev/gprs";
-    const char * cmd;
-    SerialPort * sp;
-    speed_t option_baud = B9600;
-    int option_debug = 0;
+    int mr;
 
-    LOGInit(GWT_STDERR, GWL_INFO, "Glacsweb GSM");
+    for (mr = 0; mr < DLR_SLOTS; ++mr) {
+        const DeliveryEntry * de = &dt->dt_entries[mr];
 
-    while (1) {
-        char mesg[1024]; // For logfile
-        int c = getopt(argc, argv, "p:b:d");
-        if (c == -1) {
-            break;
-        } else if (c == 'p') {
-            int ret;
-            struct stat sbuf;
-            debug( printf("Got port %s.\n", optarg); );
-            option_serialport = optarg;
-            ret = stat(option_serialport, &sbuf);
-            if (ret == -1) {
-                sprintf(mesg, "%s does not exist\n", option_serialport);
-                LOGWrite(GWL_ERROR, mesg);
-            } else if (!S_ISCHR(sbuf.st_mode)) {
-                sprintf(mesg, "%s is not a device\n", option_serialport);
-                LOGWrite(GWL_ERROR, mesg);
-            }
-        } else if (c == 'b') {
-            debug( printf("Got baud %s.\n", optarg); );
-            if (SERGetBaud(optarg, &option_baud)) {
-                sprintf(mesg, "Unknown baud rate %s", optarg);
-                LOGWrite(GWL_ERROR, mesg);
-            }
-        } else if (c == 'd') {
-            debug( printf("Got debug flag.\n"); );
-            option_debug = 1;
+        if ((de->de_state != DLR_PENDING) && (de->de_state != DLR_FAILED)) {
+            continue;
         }
+        printf("%3d %-9s %s %s ", mr, DLRStateName(de->de_state),
+               de->de_number, de->de_name);
+        if (de->de_parity < 0) {
+            printf("%x", de->de_block);
+        } else {
+            printf("%x parity %d", de->de_block, de->de_parity);
+        }
+        if (de->de_status >= 0) {
+            printf(" status %d", de->de_status);
+        }
+        printf("\n");
     }
+}
 
-    if ((argc - optind) < 1) {
-        usage(argv[0]);
-        return 1;
-    }
-
-    if (option_debug != 0) {
-        GSMDebugMode();
-    }
-
-    // set up rs232
-    sp = initialise(option_serialport, option_baud);
-    
-    if (sp == NULL) {
-        return 1;
-    }
-
-    cmd = argv[optind];
-
+/** Run the command given on the command line.
+ *  @param dt table of messages sent, which the reports command needs, or
+ *  NULL if delivery is not tracked.
+ *  @return the exit status of the program.
+ */
+static int run_command(SerialPort * sp, const char * cmd, int argc,
+                       char ** argv, const GSMFileOptions * options,
+                       DeliveryTable * dt)
+{
     if (strcmp(cmd, "send") == 0) {
         int status;
 
@@ -147,18 +157,15 @@ int main (int argc, char **argv)
             return 1;
         }
 
-        if (GSMSetSMSMode(sp) != 0) {
-            LOGWrite(GWL_ERROR, "Unable to set SMS mode");
-            return 1;
-        }
-
         status = GSMWaitSignal(sp, 5);
         if ((status < 0) || (status == 1)) {
             LOGWrite(GWL_ERROR, "Modem not able to send");
             return 1;
         }
         
-        if (GSMSendFile(sp, argv[optind + 1], argv[optind + 2]) == 0) {
+        status = GSMSendFileOptions(sp, argv[optind + 1], argv[optind + 2],
+                                    options);
+        if (status == 0) {
             return 0;
         }
 
@@ -181,7 +188,8 @@ int main (int argc, char **argv)
         }
         return 0;
     } else if (strcmp(cmd, "message") == 0) {
-        int status;
+        char mesg[64];
+        int status, mr;
 
         LOGWrite(GWL_DEBUG, "Performing message command");
 
@@ -190,18 +198,43 @@ int main (int argc, char **argv)
             return 1;
         }
 
-        if (GSMSetSMSMode(sp) != 0) {
-            LOGWrite(GWL_ERROR, "Unable to set SMS mode");
-            return 1;
-        }
-
         status = GSMWaitSignal(sp, 5);
         if ((status < 0) || (status == 1)) {
             LOGWrite(GWL_ERROR, "Modem not ready to send");
             return 1;
         }
 
-        status = GSMSendMessage(sp, argv[optind + 1], argv[optind + 2]);
+        if (GSMSubmitMessage(sp, argv[optind + 1], argv[optind + 2],
+                             &mr) != 0) {
+            LOGWrite(GWL_ERROR, "GSM message sending failed");
+            return 1;
+        }
+        sprintf(mesg, "Message sent with reference %d", mr);
+        LOGWrite(GWL_DEBUG, mesg);
+        return 0;
+    } else if (strcmp(cmd, "reports") == 0) {
+        struct timespec deadline;
+        long wait = 0;
+
+        LOGWrite(GWL_DEBUG, "Performing reports command");
+
+        if ((argc - optind) > 2) {
+            usage_reports(argv[0]);
+            return 1;
+        }
+        if ((argc - optind) == 2) {
+            wait = atof(argv[optind + 1]) * 1000000;
+        }
+
+        // Take the reports which arrive in the time given
+        SERDeadline(&deadline, wait);
+        while (SERRemaining(&deadline) > 0) {
+            if (GSMIdle(sp, SERRemaining(&deadline)) < 0) {
+                break;
+            }
+        }
+        list_undelivered(dt);
+        return 0;
     } else if (strcmp(cmd, "check-gprs") == 0) {
 	    LOGWrite(GWL_DEBUG, "Performing check-gprs command");
 
@@ -215,3 +248,150 @@ int main (int argc, char **argv)
     }
     return 1;
 }
+
+
+//-------------------- MAIN ------------------------
+int main (int argc, char **argv) 
+{
+    const char * option_serialport = "/dev/gprs";
+    const char * cmd;
+    SerialPort * sp;
+    speed_t option_baud = B9600;
+    SerialOptions option_serial = { SER_READ_DEFAULT, 64, 1, 0 };
+    char * option_capture = NULL;
+    int option_debug = 0;
+    int option_echo = 1;
+    GSMFileOptions option_file = { 0, ENC_HEX, 0, NULL, 0, 0, 1 };
+    const char * option_delivery = NULL;
+    DeliveryTable * dt = NULL;
+    int ret;
+
+    LOGInit(GWT_STDERR, GWL_INFO, "Glacsweb GSM");
+
+    while (1) {
+        char mesg[1024]; // For logfile
+        int c = getopt(argc, argv, "p:b:m:c:teT:PE:zj:F:LD:d");
+        if (c == -1) {
+            break;
+        } else if (c == 'p') {
+            int ret;
+            struct stat sbuf;
+            debug( printf("Got port %s.\n", optarg); );
+            option_serialport = optarg;
+            ret = stat(option_serialport, &sbuf);
+            if (ret == -1) {
+                sprintf(mesg, "%s does not exist\n", option_serialport);
+                LOGWrite(GWL_ERROR, mesg);
+            } else if (!S_ISCHR(sbuf.st_mode)) {
+                sprintf(mesg, "%s is not a device\n", option_serialport);
+                LOGWrite(GWL_ERROR, mesg);
+            }
+        } else if (c == 'b') {
+            debug( printf("Got baud %s.\n", optarg); );
+            if (SERGetBaud(optarg, &option_baud)) {
+                sprintf(mesg, "Unknown baud rate %s", optarg);
+                LOGWrite(GWL_ERROR, mesg);
+            }
+        } else if (c == 'm') {
+            debug( printf("Got read mode %s.\n", optarg); );
+            if (SERGetReadMode(optarg, &option_serial.so_read_mode)) {
+                sprintf(mesg, "Unknown read mode %s", optarg);
+                LOGWrite(GWL_ERROR, mesg);
+            }
+        } else if (c == 'c') {
+            debug( printf("Got capture file %s.\n", optarg); );
+            option_capture = optarg;
+        } else if (c == 't') {
+            debug( printf("Got reader thread flag.\n"); );
+            option_serial.so_reader = 1;
+        } else if (c == 'T') {
+            debug( printf("Got send timeout %s.\n", optarg); );
+            if (atof(optarg) <= 0) {
+                sprintf(mesg, "Bad send timeout %s", optarg);
+                LOGWrite(GWL_ERROR, mesg);
+            } else {
+                GSMSetSendTimeout(atof(optarg) * 1000000);
+            }
+        } else if (c == 'P') {
+            debug( printf("Got PDU mode flag.\n"); );
+            option_file.fo_pdu = 1;
+        } else if (c == 'E') {
+            debug( printf("Got encoding %s.\n", optarg); );
+            if (ENCGetEncoding(optarg, &option_file.fo_encoding)) {
+                sprintf(mesg, "Unknown encoding %s", optarg);
+                LOGWrite(GWL_ERROR, mesg);
+            }
+        } else if (c == 'z') {
+            debug( printf("Got compress flag.\n"); );
+            option_file.fo_compress = 1;
+        } else if (c == 'j') {
+            debug( printf("Got journal directory %s.\n", optarg); );
+            option_file.fo_journal = optarg;
+        } else if (c == 'F') {
+            debug( printf("Got parity %s.\n", optarg); );
+            if ((sscanf(optarg, "%d,%d", &option_file.fo_group,
+                        &option_file.fo_parity) != 2) ||
+                (option_file.fo_group < 1) || (option_file.fo_parity < 0) ||
+                (option_file.fo_group + option_file.fo_parity >
+                 FEC_MAX_BLOCKS)) {
+                sprintf(mesg, "Bad parity %s", optarg);
+                LOGWrite(GWL_ERROR, mesg);
+                option_file.fo_parity = 0;
+            }
+        } else if (c == 'L') {
+            debug( printf("Got close link flag.\n"); );
+            option_file.fo_keep_link = 0;
+        } else if (c == 'D') {
+            debug( printf("Got delivery file %s.\n", optarg); );
+            option_delivery = optarg;
+        } else if (c == 'e') {
+            debug( printf("Got echo off flag.\n"); );
+            option_echo = 0;
+        } else if (c == 'd') {
+            debug( printf("Got debug flag.\n"); );
+            option_debug = 1;
+        }
+    }
+
+    if ((argc - optind) < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (option_debug != 0) {
+        GSMDebugMode();
+    }
+
+    cmd = argv[optind];
+
+    // set up rs232, and SMS mode for the commands which send messages
+    sp = initialise(option_serialport, option_baud, &option_serial,
+                    option_capture, option_echo,
+                    (strcmp(cmd, "send") == 0) ||
+                    (strcmp(cmd, "message") == 0));
+    
+    if (sp == NULL) {
+        return 1;
+    }
+
+    // Reports are listened for by the reports command, or by gwspool
+    if ((strcmp(cmd, "reports") == 0) && (option_delivery == NULL)) {
+        option_delivery = DELIVERY_FILE;
+    }
+    if (option_delivery != NULL) {
+        if (((dt = DLROpen(option_delivery)) == NULL) ||
+            (GSMTrackDelivery(sp, dt) != 0)) {
+            LOGWrite(GWL_ERROR, "Can not track delivery reports");
+            if (dt != NULL) {
+                DLRClose(dt);
+            }
+            return 1;
+        }
+    }
+
+    ret = run_command(sp, cmd, argc, argv, &option_file, dt);
+    if (dt != NULL) {
+        DLRClose(dt);
+    }
+    return ret;
+}
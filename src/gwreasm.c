@@ -0,0 +1,174 @@
+/**
+ * Glacsweb gwreasm.c
+ * rebuild files from the SMS messages they were sent in
+ * Copyright (C) 2004 Alistair Riddoch, The University of Southampton
+ */
+
+#include "reasm.h"
+#include "log.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define debug(prg) { if (debug_flag) { prg } }
+
+static const int debug_flag = 0;
+
+/** Longest message file read. SMS messages are much shorter, so anything
+ *  longer is not one. */
+#define MAX_MESSAGE 4096
+
+/** Add the message in one file to the reassembler.
+ *  @return zero if the file was read, non-zero otherwise.
+ */
+static int read_message(Reassembler * re, const char * path)
+{
+    BYTE msg[MAX_MESSAGE];
+    char mesg[1024]; // For logfile
+    size_t len;
+    FILE * fp;
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        snprintf(mesg, sizeof(mesg), "Could not open %s.", path);
+        LOGWrite(GWL_ERROR, mesg);
+        return 1;
+    }
+    len = fread(msg, 1, sizeof(msg), fp);
+    if (ferror(fp) != 0) {
+        snprintf(mesg, sizeof(mesg), "Error reading %s.", path);
+        LOGWrite(GWL_ERROR, mesg);
+        fclose(fp);
+        return 1;
+    }
+    fclose(fp);
+
+    if (REASMAddMessage(re, msg, len) == REASM_INVALID) {
+        snprintf(mesg, sizeof(mesg), "%s is not a file block.", path);
+        LOGWrite(GWL_VERBOSE, mesg);
+    }
+    return 0;
+}
+
+/** Add every message in a directory to the reassembler, one file each.
+ *  @return zero if the directory was read, non-zero otherwise.
+ */
+static int read_directory(Reassembler * re, const char * path)
+{
+    struct dirent * entry;
+    char mesg[1024]; // For logfile
+    DIR * dir;
+    int ret = 0;
+
+    if ((dir = opendir(path)) == NULL) {
+        snprintf(mesg, sizeof(mesg), "Could not open directory %s.", path);
+        LOGWrite(GWL_ERROR, mesg);
+        return 1;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        struct stat sbuf;
+        char * file;
+
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        file = malloc(strlen(path) + strlen(entry->d_name) + 2);
+        if (file == NULL) {
+            LOGWrite(GWL_FATAL, "Out of memory.");
+            ret = 1;
+            break;
+        }
+        sprintf(file, "%s/%s", path, entry->d_name);
+        if ((stat(file, &sbuf) == 0) && S_ISREG(sbuf.st_mode)) {
+            ret |= read_message(re, file);
+        }
+        free(file);
+    }
+    closedir(dir);
+    return ret;
+}
+
+static void usage(const char * prgname)
+{
+    fprintf(stderr, "Usage: %s [-o <directory>] [-v] {<message>|<inbox>} ...\n\n", prgname);
+    fprintf(stderr, "  -o <directory>    write rebuilt files to a directory [.]\n");
+    fprintf(stderr, "  -v                report what was found in the messages\n\n");
+    fprintf(stderr, "Each message is a file holding the text, or the user data of\n"
+                    "a binary message. An inbox is a directory of such files.\n"
+                    "Files missing blocks are written with .partial added.\n");
+}
+
+int main(int argc, char ** argv)
+{
+    const char * option_outdir = ".";
+    int option_verbose = 0;
+    Reassembler * re;
+    const ReasmStats * stats;
+    int ret = 0;
+    int i;
+
+    LOGInit(GWT_STDERR, GWL_INFO, "Glacsweb reassembler");
+
+    while (1) {
+        int c = getopt(argc, argv, "o:v");
+        if (c == -1) {
+            break;
+        } else if (c == 'o') {
+            debug( printf("Got output directory %s.\n", optarg); );
+            option_outdir = optarg;
+        } else if (c == 'v') {
+            option_verbose = 1;
+            LOGSetLevel(GWL_VERBOSE);
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if ((re = REASMCreate(option_outdir)) == NULL) {
+        LOGWrite(GWL_FATAL, "Out of memory.");
+        return 1;
+    }
+
+    for (i = optind; i < argc; ++i) {
+        char mesg[1024]; // For logfile
+        struct stat sbuf;
+
+        if (stat(argv[i], &sbuf) != 0) {
+            snprintf(mesg, sizeof(mesg), "%s does not exist.", argv[i]);
+            LOGWrite(GWL_ERROR, mesg);
+            ret = 1;
+        } else if (S_ISDIR(sbuf.st_mode)) {
+            ret |= read_directory(re, argv[i]);
+        } else {
+            ret |= read_message(re, argv[i]);
+        }
+    }
+
+    if (REASMFinish(re) != 0) {
+        ret = 1;
+    }
+
+    stats = &re->re_stats;
+    if (option_verbose) {
+        printf("%ld messages: %ld blocks, %ld parity, %ld duplicates, "
+               "%ld conflicts, %ld not blocks\n", stats->rs_messages,
+               stats->rs_blocks, stats->rs_parity, stats->rs_duplicates,
+               stats->rs_conflicts, stats->rs_invalid);
+        printf("%ld blocks rebuilt from parity\n", stats->rs_recovered);
+        printf("%d files complete, %d incomplete\n", stats->rs_complete,
+               stats->rs_incomplete);
+    }
+
+    REASMDestroy(re);
+    return ret;
+}
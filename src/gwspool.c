@@ -0,0 +1,750 @@
+/**
+ * Glacsweb gwspool.c
+ * send messages and files queued in a spool, over one modem session
+ * Copyright (C) 2004 Alistair Riddoch, The University of Southampton
+ */
+
+
+#include "gsm.h"
+#include "log.h"
+#include "log_files.h"
+#include "fec.h"
+
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define debug(prg) { if (debug_flag) { prg } }
+
+static const int debug_flag = 0;
+
+/** Largest job accepted, which bounds the text of a message */
+#define SPOOL_JOB_MAX           16384
+/** Most jobs taken from the spool in one scan */
+#define SPOOL_BATCH             256
+/** Number of failed jobs whose attempts are remembered */
+#define SPOOL_TRACKED           64
+/** Longest name of a job */
+#define SPOOL_NAME_MAX          64
+
+/** Time to wait for reports from the modem between checks of the
+ *  spool */
+static const long SPOOL_IDLE_USEC = 250000;
+
+/** Directories of the spool. Jobs are written to tmp, renamed into new
+ *  once complete, and moved to done or failed once they are finished
+ *  with. */
+static const char * const SPOOL_TMP = "tmp";
+static const char * const SPOOL_NEW = "new";
+static const char * const SPOOL_DONE = "done";
+static const char * const SPOOL_FAILED = "failed";
+
+/** Number of times a job has failed, for jobs which are retried */
+typedef struct spool_attempt {
+    char        sa_name[SPOOL_NAME_MAX];
+    int         sa_count;
+} SpoolAttempt;
+
+static SpoolAttempt spool_attempts[SPOOL_TRACKED];
+
+/** Set by a signal to stop once the job being sent is finished */
+static volatile sig_atomic_t spool_stop = 0;
+
+static void stop_handler(int sig)
+{
+    spool_stop = 1;
+}
+
+/** Make the path of a file in one of the directories of the spool.
+ *  @return the path, which the caller must free, or NULL if out of
+ *  memory.
+ */
+static char * spool_path(const char * spool, const char * sub,
+                         const char * name)
+{
+    char * path = malloc(strlen(spool) + strlen(sub) + strlen(name) + 3);
+
+    if (path == NULL) {
+        LOGWrite(GWL_FATAL, "Out of memory.");
+        return NULL;
+    }
+    sprintf(path, "%s/%s%s%s", spool, sub, (*name != 0) ? "/" : "", name);
+    return path;
+}
+
+/** Create the spool and its directories, if they do not exist.
+ *  @return zero if the spool exists, non-zero otherwise.
+ */
+static int make_spool(const char * spool)
+{
+    const char * const subs[] = { SPOOL_TMP, SPOOL_NEW, SPOOL_DONE,
+                                  SPOOL_FAILED };
+    char mesg[1024]; // For logfile
+    unsigned int i;
+
+    if ((mkdir(spool, 0755) != 0) && (errno != EEXIST)) {
+        snprintf(mesg, sizeof(mesg), "Could not create spool %s.", spool);
+        LOGWrite(GWL_ERROR, mesg);
+        return 1;
+    }
+    for (i = 0; i < sizeof(subs) / sizeof(subs[0]); ++i) {
+        char * path = spool_path(spool, subs[i], "");
+
+        if (path == NULL) {
+            return 1;
+        }
+        if ((mkdir(path, 0755) != 0) && (errno != EEXIST)) {
+            snprintf(mesg, sizeof(mesg), "Could not create %s.", path);
+            LOGWrite(GWL_ERROR, mesg);
+            free(path);
+            return 1;
+        }
+        free(path);
+    }
+    return 0;
+}
+
+/** Add a job to the spool. It is written in full to the tmp directory,
+ *  and then renamed into new, so the spooler never sees part of a job.
+ *  Job names start with the time, so jobs are sent in the order they
+ *  were submitted.
+ *  @return zero if the job was queued, non-zero otherwise.
+ */
+static int submit_job(const char * spool, const char * job, size_t len)
+{
+    char mesg[1024]; // For logfile
+    char name[SPOOL_NAME_MAX];
+    char * tmp;
+    char * path;
+    struct timeval tv;
+    int fd, ret = 0;
+
+    gettimeofday(&tv, NULL);
+    snprintf(name, sizeof(name), "%010ld.%06ld.%d", (long)tv.tv_sec,
+             (long)tv.tv_usec, (int)getpid());
+    tmp = spool_path(spool, SPOOL_TMP, name);
+    path = spool_path(spool, SPOOL_NEW, name);
+    if ((tmp == NULL) || (path == NULL)) {
+        free(tmp);
+        free(path);
+        return 1;
+    }
+
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0644)) == -1) {
+        snprintf(mesg, sizeof(mesg), "Could not create %s.", tmp);
+        LOGWrite(GWL_ERROR, mesg);
+        ret = 1;
+    } else {
+        if ((write(fd, job, len) != (ssize_t)len) || (fsync(fd) != 0)) {
+            ret = 1;
+        }
+        if ((close(fd) != 0) || (ret != 0) || (rename(tmp, path) != 0)) {
+            snprintf(mesg, sizeof(mesg), "Could not queue %s.", path);
+            LOGWrite(GWL_ERROR, mesg);
+            unlink(tmp);
+            ret = 1;
+        }
+    }
+    free(tmp);
+    free(path);
+    return ret;
+}
+
+/** Queue a message or a file from the command line.
+ *  A message job is a line giving the number, followed by the text. A
+ *  file job gives the number, the directory it was submitted from, and
+ *  the name of the file, on separate lines, so the file is sent with the
+ *  name it was given.
+ */
+static int submit(const char * spool, int argc, char ** argv)
+{
+    char cwd[PATH_MAX];
+    char * job;
+    size_t len;
+    int ret;
+
+    if ((argc != 4) || ((strcmp(argv[1], "message") != 0) &&
+                        (strcmp(argv[1], "send") != 0))) {
+        return -1;
+    }
+    if (strcmp(argv[1], "send") == 0) {
+        if (access(argv[3], R_OK) != 0) {
+            char mesg[1024]; // For logfile
+
+            snprintf(mesg, sizeof(mesg), "Can not read %s.", argv[3]);
+            LOGWrite(GWL_ERROR, mesg);
+            return 1;
+        }
+        if (getcwd(cwd, sizeof(cwd)) == NULL) {
+            LOGWrite(GWL_ERROR, "Can not find the current directory.");
+            return 1;
+        }
+    }
+    job = malloc(strlen(argv[2]) + strlen(argv[3]) + sizeof(cwd) + 16);
+    if (job == NULL) {
+        LOGWrite(GWL_FATAL, "Out of memory.");
+        return 1;
+    }
+    if (strcmp(argv[1], "send") == 0) {
+        len = sprintf(job, "send %s\n%s\n%s\n", argv[2], cwd, argv[3]);
+    } else {
+        len = sprintf(job, "message %s\n%s", argv[2], argv[3]);
+    }
+    if (len > SPOOL_JOB_MAX) {
+        LOGWrite(GWL_ERROR, "Message too long to queue.");
+        free(job);
+        return 1;
+    }
+    if (make_spool(spool) != 0) {
+        free(job);
+        return 1;
+    }
+    ret = submit_job(spool, job, len);
+    free(job);
+    return ret;
+}
+
+/** Find the oldest jobs waiting in the spool, up to SPOOL_BATCH of them.
+ *  Names are kept in order as they are read, and once the batch is full
+ *  the newest is dropped for any older one found, so the batch holds the
+ *  oldest jobs however many are queued.
+ *  @param names used to return the names, oldest first, which the caller
+ *  must free.
+ *  @return the number of jobs found.
+ */
+static int scan_spool(const char * newdir, char ** names)
+{
+    struct dirent * entry;
+    DIR * dir;
+    int count = 0;
+
+    if ((dir = opendir(newdir)) == NULL) {
+        return 0;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        char * name;
+        int i;
+
+        if ((entry->d_name[0] == '.') ||
+            (strlen(entry->d_name) >= SPOOL_NAME_MAX)) {
+            continue;
+        }
+        if ((count == SPOOL_BATCH) &&
+            (strcmp(entry->d_name, names[count - 1]) >= 0)) {
+            continue;
+        }
+        if ((name = strdup(entry->d_name)) == NULL) {
+            continue;
+        }
+        if (count == SPOOL_BATCH) {
+            free(names[--count]);
+        }
+        for (i = count; (i > 0) && (strcmp(names[i - 1], name) > 0); --i) {
+            names[i] = names[i - 1];
+        }
+        names[i] = name;
+        ++count;
+    }
+    closedir(dir);
+    return count;
+}
+
+/** Send one job.
+ *  @return zero if it was sent, one if sending failed, or -1 if the job
+ *  is not valid and can never be sent.
+ */
+static int run_job(SerialPort * sp, const char * path,
+                   const GSMFileOptions * options)
+{
+    char job[SPOOL_JOB_MAX + 1];
+    char mesg[1024]; // For logfile
+    char * number;
+    char * body;
+    size_t len;
+    FILE * fp;
+    int ret;
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        return -1;
+    }
+    len = fread(job, 1, SPOOL_JOB_MAX + 1, fp);
+    fclose(fp);
+    if (len > SPOOL_JOB_MAX) {
+        return -1;
+    }
+    job[len] = 0;
+    if ((body = strchr(job, '\n')) == NULL) {
+        return -1;
+    }
+    *body++ = 0;
+    if ((number = strchr(job, ' ')) == NULL) {
+        return -1;
+    }
+    *number++ = 0;
+
+    if (strcmp(job, "message") == 0) {
+        int mr;
+
+        if (GSMSubmitMessage(sp, number, body, &mr) != 0) {
+            return 1;
+        }
+        snprintf(mesg, sizeof(mesg), "Sent message to %s with reference "
+                 "%d.", number, mr);
+        LOGWrite(GWL_INFO, mesg);
+        return 0;
+    }
+    if (strcmp(job, "send") == 0) {
+        char * filename = strchr(body, '\n');
+        char * end;
+
+        if ((filename == NULL) ||
+            ((end = strchr(filename + 1, '\n')) == NULL)) {
+            return -1;
+        }
+        *filename++ = 0;
+        *end = 0;
+        if (chdir(body) != 0) {
+            snprintf(mesg, sizeof(mesg), "Directory %s of a queued file "
+                     "is gone.", body);
+            LOGWrite(GWL_ERROR, mesg);
+            return -1;
+        }
+        ret = GSMSendFileOptions(sp, number, filename, options);
+        if (chdir("/") != 0) {
+            LOGWrite(GWL_WARNING, "Could not leave the directory of a "
+                     "queued file.");
+        }
+        if (ret != 0) {
+            return (access(filename, R_OK) == 0) ? 1 : -1;
+        }
+        snprintf(mesg, sizeof(mesg), "Sent %s to %s.", filename, number);
+        LOGWrite(GWL_INFO, mesg);
+        return 0;
+    }
+    return -1;
+}
+
+/** Count a failed attempt at a job.
+ *  @return the number of attempts which have failed.
+ */
+static int note_attempt(const char * name)
+{
+    SpoolAttempt * free_slot = &spool_attempts[0];
+    int i;
+
+    for (i = 0; i < SPOOL_TRACKED; ++i) {
+        if (strcmp(spool_attempts[i].sa_name, name) == 0) {
+            return ++spool_attempts[i].sa_count;
+        }
+        if (spool_attempts[i].sa_count < free_slot->sa_count) {
+            free_slot = &spool_attempts[i];
+        }
+    }
+    strcpy(free_slot->sa_name, name);
+    free_slot->sa_count = 1;
+    return 1;
+}
+
+/** Forget the attempts at a job which is finished with. */
+static void forget_attempts(const char * name)
+{
+    int i;
+
+    for (i = 0; i < SPOOL_TRACKED; ++i) {
+        if (strcmp(spool_attempts[i].sa_name, name) == 0) {
+            spool_attempts[i].sa_name[0] = 0;
+            spool_attempts[i].sa_count = 0;
+        }
+    }
+}
+
+/** Move a job out of new, to done or failed. */
+static void finish_job(const char * spool, const char * name,
+                       const char * sub)
+{
+    char mesg[1024]; // For logfile
+    char * from = spool_path(spool, SPOOL_NEW, name);
+    char * to = spool_path(spool, sub, name);
+
+    if ((from != NULL) && (to != NULL) && (rename(from, to) != 0)) {
+        snprintf(mesg, sizeof(mesg), "Could not move %s to %s.", from, to);
+        LOGWrite(GWL_ERROR, mesg);
+    }
+    forget_attempts(name);
+    free(from);
+    free(to);
+}
+
+//-------------------- INITIALISE ------------------
+static SerialPort * initialise(const char * port, speed_t baud,
+                               const SerialOptions * options,
+                               char * capture, int echo)
+{
+    SerialPort * sp;
+    LOGWrite(GWL_DEBUG, "Initialise gwspool.");
+
+    sp = SEROpenPort(port, baud, capture, options);
+    if (sp == NULL) {
+        LOGWrite(GWL_FATAL, "Can not open serial port!");
+        return NULL;
+    }
+
+    SERFlushChannel(sp, 100000);
+
+    /* Send a couple of newlines to wake up the translators and/or modem! */
+    GSMWakeUp(sp);
+
+    if (GSMSetup(sp, echo, 1) != 0) {
+        LOGWrite(GWL_ERROR, "Unable to set SMS mode");
+        SERClosePort(sp);
+        return NULL;
+    }
+
+    // Keep the network state up to date while waiting for jobs
+    GSMEnableReports(sp);
+
+    LOGWrite(GWL_DEBUG, "Initialise gwspool complete.");
+
+    return sp;
+}
+
+/** Send the jobs waiting in the spool.
+ *  @return the number of jobs left to retry later.
+ */
+static int drain_spool(const char * spool, SerialPort * sp, int echo,
+                       const GSMFileOptions * options, int retries)
+{
+    char * names[SPOOL_BATCH];
+    char * newdir = spool_path(spool, SPOOL_NEW, "");
+    char mesg[1024]; // For logfile
+    int count, i;
+    int left = 0;
+
+    if (newdir == NULL) {
+        return 0;
+    }
+    count = scan_spool(newdir, names);
+    free(newdir);
+
+    for (i = 0; i < count; ++i) {
+        char * path;
+        int status;
+
+        if (spool_stop) {
+            left = count - i;
+        } else if (GSMWaitSignal(sp, 5) != 0) {
+            LOGWrite(GWL_WARNING, "Modem not able to send, jobs wait.");
+            left = count - i;
+        }
+        if (left > 0) {
+            break;
+        }
+        if ((path = spool_path(spool, SPOOL_NEW, names[i])) == NULL) {
+            break;
+        }
+        status = run_job(sp, path, options);
+        free(path);
+        if (status == 0) {
+            finish_job(spool, names[i], SPOOL_DONE);
+        } else if ((status < 0) || (note_attempt(names[i]) >= retries)) {
+            snprintf(mesg, sizeof(mesg), "Giving up on job %s.", names[i]);
+            LOGWrite(GWL_ERROR, mesg);
+            finish_job(spool, names[i], SPOOL_FAILED);
+        } else {
+            ++left;
+            // Put the modem back in order before the next job
+            GSMWakeUp(sp);
+            GSMSetup(sp, echo, 1);
+        }
+    }
+    for (i = 0; i < count; ++i) {
+        free(names[i]);
+    }
+    return left;
+}
+
+/** Send jobs as they arrive in the spool, until stopped by a signal.
+ *  New jobs are noticed through inotify if it is available, and by
+ *  looking at the spool every interval otherwise. Jobs which failed are
+ *  retried every interval.
+ */
+static int run(const char * spool, SerialPort * sp, int echo,
+               const GSMFileOptions * options, int interval, int retries)
+{
+    char * newdir = spool_path(spool, SPOOL_NEW, "");
+    struct timespec now, next_scan;
+    int notify = -1;
+    int rescan = 1;
+
+    if (newdir == NULL) {
+        return 1;
+    }
+    notify = inotify_init();
+    if ((notify != -1) &&
+        ((fcntl(notify, F_SETFL, O_NONBLOCK) != 0) ||
+         (inotify_add_watch(notify, newdir, IN_MOVED_TO | IN_CLOSE_WRITE) ==
+          -1))) {
+        close(notify);
+        notify = -1;
+    }
+    if (notify == -1) {
+        LOGWrite(GWL_VERBOSE, "Looking for jobs every interval.");
+    }
+    free(newdir);
+
+    signal(SIGTERM, stop_handler);
+    signal(SIGINT, stop_handler);
+    SERDeadline(&next_scan, 0);
+
+    while (!spool_stop) {
+        char events[4096];
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if ((now.tv_sec > next_scan.tv_sec) ||
+            ((now.tv_sec == next_scan.tv_sec) &&
+             (now.tv_nsec >= next_scan.tv_nsec))) {
+            rescan = 1;
+        }
+        if (rescan) {
+            rescan = 0;
+            drain_spool(spool, sp, echo, options, retries);
+            SERDeadline(&next_scan, interval * 1000000L);
+            continue;
+        }
+        GSMIdle(sp, SPOOL_IDLE_USEC);
+        if ((notify != -1) && (read(notify, events, sizeof(events)) > 0)) {
+            rescan = 1;
+        }
+    }
+    if (notify != -1) {
+        close(notify);
+    }
+    LOGWrite(GWL_INFO, "Spooler stopped.");
+    return 0;
+}
+
+//-------------------- USAGE ------------------------
+static void usage(const char * prgname)
+{
+    fprintf(stderr, "Usage: %s [options] {run|submit} ...\n\n", prgname);
+    fprintf(stderr, "  -s <spool>        spool directory [" SPOOL_DIR "]\n");
+    fprintf(stderr, "  -d                debug, write messages to files\n");
+    fprintf(stderr, "  -c <capturefile>  capture all serial traffic to a file\n");
+    fprintf(stderr, "  -b <baud_rate>    set the serial baud rate\n");
+    fprintf(stderr, "  -m <read_mode>    default, batched or lowlatency\n");
+    fprintf(stderr, "  -t                read the serial port in a separate thread\n");
+    fprintf(stderr, "  -e                turn off command echo on the modem\n");
+    fprintf(stderr, "  -T <seconds>      time allowed to send each message [20]\n");
+    fprintf(stderr, "  -P                send file blocks as binary PDU messages\n");
+    fprintf(stderr, "  -E <encoding>     hex, base64 or base84 for file blocks sent\n"
+                    "                    as text [hex]\n");
+    fprintf(stderr, "  -z                compress files as they are sent\n");
+    fprintf(stderr, "  -j <directory>    keep journals of files sent, to resume\n"
+                    "                    failed sends, eg " JOURNAL_DIR "\n");
+    fprintf(stderr, "  -F <k>,<m>        send m parity blocks after each k blocks\n");
+    fprintf(stderr, "  -i <seconds>      time between retries of failed jobs [10]\n");
+    fprintf(stderr, "  -r <attempts>     attempts at a job before it fails [3]\n");
+    fprintf(stderr, "  -L                let the modem close the link to the network\n"
+                    "                    after each block of a file\n");
+    fprintf(stderr, "  -D <file>         request delivery reports for the blocks of\n"
+                    "                    files, tracked in a file, eg\n"
+                    "                    " DELIVERY_FILE "\n");
+    fprintf(stderr, "  -p <serialport>   set the serial port device\n\n");
+    fprintf(stderr, "     run            send jobs as they are queued, over one\n"
+                    "                    modem session, until killed\n");
+    fprintf(stderr, "     submit message <number> <message>\n"
+                    "                    queue a message\n");
+    fprintf(stderr, "     submit send <number> <file>\n"
+                    "                    queue a file\n\n");
+    fprintf(stderr, "Jobs sent are moved to done in the spool, and jobs which\n"
+                    "could not be sent to failed.\n");
+}
+
+//-------------------- MAIN ------------------------
+int main(int argc, char ** argv)
+{
+    const char * option_serialport = "/dev/gprs";
+    const char * option_spool = SPOOL_DIR;
+    const char * cmd;
+    SerialPort * sp;
+    speed_t option_baud = B9600;
+    SerialOptions option_serial = { SER_READ_DEFAULT, 64, 1, 0 };
+    char * option_capture = NULL;
+    int option_echo = 1;
+    int option_interval = 10;
+    int option_retries = 3;
+    GSMFileOptions option_file = { 0, ENC_HEX, 0, NULL, 0, 0, 1 };
+    const char * option_delivery = NULL;
+    DeliveryTable * dt = NULL;
+    int ret;
+
+    LOGInit(GWT_STDERR, GWL_INFO, "Glacsweb spooler");
+
+    while (1) {
+        char mesg[1024]; // For logfile
+        int c = getopt(argc, argv, "s:p:b:m:c:teT:PE:zj:F:i:r:LD:d");
+        if (c == -1) {
+            break;
+        } else if (c == 's') {
+            debug( printf("Got spool %s.\n", optarg); );
+            option_spool = optarg;
+        } else if (c == 'p') {
+            debug( printf("Got port %s.\n", optarg); );
+            option_serialport = optarg;
+        } else if (c == 'b') {
+            debug( printf("Got baud %s.\n", optarg); );
+            if (SERGetBaud(optarg, &option_baud)) {
+                sprintf(mesg, "Unknown baud rate %s", optarg);
+                LOGWrite(GWL_ERROR, mesg);
+            }
+        } else if (c == 'm') {
+            debug( printf("Got read mode %s.\n", optarg); );
+            if (SERGetReadMode(optarg, &option_serial.so_read_mode)) {
+                sprintf(mesg, "Unknown read mode %s", optarg);
+                LOGWrite(GWL_ERROR, mesg);
+            }
+        } else if (c == 'c') {
+            debug( printf("Got capture file %s.\n", optarg); );
+            option_capture = optarg;
+        } else if (c == 't') {
+            debug( printf("Got reader thread flag.\n"); );
+            option_serial.so_reader = 1;
+        } else if (c == 'T') {
+            debug( printf("Got send timeout %s.\n", optarg); );
+            if (atof(optarg) <= 0) {
+                sprintf(mesg, "Bad send timeout %s", optarg);
+                LOGWrite(GWL_ERROR, mesg);
+            } else {
+                GSMSetSendTimeout(atof(optarg) * 1000000);
+            }
+        } else if (c == 'P') {
+            debug( printf("Got PDU mode flag.\n"); );
+            option_file.fo_pdu = 1;
+        } else if (c == 'E') {
+            debug( printf("Got encoding %s.\n", optarg); );
+            if (ENCGetEncoding(optarg, &option_file.fo_encoding)) {
+                sprintf(mesg, "Unknown encoding %s", optarg);
+                LOGWrite(GWL_ERROR, mesg);
+            }
+        } else if (c == 'z') {
+            debug( printf("Got compress flag.\n"); );
+            option_file.fo_compress = 1;
+        } else if (c == 'j') {
+            debug( printf("Got journal directory %s.\n", optarg); );
+            option_file.fo_journal = optarg;
+        } else if (c == 'F') {
+            debug( printf("Got parity %s.\n", optarg); );
+            if ((sscanf(optarg, "%d,%d", &option_file.fo_group,
+                        &option_file.fo_parity) != 2) ||
+                (option_file.fo_group < 1) || (option_file.fo_parity < 0) ||
+                (option_file.fo_group + option_file.fo_parity >
+                 FEC_MAX_BLOCKS)) {
+                sprintf(mesg, "Bad parity %s", optarg);
+                LOGWrite(GWL_ERROR, mesg);
+                option_file.fo_parity = 0;
+            }
+        } else if (c == 'i') {
+            debug( printf("Got interval %s.\n", optarg); );
+            option_interval = atoi(optarg);
+            if (option_interval < 1) {
+                option_interval = 1;
+            }
+        } else if (c == 'r') {
+            debug( printf("Got retries %s.\n", optarg); );
+            option_retries = atoi(optarg);
+        } else if (c == 'L') {
+            debug( printf("Got close link flag.\n"); );
+            option_file.fo_keep_link = 0;
+        } else if (c == 'D') {
+            debug( printf("Got delivery file %s.\n", optarg); );
+            option_delivery = optarg;
+        } else if (c == 'e') {
+            debug( printf("Got echo off flag.\n"); );
+            option_echo = 0;
+        } else if (c == 'd') {
+            debug( printf("Got debug flag.\n"); );
+            GSMDebugMode();
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if ((argc - optind) < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    cmd = argv[optind];
+
+    if (strcmp(cmd, "submit") == 0) {
+        ret = submit(option_spool, argc - optind, argv + optind);
+        if (ret < 0) {
+            usage(argv[0]);
+            return 1;
+        }
+        return ret;
+    } else if (strcmp(cmd, "run") == 0) {
+        char mesg[1024]; // For logfile
+        char * journal = NULL;
+        char * spool;
+
+        if ((make_spool(option_spool) != 0) ||
+            ((spool = realpath(option_spool, NULL)) == NULL)) {
+            return 1;
+        }
+        // Files are sent from the directory they were queued in, so the
+        // journal must not depend on the current directory
+        if (option_file.fo_journal != NULL) {
+            journal = realpath(option_file.fo_journal, NULL);
+            if (journal == NULL) {
+                snprintf(mesg, sizeof(mesg), "Journal directory %s not "
+                         "found, failed sends can not be resumed.",
+                         option_file.fo_journal);
+                LOGWrite(GWL_WARNING, mesg);
+            }
+            option_file.fo_journal = journal;
+        }
+        sp = initialise(option_serialport, option_baud, &option_serial,
+                        option_capture, option_echo);
+        if (sp == NULL) {
+            free(journal);
+            free(spool);
+            return 1;
+        }
+        // Reports are taken while waiting for jobs
+        if ((option_delivery != NULL) &&
+            (((dt = DLROpen(option_delivery)) == NULL) ||
+             (GSMTrackDelivery(sp, dt) != 0))) {
+            LOGWrite(GWL_ERROR, "Can not track delivery reports");
+            ret = 1;
+        } else if (chdir("/") != 0) {
+            // Files are found from the directory they were queued in
+            LOGWrite(GWL_ERROR, "Could not change to the root directory.");
+            ret = 1;
+        } else {
+            ret = run(spool, sp, option_echo, &option_file,
+                      option_interval, option_retries);
+        }
+        SERClosePort(sp);
+        if (dt != NULL) {
+            DLRClose(dt);
+        }
+        free(journal);
+        free(spool);
+        return ret;
+    }
+
+    usage(argv[0]);
+    return 1;
+}
@@ -0,0 +1,360 @@
+/*
+ * Glacsweb journal.c
+ * Journals of the blocks of files which have been sent
+ */
+
+/** \file
+ * A journal records which blocks of a file have been submitted to the
+ * network, so a transfer which fails part way can be resumed later
+ * without sending the blocks again. There is one journal for each
+ * combination of number, file, contents of the file and way of sending
+ * it, kept in a directory on the card, named by a hash of all four. A
+ * changed file gets a new journal, so stale records are never used.
+ *
+ * The journal starts with a header line giving what it is for, followed
+ * by a line for each block submitted, holding the block number in hex.
+ * Lines are appended with a single write and flushed to the card with
+ * fsync() before the next block is sent. A line cut short by a crash is
+ * dropped when the journal is next opened. The journal is removed when
+ * the transfer is complete.
+ *
+ * Copyright (C) 2004 Alistair Riddoch, The University of Southampton
+ */
+
+#include "journal.h"
+#include "log.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+
+#define debug(prg) { if (debug_flag) { prg } }
+
+static const int debug_flag = 0;
+
+/** Version written in the header line of each journal */
+#define JOURNAL_VERSION 1
+
+/** Starting value of a 64 bit FNV-1a hash */
+static const unsigned long long FNV_OFFSET = 14695981039346656037ULL;
+
+/** Add some data to a 64 bit FNV-1a hash. */
+static unsigned long long fnv_add(unsigned long long h, const BYTE * data,
+                                  size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; ++i) {
+        h = (h ^ data[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+/** Hash the contents of a file.
+ *  @return zero if the file was read, non-zero otherwise.
+ */
+static int hash_file(const char * filename, unsigned long long * hash)
+{
+    BYTE buffer[4096];
+    unsigned long long h = FNV_OFFSET;
+    size_t len;
+    FILE * fp;
+    int ret;
+
+    if ((fp = fopen(filename, "r")) == NULL) {
+        return 1;
+    }
+    while ((len = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+        h = fnv_add(h, buffer, len);
+    }
+    ret = ferror(fp);
+    fclose(fp);
+    *hash = h;
+    return ret;
+}
+
+/** Flush the directory holding a journal, so a new journal survives a
+ *  crash. */
+static void sync_directory(const char * dir)
+{
+    int fd = open(dir, O_RDONLY);
+
+    if (fd != -1) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+/** Mark a block as submitted in the journal in memory.
+ *  @return zero if the block was marked, non-zero if out of memory.
+ */
+static int mark_sent(Journal * jn, int block_number)
+{
+    size_t byte = block_number / 8;
+
+    if (byte >= jn->jn_size) {
+        size_t size = (jn->jn_size > 0) ? jn->jn_size : 64;
+        BYTE * sent;
+
+        while (size <= byte) {
+            size *= 2;
+        }
+        if ((sent = realloc(jn->jn_sent, size)) == NULL) {
+            return 1;
+        }
+        memset(sent + jn->jn_size, 0, size - jn->jn_size);
+        jn->jn_sent = sent;
+        jn->jn_size = size;
+    }
+    if ((jn->jn_sent[byte] & (1 << (block_number % 8))) == 0) {
+        jn->jn_sent[byte] |= 1 << (block_number % 8);
+        ++jn->jn_count;
+    }
+    return 0;
+}
+
+/** Parse the block number in one record.
+ *  @return the block number, or -1 if the record is not valid.
+ */
+static int parse_record(const char * text, size_t len)
+{
+    int block_number = 0;
+    size_t i;
+
+    if ((len == 0) || (len > 6)) {
+        return -1;
+    }
+    for (i = 0; i < len; ++i) {
+        char c = text[i];
+
+        if ((c >= '0') && (c <= '9')) {
+            block_number = block_number * 16 + c - '0';
+        } else if ((c >= 'a') && (c <= 'f')) {
+            block_number = block_number * 16 + c - 'a' + 10;
+        } else {
+            return -1;
+        }
+    }
+    return (block_number > 0) ? block_number : -1;
+}
+
+/** Read the records of blocks submitted from a journal, and drop any
+ *  line left incomplete by a crash.
+ *  @param offset position of the first record, after the header.
+ *  @return zero if the journal was read, non-zero otherwise.
+ */
+static int read_records(Journal * jn, const char * text, size_t len,
+                        size_t offset)
+{
+    size_t start = offset;
+    size_t i;
+
+    for (i = offset; i < len; ++i) {
+        int block_number;
+
+        if (text[i] != '\n') {
+            continue;
+        }
+        block_number = parse_record(text + start, i - start);
+        if ((block_number > 0) && (mark_sent(jn, block_number) != 0)) {
+            return 1;
+        }
+        start = i + 1;
+    }
+    if ((start < len) && (ftruncate(jn->jn_fd, start) != 0)) {
+        return 1;
+    }
+    return 0;
+}
+
+/** Read an existing journal if it has the header given, or start it
+ *  afresh with the header otherwise.
+ *  @return zero if the journal is ready for records, non-zero otherwise.
+ */
+static int load_journal(Journal * jn, const char * dir, const char * header,
+                        size_t header_len)
+{
+    char mesg[1024]; // For logfile
+    struct stat sbuf;
+    char * text;
+    int ret = 0;
+
+    if (fstat(jn->jn_fd, &sbuf) != 0) {
+        return 1;
+    }
+    if (sbuf.st_size >= (off_t)header_len) {
+        if ((text = malloc(sbuf.st_size)) == NULL) {
+            LOGWrite(GWL_FATAL, "Out of memory.");
+            return 1;
+        }
+        if (pread(jn->jn_fd, text, sbuf.st_size, 0) != sbuf.st_size) {
+            ret = 1;
+        } else if (memcmp(text, header, header_len) == 0) {
+            ret = read_records(jn, text, sbuf.st_size, header_len);
+            free(text);
+            debug( fprintf(stderr, "Journal %s has %d blocks\n",
+                           jn->jn_path, jn->jn_count); );
+            return ret;
+        }
+        free(text);
+    }
+    if (ret != 0) {
+        snprintf(mesg, sizeof(mesg), "Error reading journal %s.",
+                 jn->jn_path);
+        LOGWrite(GWL_WARNING, mesg);
+        return 1;
+    }
+
+    // A new journal, or one left by another transfer with the same hash
+    if ((ftruncate(jn->jn_fd, 0) != 0) ||
+        (write(jn->jn_fd, header, header_len) != (ssize_t)header_len) ||
+        (fsync(jn->jn_fd) != 0)) {
+        snprintf(mesg, sizeof(mesg), "Error writing journal %s.",
+                 jn->jn_path);
+        LOGWrite(GWL_WARNING, mesg);
+        return 1;
+    }
+    sync_directory(dir);
+    return 0;
+}
+
+/** Open the journal for sending a file to a number, creating it if
+ *  there is none.
+ *  @param dir directory which holds journals.
+ *  @param number the file is being sent to.
+ *  @param filename name of the file being sent.
+ *  @param mode a description of how the file is being sent, which must
+ *  differ for any two ways which split the file into different blocks.
+ *  @return the journal, or NULL if it could not be opened.
+ */
+Journal * JNLOpen(const char * dir, const char * number,
+                  const char * filename, const char * mode)
+{
+    unsigned long long content;
+    char mesg[1024]; // For logfile
+    char * header;
+    Journal * jn;
+    size_t header_len;
+
+    assert(dir != NULL);
+    assert(number != NULL);
+    assert(filename != NULL);
+    assert(mode != NULL);
+
+    if (hash_file(filename, &content) != 0) {
+        snprintf(mesg, sizeof(mesg), "Could not read %s to journal it.",
+                 filename);
+        LOGWrite(GWL_ERROR, mesg);
+        return NULL;
+    }
+    header = malloc(strlen(number) + strlen(filename) + strlen(mode) + 64);
+    jn = calloc(1, sizeof(Journal));
+    if ((header == NULL) || (jn == NULL) ||
+        ((jn->jn_path = malloc(strlen(dir) + 22)) == NULL)) {
+        LOGWrite(GWL_FATAL, "Out of memory.");
+        free(header);
+        free(jn);
+        return NULL;
+    }
+    header_len = sprintf(header, "glacsweb-journal %d %s %s %s %016llx\n",
+                         JOURNAL_VERSION, number, filename, mode, content);
+    sprintf(jn->jn_path, "%s/%016llx.jnl", dir,
+            fnv_add(FNV_OFFSET, (const BYTE *)header, header_len));
+
+    jn->jn_fd = open(jn->jn_path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (jn->jn_fd == -1) {
+        snprintf(mesg, sizeof(mesg), "Could not open journal %s.",
+                 jn->jn_path);
+        LOGWrite(GWL_WARNING, mesg);
+    } else if (load_journal(jn, dir, header, header_len) != 0) {
+        close(jn->jn_fd);
+        jn->jn_fd = -1;
+    }
+    free(header);
+
+    if (jn->jn_fd == -1) {
+        free(jn->jn_sent);
+        free(jn->jn_path);
+        free(jn);
+        return NULL;
+    }
+    return jn;
+}
+
+/** Check whether a block has been submitted.
+ *  @return non-zero if the block has been submitted, zero otherwise.
+ */
+int JNLSent(const Journal * jn, int block_number)
+{
+    size_t byte = block_number / 8;
+
+    assert(jn != NULL);
+
+    return (byte < jn->jn_size) &&
+           ((jn->jn_sent[byte] & (1 << (block_number % 8))) != 0);
+}
+
+/** Get the first block which has not been submitted.
+ *  @return the block number.
+ */
+int JNLFirstUnsent(const Journal * jn)
+{
+    int block_number = 1;
+
+    assert(jn != NULL);
+
+    while (JNLSent(jn, block_number)) {
+        ++block_number;
+    }
+    return block_number;
+}
+
+/** Record that a block has been submitted, and flush the record to the
+ *  card before returning.
+ *  @return zero if the record was written, non-zero otherwise.
+ */
+int JNLRecord(Journal * jn, int block_number)
+{
+    char line[16];
+    int len;
+
+    assert(jn != NULL);
+    assert(block_number > 0);
+
+    if (JNLSent(jn, block_number)) {
+        return 0;
+    }
+    len = sprintf(line, "%x\n", block_number);
+    if ((write(jn->jn_fd, line, len) != len) || (fsync(jn->jn_fd) != 0)) {
+        LOGWrite(GWL_WARNING, "Error writing send journal.");
+        return 1;
+    }
+    if (mark_sent(jn, block_number) != 0) {
+        LOGWrite(GWL_FATAL, "Out of memory.");
+        return 1;
+    }
+    return 0;
+}
+
+/** Close a journal.
+ *  @param complete non-zero if the transfer is complete, in which case
+ *  the journal is removed.
+ */
+void JNLClose(Journal * jn, int complete)
+{
+    assert(jn != NULL);
+
+    close(jn->jn_fd);
+    if (complete) {
+        unlink(jn->jn_path);
+    }
+    free(jn->jn_sent);
+    free(jn->jn_path);
+    free(jn);
+}
@@ -0,0 +1,34 @@
+/*
+ * Glacsweb journal.h
+ * Copyright (C) 2004 Alistair Riddoch, The University of Southampton
+ */
+
+#ifndef GLACSWEB_JOURNAL_H
+#define GLACSWEB_JOURNAL_H
+
+#include "types.h"
+
+#include <stddef.h>
+
+/** The blocks of one transfer which have been submitted */
+typedef struct journal {
+    /** File descriptor of the journal, open for appending */
+    int         jn_fd;
+    /** Path of the journal */
+    char *      jn_path;
+    /** Bit for each block number, set if the block has been submitted */
+    BYTE *      jn_sent;
+    /** Number of bytes allocated in jn_sent */
+    size_t      jn_size;
+    /** Number of distinct blocks submitted */
+    int         jn_count;
+} Journal;
+
+Journal * JNLOpen(const char * dir, const char * number,
+                  const char * filename, const char * mode);
+int JNLSent(const Journal *, int block_number);
+int JNLFirstUnsent(const Journal *);
+int JNLRecord(Journal *, int block_number);
+void JNLClose(Journal *, int complete);
+
+#endif // GLACSWEB_JOURNAL_H
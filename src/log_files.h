@@ -11,6 +11,15 @@
 /* Location of the calibration file */
 #define DEFAULT_CALFILE DIR_PREFIX "/caldata"
 
+/* Directory for journals of files being sent */
+#define JOURNAL_DIR DIR_PREFIX "/journal"
+
+/* Table of messages sent, for matching delivery reports to blocks */
+#define DELIVERY_FILE DIR_PREFIX "/delivery"
+
+/* Spool of messages and files waiting to be sent by gwspool */
+#define SPOOL_DIR DATA_DIR "/spool"
+
 /* Directory for all log files */
 #define LOG_DIR DIR_PREFIX "/data"
 
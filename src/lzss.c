@@ -0,0 +1,285 @@
+/*
+ * Glacsweb lzss.c
+ * Streaming LZSS compression
+ */
+
+/** \file
+ * A small LZSS compressor and decompressor, for files sent by SMS. Data
+ * is encoded in groups of eight items, each group led by a byte of flags,
+ * least significant bit first. A set flag marks a literal byte. A clear
+ * flag marks a reference to earlier data, as two bytes holding 12 bits of
+ * distance less one, then 4 bits of length less LZSS_MIN_MATCH.
+ *
+ * Both directions work on a stream, a piece at a time, so a file never
+ * has to be held in memory. Matches are found with hash chains of three
+ * byte sequences, searched to a limited depth.
+ *
+ * Copyright (C) 2004 Alistair Riddoch, The University of Southampton
+ */
+
+#include "lzss.h"
+
+#include <string.h>
+#include <assert.h>
+
+/** Number of earlier positions tried when looking for a match */
+static const int LZSS_CHAIN_DEPTH = 32;
+
+/** Hash the three bytes at a position. */
+static int hash3(const BYTE * p)
+{
+    return ((p[0] << 4) ^ (p[1] << 2) ^ p[2] ^ (p[0] >> 4)) &
+           (LZSS_HASH - 1);
+}
+
+/** Prepare a compressor for a new stream. */
+void LZSSInitEncoder(LZSSEncoder * le)
+{
+    assert(le != NULL);
+
+    le->le_pos = 0;
+    le->le_end = 0;
+    memset(le->le_head, -1, sizeof(le->le_head));
+    memset(le->le_prev, -1, sizeof(le->le_prev));
+    le->le_group[0] = 0;
+    le->le_group_len = 1;
+    le->le_group_items = 0;
+}
+
+/** Move the group being built to the output, if it has any items.
+ *  @return the number of bytes written.
+ */
+static size_t flush_group(LZSSEncoder * le, BYTE * out)
+{
+    size_t len = le->le_group_len;
+
+    if (le->le_group_items == 0) {
+        return 0;
+    }
+    memcpy(out, le->le_group, len);
+    le->le_group[0] = 0;
+    le->le_group_len = 1;
+    le->le_group_items = 0;
+    return len;
+}
+
+/** Add the position of the three bytes at a position to its hash chain,
+ *  if all three are present. */
+static void insert(LZSSEncoder * le, int pos)
+{
+    int h;
+
+    if (pos + LZSS_MIN_MATCH > le->le_end) {
+        return;
+    }
+    h = hash3(le->le_buf + pos);
+    le->le_prev[pos] = le->le_head[h];
+    le->le_head[h] = pos;
+}
+
+/** Drop the older half of the buffer, to make room for more data. */
+static void slide(LZSSEncoder * le)
+{
+    int i;
+
+    assert(le->le_pos >= LZSS_WINDOW);
+
+    memmove(le->le_buf, le->le_buf + LZSS_WINDOW, le->le_end - LZSS_WINDOW);
+    le->le_pos -= LZSS_WINDOW;
+    le->le_end -= LZSS_WINDOW;
+    for (i = 0; i < LZSS_HASH; ++i) {
+        le->le_head[i] = (le->le_head[i] >= LZSS_WINDOW) ?
+                         le->le_head[i] - LZSS_WINDOW : -1;
+    }
+    for (i = 0; i < LZSS_WINDOW; ++i) {
+        short prev = le->le_prev[i + LZSS_WINDOW];
+
+        le->le_prev[i] = (prev >= LZSS_WINDOW) ? prev - LZSS_WINDOW : -1;
+        le->le_prev[i + LZSS_WINDOW] = -1;
+    }
+}
+
+/** Find the longest match for the data at the current position.
+ *  @param distance pointer used to return how far back the match is.
+ *  @return the length of the match, which may be less than
+ *  LZSS_MIN_MATCH if there is none.
+ */
+static int find_match(const LZSSEncoder * le, int * distance)
+{
+    const BYTE * cur = le->le_buf + le->le_pos;
+    int max = le->le_end - le->le_pos;
+    int best = 0;
+    int depth = LZSS_CHAIN_DEPTH;
+    int cand;
+
+    if (max > LZSS_MAX_MATCH) {
+        max = LZSS_MAX_MATCH;
+    }
+    if (max < LZSS_MIN_MATCH) {
+        return 0;
+    }
+    cand = le->le_head[hash3(cur)];
+    while ((cand >= 0) && (le->le_pos - cand <= LZSS_WINDOW) &&
+           (depth-- > 0)) {
+        const BYTE * p = le->le_buf + cand;
+        int len = 0;
+
+        while ((len < max) && (p[len] == cur[len])) {
+            ++len;
+        }
+        if (len > best) {
+            best = len;
+            *distance = le->le_pos - cand;
+            if (len == max) {
+                break;
+            }
+        }
+        cand = le->le_prev[cand];
+    }
+    return best;
+}
+
+/** Encode the data held, keeping back enough for a full length match
+ *  unless the stream is being finished.
+ *  @return the number of bytes written.
+ */
+static size_t encode(LZSSEncoder * le, BYTE * out, int finish)
+{
+    size_t produced = 0;
+
+    while ((le->le_end - le->le_pos >= LZSS_MAX_MATCH) ||
+           (finish && (le->le_pos < le->le_end))) {
+        int distance = 0;
+        int len = find_match(le, &distance);
+        BYTE * item = le->le_group + le->le_group_len;
+
+        if (len >= LZSS_MIN_MATCH) {
+            item[0] = (distance - 1) >> 4;
+            item[1] = (((distance - 1) & 0x0f) << 4) | (len - LZSS_MIN_MATCH);
+            le->le_group_len += 2;
+        } else {
+            len = 1;
+            item[0] = le->le_buf[le->le_pos];
+            le->le_group[0] |= 1 << le->le_group_items;
+            le->le_group_len += 1;
+        }
+        while (len-- > 0) {
+            insert(le, le->le_pos++);
+        }
+        if (++le->le_group_items == 8) {
+            produced += flush_group(le, out + produced);
+        }
+    }
+    return produced;
+}
+
+/** Compress some more of a stream. Some of the data may be held back
+ *  until more is given, or the stream is finished.
+ *  @param in data to compress.
+ *  @param len number of bytes of data.
+ *  @param out buffer for the compressed data, of LZSS_BOUND(len) bytes.
+ *  @return the number of bytes of compressed data written.
+ */
+size_t LZSSCompress(LZSSEncoder * le, const BYTE * in, size_t len, BYTE * out)
+{
+    size_t produced = 0;
+
+    assert(le != NULL);
+    assert(in != NULL || len == 0);
+    assert(out != NULL);
+
+    while (len > 0) {
+        size_t space = 2 * LZSS_WINDOW - le->le_end;
+
+        if (space == 0) {
+            slide(le);
+            continue;
+        }
+        if (space > len) {
+            space = len;
+        }
+        memcpy(le->le_buf + le->le_end, in, space);
+        le->le_end += space;
+        in += space;
+        len -= space;
+        produced += encode(le, out + produced, 0);
+    }
+    return produced;
+}
+
+/** Finish a stream, writing out all the data held back.
+ *  @param out buffer for the compressed data, of LZSS_BOUND(0) bytes.
+ *  @return the number of bytes of compressed data written.
+ */
+size_t LZSSFinish(LZSSEncoder * le, BYTE * out)
+{
+    size_t produced;
+
+    assert(le != NULL);
+    assert(out != NULL);
+
+    produced = encode(le, out, 1);
+    produced += flush_group(le, out + produced);
+    return produced;
+}
+
+/** Prepare a decompressor for a new stream. */
+void LZSSInitDecoder(LZSSDecoder * ld)
+{
+    assert(ld != NULL);
+
+    ld->ld_total = 0;
+    ld->ld_flags = 0;
+    ld->ld_items = 0;
+    ld->ld_first = -1;
+}
+
+/** Decompress some more of a stream.
+ *  @param in compressed data.
+ *  @param len number of bytes of compressed data.
+ *  @param out buffer for the data, of len * LZSS_MAX_MATCH bytes.
+ *  @return the number of bytes of data written, or -1 if the compressed
+ *  data refers back past the start of the stream.
+ */
+long LZSSDecompress(LZSSDecoder * ld, const BYTE * in, size_t len, BYTE * out)
+{
+    BYTE * p = out;
+    size_t i;
+
+    assert(ld != NULL);
+    assert(in != NULL || len == 0);
+    assert(out != NULL);
+
+    for (i = 0; i < len; ++i) {
+        BYTE c = in[i];
+
+        if (ld->ld_items == 0) {
+            ld->ld_flags = c;
+            ld->ld_items = 8;
+        } else if (ld->ld_flags & 1) {
+            ld->ld_window[ld->ld_total++ % LZSS_WINDOW] = c;
+            *p++ = c;
+            ld->ld_flags >>= 1;
+            --ld->ld_items;
+        } else if (ld->ld_first < 0) {
+            ld->ld_first = c;
+        } else {
+            unsigned long distance = ((ld->ld_first << 4) | (c >> 4)) + 1;
+            int n = (c & 0x0f) + LZSS_MIN_MATCH;
+
+            if (distance > ld->ld_total) {
+                return -1;
+            }
+            while (n-- > 0) {
+                BYTE b = ld->ld_window[(ld->ld_total - distance) % LZSS_WINDOW];
+
+                ld->ld_window[ld->ld_total++ % LZSS_WINDOW] = b;
+                *p++ = b;
+            }
+            ld->ld_first = -1;
+            ld->ld_flags >>= 1;
+            --ld->ld_items;
+        }
+    }
+    return p - out;
+}
@@ -0,0 +1,63 @@
+/*
+ * Glacsweb lzss.h
+ * Copyright (C) 2004 Alistair Riddoch, The University of Southampton
+ */
+
+#ifndef GLACSWEB_LZSS_H
+#define GLACSWEB_LZSS_H
+
+#include "types.h"
+
+#include <stddef.h>
+
+/** Size of the window of earlier data which matches can refer to */
+#define LZSS_WINDOW             4096
+/** Shortest match encoded as a reference */
+#define LZSS_MIN_MATCH          3
+/** Longest match encoded as a reference */
+#define LZSS_MAX_MATCH          18
+/** Number of hash chains used to find matches */
+#define LZSS_HASH               4096
+
+/** Size of output buffer which is always enough for the result of
+ *  compressing len bytes, or of finishing */
+#define LZSS_BOUND(len)         (((len) + LZSS_MAX_MATCH) * 9 / 8 + 24)
+
+/** State of a compressor */
+typedef struct lzss_encoder {
+    /** The window, followed by data not yet encoded */
+    BYTE        le_buf[2 * LZSS_WINDOW];
+    /** Position in le_buf of the next byte to encode */
+    int         le_pos;
+    /** Position in le_buf after the last byte given */
+    int         le_end;
+    /** Latest position of each hash of three bytes, or -1 */
+    short       le_head[LZSS_HASH];
+    /** Previous position with the same hash as each position, or -1 */
+    short       le_prev[2 * LZSS_WINDOW];
+    /** Flags byte and items of the group being built */
+    BYTE        le_group[1 + 8 * 2];
+    int         le_group_len;
+    int         le_group_items;
+} LZSSEncoder;
+
+/** State of a decompressor */
+typedef struct lzss_decoder {
+    BYTE        ld_window[LZSS_WINDOW];
+    /** Number of bytes decoded so far */
+    unsigned long ld_total;
+    /** Flags of the group being decoded */
+    unsigned int ld_flags;
+    /** Number of items left in the group */
+    int         ld_items;
+    /** First byte of a reference, or -1 */
+    int         ld_first;
+} LZSSDecoder;
+
+void LZSSInitEncoder(LZSSEncoder *);
+size_t LZSSCompress(LZSSEncoder *, const BYTE * in, size_t len, BYTE * out);
+size_t LZSSFinish(LZSSEncoder *, BYTE * out);
+void LZSSInitDecoder(LZSSDecoder *);
+long LZSSDecompress(LZSSDecoder *, const BYTE * in, size_t len, BYTE * out);
+
+#endif // GLACSWEB_LZSS_H
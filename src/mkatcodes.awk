@@ -0,0 +1,136 @@
+# Glacsweb mkatcodes.awk
+# Generate atcodes.h from atcodes.def
+#
+# Finds a seed and table size for which the hash used by ATClassify
+# puts every key in its own slot, so classifying a line takes one hash
+# and one comparison.
+#
+# Copyright (C) 2004 Alistair Riddoch, The University of Southampton
+
+BEGIN {
+    FS = "\t+"
+    MOD = 1000003
+    for (i = 1; i < 128; ++i) {
+        ord[sprintf("%c", i)] = i
+    }
+    n = 0
+}
+
+/^#/ || /^[ \t]*$/ {
+    next
+}
+
+NF != 3 {
+    printf("atcodes.def:%d: expected key, kinds and name\n", NR) > "/dev/stderr"
+    failed = 1
+    exit 1
+}
+
+{
+    ++n
+    key[n] = $1
+    name[n] = $3
+    kinds = ""
+    count = split($2, kind, ",")
+    for (k = 1; k <= count; ++k) {
+        if (kind[k] == "final") {
+            flag = "AT_KIND_FINAL"
+        } else if (kind[k] == "info") {
+            flag = "AT_KIND_INFO"
+        } else if (kind[k] == "urc") {
+            flag = "AT_KIND_URC"
+        } else {
+            printf("atcodes.def:%d: unknown kind %s\n", NR, kind[k]) > "/dev/stderr"
+            failed = 1
+            exit 1
+        }
+        kinds = (kinds == "") ? flag : kinds " | " flag
+    }
+    kindset[n] = kinds
+    if (length($1) > keymax) {
+        keymax = length($1)
+    }
+}
+
+function hash(s, seed,    h, i) {
+    h = seed
+    for (i = 1; i <= length(s); ++i) {
+        h = (h * 33 + ord[substr(s, i, 1)]) % MOD
+    }
+    return h
+}
+
+# Try each seed in turn for a table size, and return the first which
+# gives no collisions, or -1 if none does.
+function find_seed(size,    seed, i, slot, used) {
+    for (seed = 0; seed < 5000; ++seed) {
+        split("", used)
+        for (i = 1; i <= n; ++i) {
+            slot = hash(key[i], seed) % size
+            if (slot in used) {
+                break
+            }
+            used[slot] = i
+        }
+        if (i > n) {
+            return seed
+        }
+    }
+    return -1
+}
+
+END {
+    if (failed) {
+        exit 1
+    }
+
+    size = 16
+    while (size < 2 * n) {
+        size *= 2
+    }
+    while ((seed = find_seed(size)) < 0) {
+        size *= 2
+    }
+    for (i = 1; i <= n; ++i) {
+        slot_of[hash(key[i], seed) % size] = i
+    }
+
+    print "/* Generated from atcodes.def by mkatcodes.awk. Do not edit. */"
+    print ""
+    print "#ifndef GLACSWEB_ATCODES_H"
+    print "#define GLACSWEB_ATCODES_H"
+    print ""
+    print "/** Known result codes and response prefixes */"
+    print "typedef enum at_code {"
+    print "    AT_CODE_NONE = 0,"
+    for (i = 1; i <= n; ++i) {
+        printf("    AT_CODE_%s,\n", name[i])
+    }
+    print "    AT_CODE_COUNT"
+    print "} ATCode;"
+    print ""
+    print "/** Hash parameters, which must match the table below */"
+    printf("#define AT_HASH_SEED    %d\n", seed)
+    printf("#define AT_HASH_MOD     %d\n", MOD)
+    printf("#define AT_HASH_SIZE    %d\n", size)
+    printf("#define AT_KEY_MAX      %d\n", keymax)
+    print ""
+    print "#endif // GLACSWEB_ATCODES_H"
+    print ""
+    print "#ifdef AT_CODES_TABLE"
+    print ""
+    print "/** Known keys, each in the slot its hash selects */"
+    print "static const ATCodeEntry at_code_table[AT_HASH_SIZE] = {"
+    for (slot = 0; slot < size; ++slot) {
+        if (slot in slot_of) {
+            i = slot_of[slot]
+            printf("    { \"%s\", %d, AT_CODE_%s, %s },\n", key[i],
+                   length(key[i]), name[i], kindset[i])
+        } else {
+            print "    { 0, 0, AT_CODE_NONE, 0 },"
+        }
+    }
+    print "};"
+    print ""
+    print "#endif // AT_CODES_TABLE"
+}
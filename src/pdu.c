@@ -0,0 +1,246 @@
+/*
+ * Glacsweb pdu.c
+ * SMS PDU building
+ */
+
+/** \file
+ * Building of SMS-SUBMIT PDUs, as given to the modem with AT+CMGS in PDU
+ * mode (AT+CMGF=0). This lets messages carry 140 bytes of 8-bit data,
+ * or 70 characters of UCS2 text, rather than the text which can be sent
+ * in text mode. Status reports, which the modem passes on as PDUs in PDU
+ * mode, are also decoded here.
+ *
+ * Copyright (C) 2004 Alistair Riddoch, The University of Southampton
+ */
+
+#include "pdu.h"
+#include "log.h"
+
+#include <ctype.h>
+#include <string.h>
+#include <assert.h>
+
+#define debug(prg) { if (debug_flag) { prg } }
+
+static const int debug_flag = 0;
+
+/** First octet of an SMS-SUBMIT with no validity period */
+static const BYTE PDU_SMS_SUBMIT = 0x01;
+
+/** Message type of an SMS-STATUS-REPORT, in the low bits of the first
+ *  octet */
+static const BYTE PDU_MTI_STATUS_REPORT = 0x02;
+
+/** Type of address for an international number */
+static const BYTE PDU_TOA_INTERNATIONAL = 0x91;
+/** Type of address for a number of unknown type */
+static const BYTE PDU_TOA_UNKNOWN = 0x81;
+
+/** Information element for a concatenated message with an 8-bit
+ *  reference number */
+static const BYTE PDU_IEI_CONCAT_8 = 0x00;
+
+static const char hex_digits[] = "0123456789ABCDEF";
+
+/** Encode bytes as upper case hex text.
+ *  @param data bytes to encode.
+ *  @param len number of bytes.
+ *  @param hex buffer for the text, which must hold 2 * len + 1 characters.
+ */
+void PDUHexEncode(const BYTE * data, size_t len, char * hex)
+{
+    size_t i;
+
+    for (i = 0; i < len; ++i) {
+        *hex++ = hex_digits[data[i] >> 4];
+        *hex++ = hex_digits[data[i] & 0x0f];
+    }
+    *hex = 0;
+}
+
+/** Decode hex text into bytes, stopping at the end of the text or of
+ *  the buffer.
+ *  @return the number of bytes decoded, or -1 if the text is not hex.
+ */
+static int hex_decode(const char * hex, BYTE * data, size_t size)
+{
+    size_t len = 0;
+
+    while ((hex[0] != 0) && (len < size)) {
+        const char * high = strchr(hex_digits, toupper((BYTE)hex[0]));
+        const char * low = strchr(hex_digits, toupper((BYTE)hex[1]));
+
+        if ((hex[1] == 0) || (high == NULL) || (low == NULL)) {
+            return -1;
+        }
+        data[len++] = ((high - hex_digits) << 4) | (low - hex_digits);
+        hex += 2;
+    }
+    return len;
+}
+
+/** Build the user data header which marks one part of a concatenated
+ *  message. Receivers join the parts with the same reference number, in
+ *  order of sequence number, into one message. Messages carrying the
+ *  header must be sent with PDU_FLAG_UDHI set.
+ *  @param udh buffer for the header, of PDU_CONCAT_HEADER bytes.
+ *  @param ref reference number shared by all the parts of the message.
+ *  @param total number of parts in the message, from 1 to 255.
+ *  @param seq sequence number of this part, counting from 1.
+ *  @return the length of the header.
+ */
+size_t PDUConcatHeader(BYTE * udh, int ref, int total, int seq)
+{
+    assert(udh != NULL);
+    assert((total > 0) && (total < 256));
+    assert((seq > 0) && (seq <= total));
+
+    udh[0] = PDU_CONCAT_HEADER - 1;     // Length of the header
+    udh[1] = PDU_IEI_CONCAT_8;
+    udh[2] = 3;                         // Length of the element
+    udh[3] = ref & 0xff;
+    udh[4] = total;
+    udh[5] = seq;
+    return PDU_CONCAT_HEADER;
+}
+
+/** Build the hex text of an SMS-SUBMIT PDU.
+ *  The service centre address is left empty, so the modem uses the one
+ *  stored on the SIM.
+ *  @param number destination, of digits with an optional leading +.
+ *  @param flags PDU_FLAG_ bits to set in the first octet.
+ *  @param dcs data coding scheme of the user data.
+ *  @param data user data, including any user data header. Text in the
+ *  7-bit alphabet must already be packed.
+ *  @param len length of the user data, which is counted in septets for
+ *  7-bit text, including the header and the fill bits after it, or in
+ *  bytes otherwise.
+ *  @param hex buffer for the PDU text, of at least PDU_MAX_HEX characters.
+ *  @param tpdu_len pointer used to return the length in octets to give
+ *  to AT+CMGS, which does not count the service centre address.
+ *  @return zero on success, or non-zero if the number or data can not be
+ *  sent.
+ */
+int PDUEncodeSubmit(const char * number, int flags, BYTE dcs,
+                    const BYTE * data, size_t len, char * hex,
+                    int * tpdu_len)
+{
+    BYTE pdu[PDU_MAX_HEX / 2];
+    BYTE * p = pdu;
+    size_t bytes = len;
+    size_t digits;
+    size_t i;
+
+    assert(number != NULL);
+    assert(data != NULL || len == 0);
+    assert(hex != NULL);
+    assert(tpdu_len != NULL);
+
+    // Default alphabet in the general data coding group
+    if (((dcs & 0xc0) == 0) && ((dcs & 0x0c) == PDU_DCS_7BIT)) {
+        bytes = (len * 7 + 7) / 8;
+    }
+    if ((len > PDU_MAX_SEPTETS) || (bytes > PDU_MAX_DATA)) {
+        LOGWrite(GWL_ERROR, "Too much data for one message.");
+        return 1;
+    }
+
+    *p++ = 0x00;                        // Service centre from the SIM
+    *p++ = PDU_SMS_SUBMIT | flags;
+    *p++ = 0x00;                        // Message reference set by modem
+
+    // Destination address, as swapped semi-octets padded with F
+    if (*number == '+') {
+        ++number;
+        digits = strlen(number);
+        p[1] = PDU_TOA_INTERNATIONAL;
+    } else {
+        digits = strlen(number);
+        p[1] = PDU_TOA_UNKNOWN;
+    }
+    if ((digits == 0) || (digits > PDU_MAX_DIGITS) ||
+        (strspn(number, "0123456789") != digits)) {
+        LOGWrite(GWL_ERROR, "Bad phone number for PDU message.");
+        return 1;
+    }
+    p[0] = digits;
+    p += 2;
+    for (i = 0; i < digits; i += 2) {
+        BYTE low = number[i] - '0';
+        BYTE high = (i + 1 < digits) ? number[i + 1] - '0' : 0x0f;
+
+        *p++ = (high << 4) | low;
+    }
+
+    *p++ = 0x00;                        // Protocol identifier
+    *p++ = dcs;
+    *p++ = len;
+    memcpy(p, data, bytes);
+    p += bytes;
+
+    *tpdu_len = (p - pdu) - 1;
+    PDUHexEncode(pdu, p - pdu, hex);
+    debug( printf("PDU %s\n", hex); );
+    return 0;
+}
+
+/** Decode the hex text of an SMS-STATUS-REPORT PDU, as the modem gives
+ *  it after a +CDS report in PDU mode.
+ *  @param hex PDU text, starting with the service centre address.
+ *  @param mr pointer used to return the reference of the message the
+ *  report is for.
+ *  @param number buffer of PDU_MAX_DIGITS + 2 characters used to return
+ *  the recipient, or NULL. Alphanumeric addresses are returned empty.
+ *  @param status pointer used to return the status of the message.
+ *  @return zero on success, or non-zero if the text is not a status
+ *  report.
+ */
+int PDUDecodeStatusReport(const char * hex, int * mr, char * number,
+                          int * status)
+{
+    BYTE pdu[PDU_MAX_HEX / 2];
+    int len, digits, i;
+    int p;
+
+    assert(hex != NULL);
+    assert(mr != NULL);
+    assert(status != NULL);
+
+    if ((len = hex_decode(hex, pdu, sizeof(pdu))) < 1) {
+        return 1;
+    }
+
+    // Skip the service centre address
+    p = 1 + pdu[0];
+    if ((p + 4 > len) || ((pdu[p] & 0x03) != PDU_MTI_STATUS_REPORT)) {
+        return 1;
+    }
+    *mr = pdu[p + 1];
+    digits = pdu[p + 2];
+    p += 4;
+    if ((digits > PDU_MAX_DIGITS) || (p + (digits + 1) / 2 + 15 > len)) {
+        return 1;
+    }
+    if (number != NULL) {
+        char * n = number;
+
+        if ((pdu[p - 1] & 0x70) == 0x50) {
+            // Alphanumeric, which no reply can be sent to
+            digits = 0;
+        } else if (pdu[p - 1] == PDU_TOA_INTERNATIONAL) {
+            *n++ = '+';
+        }
+        for (i = 0; i < digits; ++i) {
+            BYTE digit = (pdu[p + i / 2] >> ((i % 2) * 4)) & 0x0f;
+
+            *n++ = (digit < 10) ? '0' + digit : '#';
+        }
+        *n = 0;
+    }
+
+    // Skip the address and the service centre and discharge times
+    p += (pdu[p - 2] + 1) / 2 + 14;
+    *status = pdu[p];
+    debug( printf("Status report for %d is %02x\n", *mr, *status); );
+    return 0;
+}
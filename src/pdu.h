@@ -0,0 +1,50 @@
+/*
+ * Glacsweb pdu.h
+ * Copyright (C) 2004 Alistair Riddoch, The University of Southampton
+ */
+
+#ifndef GLACSWEB_PDU_H
+#define GLACSWEB_PDU_H
+
+#include "types.h"
+
+#include <stddef.h>
+
+/** Maximum number of user data bytes in one SMS message */
+#define PDU_MAX_DATA            140
+/** Maximum number of user data septets in one 7-bit SMS message */
+#define PDU_MAX_SEPTETS         160
+
+/** Maximum number of digits in a destination address */
+#define PDU_MAX_DIGITS          20
+
+/** Maximum length of the hex text of an SMS-SUBMIT PDU, including the
+ *  empty service centre address and the NULL terminator */
+#define PDU_MAX_HEX             (2 * (1 + 1 + 1 + 2 + PDU_MAX_DIGITS / 2 + \
+                                      3 + PDU_MAX_DATA) + 1)
+
+/** First octet flag for user data which starts with a header */
+#define PDU_FLAG_UDHI           0x40
+/** First octet flag requesting a status report */
+#define PDU_FLAG_SRR            0x20
+
+/** Data coding scheme for text in the GSM 7-bit default alphabet */
+#define PDU_DCS_7BIT            0x00
+/** Data coding scheme for 8-bit data */
+#define PDU_DCS_8BIT            0x04
+/** Data coding scheme for UCS2 text */
+#define PDU_DCS_UCS2            0x08
+
+/** Length of the user data header for one part of a concatenated
+ *  message */
+#define PDU_CONCAT_HEADER       6
+
+int PDUEncodeSubmit(const char * number, int flags, BYTE dcs,
+                    const BYTE * data, size_t len, char * hex,
+                    int * tpdu_len);
+size_t PDUConcatHeader(BYTE * udh, int ref, int total, int seq);
+void PDUHexEncode(const BYTE * data, size_t len, char * hex);
+int PDUDecodeStatusReport(const char * hex, int * mr, char * number,
+                          int * status);
+
+#endif // GLACSWEB_PDU_H
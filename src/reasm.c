@@ -0,0 +1,898 @@
+/*
+ * Glacsweb reasm.c
+ * Rebuilding files from the messages they were sent in
+ */
+
+/** \file
+ * Reassembly of files sent by GSMSendFile. Messages are given one at a
+ * time, in any order, and each is decoded as it arrives, so a whole inbox
+ * is handled in one pass. Both the text formats, with their header line
+ * of name and block number, and the binary PDU format are understood.
+ * Repeated blocks are counted and dropped. When all the messages have
+ * been given, REASMFinish writes out each file, and reports the blocks
+ * which are missing from any which are not complete. Files which were
+ * compressed as they were sent are decompressed as they are written.
+ * Parity blocks are held until then, and used to rebuild any blocks
+ * which are missing from the groups they cover.
+ *
+ * Copyright (C) 2004 Alistair Riddoch, The University of Southampton
+ */
+
+#include "reasm.h"
+#include "encode.h"
+#include "lzss.h"
+#include "fec.h"
+#include "log.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#define debug(prg) { if (debug_flag) { prg } }
+
+static const int debug_flag = 0;
+
+/** Longest line of encoded data accepted in a text message */
+#define REASM_TEXT_MAX          1024
+
+/** Bytes in the header of a binary block, besides the name */
+static const size_t REASM_BINARY_HEADER = 4;
+
+/** Bytes in the header of a binary parity block, besides the name */
+static const size_t REASM_PARITY_HEADER = 7;
+
+/** All the flags which may be set in a block header */
+static const int REASM_FLAGS = REASM_FLAG_COMPRESSED | REASM_FLAG_PARITY;
+
+/** Create a reassembler.
+ *  @param outdir directory into which the files are written.
+ *  @return the new reassembler, or NULL if out of memory.
+ */
+Reassembler * REASMCreate(const char * outdir)
+{
+    Reassembler * re;
+
+    assert(outdir != NULL);
+
+    re = calloc(1, sizeof(Reassembler));
+    if (re == NULL) {
+        return NULL;
+    }
+    re->re_outdir = strdup(outdir);
+    if (re->re_outdir == NULL) {
+        free(re);
+        return NULL;
+    }
+    return re;
+}
+
+/** Free a file and all its blocks. */
+static void free_file(ReasmFile * rf)
+{
+    int i;
+
+    for (i = 0; i < rf->rf_size; ++i) {
+        free(rf->rf_blocks[i].rb_data);
+    }
+    for (i = 0; i < rf->rf_parity_count; ++i) {
+        free(rf->rf_parity[i].rp_data);
+    }
+    free(rf->rf_blocks);
+    free(rf->rf_parity);
+    free(rf);
+}
+
+/** Destroy a reassembler, dropping any files not yet written. */
+void REASMDestroy(Reassembler * re)
+{
+    int i;
+
+    assert(re != NULL);
+
+    for (i = 0; i < REASM_BUCKETS; ++i) {
+        while (re->re_files[i] != NULL) {
+            ReasmFile * rf = re->re_files[i];
+
+            re->re_files[i] = rf->rf_next;
+            free_file(rf);
+        }
+    }
+    free(re->re_outdir);
+    free(re);
+}
+
+/** Hash a file name into a bucket, with FNV-1a. */
+static unsigned int name_bucket(const char * name, size_t len)
+{
+    unsigned long h = 2166136261UL;
+    size_t i;
+
+    for (i = 0; i < len; ++i) {
+        h = ((h ^ (unsigned char)name[i]) * 16777619UL) & 0xffffffffUL;
+    }
+    return h % REASM_BUCKETS;
+}
+
+/** Find the file with a name, creating it if it is not known.
+ *  @return the file, or NULL if out of memory.
+ */
+static ReasmFile * find_file(Reassembler * re, const char * name, size_t len)
+{
+    unsigned int bucket = name_bucket(name, len);
+    ReasmFile * rf;
+
+    for (rf = re->re_files[bucket]; rf != NULL; rf = rf->rf_next) {
+        if ((strncmp(rf->rf_name, name, len) == 0) &&
+            (rf->rf_name[len] == 0)) {
+            return rf;
+        }
+    }
+    rf = calloc(1, sizeof(ReasmFile));
+    if (rf == NULL) {
+        return NULL;
+    }
+    memcpy(rf->rf_name, name, len);
+    rf->rf_name[len] = 0;
+    rf->rf_next = re->re_files[bucket];
+    re->re_files[bucket] = rf;
+    return rf;
+}
+
+/** Find the file a block belongs to, checking that the block has the
+ *  same flags as the others of the file.
+ *  @return the file, or NULL if the block can not be used.
+ */
+static ReasmFile * file_for_block(Reassembler * re, const char * name,
+                                  size_t namelen, int block_number, int flags)
+{
+    ReasmFile * rf;
+
+    if ((namelen == 0) || (namelen > REASM_NAME_MAX) ||
+        (memchr(name, 0, namelen) != NULL) || (block_number < 1)) {
+        return NULL;
+    }
+    if ((rf = find_file(re, name, namelen)) == NULL) {
+        LOGWrite(GWL_FATAL, "Out of memory.");
+        return NULL;
+    }
+    flags &= ~REASM_FLAG_PARITY;
+    if ((rf->rf_count == 0) && (rf->rf_parity_count == 0)) {
+        rf->rf_flags = flags;
+    } else if (rf->rf_flags != flags) {
+        char mesg[REASM_NAME_MAX + 100];
+
+        snprintf(mesg, sizeof(mesg), "Block %d of %s does not match the "
+                 "compression of the others, and was dropped.", block_number,
+                 rf->rf_name);
+        LOGWrite(GWL_WARNING, mesg);
+        return NULL;
+    }
+    return rf;
+}
+
+/** Make room in a file for a block number.
+ *  @return zero if there is room, non-zero if out of memory.
+ */
+static int grow_blocks(ReasmFile * rf, int block_number)
+{
+    int size = (rf->rf_size > 0) ? rf->rf_size : 16;
+    ReasmBlock * blocks;
+
+    if (block_number <= rf->rf_size) {
+        return 0;
+    }
+    while (size < block_number) {
+        size *= 2;
+    }
+    blocks = realloc(rf->rf_blocks, size * sizeof(ReasmBlock));
+    if (blocks == NULL) {
+        LOGWrite(GWL_FATAL, "Out of memory.");
+        return 1;
+    }
+    memset(blocks + rf->rf_size, 0, (size - rf->rf_size) * sizeof(ReasmBlock));
+    rf->rf_blocks = blocks;
+    rf->rf_size = size;
+    return 0;
+}
+
+/** Store a block which is not yet held in a file.
+ *  @return zero if the block was stored, non-zero if out of memory.
+ */
+static int store_block(ReasmFile * rf, int block_number, const BYTE * data,
+                       size_t len)
+{
+    ReasmBlock * rb;
+
+    if (grow_blocks(rf, block_number) != 0) {
+        return 1;
+    }
+    rb = &rf->rf_blocks[block_number - 1];
+    if ((rb->rb_data = malloc(len)) == NULL) {
+        LOGWrite(GWL_FATAL, "Out of memory.");
+        return 1;
+    }
+    memcpy(rb->rb_data, data, len);
+    rb->rb_len = len;
+    ++rf->rf_count;
+    if (block_number > rf->rf_last) {
+        rf->rf_last = block_number;
+    }
+    return 0;
+}
+
+/** Store a decoded block in the file it belongs to. */
+static ReasmResult add_block(Reassembler * re, const char * name,
+                             size_t namelen, int block_number, int flags,
+                             const BYTE * data, size_t len)
+{
+    ReasmFile * rf;
+    ReasmBlock * rb;
+
+    if ((len == 0) ||
+        ((rf = file_for_block(re, name, namelen, block_number,
+                              flags)) == NULL)) {
+        ++re->re_stats.rs_invalid;
+        return REASM_INVALID;
+    }
+
+    if (block_number <= rf->rf_size) {
+        rb = &rf->rf_blocks[block_number - 1];
+        if ((rb->rb_data != NULL) && (rb->rb_len == len) &&
+            (memcmp(rb->rb_data, data, len) == 0)) {
+            ++re->re_stats.rs_duplicates;
+            return REASM_DUPLICATE;
+        }
+        if (rb->rb_data != NULL) {
+            char mesg[REASM_NAME_MAX + 80];
+
+            snprintf(mesg, sizeof(mesg), "Block %d of %s differs from the "
+                     "copy already received, and was dropped.", block_number,
+                     rf->rf_name);
+            LOGWrite(GWL_WARNING, mesg);
+            ++re->re_stats.rs_conflicts;
+            return REASM_CONFLICT;
+        }
+    }
+    if (store_block(rf, block_number, data, len) != 0) {
+        ++re->re_stats.rs_invalid;
+        return REASM_INVALID;
+    }
+    ++re->re_stats.rs_blocks;
+    debug( fprintf(stderr, "Block %d of %s, %zu bytes\n", block_number,
+                   rf->rf_name, len); );
+    return REASM_NEW;
+}
+
+/** Store a parity block in the file it belongs to, to be used when the
+ *  file is written. */
+static ReasmResult add_parity(Reassembler * re, const char * name,
+                              size_t namelen, const ReasmParity * parity,
+                              int flags, const BYTE * data, size_t len)
+{
+    ReasmFile * rf;
+    ReasmParity * rp;
+    int i;
+
+    if ((parity->rp_k < 1) || (parity->rp_m < 1) ||
+        (parity->rp_j >= parity->rp_m) ||
+        (parity->rp_k + parity->rp_m > FEC_MAX_BLOCKS) || (len < 3) ||
+        ((rf = file_for_block(re, name, namelen, parity->rp_first,
+                              flags)) == NULL)) {
+        ++re->re_stats.rs_invalid;
+        return REASM_INVALID;
+    }
+
+    for (i = 0; i < rf->rf_parity_count; ++i) {
+        rp = &rf->rf_parity[i];
+        if ((rp->rp_first != parity->rp_first) ||
+            (rp->rp_j != parity->rp_j)) {
+            continue;
+        }
+        if ((rp->rp_k == parity->rp_k) && (rp->rp_m == parity->rp_m) &&
+            (rp->rp_len == len) && (memcmp(rp->rp_data, data, len) == 0)) {
+            ++re->re_stats.rs_duplicates;
+            return REASM_DUPLICATE;
+        }
+        ++re->re_stats.rs_conflicts;
+        return REASM_CONFLICT;
+    }
+
+    if (rf->rf_parity_count == rf->rf_parity_size) {
+        int size = (rf->rf_parity_size > 0) ? rf->rf_parity_size * 2 : 16;
+
+        rp = realloc(rf->rf_parity, size * sizeof(ReasmParity));
+        if (rp == NULL) {
+            LOGWrite(GWL_FATAL, "Out of memory.");
+            ++re->re_stats.rs_invalid;
+            return REASM_INVALID;
+        }
+        rf->rf_parity = rp;
+        rf->rf_parity_size = size;
+    }
+    rp = &rf->rf_parity[rf->rf_parity_count];
+    *rp = *parity;
+    if ((rp->rp_data = malloc(len)) == NULL) {
+        LOGWrite(GWL_FATAL, "Out of memory.");
+        ++re->re_stats.rs_invalid;
+        return REASM_INVALID;
+    }
+    memcpy(rp->rp_data, data, len);
+    rp->rp_len = len;
+    ++rf->rf_parity_count;
+    ++re->re_stats.rs_parity;
+    return REASM_NEW;
+}
+
+/** Parse a block number given in hex.
+ *  @return the block number, or -1 if the text is not one.
+ */
+static int parse_block_number(const char * text, size_t len)
+{
+    long number = 0;
+    size_t i;
+
+    if ((len == 0) || (len > 6)) {
+        return -1;
+    }
+    for (i = 0; i < len; ++i) {
+        char c = text[i];
+
+        if ((c >= '0') && (c <= '9')) {
+            number = number * 16 + c - '0';
+        } else if ((c >= 'a') && (c <= 'f')) {
+            number = number * 16 + c - 'a' + 10;
+        } else if ((c >= 'A') && (c <= 'F')) {
+            number = number * 16 + c - 'A' + 10;
+        } else {
+            return -1;
+        }
+    }
+    return number;
+}
+
+/** Find the last space in some text.
+ *  @return a pointer to the space, or NULL if there is none.
+ */
+static const char * last_space(const char * text, size_t len)
+{
+    while (len-- > 0) {
+        if (text[len] == ' ') {
+            return text + len;
+        }
+    }
+    return NULL;
+}
+
+/** Parse a pair of hex numbers separated by a slash.
+ *  @return zero if the text is such a pair, non-zero otherwise.
+ */
+static int parse_pair(const char * text, size_t len, int * a, int * b)
+{
+    const char * slash = memchr(text, '/', len);
+
+    if (slash == NULL) {
+        return 1;
+    }
+    *a = parse_block_number(text, slash - text);
+    *b = parse_block_number(slash + 1, text + len - slash - 1);
+    return (*a < 0) || (*b < 0);
+}
+
+/** Parse the header line of a data block. It ends with the block number
+ *  in hex, and optionally the letter of the encoding, in upper case if
+ *  the file was compressed.
+ *  @return the end of the name, or NULL if the header is not valid.
+ */
+static const char * parse_block_header(const char * msg, size_t header_len,
+                                       int * block_number, Encoding * enc,
+                                       int * flags)
+{
+    const char * space;
+    const char * name_end;
+
+    if ((space = last_space(msg, header_len)) == NULL) {
+        return NULL;
+    }
+    name_end = space;
+    *block_number = parse_block_number(space + 1,
+                                       msg + header_len - space - 1);
+
+    // A single letter after the block number names the encoding
+    if ((msg + header_len - space == 2) &&
+        (ENCGetLetter(tolower(space[1]), enc) == 0) &&
+        ((space = last_space(msg, space - msg)) != NULL)) {
+        int number = parse_block_number(space + 1, name_end - space - 1);
+
+        if (number > 0) {
+            if (isupper(name_end[1])) {
+                *flags |= REASM_FLAG_COMPRESSED;
+            }
+            *block_number = number;
+            name_end = space;
+        } else {
+            *enc = ENC_HEX;
+        }
+    } else {
+        *enc = ENC_HEX;
+    }
+    return name_end;
+}
+
+/** Parse the header line of a parity block. It ends with the first block
+ *  of the group and the number of blocks in it, the index of the parity
+ *  block and the number of parity blocks, each pair separated by a
+ *  slash, and the letter of the encoding.
+ *  @return the end of the name, or NULL if the header is not of a parity
+ *  block.
+ */
+static const char * parse_parity_header(const char * msg, size_t header_len,
+                                        ReasmParity * rp, Encoding * enc,
+                                        int * flags)
+{
+    const char * letter;
+    const char * group;
+    const char * index;
+
+    if (((letter = last_space(msg, header_len)) == NULL) ||
+        (msg + header_len - letter != 2) ||
+        (ENCGetLetter(tolower(letter[1]), enc) != 0) ||
+        ((index = last_space(msg, letter - msg)) == NULL) ||
+        (parse_pair(index + 1, letter - index - 1, &rp->rp_j,
+                    &rp->rp_m) != 0) ||
+        ((group = last_space(msg, index - msg)) == NULL) ||
+        (parse_pair(group + 1, index - group - 1, &rp->rp_first,
+                    &rp->rp_k) != 0)) {
+        return NULL;
+    }
+    *flags |= REASM_FLAG_PARITY;
+    if (isupper(letter[1])) {
+        *flags |= REASM_FLAG_COMPRESSED;
+    }
+    return group;
+}
+
+/** Add a text message to the reassembler. The first line of the message
+ *  gives the file name and block number in hex, and optionally the
+ *  letter of the encoding, in upper case if the file was compressed.
+ *  The lines which follow are the data, in hex if no encoding is given.
+ *  Parity blocks have a header which identifies their group instead of
+ *  the block number.
+ *  @param msg text of the message, which need not be NULL terminated.
+ *  @param len length of the message.
+ */
+ReasmResult REASMAddText(Reassembler * re, const char * msg, size_t len)
+{
+    char text[REASM_TEXT_MAX];
+    BYTE data[REASM_TEXT_MAX];
+    const char * header_end;
+    const char * name_end;
+    const char * end = msg + len;
+    const char * p;
+    ReasmParity parity;
+    Encoding enc = ENC_HEX;
+    int flags = 0;
+    size_t header_len;
+    size_t chars = 0;
+    int block_number = 0;
+    int n;
+
+    assert(re != NULL);
+    assert(msg != NULL);
+
+    ++re->re_stats.rs_messages;
+
+    if ((header_end = memchr(msg, '\n', len)) == NULL) {
+        ++re->re_stats.rs_invalid;
+        return REASM_INVALID;
+    }
+    header_len = header_end - msg;
+    while ((header_len > 0) && ((msg[header_len - 1] == '\r') ||
+                                (msg[header_len - 1] == ' '))) {
+        --header_len;
+    }
+
+    if (((name_end = parse_parity_header(msg, header_len, &parity, &enc,
+                                         &flags)) == NULL) &&
+        ((name_end = parse_block_header(msg, header_len, &block_number, &enc,
+                                        &flags)) == NULL)) {
+        ++re->re_stats.rs_invalid;
+        return REASM_INVALID;
+    }
+
+    for (p = header_end + 1; p < end; ++p) {
+        if ((*p == '\r') || (*p == '\n') || (*p == ' ')) {
+            continue;
+        }
+        if (chars == sizeof(text)) {
+            ++re->re_stats.rs_invalid;
+            return REASM_INVALID;
+        }
+        text[chars++] = *p;
+    }
+    if ((ENCCapacity(enc, chars) > sizeof(data)) ||
+        ((n = ENCDecode(enc, text, chars, data)) <= 0)) {
+        ++re->re_stats.rs_invalid;
+        return REASM_INVALID;
+    }
+
+    if (flags & REASM_FLAG_PARITY) {
+        return add_parity(re, msg, name_end - msg, &parity, flags, data, n);
+    }
+    return add_block(re, msg, name_end - msg, block_number, flags, data, n);
+}
+
+/** Add the user data of a binary PDU message to the reassembler. It
+ *  starts with a flags byte, the length of the name, the name, and the
+ *  block number in two bytes, most significant first, and the rest of
+ *  the message is the data. Parity blocks have the first block of the
+ *  group in place of the block number, followed by a byte each for the
+ *  number of blocks in the group, the index of the parity block and the
+ *  number of parity blocks.
+ *  @param msg user data of the message.
+ *  @param len length of the user data.
+ */
+ReasmResult REASMAddBinary(Reassembler * re, const BYTE * msg, size_t len)
+{
+    ReasmParity parity;
+    size_t namelen;
+    size_t offset;
+
+    assert(re != NULL);
+    assert(msg != NULL);
+
+    ++re->re_stats.rs_messages;
+
+    if ((len < REASM_BINARY_HEADER) || ((msg[0] & ~REASM_FLAGS) != 0)) {
+        ++re->re_stats.rs_invalid;
+        return REASM_INVALID;
+    }
+    namelen = msg[1];
+    if (msg[0] & REASM_FLAG_PARITY) {
+        offset = namelen + REASM_PARITY_HEADER;
+        if (len <= offset) {
+            ++re->re_stats.rs_invalid;
+            return REASM_INVALID;
+        }
+        parity.rp_first = (msg[offset - 5] << 8) | msg[offset - 4];
+        parity.rp_k = msg[offset - 3];
+        parity.rp_j = msg[offset - 2];
+        parity.rp_m = msg[offset - 1];
+        return add_parity(re, (const char *)msg + 2, namelen, &parity,
+                          msg[0], msg + offset, len - offset);
+    }
+    offset = namelen + REASM_BINARY_HEADER;
+    if (len <= offset) {
+        ++re->re_stats.rs_invalid;
+        return REASM_INVALID;
+    }
+    return add_block(re, (const char *)msg + 2, namelen,
+                     (msg[offset - 2] << 8) | msg[offset - 1], msg[0],
+                     msg + offset, len - offset);
+}
+
+/** Add a message to the reassembler, in whichever format it is. Binary
+ *  messages start with a byte of flags, which text messages never do.
+ *  @param msg the message.
+ *  @param len length of the message.
+ */
+ReasmResult REASMAddMessage(Reassembler * re, const BYTE * msg, size_t len)
+{
+    assert(re != NULL);
+    assert(msg != NULL);
+
+    if ((len > 0) && ((msg[0] & ~REASM_FLAGS) == 0)) {
+        return REASMAddBinary(re, msg, len);
+    }
+    return REASMAddText(re, (const char *)msg, len);
+}
+
+/** Make the path a file is written to, from the name in its header.
+ *  Only the last part of the name is used, so files are never written
+ *  outside the output directory.
+ *  @return the path, which the caller must free, or NULL if the name
+ *  can not be used.
+ */
+static char * output_path(const Reassembler * re, const char * name,
+                          const char * suffix)
+{
+    const char * base = strrchr(name, '/');
+    char * path;
+    char * p;
+
+    base = (base == NULL) ? name : base + 1;
+    if ((*base == 0) || (strcmp(base, ".") == 0) ||
+        (strcmp(base, "..") == 0)) {
+        return NULL;
+    }
+    path = malloc(strlen(re->re_outdir) + strlen(base) + strlen(suffix) + 2);
+    if (path == NULL) {
+        return NULL;
+    }
+    sprintf(path, "%s/%s%s", re->re_outdir, base, suffix);
+    for (p = path + strlen(re->re_outdir) + 1; *p != 0; ++p) {
+        if ((unsigned char)*p < ' ') {
+            *p = '_';
+        }
+    }
+    return path;
+}
+
+/** Log the blocks missing from a file, as ranges. */
+static void log_missing(const ReasmFile * rf)
+{
+    char mesg[REASM_NAME_MAX + 320];
+    char ranges[256];
+    size_t used = 0;
+    int i = 0;
+
+    ranges[0] = 0;
+    while ((i < rf->rf_last) && (used < sizeof(ranges) - 32)) {
+        int start;
+
+        if (rf->rf_blocks[i].rb_data != NULL) {
+            ++i;
+            continue;
+        }
+        start = i + 1;
+        while ((i < rf->rf_last) && (rf->rf_blocks[i].rb_data == NULL)) {
+            ++i;
+        }
+        used += sprintf(ranges + used, (start == i) ? "%s%d" : "%s%d-%d",
+                        (used > 0) ? "," : "", start, i);
+    }
+    snprintf(mesg, sizeof(mesg), "%s is missing blocks %s%s of %d.",
+             rf->rf_name, ranges, (i < rf->rf_last) ? ",..." : "",
+             rf->rf_last);
+    LOGWrite(GWL_WARNING, mesg);
+}
+
+/** Rebuild the missing blocks of one group of a file from its parity.
+ *  @param parity the parity blocks of the group, indexed by their index
+ *  in it, with NULL for those which did not arrive.
+ *  @param len length of the parity blocks.
+ */
+static void recover_group(Reassembler * re, ReasmFile * rf, int first,
+                          int k, int m, const BYTE * const * parity,
+                          size_t len)
+{
+    char mesg[REASM_NAME_MAX + 80];
+    BYTE * rows[FEC_MAX_BLOCKS];
+    int present[FEC_MAX_BLOCKS];
+    BYTE * buffer;
+    int missing = 0;
+    int i;
+
+    for (i = 0; i < k; ++i) {
+        int block_number = first + i;
+        const ReasmBlock * rb = (block_number <= rf->rf_size) ?
+                                &rf->rf_blocks[block_number - 1] : NULL;
+
+        present[i] = (rb != NULL) && (rb->rb_data != NULL);
+        if (!present[i]) {
+            ++missing;
+        } else if (rb->rb_len + 2 > len) {
+            snprintf(mesg, sizeof(mesg), "Block %d of %s is longer than "
+                     "the parity for its group.", block_number, rf->rf_name);
+            LOGWrite(GWL_WARNING, mesg);
+            return;
+        }
+    }
+    if ((missing == 0) || ((buffer = calloc(k, len)) == NULL)) {
+        return;
+    }
+
+    // Each block is covered by the parity with its length in front
+    for (i = 0; i < k; ++i) {
+        rows[i] = buffer + i * len;
+        if (present[i]) {
+            const ReasmBlock * rb = &rf->rf_blocks[first + i - 1];
+
+            rows[i][0] = rb->rb_len >> 8;
+            rows[i][1] = rb->rb_len & 0xff;
+            memcpy(rows[i] + 2, rb->rb_data, rb->rb_len);
+        }
+    }
+    if (FECRecover(k, m, rows, present, parity, len) == 0) {
+        for (i = 0; i < k; ++i) {
+            size_t block_len = (rows[i][0] << 8) | rows[i][1];
+
+            if (present[i]) {
+                continue;
+            }
+            if ((block_len == 0) || (block_len + 2 > len)) {
+                snprintf(mesg, sizeof(mesg), "Parity for block %d of %s is "
+                         "not consistent.", first + i, rf->rf_name);
+                LOGWrite(GWL_WARNING, mesg);
+                continue;
+            }
+            if (store_block(rf, first + i, rows[i] + 2, block_len) == 0) {
+                ++re->re_stats.rs_recovered;
+                snprintf(mesg, sizeof(mesg), "Rebuilt block %d of %s from "
+                         "parity.", first + i, rf->rf_name);
+                LOGWrite(GWL_VERBOSE, mesg);
+            }
+        }
+    }
+    free(buffer);
+}
+
+/** Rebuild what blocks can be rebuilt from the parity held for a file.
+ *  Parity blocks are grouped by the first block of their group. Any
+ *  which disagree with the first of their group about its size are not
+ *  used.
+ */
+static void recover_file(Reassembler * re, ReasmFile * rf)
+{
+    const BYTE * parity[FEC_MAX_BLOCKS];
+    int i, j;
+
+    for (i = 0; i < rf->rf_parity_count; ++i) {
+        const ReasmParity * rp = &rf->rf_parity[i];
+
+        // Each group is handled at the first of its parity blocks
+        for (j = 0; j < i; ++j) {
+            if (rf->rf_parity[j].rp_first == rp->rp_first) {
+                break;
+            }
+        }
+        if (j < i) {
+            continue;
+        }
+        memset(parity, 0, rp->rp_m * sizeof(parity[0]));
+        for (j = i; j < rf->rf_parity_count; ++j) {
+            const ReasmParity * other = &rf->rf_parity[j];
+
+            if ((other->rp_first == rp->rp_first) &&
+                (other->rp_k == rp->rp_k) && (other->rp_m == rp->rp_m) &&
+                (other->rp_len == rp->rp_len)) {
+                parity[other->rp_j] = other->rp_data;
+            }
+        }
+        recover_group(re, rf, rp->rp_first, rp->rp_k, rp->rp_m, parity,
+                      rp->rp_len);
+    }
+}
+
+/** Write the blocks of a compressed file, decompressed, as far as the
+ *  first missing block. Nothing after a gap can be recovered, as it may
+ *  refer back to the data which is missing.
+ *  @return zero if the data was written, non-zero otherwise.
+ */
+static int write_compressed(const ReasmFile * rf, FILE * fp)
+{
+    LZSSDecoder ld;
+    BYTE * out = NULL;
+    size_t out_size = 0;
+    int i, ret = 0;
+
+    LZSSInitDecoder(&ld);
+    for (i = 0; (i < rf->rf_last) && (ret == 0); ++i) {
+        const ReasmBlock * rb = &rf->rf_blocks[i];
+        long len;
+
+        if (rb->rb_data == NULL) {
+            break;
+        }
+        if (rb->rb_len * LZSS_MAX_MATCH > out_size) {
+            free(out);
+            out_size = rb->rb_len * LZSS_MAX_MATCH;
+            if ((out = malloc(out_size)) == NULL) {
+                LOGWrite(GWL_FATAL, "Out of memory.");
+                return 1;
+            }
+        }
+        if ((len = LZSSDecompress(&ld, rb->rb_data, rb->rb_len, out)) < 0) {
+            char mesg[REASM_NAME_MAX + 80];
+
+            snprintf(mesg, sizeof(mesg), "Block %d of %s is not valid "
+                     "compressed data.", i + 1, rf->rf_name);
+            LOGWrite(GWL_ERROR, mesg);
+            ret = 1;
+        } else if (fwrite(out, 1, len, fp) != (size_t)len) {
+            ret = 1;
+        }
+    }
+    free(out);
+    return ret;
+}
+
+/** Write out one file, first rebuilding what missing blocks it can from
+ *  parity. Files with missing blocks are written with the blocks which
+ *  did arrive, to the name with .partial added. Compressed files with
+ *  missing blocks are written only as far as the first gap.
+ *  @return zero if the file was complete and written, non-zero
+ *  otherwise.
+ */
+static int write_file(Reassembler * re, ReasmFile * rf)
+{
+    int complete;
+    char mesg[1024];
+    char * path;
+    char * tmp;
+    FILE * fp;
+    int i, ret = 0;
+
+    recover_file(re, rf);
+    if (rf->rf_count == 0) {
+        snprintf(mesg, sizeof(mesg), "No blocks of %s could be rebuilt.",
+                 rf->rf_name);
+        LOGWrite(GWL_WARNING, mesg);
+        return 1;
+    }
+    complete = (rf->rf_count == rf->rf_last);
+
+    if ((path = output_path(re, rf->rf_name,
+                            complete ? "" : ".partial")) == NULL) {
+        snprintf(mesg, sizeof(mesg), "Can not write a file named %s.",
+                 rf->rf_name);
+        LOGWrite(GWL_ERROR, mesg);
+        return 1;
+    }
+    if ((tmp = malloc(strlen(path) + 5)) == NULL) {
+        free(path);
+        return 1;
+    }
+    sprintf(tmp, "%s.tmp", path);
+
+    if ((fp = fopen(tmp, "w")) == NULL) {
+        snprintf(mesg, sizeof(mesg), "Could not open %s for writing.", tmp);
+        LOGWrite(GWL_ERROR, mesg);
+        free(tmp);
+        free(path);
+        return 1;
+    }
+    if (rf->rf_flags & REASM_FLAG_COMPRESSED) {
+        ret = write_compressed(rf, fp);
+    } else {
+        for (i = 0; i < rf->rf_last; ++i) {
+            const ReasmBlock * rb = &rf->rf_blocks[i];
+
+            if ((rb->rb_data != NULL) &&
+                (fwrite(rb->rb_data, 1, rb->rb_len, fp) != rb->rb_len)) {
+                ret = 1;
+            }
+        }
+    }
+    if ((fclose(fp) != 0) || (ret != 0) || (rename(tmp, path) != 0)) {
+        snprintf(mesg, sizeof(mesg), "Error writing %s.", path);
+        LOGWrite(GWL_ERROR, mesg);
+        remove(tmp);
+        ret = 1;
+    }
+    if (!complete) {
+        log_missing(rf);
+        ret = 1;
+    }
+    free(tmp);
+    free(path);
+    return ret;
+}
+
+/** Write out all the files rebuilt so far, and forget them.
+ *  @return the number of files which were not complete, or could not be
+ *  written.
+ */
+int REASMFinish(Reassembler * re)
+{
+    int failed = 0;
+    int i;
+
+    assert(re != NULL);
+
+    for (i = 0; i < REASM_BUCKETS; ++i) {
+        while (re->re_files[i] != NULL) {
+            ReasmFile * rf = re->re_files[i];
+
+            if (write_file(re, rf) == 0) {
+                ++re->re_stats.rs_complete;
+            } else {
+                ++re->re_stats.rs_incomplete;
+                ++failed;
+            }
+            re->re_files[i] = rf->rf_next;
+            free_file(rf);
+        }
+    }
+    return failed;
+}
@@ -0,0 +1,112 @@
+/*
+ * Glacsweb reasm.h
+ * Copyright (C) 2004 Alistair Riddoch, The University of Southampton
+ */
+
+#ifndef GLACSWEB_REASM_H
+#define GLACSWEB_REASM_H
+
+#include "types.h"
+
+#include <stddef.h>
+
+/** Number of hash buckets for the files being rebuilt */
+#define REASM_BUCKETS           256
+
+/** Longest file name accepted from a message header */
+#define REASM_NAME_MAX          255
+
+/** Flag in a block header marking a block of a compressed stream, as
+ *  sent by GSMSendFileOptions */
+#define REASM_FLAG_COMPRESSED   0x01
+/** Flag in a block header marking a block of parity for a group of
+ *  blocks */
+#define REASM_FLAG_PARITY       0x02
+
+/** What became of a message given to the reassembler */
+typedef enum reasm_result {
+    /** The message held a block not seen before */
+    REASM_NEW = 0,
+    /** The message repeated a block already held */
+    REASM_DUPLICATE,
+    /** The message had a block already held with different contents,
+     *  and was ignored */
+    REASM_CONFLICT,
+    /** The message was not a file block */
+    REASM_INVALID
+} ReasmResult;
+
+/** One block of a file */
+typedef struct reasm_block {
+    /** Data of the block, or NULL if it has not arrived */
+    BYTE *      rb_data;
+    size_t      rb_len;
+} ReasmBlock;
+
+/** One parity block for a group of blocks of a file */
+typedef struct reasm_parity {
+    /** Block number of the first block in the group */
+    int         rp_first;
+    /** Number of blocks in the group */
+    int         rp_k;
+    /** Index of this parity block */
+    int         rp_j;
+    /** Number of parity blocks for the group */
+    int         rp_m;
+    BYTE *      rp_data;
+    size_t      rp_len;
+} ReasmParity;
+
+/** A file being rebuilt from its blocks */
+typedef struct reasm_file {
+    /** Name given in the message headers */
+    char        rf_name[REASM_NAME_MAX + 1];
+    /** Blocks indexed by block number less one */
+    ReasmBlock * rf_blocks;
+    /** Number of entries allocated in rf_blocks */
+    int         rf_size;
+    /** Highest block number seen */
+    int         rf_last;
+    /** Number of distinct blocks held */
+    int         rf_count;
+    /** REASM_FLAG_ flags given with the blocks, except parity */
+    int         rf_flags;
+    /** Parity blocks received, in the order they arrived */
+    ReasmParity * rf_parity;
+    /** Number of parity blocks held, and entries allocated */
+    int         rf_parity_count;
+    int         rf_parity_size;
+    /** Next file in the same hash bucket */
+    struct reasm_file * rf_next;
+} ReasmFile;
+
+/** Counts of what the reassembler has been given and has written */
+typedef struct reasm_stats {
+    long        rs_messages;
+    long        rs_blocks;
+    long        rs_duplicates;
+    long        rs_conflicts;
+    long        rs_invalid;
+    long        rs_parity;
+    long        rs_recovered;
+    int         rs_complete;
+    int         rs_incomplete;
+} ReasmStats;
+
+/** State of the reassembler */
+typedef struct reassembler {
+    /** Directory into which files are written */
+    char *      re_outdir;
+    /** Files being rebuilt, hashed by name */
+    ReasmFile * re_files[REASM_BUCKETS];
+    ReasmStats  re_stats;
+} Reassembler;
+
+Reassembler * REASMCreate(const char * outdir);
+void REASMDestroy(Reassembler *);
+ReasmResult REASMAddText(Reassembler *, const char * msg, size_t len);
+ReasmResult REASMAddBinary(Reassembler *, const BYTE * msg, size_t len);
+ReasmResult REASMAddMessage(Reassembler *, const BYTE * msg, size_t len);
+int REASMFinish(Reassembler *);
+
+#endif // GLACSWEB_REASM_H
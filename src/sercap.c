@@ -0,0 +1,331 @@
+/*
+ * Glacsweb sercap.c
+ * capture of serial port traffic
+ */
+
+/** \file
+ * Timestamped binary capture of the traffic on a serial port. Records
+ * are queued in memory by the thread doing the I/O, and written to the
+ * capture file by a background thread.
+ *
+ * Copyright (C) 2003, 2004 Kirk Martinez, Alistair Riddoch,
+ *                          The University of Southampton
+ */
+
+#include "sercap.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+
+/** Run debug code if debugging is enabled. */
+#define debug(prg) { if (debug_flag) { prg } }
+
+/** Control whether debug code is run.
+ *  Set to non-zero if debug code should be run.
+ */
+static const int debug_flag = 0;
+
+/** Smallest ring which will be allocated for a capture */
+static const size_t SERCAP_MIN_RING = 4096;
+
+/** Encode a record header into its on-disk form.
+ *  @param hdr buffer of SERCAP_HEADER_LEN bytes to encode into.
+ *  @param ts time the bytes were transferred.
+ *  @param type type of record.
+ *  @param flags flags qualifying the record.
+ *  @param len number of bytes of data in the record.
+ */
+static void encode_header(BYTE * hdr, const struct timespec * ts,
+                          int type, int flags, size_t len)
+{
+    uint32_t sec = ts->tv_sec;
+    uint32_t nsec = ts->tv_nsec;
+    int i;
+
+    for (i = 0; i < 4; ++i) {
+        hdr[i] = (sec >> (8 * i)) & 0xff;
+        hdr[4 + i] = (nsec >> (8 * i)) & 0xff;
+    }
+    hdr[8] = len & 0xff;
+    hdr[9] = (len >> 8) & 0xff;
+    hdr[10] = type;
+    hdr[11] = flags;
+}
+
+/** Copy bytes into the ring of a capture. The caller must hold the lock,
+ *  and have checked there is space.
+ */
+static void ring_put(SerCapture * sc, const BYTE * data, size_t len)
+{
+    while (len > 0) {
+        size_t tail = sc->sc_tail & (sc->sc_size - 1);
+        size_t chunk = sc->sc_size - tail;
+
+        if (chunk > len) {
+            chunk = len;
+        }
+        memcpy(&sc->sc_buf[tail], data, chunk);
+        sc->sc_tail += chunk;
+        data += chunk;
+        len -= chunk;
+    }
+}
+
+/** Write a record straight to the capture file.
+ *  Only used by the writer thread, which owns the file.
+ */
+static void write_record(FILE * fp, int type, const char * text)
+{
+    BYTE hdr[SERCAP_HEADER_LEN];
+    struct timespec ts;
+    size_t len = strlen(text);
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    encode_header(hdr, &ts, type, 0, len);
+    fwrite(hdr, 1, SERCAP_HEADER_LEN, fp);
+    fwrite(text, 1, len, fp);
+}
+
+/** Body of the background thread which writes a capture to its file. */
+static void * capture_writer(void * arg)
+{
+    SerCapture * sc = arg;
+
+    pthread_mutex_lock(&sc->sc_lock);
+    for (;;) {
+        size_t head, tail;
+        unsigned long dropped;
+
+        while ((sc->sc_head == sc->sc_tail) && (sc->sc_dropped == 0) &&
+               !sc->sc_stop) {
+            pthread_cond_wait(&sc->sc_cond, &sc->sc_lock);
+        }
+        if ((sc->sc_head == sc->sc_tail) && (sc->sc_dropped == 0)) {
+            break;
+        }
+        head = sc->sc_head;
+        tail = sc->sc_tail;
+        dropped = sc->sc_dropped;
+        sc->sc_dropped = 0;
+        pthread_mutex_unlock(&sc->sc_lock);
+
+        // The producer only writes outside [head, tail), so the records
+        // can be written out without holding the lock.
+        if (dropped != 0) {
+            char note[64];
+
+            snprintf(note, sizeof(note), "dropped %lu bytes", dropped);
+            write_record(sc->sc_fp, SERCAP_NOTE, note);
+        }
+        while (head != tail) {
+            size_t start = head & (sc->sc_size - 1);
+            size_t chunk = sc->sc_size - start;
+
+            if (chunk > tail - head) {
+                chunk = tail - head;
+            }
+            fwrite(&sc->sc_buf[start], 1, chunk, sc->sc_fp);
+            head += chunk;
+        }
+        fflush(sc->sc_fp);
+
+        pthread_mutex_lock(&sc->sc_lock);
+        sc->sc_head = head;
+    }
+    pthread_mutex_unlock(&sc->sc_lock);
+
+    fflush(sc->sc_fp);
+    return NULL;
+}
+
+/** Start capturing serial traffic to a file.
+ *  @param fp file to write the capture to. It is not closed by
+ *  SERCapClose.
+ *  @param size number of bytes of records which can be held in memory
+ *  waiting to be written.
+ *  @return a pointer to the new capture on the heap, or NULL if an
+ *  error occured.
+ */
+SerCapture * SERCapOpen(FILE * fp, size_t size)
+{
+    SerCapture * sc;
+    size_t ring = SERCAP_MIN_RING;
+
+    assert(fp != NULL);
+
+    while (ring < size) {
+        ring <<= 1;
+    }
+
+    sc = calloc(1, sizeof(SerCapture));
+    if (sc == NULL) {
+        return NULL;
+    }
+    sc->sc_buf = malloc(ring);
+    if (sc->sc_buf == NULL) {
+        free(sc);
+        return NULL;
+    }
+    sc->sc_fp = fp;
+    sc->sc_size = ring;
+    pthread_mutex_init(&sc->sc_lock, NULL);
+    pthread_cond_init(&sc->sc_cond, NULL);
+
+    if (pthread_create(&sc->sc_thread, NULL, capture_writer, sc) != 0) {
+        pthread_cond_destroy(&sc->sc_cond);
+        pthread_mutex_destroy(&sc->sc_lock);
+        free(sc->sc_buf);
+        free(sc);
+        return NULL;
+    }
+    return sc;
+}
+
+/** Stop capturing, once all queued records have been written.
+ *  @param sc capture to be stopped and freed.
+ */
+void SERCapClose(SerCapture * sc)
+{
+    if (sc == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&sc->sc_lock);
+    sc->sc_stop = 1;
+    pthread_cond_signal(&sc->sc_cond);
+    pthread_mutex_unlock(&sc->sc_lock);
+
+    pthread_join(sc->sc_thread, NULL);
+
+    pthread_cond_destroy(&sc->sc_cond);
+    pthread_mutex_destroy(&sc->sc_lock);
+    free(sc->sc_buf);
+    free(sc);
+}
+
+/** Add a record made up of several fragments to a capture.
+ *  This never waits for the capture file; if there is no room left in
+ *  memory the record is dropped. Data longer than SERCAP_MAX_DATA is
+ *  split over several records.
+ *  @param sc capture to add to, or NULL if capture is not enabled.
+ *  @param type type of record.
+ *  @param flags flags qualifying the record.
+ *  @param iov fragments of data to be recorded.
+ *  @param iovcnt number of fragments.
+ */
+void SERCapRecordv(SerCapture * sc, int type, int flags,
+                   const struct iovec * iov, int iovcnt)
+{
+    BYTE hdr[SERCAP_HEADER_LEN];
+    struct timespec ts;
+    size_t total = 0, offset = 0;
+    int i;
+
+    if (sc == NULL) {
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    for (i = 0; i < iovcnt; ++i) {
+        total += iov[i].iov_len;
+    }
+
+    do {
+        size_t len = (total > SERCAP_MAX_DATA) ? SERCAP_MAX_DATA : total;
+        size_t left = len;
+
+        encode_header(hdr, &ts, type, flags, len);
+
+        pthread_mutex_lock(&sc->sc_lock);
+        if (sc->sc_size - (sc->sc_tail - sc->sc_head) <
+            SERCAP_HEADER_LEN + len) {
+            sc->sc_dropped += SERCAP_HEADER_LEN + len;
+            left = 0;
+        } else {
+            ring_put(sc, hdr, SERCAP_HEADER_LEN);
+        }
+        // Walk the fragments even when dropping, to stay in step
+        while ((len > 0) && (iovcnt > 0)) {
+            size_t chunk = iov->iov_len - offset;
+
+            if (chunk > len) {
+                chunk = len;
+            }
+            if (left > 0) {
+                ring_put(sc, (const BYTE *)iov->iov_base + offset, chunk);
+                left -= chunk;
+            }
+            offset += chunk;
+            len -= chunk;
+            total -= chunk;
+            if (offset == iov->iov_len) {
+                ++iov;
+                --iovcnt;
+                offset = 0;
+            }
+        }
+        pthread_cond_signal(&sc->sc_cond);
+        pthread_mutex_unlock(&sc->sc_lock);
+    } while (total > 0);
+}
+
+/** Add a record to a capture.
+ *  @param sc capture to add to, or NULL if capture is not enabled.
+ *  @param type type of record.
+ *  @param flags flags qualifying the record.
+ *  @param data pointer to the data to be recorded.
+ *  @param len number of bytes of data.
+ */
+void SERCapRecord(SerCapture * sc, int type, int flags,
+                  const void * data, size_t len)
+{
+    struct iovec iov;
+
+    iov.iov_base = (void *)data;
+    iov.iov_len = len;
+    SERCapRecordv(sc, type, flags, &iov, 1);
+}
+
+/** Read the next record from a capture file.
+ *  @param fp capture file to read from.
+ *  @param rec pointer used to return the record header.
+ *  @param data buffer of at least SERCAP_MAX_DATA bytes used to return
+ *  the record data.
+ *  @return one if a record was read, zero at the end of the file, or -1
+ *  if the file is truncated.
+ */
+int SERCapRead(FILE * fp, SerCapRecord * rec, BYTE * data)
+{
+    BYTE hdr[SERCAP_HEADER_LEN];
+    size_t got;
+
+    assert(fp != NULL);
+    assert(rec != NULL);
+    assert(data != NULL);
+
+    got = fread(hdr, 1, SERCAP_HEADER_LEN, fp);
+    if (got == 0) {
+        return 0;
+    }
+    if (got != SERCAP_HEADER_LEN) {
+        debug( fprintf(stderr, "Truncated record header\n"); );
+        return -1;
+    }
+
+    rec->cr_sec = hdr[0] | (hdr[1] << 8) | (hdr[2] << 16) |
+                  ((uint32_t)hdr[3] << 24);
+    rec->cr_nsec = hdr[4] | (hdr[5] << 8) | (hdr[6] << 16) |
+                   ((uint32_t)hdr[7] << 24);
+    rec->cr_len = hdr[8] | (hdr[9] << 8);
+    rec->cr_type = hdr[10];
+    rec->cr_flags = hdr[11];
+
+    if (fread(data, 1, rec->cr_len, fp) != rec->cr_len) {
+        debug( fprintf(stderr, "Truncated record data\n"); );
+        return -1;
+    }
+    return 1;
+}
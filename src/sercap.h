@@ -0,0 +1,94 @@
+/*
+ * Glacsweb sercap.h
+ * Copyright (C) 2003, 2004 Kirk Martinez, Alistair Riddoch,
+ *                          The University of Southampton
+ */
+
+#ifndef GLACSWEB_SERCAP_H
+#define GLACSWEB_SERCAP_H
+
+#include "types.h"
+
+#include <sys/uio.h>
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* A capture file is a sequence of records, each a 12 byte header
+ * followed by cr_len bytes of data. Header fields are little endian.
+ * Each time a port is opened a SERCAP_NOTE record starting with
+ * SERCAP_MAGIC is written, so a file may hold several sessions. */
+
+/** Text at the start of the note which begins each capture session */
+#define SERCAP_MAGIC            "GWCAP1"
+
+/** Record of bytes received from the port */
+#define SERCAP_RX               'R'
+/** Record of bytes written to the port */
+#define SERCAP_TX               'T'
+/** Record containing a text note about the session */
+#define SERCAP_NOTE             'N'
+
+/** Flag set on received bytes which were thrown away unread */
+#define SERCAP_DISCARDED        0x01
+
+/** Size of the record header in the capture file */
+#define SERCAP_HEADER_LEN       12
+
+/** Largest amount of data held in a single record */
+#define SERCAP_MAX_DATA         0xffff
+
+/** Header of one record in a capture file. */
+typedef struct sercap_record {
+    /** Monotonic clock seconds when the bytes were transferred */
+    uint32_t    cr_sec;
+    /** Monotonic clock nanoseconds when the bytes were transferred */
+    uint32_t    cr_nsec;
+    /** Number of bytes of data which follow the header */
+    uint16_t    cr_len;
+    /** Type of record, SERCAP_RX, SERCAP_TX or SERCAP_NOTE */
+    uint8_t     cr_type;
+    /** Flags qualifying the record */
+    uint8_t     cr_flags;
+} SerCapRecord;
+
+/** Structure to hold a capture in progress. Records are copied into a
+ *  preallocated ring by the thread doing the serial I/O, and written
+ *  out to the file by a background thread, so slow storage never holds
+ *  up the serial port. If the ring fills, records are dropped and the
+ *  number of bytes lost is noted in the file.
+ */
+typedef struct ser_capture {
+    /** File the capture is written to */
+    FILE *          sc_fp;
+    /** Ring of encoded records waiting to be written */
+    BYTE *          sc_buf;
+    /** Size of sc_buf, a power of two */
+    size_t          sc_size;
+    /** Free running count of bytes written out from sc_buf */
+    size_t          sc_head;
+    /** Free running count of bytes stored into sc_buf */
+    size_t          sc_tail;
+    /** Number of bytes of records dropped because the ring was full */
+    unsigned long   sc_dropped;
+    /** Set to non-zero when the writer thread should finish */
+    int             sc_stop;
+    /** Lock protecting the ring indices and sc_stop */
+    pthread_mutex_t sc_lock;
+    /** Signalled when records are added, or the writer should stop */
+    pthread_cond_t  sc_cond;
+    /** Background writer thread */
+    pthread_t       sc_thread;
+} SerCapture;
+
+SerCapture * SERCapOpen(FILE * fp, size_t size);
+void SERCapClose(SerCapture * sc);
+void SERCapRecordv(SerCapture * sc, int type, int flags,
+                   const struct iovec * iov, int iovcnt);
+void SERCapRecord(SerCapture * sc, int type, int flags,
+                  const void * data, size_t len);
+
+int  SERCapRead(FILE * fp, SerCapRecord * rec, BYTE * data);
+
+#endif // GLACSWEB_SERCAP_H
@@ -12,11 +12,15 @@
 
 
 #include "serial.h"
+#include "termios2.h"
 
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 
 #include <fcntl.h>
+#include <pthread.h>
 #include <termios.h>
 #include <unistd.h>
 #include <stdio.h>
@@ -24,6 +28,11 @@
 #include <string.h>
 #include <assert.h>
 #include <errno.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <linux/serial.h>
+#endif
 
 /** Run debug code if debugging is enabled. */
 #define debug(prg) { if (debug_flag) { prg } }
@@ -33,9 +42,15 @@
  */
 static const int debug_flag = 0;
 
+/** Bytes of traffic which can be held in memory waiting to be written
+ *  to the capture file. */
+static const size_t SER_CAPTURE_RING = 65536;
+
 /** Get the baud rate from a string, and return the speed_t value.
  *  Accepts the baud name as a string. Any of the standard baud rates
- *  supported by standard serial ports should be accepted.
+ *  supported by standard serial ports should be accepted. Any other
+ *  rate is returned as a literal rate made with SER_BAUD_CUSTOM, which
+ *  SEROpenPort sets using termios2.
  *  @param baud_string is a string describing the baud rate
  *  @param serial_speed is a pointer used to return the speed
  *  @return zero if baud rate is recognised, non-zero otherwise
@@ -99,6 +114,66 @@ int SERGetBaud(const char * baud_string, speed_t * serial_speed)
     } else if (strcmp("230400", baud_string) == 0) {
         *serial_speed = B230400;
         return 0;
+#ifdef B460800
+    } else if (strcmp("460800", baud_string) == 0) {
+        *serial_speed = B460800;
+        return 0;
+#endif
+#ifdef B500000
+    } else if (strcmp("500000", baud_string) == 0) {
+        *serial_speed = B500000;
+        return 0;
+#endif
+#ifdef B576000
+    } else if (strcmp("576000", baud_string) == 0) {
+        *serial_speed = B576000;
+        return 0;
+#endif
+#ifdef B921600
+    } else if (strcmp("921600", baud_string) == 0) {
+        *serial_speed = B921600;
+        return 0;
+#endif
+#ifdef B1000000
+    } else if (strcmp("1000000", baud_string) == 0) {
+        *serial_speed = B1000000;
+        return 0;
+#endif
+#ifdef B1152000
+    } else if (strcmp("1152000", baud_string) == 0) {
+        *serial_speed = B1152000;
+        return 0;
+#endif
+#ifdef B1500000
+    } else if (strcmp("1500000", baud_string) == 0) {
+        *serial_speed = B1500000;
+        return 0;
+#endif
+#ifdef B2000000
+    } else if (strcmp("2000000", baud_string) == 0) {
+        *serial_speed = B2000000;
+        return 0;
+#endif
+#ifdef B3000000
+    } else if (strcmp("3000000", baud_string) == 0) {
+        *serial_speed = B3000000;
+        return 0;
+#endif
+#ifdef B4000000
+    } else if (strcmp("4000000", baud_string) == 0) {
+        *serial_speed = B4000000;
+        return 0;
+#endif
+    } else {
+        char * end;
+        unsigned long rate = strtoul(baud_string, &end, 10);
+
+        // Anything else must be a plain positive number of bits/second
+        if ((end != baud_string) && (*end == 0) && (rate > 0) &&
+            (rate < SER_BAUD_CUSTOM_FLAG)) {
+            *serial_speed = SER_BAUD_CUSTOM(rate);
+            return 0;
+        }
     }
     return 1;
 }
@@ -116,73 +191,198 @@ static SerialPort * new_SerialPort()
     } else {
         sp->sp_fd = -1;
         sp->sp_logfp = NULL;
+        sp->sp_capture = NULL;
+        sp->sp_read_mode = SER_READ_DEFAULT;
+        sp->sp_reader = NULL;
+        sp->sp_rxhead = 0;
+        sp->sp_rxtail = 0;
+        sp->sp_txcnt = 0;
     }
     return sp;
 }
 
-/** Open a serial port, and set the baud rate.
- *  @param serialportname string giving the filename of the serial device
- *  @param serial_speed baud rate to use
- *  @param logfilename string giving the filename of a log file to be used
- *  in association with this serial port.
- *  @return a pointer to the new serial port structure on the heap.
+/** Get a read mode from a string.
+ *  Accepts "default", "batched" or "lowlatency".
+ *  @param mode_string is a string naming the read mode
+ *  @param mode is a pointer used to return the mode
+ *  @return zero if the mode is recognised, non-zero otherwise
  */
-SerialPort * SEROpenPort(const char * serialportname,
-                         speed_t serial_speed,
-                         char * logfilename)
+int SERGetReadMode(const char * mode_string, SerReadMode * mode)
 {
-    struct termios term;
-    SerialPort * sp;
+    assert(mode_string != NULL);
+    assert(mode != NULL);
 
-    assert(serialportname != NULL);
+    if (strcmp("default", mode_string) == 0) {
+        *mode = SER_READ_DEFAULT;
+        return 0;
+    } else if (strcmp("batched", mode_string) == 0) {
+        *mode = SER_READ_BATCHED;
+        return 0;
+    } else if (strcmp("lowlatency", mode_string) == 0) {
+        *mode = SER_READ_LOWLATENCY;
+        return 0;
+    }
+    return 1;
+}
 
-    sp = new_SerialPort();
-    if (sp == NULL) {
-        // The error should already have been reported.
-        return sp;
+/** Ask the driver of a serial port to pass on received data immediately.
+ *  Not all drivers support this, so failure is not fatal.
+ *  @param fd file descriptor of the serial port.
+ *  @return zero if low latency mode was set, non-zero otherwise.
+ */
+static int set_low_latency(int fd)
+{
+#if defined(TIOCGSERIAL) && defined(ASYNC_LOW_LATENCY)
+    struct serial_struct serinfo;
+
+    if (ioctl(fd, TIOCGSERIAL, &serinfo) != 0) {
+        return -1;
     }
+    serinfo.flags |= ASYNC_LOW_LATENCY;
+    if (ioctl(fd, TIOCSSERIAL, &serinfo) != 0) {
+        return -1;
+    }
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+/** Open the device and log file of a new serial port, and set it up.
+ *  Whatever has been opened when a step fails is left in the port, for
+ *  SERClosePort to release.
+ *  @return zero if the port was set up, non-zero otherwise.
+ */
+static int set_up_port(SerialPort * sp, const char * serialportname,
+                       speed_t serial_speed, char * logfilename,
+                       const SerialOptions * options)
+{
+    struct termios term;
 
     if (logfilename != NULL) {
         // open log file for appending
-        sp->sp_logfp = fopen(logfilename, "a");
+        sp->sp_logfp = fopen(logfilename, "ab");
         if (sp->sp_logfp == NULL) {
             // erexit("Failed to open serial port log file!");
-            return NULL;
+            return -1;
+        }
+        sp->sp_capture = SERCapOpen(sp->sp_logfp, SER_CAPTURE_RING);
+        if (sp->sp_capture == NULL) {
+            fprintf(stderr, "SEROpenPort(): Failed to start capture\n");
         }
     }
     
-    // now the serial port
-    sp->sp_fd = open (serialportname, O_RDWR | O_NOCTTY );
+    // now the serial port. It is non-blocking so that writes can be
+    // bounded by a deadline; reads always wait with select first.
+    sp->sp_fd = open (serialportname, O_RDWR | O_NOCTTY | O_NONBLOCK);
     if (sp->sp_fd == -1) {
         // erexit ("can not open serial port!\n");
-        return NULL;
+        return -1;
     }
 
     if (tcgetattr(sp->sp_fd, &term) != 0) {
         // erexit("getattr failed!");
-        return NULL;
-    }
-    // set BAUD rate
-    if (cfsetospeed(&term, serial_speed) != 0) {
-        fprintf(stderr, "SEROpenPort(): Failed to set out speed\n");
+        return -1;
     }
-    if (cfsetispeed(&term, serial_speed) != 0) {
-        fprintf(stderr, "SEROpenPort(): Failed to set out speed\n");
+    // set BAUD rate. A literal rate is set using termios2 below, once
+    // the rest of the attributes are in place.
+    if (SER_BAUD_IS_CUSTOM(serial_speed)) {
+        cfsetospeed(&term, B38400);
+        cfsetispeed(&term, B38400);
+    } else {
+        if (cfsetospeed(&term, serial_speed) != 0) {
+            fprintf(stderr, "SEROpenPort(): Failed to set out speed\n");
+        }
+        if (cfsetispeed(&term, serial_speed) != 0) {
+            fprintf(stderr, "SEROpenPort(): Failed to set out speed\n");
+        }
     }
     cfmakeraw(&term);
 
 	term.c_iflag |= IGNBRK;
+
+    if (options != NULL) {
+        sp->sp_read_mode = options->so_read_mode;
+    }
+    if (sp->sp_read_mode == SER_READ_BATCHED) {
+        // A read returns once VMIN bytes have arrived, or the line has
+        // been idle for VTIME. Reads are only made once select has seen
+        // data, so VTIME bounds how long a read can block.
+        term.c_cc[VMIN] = (options->so_vmin > 0) ? options->so_vmin : 1;
+        term.c_cc[VTIME] = (options->so_vtime > 0) ? options->so_vtime : 1;
+        fcntl(sp->sp_fd, F_SETFL, fcntl(sp->sp_fd, F_GETFL) & ~O_NONBLOCK);
+    } else {
+        term.c_cc[VMIN] = 1;
+        term.c_cc[VTIME] = 0;
+    }
+
     // Set the serial port mode NOW
     if (tcsetattr(sp->sp_fd, TCSANOW, &term) != 0) {
         fprintf(stderr, "SEROpenPort(): Failed to set port attrs\n");
         // erexit("setattr failed!");
-        return NULL;
+        return -1;
+    }
+
+    if (SER_BAUD_IS_CUSTOM(serial_speed) &&
+        (SERSetCustomSpeed(sp->sp_fd, SER_BAUD_RATE(serial_speed)) != 0)) {
+        fprintf(stderr, "SEROpenPort(): Failed to set custom speed %u\n",
+                SER_BAUD_RATE(serial_speed));
+        return -1;
     }
     
-    if (sp->sp_logfp != NULL) {
-        fprintf(sp->sp_logfp, "Serial port %s opened ok.\n", serialportname);
+    if ((sp->sp_read_mode == SER_READ_LOWLATENCY) &&
+        (set_low_latency(sp->sp_fd) != 0)) {
+        debug( printf("Low latency mode not supported by driver\n"); );
+    }
+
+    if ((options != NULL) && options->so_reader &&
+        (SERStartReader(sp) != 0)) {
+        fprintf(stderr, "SEROpenPort(): Failed to start reader thread\n");
+        return -1;
+    }
+
+    if (sp->sp_capture != NULL) {
+        char note[256];
+
+        snprintf(note, sizeof(note), SERCAP_MAGIC " %ld Serial port %s opened ok.",
+                 (long)time(NULL), serialportname);
+        SERCapRecord(sp->sp_capture, SERCAP_NOTE, 0, note, strlen(note));
+    }
+
+    return 0;
+}
+
+/** Open a serial port, and set the baud rate.
+ *  @param serialportname string giving the filename of the serial device
+ *  @param serial_speed baud rate to use
+ *  @param logfilename string giving the filename of a log file to be used
+ *  in association with this serial port. All traffic on the port is
+ *  captured to this file in the binary format described in sercap.h.
+ *  @param options pointer to options controlling how the port is set up,
+ *  or NULL to use the defaults.
+ *  @return a pointer to the new serial port structure on the heap, or
+ *  NULL if the port could not be opened and set up.
+ */
+SerialPort * SEROpenPort(const char * serialportname,
+                         speed_t serial_speed,
+                         char * logfilename,
+                         const SerialOptions * options)
+{
+    SerialPort * sp;
+
+    assert(serialportname != NULL);
+
+    sp = new_SerialPort();
+    if (sp == NULL) {
+        // The error should already have been reported.
+        return sp;
     }
 
+    if (set_up_port(sp, serialportname, serial_speed, logfilename,
+                    options) != 0) {
+        SERClosePort(sp);
+        return NULL;
+    }
     return sp;
 }
 
@@ -193,34 +393,387 @@ SerialPort * SEROpenPort(const char * serialportname,
  */
 void SERClosePort(SerialPort * sp)
 {
+    SERStopReader(sp);
     if (sp->sp_fd != -1) {
         close(sp->sp_fd);
     }
+    SERCapClose(sp->sp_capture);
     if (sp->sp_logfp != NULL) {
         fclose(sp->sp_logfp);
     }
     free(sp);
 }
 
+/** Number of bytes waiting in the receive buffer of a serial port. */
+#define rx_pending(sp) ((sp)->sp_rxtail - (sp)->sp_rxhead)
+
+/** Mask a free running ring count down to an index into sp_rxbuf. */
+#define rx_index(count) ((count) & (SER_RXBUF_SIZE - 1))
+
+/** Remove and return the next byte from the receive buffer.
+ *  The caller must have checked that the buffer is not empty.
+ */
+static BYTE rx_pop(SerialPort * sp)
+{
+    return sp->sp_rxbuf[rx_index(sp->sp_rxhead++)];
+}
+
+/** State of a reader thread. The thread is the only writer of r_tail
+ *  and the user of the port the only writer of r_head, so the ring
+ *  between them needs no lock.
+ */
+typedef struct ser_reader {
+    /** Bytes read from the port, waiting to be consumed */
+    BYTE        r_buf[SER_READER_SIZE];
+    /** Free running count of bytes consumed, written by the consumer */
+    size_t      r_head;
+    /** Free running count of bytes stored, written by the thread */
+    size_t      r_tail;
+    /** Set by the thread if reading from the port fails */
+    int         r_error;
+    /** Pipe written by the thread each time data is added */
+    int         r_wake[2];
+    /** Pipe written to ask the thread to stop */
+    int         r_stop[2];
+    /** The reader thread */
+    pthread_t   r_thread;
+} SerReader;
+
+/** Number of bytes waiting in the ring of a reader thread. */
+static size_t reader_pending(SerReader * r)
+{
+    return __atomic_load_n(&r->r_tail, __ATOMIC_ACQUIRE) - r->r_head;
+}
+
+/** Body of the reader thread. Waits for data on the port, reads as much
+ *  as fits into the ring, publishes it, and wakes the consumer.
+ */
+static void * reader_thread(void * arg)
+{
+    SerialPort * sp = arg;
+    SerReader * r = sp->sp_reader;
+    int maxfd = (sp->sp_fd > r->r_stop[0]) ? sp->sp_fd : r->r_stop[0];
+
+    for (;;) {
+        size_t head = __atomic_load_n(&r->r_head, __ATOMIC_ACQUIRE);
+        size_t tail = r->r_tail;
+        size_t space = SER_READER_SIZE - (tail - head);
+        size_t start = tail & (SER_READER_SIZE - 1);
+        struct iovec iov[2];
+        int iovcnt = 1;
+        struct timeval tv;
+        fd_set rfds;
+        ssize_t ret;
+
+        FD_ZERO(&rfds);
+        FD_SET(r->r_stop[0], &rfds);
+        if (space > 0) {
+            FD_SET(sp->sp_fd, &rfds);
+        }
+        // When the ring is full, poll until the consumer makes space.
+        // The data meanwhile waits safely in the driver.
+        tv.tv_sec = 0;
+        tv.tv_usec = 10000;
+        ret = select(maxfd + 1, &rfds, NULL, NULL,
+                     (space > 0) ? NULL : &tv);
+        if ((ret == -1) && (errno != EINTR)) {
+            break;
+        }
+        if (ret <= 0) {
+            continue;
+        }
+        if (FD_ISSET(r->r_stop[0], &rfds)) {
+            return NULL;
+        }
+
+        iov[0].iov_base = &r->r_buf[start];
+        iov[0].iov_len = SER_READER_SIZE - start;
+        if (iov[0].iov_len >= space) {
+            iov[0].iov_len = space;
+        } else {
+            iov[1].iov_base = &r->r_buf[0];
+            iov[1].iov_len = space - iov[0].iov_len;
+            iovcnt = 2;
+        }
+
+        ret = readv(sp->sp_fd, iov, iovcnt);
+        if (ret == -1) {
+            if ((errno == EINTR) || (errno == EAGAIN)) {
+                continue;
+            }
+            break;
+        }
+        if (ret == 0) {
+            break;
+        }
+
+        if (sp->sp_capture != NULL) {
+            if (ret <= iov[0].iov_len) {
+                iov[0].iov_len = ret;
+                iovcnt = 1;
+            } else {
+                iov[1].iov_len = ret - iov[0].iov_len;
+            }
+            SERCapRecordv(sp->sp_capture, SERCAP_RX, 0, iov, iovcnt);
+        }
+
+        __atomic_store_n(&r->r_tail, tail + ret, __ATOMIC_RELEASE);
+        write(r->r_wake[1], "", 1);
+    }
+
+    debug( printf("Reader thread stopped by read error\n"); );
+    __atomic_store_n(&r->r_error, 1, __ATOMIC_RELEASE);
+    write(r->r_wake[1], "", 1);
+    return NULL;
+}
+
+/** Move data from the ring of a reader thread into the receive buffer.
+ *  @param sp serial port to read from.
+ *  @return number of bytes moved, zero if none were waiting, or -1 if
+ *  the reader thread has stopped.
+ */
+static int reader_fill(SerialPort * sp)
+{
+    SerReader * r = sp->sp_reader;
+    size_t avail = reader_pending(r);
+    size_t space = SER_RXBUF_SIZE - (sp->sp_rxtail - sp->sp_rxhead);
+    size_t count, left;
+
+    if (avail == 0) {
+        return __atomic_load_n(&r->r_error, __ATOMIC_ACQUIRE) ? -1 : 0;
+    }
+
+    count = left = (avail < space) ? avail : space;
+    while (left > 0) {
+        size_t from = r->r_head & (SER_READER_SIZE - 1);
+        size_t to = sp->sp_rxtail & (SER_RXBUF_SIZE - 1);
+        size_t chunk = left;
+
+        if (chunk > SER_READER_SIZE - from) {
+            chunk = SER_READER_SIZE - from;
+        }
+        if (chunk > SER_RXBUF_SIZE - to) {
+            chunk = SER_RXBUF_SIZE - to;
+        }
+        memcpy(&sp->sp_rxbuf[to], &r->r_buf[from], chunk);
+        sp->sp_rxtail += chunk;
+        __atomic_store_n(&r->r_head, r->r_head + chunk, __ATOMIC_RELEASE);
+        left -= chunk;
+    }
+    return count;
+}
+
+/** Throw away everything waiting in the ring of a reader thread. */
+static void reader_discard(SerialPort * sp)
+{
+    SerReader * r = sp->sp_reader;
+
+    __atomic_store_n(&r->r_head,
+                     __atomic_load_n(&r->r_tail, __ATOMIC_ACQUIRE),
+                     __ATOMIC_RELEASE);
+}
+
+static int wait_fd(int fd, int for_write, const struct timespec * deadline);
+
+/** Wait until a reader thread has data for the consumer, or a deadline.
+ *  @return one if there is data or the reader has stopped, zero if the
+ *  deadline passed.
+ */
+static int reader_wait(SerialPort * sp, const struct timespec * deadline)
+{
+    SerReader * r = sp->sp_reader;
+    char buf[64];
+
+    for (;;) {
+        if ((reader_pending(r) > 0) ||
+            __atomic_load_n(&r->r_error, __ATOMIC_ACQUIRE)) {
+            return 1;
+        }
+        if (!wait_fd(r->r_wake[0], 0, deadline)) {
+            return 0;
+        }
+        while (read(r->r_wake[0], buf, sizeof(buf)) > 0) {
+            // Empty the wakeup pipe
+        }
+    }
+}
+
+/** Start a thread which continuously reads from a serial port.
+ *  From then on, everything which arrives at the port is kept until it
+ *  is read or explicitly flushed, however long it is between reads.
+ *  @param sp serial port to read from.
+ *  @return zero if the thread was started, non-zero otherwise.
+ */
+int SERStartReader(SerialPort * sp)
+{
+    SerReader * r;
+
+    assert(sp != NULL);
+    assert(sp->sp_fd != -1);
+
+    if (sp->sp_reader != NULL) {
+        return 0;
+    }
+
+    r = calloc(1, sizeof(SerReader));
+    if (r == NULL) {
+        return -1;
+    }
+    if (pipe(r->r_wake) != 0) {
+        free(r);
+        return -1;
+    }
+    if (pipe(r->r_stop) != 0) {
+        close(r->r_wake[0]);
+        close(r->r_wake[1]);
+        free(r);
+        return -1;
+    }
+    fcntl(r->r_wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(r->r_wake[1], F_SETFL, O_NONBLOCK);
+
+    sp->sp_reader = r;
+    if (pthread_create(&r->r_thread, NULL, reader_thread, sp) != 0) {
+        sp->sp_reader = NULL;
+        close(r->r_wake[0]);
+        close(r->r_wake[1]);
+        close(r->r_stop[0]);
+        close(r->r_stop[1]);
+        free(r);
+        return -1;
+    }
+    return 0;
+}
+
+/** Stop the reader thread of a serial port, if it has one.
+ *  Anything the thread has read but which has not been consumed is kept
+ *  in the receive buffer, as far as it fits.
+ *  @param sp serial port to stop reading from.
+ */
+void SERStopReader(SerialPort * sp)
+{
+    SerReader * r = sp->sp_reader;
+
+    if (r == NULL) {
+        return;
+    }
+
+    write(r->r_stop[1], "", 1);
+    pthread_join(r->r_thread, NULL);
+    reader_fill(sp);
+    sp->sp_reader = NULL;
+
+    close(r->r_wake[0]);
+    close(r->r_wake[1]);
+    close(r->r_stop[0]);
+    close(r->r_stop[1]);
+    free(r);
+}
+
+/** Fill the receive buffer with a single bulk read.
+ *  Reads as much as is available and fits into the free space of the
+ *  ring. readv is used so that free space which wraps around the end
+ *  of the ring still costs only one system call.
+ *  @param sp serial port to read from.
+ *  @return number of bytes read, zero if the buffer is full or at end of
+ *  file, or -1 if an error occured.
+ */
+static int rx_fill(SerialPort * sp)
+{
+    struct iovec iov[2];
+    size_t space = SER_RXBUF_SIZE - rx_pending(sp);
+    size_t tail = rx_index(sp->sp_rxtail);
+    size_t first = SER_RXBUF_SIZE - tail;
+    int iovcnt = 1;
+    ssize_t ret;
+
+    if (sp->sp_reader != NULL) {
+        return reader_fill(sp);
+    }
+
+    if (space == 0) {
+        return 0;
+    }
+
+    iov[0].iov_base = &sp->sp_rxbuf[tail];
+    iov[0].iov_len = (first < space) ? first : space;
+    if (first < space) {
+        iov[1].iov_base = &sp->sp_rxbuf[0];
+        iov[1].iov_len = space - first;
+        iovcnt = 2;
+    }
+
+    do {
+        ret = readv(sp->sp_fd, iov, iovcnt);
+    } while ((ret == -1) && (errno == EINTR));
+
+    if (ret > 0) {
+        if (sp->sp_capture != NULL) {
+            // Only capture the part of the buffer actually filled
+            if (ret <= iov[0].iov_len) {
+                iov[0].iov_len = ret;
+                iovcnt = 1;
+            } else {
+                iov[1].iov_len = ret - iov[0].iov_len;
+            }
+            SERCapRecordv(sp->sp_capture, SERCAP_RX, 0, iov, iovcnt);
+        }
+        sp->sp_rxtail += ret;
+    } else {
+        debug( printf("read error"); );
+    }
+    return ret;
+}
+
+/** Copy bytes out of the receive buffer.
+ *  @param sp serial port to read from.
+ *  @param buffer pointer to buffer where bytes are stored.
+ *  @param count maximum number of bytes to copy.
+ *  @return number of bytes copied.
+ */
+static int rx_take(SerialPort * sp, BYTE * buffer, int count)
+{
+    int done = 0;
+
+    while ((count > 0) && (rx_pending(sp) > 0)) {
+        size_t head = rx_index(sp->sp_rxhead);
+        size_t len = SER_RXBUF_SIZE - head;
+
+        if (len > rx_pending(sp)) {
+            len = rx_pending(sp);
+        }
+        if (len > count) {
+            len = count;
+        }
+        memcpy(buffer, &sp->sp_rxbuf[head], len);
+        sp->sp_rxhead += len;
+        buffer += len;
+        done += len;
+        count -= len;
+    }
+    return done;
+}
+
 /** Get a byte from a serial port.
  *  Read a byte from a serial port. This blocks if no data is available.
  *  @param sp serial port to read from.
- *  @return value of byte read.
+ *  @return value of byte read, or zero if the read failed.
  */
 BYTE SERGetByte(SerialPort * sp) 
 {
-    BYTE byte;
-
     assert(sp != NULL);
     assert(sp->sp_fd != -1);
 
-    read(sp->sp_fd, &byte, 1);
-    return byte;
+    if ((rx_pending(sp) == 0) &&
+        (!SERWaitDeadline(sp, NULL) || (rx_fill(sp) < 1))) {
+        return 0;
+    }
+    return rx_pop(sp);
 }
 
 /** Put a byte to a serial port.
  *  Write a byte to a serial port. This blocks if the serial port is not
- *  ready to accept new data.
+ *  ready to accept new data. Any output already queued is written first.
  *  @param sp serial port to write to.
  *  @param b value of byte to be written.
  */
@@ -229,29 +782,206 @@ void SERPutByte(SerialPort * sp, BYTE b)
     assert(sp != NULL);
     assert(sp->sp_fd != -1);
 
-    write(sp->sp_fd, &b, 1);
+    SERQueueByte(sp, b);
+    SERFlushOutput(sp, NULL, 0);
 }
 
 /** Put a string of bytes to a serial port.
  *  Write a sequence of bytes to a serial port. This blocks if the serial
- *  port is not ready to accept new data.
+ *  port is not ready to accept new data. Any output already queued is
+ *  written first.
  *  @param sp serial port to write to.
  *  @param s pointer to string of bytes to be written
  *  @return zero if write succeeded, non-zero otherwise.
  */
 int SERPutString(SerialPort * sp, const char * s)
 {
-    int l;
-
     assert(sp != NULL);
     assert(sp->sp_fd != -1);
 
-    l = strlen(s);
-    if (write(sp->sp_fd, s, l) != l) {
+    if (SERQueueString(sp, s) != 0) {
         return -1;
-    } else {
+    }
+    return SERFlushOutput(sp, NULL, 0);
+}
+
+/** Queue a fragment of data to be written to a serial port.
+ *  The data is not copied, so it must remain valid until the queue is
+ *  flushed. If the queue is already full it is flushed first, waiting
+ *  as long as necessary.
+ *  @param sp serial port to write to.
+ *  @param data pointer to the data to be written.
+ *  @param len number of bytes to be written.
+ *  @return zero if the data was queued, non-zero otherwise.
+ */
+int SERQueueBytes(SerialPort * sp, const void * data, size_t len)
+{
+    assert(sp != NULL);
+    assert(data != NULL);
+
+    if (len == 0) {
+        return 0;
+    }
+    if ((sp->sp_txcnt == SER_TXIOV_MAX) &&
+        (SERFlushOutput(sp, NULL, 0) != 0)) {
+        return -1;
+    }
+    sp->sp_txiov[sp->sp_txcnt].iov_base = (void *)data;
+    sp->sp_txiov[sp->sp_txcnt].iov_len = len;
+    ++sp->sp_txcnt;
+    return 0;
+}
+
+/** Queue a string to be written to a serial port.
+ *  The string is not copied, so it must remain valid until the queue is
+ *  flushed.
+ *  @param sp serial port to write to.
+ *  @param s string to be written, not including the terminator.
+ *  @return zero if the string was queued, non-zero otherwise.
+ */
+int SERQueueString(SerialPort * sp, const char * s)
+{
+    assert(s != NULL);
+
+    return SERQueueBytes(sp, s, strlen(s));
+}
+
+/** Queue a single byte to be written to a serial port.
+ *  The byte is copied into storage held by the port.
+ *  @param sp serial port to write to.
+ *  @param b value of byte to be written.
+ *  @return zero if the byte was queued, non-zero otherwise.
+ */
+int SERQueueByte(SerialPort * sp, BYTE b)
+{
+    assert(sp != NULL);
+
+    if ((sp->sp_txcnt == SER_TXIOV_MAX) &&
+        (SERFlushOutput(sp, NULL, 0) != 0)) {
+        return -1;
+    }
+    sp->sp_txbytes[sp->sp_txcnt] = b;
+    return SERQueueBytes(sp, &sp->sp_txbytes[sp->sp_txcnt], 1);
+}
+
+/** Wait until a file descriptor is ready, or a deadline passes.
+ *  @param fd file descriptor to wait on.
+ *  @param for_write non-zero to wait until the descriptor is writable,
+ *  zero to wait until it is readable.
+ *  @param deadline time by which it must be ready, or NULL to wait for
+ *  ever.
+ *  @return one if the descriptor is ready, zero otherwise.
+ */
+static int wait_fd(int fd, int for_write, const struct timespec * deadline)
+{
+    fd_set fds;
+    struct timeval tv;
+    long usec;
+    int retval;
+
+    do {
+        FD_ZERO(&fds);
+        FD_SET(fd, &fds);
+        usec = SERRemaining(deadline);
+        tv.tv_sec = usec / 1000000;
+        tv.tv_usec = usec % 1000000;
+
+        retval = select(fd + 1, for_write ? NULL : &fds,
+                        for_write ? &fds : NULL, NULL,
+                        (usec < 0) ? NULL : &tv);
+    } while ((retval == -1) && (errno == EINTR));
+
+    if (retval == -1) {
+        perror("select");
         return 0;
     }
+    return (retval > 0) ? 1 : 0;
+}
+
+/** Capture the part of the output queue which a write accepted.
+ *  @param sp serial port which was written to.
+ *  @param iov fragments which were passed to the write.
+ *  @param iovcnt number of fragments.
+ *  @param done number of bytes the write accepted.
+ */
+static void capture_written(SerialPort * sp, const struct iovec * iov,
+                            int iovcnt, size_t done)
+{
+    struct iovec written[SER_TXIOV_MAX];
+    int i;
+
+    for (i = 0; (i < iovcnt) && (done > 0); ++i) {
+        written[i] = iov[i];
+        if (written[i].iov_len > done) {
+            written[i].iov_len = done;
+        }
+        done -= written[i].iov_len;
+    }
+    SERCapRecordv(sp->sp_capture, SERCAP_TX, 0, written, i);
+}
+
+/** Write all the output queued on a serial port.
+ *  The queued fragments are written with writev, so a whole queue
+ *  usually costs one system call. A short write is resumed from where
+ *  it stopped once the port can accept more data. Whether or not the
+ *  write succeeds, the queue is empty when this returns.
+ *  @param sp serial port to write to.
+ *  @param deadline time by which the data must have been accepted by
+ *  the driver, or NULL to wait for ever.
+ *  @param drain non-zero if the call should also wait until the data
+ *  has actually been transmitted.
+ *  @return zero if all the data was written, non-zero otherwise.
+ */
+int SERFlushOutput(SerialPort * sp, const struct timespec * deadline,
+                   int drain)
+{
+    struct iovec * iov = sp->sp_txiov;
+    int iovcnt = sp->sp_txcnt;
+    int ret = 0;
+
+    assert(sp != NULL);
+    assert(sp->sp_fd != -1);
+
+    sp->sp_txcnt = 0;
+
+    while (iovcnt > 0) {
+        ssize_t done = writev(sp->sp_fd, iov, iovcnt);
+
+        if (done == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+                if (wait_fd(sp->sp_fd, 1, deadline)) {
+                    continue;
+                }
+                debug( printf("Write timed out"); );
+            } else {
+                perror("writev");
+            }
+            return -1;
+        }
+
+        if (sp->sp_capture != NULL) {
+            capture_written(sp, iov, iovcnt, done);
+        }
+
+        // Skip whatever was written, and resume part way into a fragment
+        while ((iovcnt > 0) && (done >= iov->iov_len)) {
+            done -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+        if (done > 0) {
+            iov->iov_base = (BYTE *)iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+    }
+
+    if (drain && (tcdrain(sp->sp_fd) != 0)) {
+        ret = -1;
+    }
+    return ret;
 }
 
 /** Clear any bytes that arrive at a serial port for a period of time.
@@ -269,11 +999,27 @@ void SERFlushChannel(SerialPort * sp, int usec)
 
     assert(sp->sp_fd != -1);
 
+    // Anything already buffered is unwanted too
+    sp->sp_rxhead = sp->sp_rxtail;
+
+    if (sp->sp_reader != NULL) {
+        struct timespec deadline;
+
+        do {
+            reader_discard(sp);
+            if (__atomic_load_n(&sp->sp_reader->r_error, __ATOMIC_ACQUIRE)) {
+                return;
+            }
+            SERDeadline(&deadline, usec);
+        } while (reader_wait(sp, &deadline));
+        return;
+    }
+
     for (;;) {
         FD_ZERO(&rfds);
         FD_SET(sp->sp_fd, &rfds);
-        tv.tv_sec = 0;
-        tv.tv_usec = usec;
+        tv.tv_sec = usec / 1000000;
+        tv.tv_usec = usec % 1000000;
 
         retval = select(sp->sp_fd + 1, &rfds, NULL, NULL, &tv);
         if (retval == -1) {
@@ -284,8 +1030,13 @@ void SERFlushChannel(SerialPort * sp, int usec)
             return;
         } else {
             char buf[256];
+            ssize_t len;
             debug( printf("Reading unwanted data\n"); );
-            read(sp->sp_fd, buf, 256);
+            len = read(sp->sp_fd, buf, 256);
+            if (len > 0) {
+                SERCapRecord(sp->sp_capture, SERCAP_RX, SERCAP_DISCARDED,
+                             buf, len);
+            }
         }
     }
 }
@@ -305,10 +1056,20 @@ int SERQueryChannel(SerialPort * sp, int usec)
 
     assert(sp->sp_fd != -1);
 
+    if (rx_pending(sp) > 0) {
+        return 1;
+    }
+    if (sp->sp_reader != NULL) {
+        struct timespec deadline;
+
+        SERDeadline(&deadline, usec);
+        return reader_wait(sp, &deadline);
+    }
+
     FD_ZERO(&rfds);
     FD_SET(sp->sp_fd, &rfds);
-    tv.tv_sec = 0;
-    tv.tv_usec = usec;
+    tv.tv_sec = usec / 1000000;
+    tv.tv_usec = usec % 1000000;
 
     retval = select(sp->sp_fd + 1, &rfds, NULL, NULL, &tv);
     if (retval == -1) {
@@ -335,9 +1096,12 @@ int SERGetByteTimeout(SerialPort * sp, int usec)
 {
         assert(sp->sp_fd != -1);
 
-        if (SERQueryChannel(sp, usec))
+        if (rx_pending(sp) > 0) {
+                return rx_pop(sp);
+        }
+        if (SERQueryChannel(sp, usec) && (rx_fill(sp) > 0))
         {
-                return SERGetByte(sp);
+                return rx_pop(sp);
         }
         else
         {
@@ -350,6 +1114,8 @@ int SERGetByteTimeout(SerialPort * sp, int usec)
  *  Wait at most usec microseconds for data to be available on the
  *  given serial port, and then read some bytes if it they are available.
  *  This is repeated until enough bytes have been read. 
+ *  Bytes already held in the receive buffer are returned first, and
+ *  the buffer is refilled with bulk reads.
  *  @param sp serial port to read from.
  *  @param buffer pointer to buffer where bytes are stored.
  *  @param count number of bytes to read.
@@ -363,22 +1129,212 @@ int SERGetBytesTimeout(SerialPort * sp, BYTE * buffer, int count, int usec)
 	assert(sp->sp_fd != -1);
 
 	while (count) {
+		ret = rx_take(sp, buffer, count);
+		buffer += ret;
+		done += ret;
+		count -= ret;
+		if (count == 0)
+			break;
 		if (!SERQueryChannel(sp, usec))
 			return done;
-		else {
-			ret = read(sp->sp_fd, buffer, count);
-			if (ret < 1) {
-				debug( printf("read error"); );
-				return done;
-			}
-			buffer += ret;
-			done += ret;
-			count -= ret;
-		}
+		else if (rx_fill(sp) < 1)
+			return done;
 	}
 	return done;
 }
 
+/** Read a LF terminated line from a serial port with a timeout.
+ *  The whole line must arrive within usec microseconds.
+ *  @param sp serial port to read from.
+ *  @param buffer pointer to buffer where the line is stored.
+ *  @param buflen size of buffer, including space for the terminator.
+ *  @param usec number of microseconds to wait for the line.
+ *  @return length of the line, or -1 on timeout or overflow.
+ */
+int SERGetLineTimeout(SerialPort * sp, char * buffer, int buflen, int usec)
+{
+    struct timespec deadline;
+
+    SERDeadline(&deadline, usec);
+    return SERGetLineDeadline(sp, buffer, buflen, &deadline);
+}
+
+/** Set a deadline a number of microseconds from now.
+ *  Deadlines are measured on the monotonic clock, so they are not
+ *  affected by the system time being set while waiting.
+ *  @param deadline pointer used to return the deadline.
+ *  @param usec number of microseconds from now.
+ */
+void SERDeadline(struct timespec * deadline, long usec)
+{
+    assert(deadline != NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += usec / 1000000;
+    deadline->tv_nsec += (usec % 1000000) * 1000;
+    if (deadline->tv_nsec >= 1000000000) {
+        deadline->tv_sec += 1;
+        deadline->tv_nsec -= 1000000000;
+    }
+}
+
+/** Get the time remaining before a deadline.
+ *  @param deadline deadline to check, or NULL for no deadline.
+ *  @return number of microseconds remaining, zero if the deadline has
+ *  passed, or -1 if there is no deadline.
+ */
+long SERRemaining(const struct timespec * deadline)
+{
+    struct timespec now;
+    long usec;
+
+    if (deadline == NULL) {
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec > deadline->tv_sec) {
+        return 0;
+    }
+    // Keep the result in range of a 32 bit long
+    if (deadline->tv_sec - now.tv_sec > 2000) {
+        return 2000000000L;
+    }
+    usec = (deadline->tv_sec - now.tv_sec) * 1000000 +
+           (deadline->tv_nsec - now.tv_nsec) / 1000;
+    return (usec > 0) ? usec : 0;
+}
+
+/** Wait until there is data waiting on a serial port, or a deadline.
+ *  Unlike SERQueryChannel this restarts the wait if it is interrupted
+ *  by a signal, and waits of any length are handled correctly.
+ *  @param sp serial port to check.
+ *  @param deadline time by which data must arrive, or NULL to wait
+ *  for ever.
+ *  @return one if data is now available, zero otherwise.
+ */
+int SERWaitDeadline(SerialPort * sp, const struct timespec * deadline)
+{
+    assert(sp->sp_fd != -1);
+
+    if (rx_pending(sp) > 0) {
+        return 1;
+    }
+    if (sp->sp_reader != NULL) {
+        return reader_wait(sp, deadline);
+    }
+    return wait_fd(sp->sp_fd, 0, deadline);
+}
+
+/** Read a byte from a serial port, waiting no later than a deadline.
+ *  @param sp serial port to read from.
+ *  @param deadline time by which the byte must arrive.
+ *  @return value of byte read, or -1 if the deadline passed.
+ */
+int SERGetByteDeadline(SerialPort * sp, const struct timespec * deadline)
+{
+    assert(sp->sp_fd != -1);
+
+    if ((rx_pending(sp) > 0) ||
+        (SERWaitDeadline(sp, deadline) && (rx_fill(sp) > 0))) {
+        return rx_pop(sp);
+    }
+    debug( printf("TIMEOUT"); );
+    return -1;
+}
+
+/** Read some bytes from a serial port, waiting no later than a deadline.
+ *  Unlike SERGetBytesTimeout the wait is not restarted each time some
+ *  data arrives, so the call returns by the deadline however slowly the
+ *  data trickles in.
+ *  @param sp serial port to read from.
+ *  @param buffer pointer to buffer where bytes are stored.
+ *  @param count number of bytes to read.
+ *  @param deadline time by which the bytes must arrive.
+ *  @return number of bytes read.
+ */
+int SERGetBytesDeadline(SerialPort * sp, BYTE * buffer, int count,
+                        const struct timespec * deadline)
+{
+    int ret, done = 0;
+
+    assert(sp->sp_fd != -1);
+
+    for (;;) {
+        ret = rx_take(sp, buffer, count);
+        buffer += ret;
+        done += ret;
+        count -= ret;
+        if (count == 0) {
+            return done;
+        }
+        if (!SERWaitDeadline(sp, deadline) || (rx_fill(sp) < 1)) {
+            return done;
+        }
+    }
+}
+
+/** Read a LF terminated line from a serial port, no later than a deadline.
+ *  Bytes are consumed from the receive buffer a contiguous run at a time,
+ *  and the buffer is refilled with bulk reads whenever it runs dry.
+ *  @param sp serial port to read from.
+ *  @param buffer pointer to buffer where the line is stored.
+ *  @param buflen size of buffer, including space for the terminator.
+ *  @param deadline time by which the whole line must arrive.
+ *  @return length of the line, or -1 on timeout or overflow.
+ */
+int SERGetLineDeadline(SerialPort * sp, char * buffer, int buflen,
+                       const struct timespec * deadline)
+{
+    int count = 0;
+
+    assert(sp->sp_fd != -1);
+    assert(buffer != NULL);
+    assert(buflen > 0);
+
+    for (;;) {
+        while (rx_pending(sp) > 0) {
+            size_t head = rx_index(sp->sp_rxhead);
+            size_t len = SER_RXBUF_SIZE - head;
+            BYTE * start = &sp->sp_rxbuf[head];
+            BYTE * eol;
+
+            if (len > rx_pending(sp)) {
+                len = rx_pending(sp);
+            }
+            eol = memchr(start, '\n', len);
+            if (eol != NULL) {
+                len = eol - start;
+            }
+            if (count + len >= buflen) {
+                debug( printf("Line overflow"); );
+                len = buflen - 1 - count;
+                memcpy(&buffer[count], start, len);
+                sp->sp_rxhead += len;
+                buffer[buflen - 1] = 0;
+                return -1;
+            }
+            memcpy(&buffer[count], start, len);
+            count += len;
+            sp->sp_rxhead += len;
+            if (eol != NULL) {
+                // Skip the LF, and strip the CR which precedes it
+                ++sp->sp_rxhead;
+                while ((count > 0) && (buffer[count - 1] == '\r')) {
+                    --count;
+                }
+                buffer[count] = 0;
+                return count;
+            }
+        }
+        if (!SERWaitDeadline(sp, deadline) || (rx_fill(sp) < 1)) {
+            debug( printf("TIMEOUT"); );
+            buffer[count] = 0;
+            return -1;
+        }
+    }
+}
+
 void SERClearIncoming( SerialPort *sp )
 {
 	assert(sp->sp_fd != -1);
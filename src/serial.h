@@ -8,11 +8,74 @@
 #define GLACSWEB_SERIAL_H
 
 #include "types.h"
+#include "sercap.h"
+
+#include <sys/uio.h>
 
 #include <stdint.h>
 #include <termios.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <time.h>
+
+/** Flag marking a speed_t which holds a literal rate in bits per second,
+ *  rather than one of the standard Bxxx constants. Such rates are set
+ *  using the Linux termios2 interface.
+ */
+#define SER_BAUD_CUSTOM_FLAG    0x80000000u
+/** Make a speed_t holding a literal baud rate. */
+#define SER_BAUD_CUSTOM(rate)   ((speed_t)(rate) | SER_BAUD_CUSTOM_FLAG)
+/** Test whether a speed_t holds a literal baud rate. */
+#define SER_BAUD_IS_CUSTOM(speed) (((speed) & SER_BAUD_CUSTOM_FLAG) != 0)
+/** Get the literal baud rate held by a speed_t. */
+#define SER_BAUD_RATE(speed)    ((unsigned int)((speed) & ~SER_BAUD_CUSTOM_FLAG))
+
+/** Size of the receive buffer held by each serial port. Must be a
+ *  power of two so the ring indices can be masked rather than divided.
+ */
+#define SER_RXBUF_SIZE 1024
+
+/** Maximum number of fragments which can be queued for output before
+ *  the queue is flushed.
+ */
+#define SER_TXIOV_MAX 16
+
+/** Size of the ring between a reader thread and the port user. Must be
+ *  a power of two.
+ */
+#define SER_READER_SIZE 16384
+
+/** State of a reader thread, private to serial.c */
+struct ser_reader;
+
+/** Ways in which the driver can be asked to deliver received data. */
+typedef enum ser_read_mode {
+    /** Leave the driver as cfmakeraw sets it up */
+    SER_READ_DEFAULT = 0,
+    /** Let the kernel gather received bytes into larger reads, using
+     *  VMIN and VTIME. Fewer wakeups, at the cost of up to VTIME extra
+     *  latency at the end of each burst. The port is left blocking in
+     *  this mode, so writes are not bounded by a deadline. */
+    SER_READ_BATCHED,
+    /** Ask the driver to pass on each byte as soon as it arrives, using
+     *  ASYNC_LOW_LATENCY where the driver supports it. */
+    SER_READ_LOWLATENCY
+} SerReadMode;
+
+/** Options which control how a serial port is set up when it is opened.
+ *  A NULL pointer to this structure selects the defaults.
+ */
+typedef struct serial_options {
+    /** How the driver should deliver received data */
+    SerReadMode so_read_mode;
+    /** Minimum number of bytes for a batched read (VMIN) */
+    int         so_vmin;
+    /** Gap after which a batched read returns early, in tenths of a
+     *  second (VTIME). Must be at least one. */
+    int         so_vtime;
+    /** Non-zero to start a reader thread when the port is opened */
+    int         so_reader;
+} SerialOptions;
 
 /** Structure to hold data to handle an open serial port. Used by
  *  all code that uses standard serial ports to talk to devices.
@@ -22,15 +85,37 @@ typedef struct serial_port {
     int         sp_fd;
     /** File pointer of log file associated with this port */
     FILE *      sp_logfp;
+    /** Capture of all traffic on the port, written to sp_logfp */
+    SerCapture * sp_capture;
+    /** How the driver has been asked to deliver received data */
+    SerReadMode sp_read_mode;
+    /** Reader thread draining sp_fd, or NULL if reads are made directly */
+    struct ser_reader * sp_reader;
+    /** Receive ring buffer, filled by bulk reads from sp_fd */
+    BYTE        sp_rxbuf[SER_RXBUF_SIZE];
+    /** Free running count of bytes consumed from sp_rxbuf */
+    size_t      sp_rxhead;
+    /** Free running count of bytes stored into sp_rxbuf */
+    size_t      sp_rxtail;
+    /** Fragments queued for output, written together with writev */
+    struct iovec sp_txiov[SER_TXIOV_MAX];
+    /** Number of fragments in sp_txiov */
+    int         sp_txcnt;
+    /** Storage for single bytes queued with SERQueueByte */
+    BYTE        sp_txbytes[SER_TXIOV_MAX];
 } SerialPort;
 
 // New clean OO API for handling many ports
 
 int SERGetBaud(const char * baud_string, speed_t * serial_speed);
+int SERGetReadMode(const char * mode_string, SerReadMode * mode);
 SerialPort * SEROpenPort(const char * serialportname,
                          speed_t serial_speed,
-                         char * logfilename);
+                         char * logfilename,
+                         const SerialOptions * options);
 void SERClosePort(SerialPort * sp);
+int  SERStartReader(SerialPort * sp);
+void SERStopReader(SerialPort * sp);
 BYTE SERGetByte(SerialPort * sp);
 void SERPutByte(SerialPort * sp, BYTE b);
 int  SERPutString(SerialPort * sp, const char * s);
@@ -52,4 +137,41 @@ void SERClearIncoming( SerialPort *sp );
  *  @return number of bytes read, or -1 on timeout. */
 int  SERGetBytesTimeout(SerialPort * sp, BYTE * buffer, int count, int usec);
 
+/** Read a LF terminated line from a serial port with a timeout.
+ *  Wait at most usec microseconds for the whole line to arrive. The
+ *  line terminator, and any CR characters immediately before it, are
+ *  stripped and the buffer is NULL terminated.
+ *  @param sp serial port to read from.
+ *  @param buffer pointer to buffer where the line is stored.
+ *  @param buflen size of buffer, including space for the terminator.
+ *  @param usec number of microseconds to wait.
+ *  @return length of the line, or -1 on timeout or overflow. */
+int  SERGetLineTimeout(SerialPort * sp, char * buffer, int buflen, int usec);
+
+// Deadline based API. Deadlines are absolute times on the monotonic
+// clock, so a sequence of reads can share a single bound on how long
+// an operation may take.
+
+/** Set a deadline usec microseconds from now. */
+void SERDeadline(struct timespec * deadline, long usec);
+/** Get the microseconds left before a deadline, or -1 if it is NULL. */
+long SERRemaining(const struct timespec * deadline);
+int  SERWaitDeadline(SerialPort * sp, const struct timespec * deadline);
+int  SERGetByteDeadline(SerialPort * sp, const struct timespec * deadline);
+int  SERGetBytesDeadline(SerialPort * sp, BYTE * buffer, int count,
+                         const struct timespec * deadline);
+int  SERGetLineDeadline(SerialPort * sp, char * buffer, int buflen,
+                        const struct timespec * deadline);
+
+// Output queue. Fragments are gathered on the port and written with as
+// few system calls as possible when the queue is flushed. Data queued
+// with SERQueueBytes or SERQueueString is not copied, so it must remain
+// valid until the queue has been flushed.
+
+int  SERQueueBytes(SerialPort * sp, const void * data, size_t len);
+int  SERQueueString(SerialPort * sp, const char * s);
+int  SERQueueByte(SerialPort * sp, BYTE b);
+int  SERFlushOutput(SerialPort * sp, const struct timespec * deadline,
+                    int drain);
+
 #endif // GLACSWEB_SERIAL_H
@@ -0,0 +1,49 @@
+/*
+ * Glacsweb termios2.c
+ * arbitrary baud rate support
+ */
+
+/** \file
+ * Setting of non-standard baud rates using the Linux termios2 interface.
+ * This is kept apart from serial.c because the kernel definitions of the
+ * termios structures cannot be included alongside those of the C library.
+ *
+ * Copyright (C) 2003, 2004 Kirk Martinez, Alistair Riddoch,
+ *                          The University of Southampton
+ */
+
+#include "termios2.h"
+
+#include <errno.h>
+
+#if defined(__linux__)
+#include <asm/termbits.h>
+#include <sys/ioctl.h>
+#endif
+
+int SERSetCustomSpeed(int fd, unsigned int rate)
+{
+#if defined(__linux__) && defined(BOTHER) && defined(TCGETS2)
+    struct termios2 term;
+
+    if (ioctl(fd, TCGETS2, &term) != 0) {
+        return -1;
+    }
+
+    // BOTHER tells the driver to use the literal rates that follow
+    term.c_cflag &= ~CBAUD;
+    term.c_cflag |= BOTHER;
+    term.c_ospeed = rate;
+    term.c_cflag &= ~(CBAUD << IBSHIFT);
+    term.c_cflag |= BOTHER << IBSHIFT;
+    term.c_ispeed = rate;
+
+    if (ioctl(fd, TCSETS2, &term) != 0) {
+        return -1;
+    }
+    return 0;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
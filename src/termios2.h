@@ -0,0 +1,20 @@
+/*
+ * Glacsweb termios2.h
+ * Copyright (C) 2003, 2004 Kirk Martinez, Alistair Riddoch,
+ *                          The University of Southampton
+ */
+
+#ifndef GLACSWEB_TERMIOS2_H
+#define GLACSWEB_TERMIOS2_H
+
+/* This header deliberately does not include <termios.h>, as the kernel
+ * termios2 definitions clash with those of the C library. */
+
+/** Set an arbitrary baud rate on an open serial port.
+ *  @param fd file descriptor of the serial port.
+ *  @param rate baud rate in bits per second.
+ *  @return zero if the rate was set, non-zero otherwise.
+ */
+int SERSetCustomSpeed(int fd, unsigned int rate);
+
+#endif // GLACSWEB_TERMIOS2_H